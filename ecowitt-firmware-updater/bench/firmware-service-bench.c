@@ -0,0 +1,312 @@
+/*
+ *	Benchmark for the firmware download engines - serves the same
+ *	image to a number of simulated devices at once, with poll() and
+ *	with io_uring, and reports the system calls and the CPU time that
+ *	the serving side used for each MiB sent - and how much memory each
+ *	download in progress cost it, as the growth in its peak RSS.
+ *
+ *	The devices are a separate process, talking the download protocol
+ *	over loopback TCP as fast as they can, so only the server's own
+ *	work is counted.
+ *
+ *	Usage: firmware-service-bench [-n devices] [-k image-KiB] [-r rounds]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+char	*progname = "firmware-service-bench";
+int	debug = 0;
+int	verbose = 0;
+
+void
+hexdump (uchar *data, int length)
+{
+}
+
+/* a simulated device */
+struct device {
+	int	fd;
+	long	size;		// of the image, once we know it
+	long	got;		// bytes of it so far
+	int	sizegot;	// bytes of the size so far
+	uchar	sizebuf[4];
+	long	want;		// bytes still to come of this chunk
+};
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_seconds (void)
+{
+	struct rusage ru;
+
+	getrusage (RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* the most resident memory that we've used so far, in bytes */
+static long
+peak_rss (void)
+{
+	struct rusage ru;
+
+	getrusage (RUSAGE_SELF, &ru);
+	return ru.ru_maxrss * 1024L;	// it's in KiB
+}
+
+static void
+say (int fd, const char *what)
+{
+	if (write (fd, what, strlen (what) + 1) < 0) {
+		perror ("device write");
+		exit (1);
+	}
+}
+
+/*
+ *	Be n devices downloading from these ports, all at once.  Runs in
+ *	the child process.
+ */
+static void
+devices (int n, unsigned short *ports)
+{
+	struct device *dev;
+	struct pollfd *pfds;
+	struct sockaddr_in addr;
+	uchar	buf[FS_CHUNK];
+	int	i, r, left = n;
+
+	dev = calloc (n, sizeof *dev);
+	pfds = calloc (n, sizeof *pfds);
+	memset (&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	for (i = 0; i < n; i++) {
+		addr.sin_port = ports[i];
+		if ((dev[i].fd = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    connect (dev[i].fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+			perror ("device connect");
+			exit (1);
+		}
+		say (dev[i].fd, "user1.bin");
+		pfds[i].fd = dev[i].fd;
+		pfds[i].events = POLLIN;
+	}
+
+	while (left > 0) {
+		if (poll (pfds, n, 10000) <= 0) {
+			fprintf (stderr, "%s: the server stopped\n", progname);
+			exit (1);
+		}
+		for (i = 0; i < n; i++) {
+			if (pfds[i].fd < 0 || pfds[i].revents == 0)
+				continue;
+			if (dev[i].sizegot < 4) {
+				r = read (dev[i].fd, dev[i].sizebuf + dev[i].sizegot, 4 - dev[i].sizegot);
+				if (r <= 0)
+					exit (1);
+				if ((dev[i].sizegot += r) == 4) {
+					dev[i].size = ntohl (*(uint32_t *) dev[i].sizebuf);
+					dev[i].want = dev[i].size < FS_CHUNK ? dev[i].size : FS_CHUNK;
+					say (dev[i].fd, "start");
+				}
+				continue;
+			}
+			r = read (dev[i].fd, buf, dev[i].want);
+			if (r <= 0)
+				exit (1);
+			dev[i].got += r;
+			if ((dev[i].want -= r) > 0)
+				continue;
+			if (dev[i].got < dev[i].size) {
+				dev[i].want = dev[i].size - dev[i].got;
+				if (dev[i].want > FS_CHUNK)
+					dev[i].want = FS_CHUNK;
+				say (dev[i].fd, "continue");
+			} else {
+				say (dev[i].fd, "end");
+				close (dev[i].fd);
+				pfds[i].fd = -1;
+				left--;
+			}
+		}
+	}
+}
+
+/* one run with this engine: returns 0, with what it cost */
+static int
+run (int engine, int n, struct fw_image *image, double *seconds, double *cpu,
+	struct fw_stats *stats)
+{
+	struct fw_session **sessions;
+	unsigned short *ports;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	double	t0, c0;
+	pid_t	pid;
+	int	i, fd, status;
+
+	sessions = calloc (n, sizeof *sessions);
+	ports = calloc (n, sizeof *ports);
+	for (i = 0; i < n; i++) {
+		memset (&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		addrlen = sizeof addr;
+		if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    bind (fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+		    listen (fd, 1) < 0 ||
+		    getsockname (fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+			perror ("listen");
+			exit (1);
+		}
+		ports[i] = addr.sin_port;
+		sessions[i] = fw_session_get ();
+		fw_session_init (sessions[i], "device", fd, image, NULL);
+		sessions[i]->quiet = 1;
+	}
+
+	fflush (stdout);
+	if ((pid = fork ()) == 0) {
+		devices (n, ports);
+		_exit (0);
+	}
+
+	// keep fw_session_end() quiet, too
+	fd = dup (1);
+	freopen ("/dev/null", "w", stdout);
+
+	t0 = now ();
+	c0 = cpu_seconds ();
+	serve_sessions (sessions, n, engine, stats);
+	*cpu = cpu_seconds () - c0;
+	*seconds = now () - t0;
+
+	fflush (stdout);
+	dup2 (fd, 1);
+	close (fd);
+
+	waitpid (pid, &status, 0);
+	for (i = 0; i < n; i++) {
+		if (sessions[i]->status != FS_OK)
+			status = 1;
+		fw_session_put (sessions[i]);
+	}
+	free (sessions);
+	free (ports);
+	return status == 0 ? 0 : -1;
+}
+
+int
+main (int argc, char **argv)
+{
+	static const char *names[] = { "poll", "uring" };
+	struct fw_image *image;
+	struct fw_stats stats;
+	char	path[] = "/tmp/firmware-service-bench.XXXXXX";
+	int	n = 32, kib = 1024, rounds = 3;
+	int	c, fd, engine, round, status;
+	pid_t	pid;
+	long	rss;
+	struct fw_pool_stats pool;
+	struct rlimit rl;
+	uchar	*data;
+	double	seconds, cpu, mib;
+
+	while ((c = getopt (argc, argv, "n:k:r:")) != EOF) {
+		switch (c) {
+		case 'n':	n = atoi (optarg); break;
+		case 'k':	kib = atoi (optarg); break;
+		case 'r':	rounds = atoi (optarg); break;
+		default:
+			fprintf (stderr, "Usage: %s [-n devices] [-k image-KiB] [-r rounds]\n", progname);
+			exit (1);
+		}
+	}
+
+	// an image of the size asked for
+	if ((fd = mkstemp (path)) < 0 || (data = malloc (kib * 1024)) == NULL) {
+		perror (path);
+		exit (1);
+	}
+	for (c = 0; c < kib * 1024; c++)
+		data[c] = c * 7;
+	if (write (fd, data, kib * 1024) != kib * 1024) {
+		perror (path);
+		exit (1);
+	}
+	close (fd);
+	image = fw_image_load (path);
+	unlink (path);
+	if (image == NULL)
+		exit (1);
+
+	// each session is two connections here, and the devices' ends
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) 2 * n + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &rl);
+	}
+
+	mib = (double) n * kib / 1024;
+	printf ("%d devices, %d KiB image, %d chunks each\n", n, kib, (kib * 1024 + FS_CHUNK - 1) / FS_CHUNK);
+	printf ("%-8s %8s %10s %14s %14s %12s\n",
+		"engine", "round", "MiB/s", "syscalls/MiB", "CPU ms/MiB", "syscalls");
+
+	// each engine in a process of its own, so that its peak RSS is its own
+	for (engine = ENGINE_POLL; engine <= ENGINE_URING; engine++) {
+		fflush (stdout);
+		if ((pid = fork ()) < 0) {
+			perror ("fork");
+			exit (1);
+		}
+		if (pid > 0) {
+			if (waitpid (pid, &status, 0) < 0 || status != 0)
+				exit (1);
+			continue;
+		}
+
+		fw_pool_init (0, serve_session_bytes (engine));
+		rss = peak_rss ();
+		for (round = 1; round <= rounds; round++) {
+			if (run (engine, n, image, &seconds, &cpu, &stats) < 0) {
+				fprintf (stderr, "%s: %s: a download failed\n", progname, names[engine]);
+				exit (1);
+			}
+			printf ("%-8s %8d %10.1f %14.1f %14.2f %12ld\n",
+				names[engine], round, mib / seconds,
+				stats.syscalls / mib, cpu * 1000 / mib, stats.syscalls);
+		}
+		fw_pool_stats (&pool);
+		rss = peak_rss () - rss;
+		printf ("%-8s peak RSS grew %ld KiB: %ld bytes per session"
+			" (%ld of them the session and the engine's state)\n",
+			names[engine], rss / 1024, rss / n, (long) (pool.bytes / pool.peak));
+		exit (0);
+	}
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ *	Benchmark for reading the firmware images - how long the first
+ *	device to want an image waits for it to be read into memory, as it
+ *	is and compressed with zstd, with the file not yet in the page cache
+ *	("cold") and already there ("warm").
+ *
+ *	Each load is in a process of its own, so that it's always the first.
+ *	The image is made up - something about as compressible as firmware
+ *	- unless a real one is given.
+ *
+ *	Usage: image-load-bench [-k image-KiB] [-r rounds] [-l zstd-level] [-f image]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+char	*progname = "image-load-bench";
+int	debug = 0;
+int	verbose = 0;
+
+void
+hexdump (uchar *data, int length)
+{
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* take the file out of the page cache, as far as we can */
+static void
+evict (const char *path)
+{
+	int	fd;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return;
+	fdatasync (fd);
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+	close (fd);
+}
+
+/* milliseconds for a process's first fw_image_load() of path, or -1 */
+static double
+load (const char *path, int cold)
+{
+	char	zpath[256];
+	const char *source;
+	int	p[2], status;
+	double	ms = -1, t0;
+	pid_t	pid;
+
+	if (cold && (source = fw_image_source (path, zpath, sizeof zpath)) != NULL)
+		evict (source);
+	if (pipe (p) < 0 || (pid = fork ()) < 0) {
+		perror ("fork");
+		exit (1);
+	}
+	if (pid == 0) {
+		close (p[0]);
+		t0 = now ();
+		if (fw_image_load (path) == NULL)
+			_exit (1);
+		ms = (now () - t0) * 1000;
+		_exit (write (p[1], &ms, sizeof ms) == sizeof ms ? 0 : 1);
+	}
+	close (p[1]);
+	if (read (p[0], &ms, sizeof ms) != sizeof ms)
+		ms = -1;
+	close (p[0]);
+	if (waitpid (pid, &status, 0) < 0 || status != 0)
+		ms = -1;
+	return ms;
+}
+
+int
+main (int argc, char **argv)
+{
+	static const char *names[] = { "raw", "zstd" };
+	char	dir[] = "/tmp/image-load-bench.XXXXXX";
+	char	path[256], zpath[256], cmd[600];
+	const char *image = NULL, *files[2];
+	int	kib = 1024, rounds = 5, level = 19;
+	int	c, i, fd, round, warm;
+	unsigned int seed = 1;
+	double	ms, sum[2][2];
+	long	size, bytes[2];
+	uchar	*data;
+	FILE	*fp;
+
+	while ((c = getopt (argc, argv, "k:r:l:f:")) != EOF) {
+		switch (c) {
+		case 'k':	kib = atoi (optarg); break;
+		case 'r':	rounds = atoi (optarg); break;
+		case 'l':	level = atoi (optarg); break;
+		case 'f':	image = optarg; break;
+		default:
+			fprintf (stderr, "Usage: %s [-k image-KiB] [-r rounds] [-l zstd-level] [-f image]\n",
+				progname);
+			exit (1);
+		}
+	}
+	if (mkdtemp (dir) == NULL) {
+		perror (dir);
+		exit (1);
+	}
+	snprintf (path, sizeof path, "%s/user1.bin", dir);
+	snprintf (zpath, sizeof zpath, "%s/user2.bin" IMAGE_ZSTD, dir);
+
+	if (image != NULL) {
+		snprintf (cmd, sizeof cmd, "cp '%s' '%s'", image, path);
+		if (system (cmd) != 0)
+			exit (1);
+	} else {
+		// runs of a few repeated words, and some noise, like code and tables
+		size = kib * 1024L;
+		if ((data = malloc (size)) == NULL || (fd = open (path, O_WRONLY | O_CREAT, 0644)) < 0) {
+			perror (path);
+			exit (1);
+		}
+		for (i = 0; i < size; ) {
+			seed = seed * 1103515245 + 12345;
+			if ((seed >> 16) % 4 == 0) {
+				data[i++] = seed >> 8;
+				continue;
+			}
+			for (c = (seed >> 20) % 16; c > 0 && i < size; c--, i++)
+				data[i] = (seed >> 12) % 64;
+		}
+		if (write (fd, data, size) != size) {
+			perror (path);
+			exit (1);
+		}
+		close (fd);
+		free (data);
+	}
+	snprintf (cmd, sizeof cmd, "zstd -q -%d -c '%s' > '%s'", level, path, zpath);
+	if (system (cmd) != 0) {
+		fprintf (stderr, "%s: cannot compress the image with zstd\n", progname);
+		exit (1);
+	}
+	zpath[strlen (zpath) - strlen (IMAGE_ZSTD)] = '\0';	// it's asked for by its plain name
+	files[0] = path;
+	files[1] = zpath;
+
+	for (i = 0; i < 2; i++) {
+		snprintf (cmd, sizeof cmd, "%s%s", files[i], i ? IMAGE_ZSTD : "");
+		if ((fp = fopen (cmd, "r")) == NULL) {
+			perror (cmd);
+			exit (1);
+		}
+		fseek (fp, 0, SEEK_END);
+		bytes[i] = ftell (fp);
+		fclose (fp);
+	}
+
+	printf ("%ld KiB image, %ld KiB compressed (zstd -%d), %d rounds\n",
+		bytes[0] / 1024, bytes[1] / 1024, level, rounds);
+	printf ("%-8s %10s %12s %12s %14s\n", "image", "KiB", "cold ms", "warm ms", "cold MiB/s");
+
+	memset (sum, 0, sizeof sum);
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < 2; i++) {
+			for (warm = 0; warm < 2; warm++) {
+				if ((ms = load (files[i], !warm)) < 0) {
+					fprintf (stderr, "%s: %s: the image didn't load\n", progname, names[i]);
+					exit (1);
+				}
+				sum[i][warm] += ms;
+			}
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		printf ("%-8s %10ld %12.2f %12.2f %14.1f\n", names[i], bytes[i] / 1024,
+			sum[i][0] / rounds, sum[i][1] / rounds,
+			bytes[0] / 1048576.0 / (sum[i][0] / rounds / 1000));
+	}
+
+	unlink (path);
+	snprintf (cmd, sizeof cmd, "%s" IMAGE_ZSTD, zpath);
+	unlink (cmd);
+	rmdir (dir);
+	return 0;
+}
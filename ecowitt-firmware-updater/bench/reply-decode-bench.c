@@ -0,0 +1,305 @@
+/*
+ *	Microbenchmark for the reply decoders - compares the table-driven
+ *	decoders generated from reply-layouts.def against the previous style
+ *	of hand-written decoding with the GET_BYTE/GET_BUFFER macros and an
+ *	if/else chain on the command.
+ *
+ *	Both sides decode the same synthetic replies without printing, so
+ *	only the decoding itself is measured.  Expect a speedup of about 1 for
+ *	"sensor_id", and below 1 for "livedata": the table decoder keeps each field's
+ *	description and position as well as its value, which the legacy
+ *	code doesn't, and that costs more than the table saves.
+ *
+ *	Usage: reply-decode-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ecowitt-firmware-updater.h"
+
+char	*progname = "reply-decode-bench";
+int	debug = 0;
+int	verbose = 0;
+
+void
+hexdump (uchar *data, int length)
+{
+}
+
+/*
+ *	Somewhere for the legacy decoders to put their results, so that
+ *	both sides produce the same values for a caller to use.
+ */
+long	values[REPLY_MAXFIELDS];
+int	nvalues;
+#define	sink	values[nvalues++]
+
+
+/*
+ *	The previous decoding style, minus the printf() calls.
+ */
+#define	GET_BYTE(VAR,PTR,LEN)		{	\
+				VAR = (*(PTR++));	\
+				(LEN) --;		\
+					}
+
+#define	GET_BUFFER(VAR,N,PTR,LEN)	{	\
+				uchar *_p = (uchar *)(VAR);	\
+				for (int _remain = (N); _remain > 0; _remain--) {	\
+					*_p++ = (*(PTR++));	\
+					(LEN) --;		\
+				}				\
+					}
+
+static int
+legacy_livedata (uchar *ptr, int length)
+{
+	int	original_length = length;
+	int	item;
+	int	hi, lo, b2, b3;
+	uchar	buf[32];
+
+	while (length > 0) {
+		GET_BYTE (item, ptr, length);
+		if (item == 0x06 || item == 0x07 || item == 0x17 ||
+		    (item >= 0x22 && item <= 0x29) ||
+		    (item >= 0x2c && item <= 0x4a && (item & 1) == 0) ||
+		    (item >= 0x58 && item <= 0x5b) || item == 0x60 ||
+		    (item >= 0x72 && item <= 0x79)) {
+			GET_BYTE (lo, ptr, length);
+			sink = lo;
+		} else if (item == 0x12 || item == 0x13 || item == 0x14 ||
+		    item == 0x15 || item == 0x61 || item == 0x62 || item == 0x6c ||
+		    (item >= 0x83 && item <= 0x86)) {
+			GET_BYTE (hi, ptr, length);
+			GET_BYTE (b2, ptr, length);
+			GET_BYTE (b3, ptr, length);
+			GET_BYTE (lo, ptr, length);
+			sink = ((long)hi << 24) | (b2 << 16) | (b3 << 8) | lo;
+		} else if (item >= 0x63 && item <= 0x6a) {
+			GET_BYTE (hi, ptr, length);
+			GET_BYTE (lo, ptr, length);
+			GET_BYTE (b2, ptr, length);	// battery
+			sink = (short)((hi << 8) | lo);
+		} else if (item == 0x18 || item == 0x88) {
+			GET_BUFFER (buf, (item == 0x18 ? 6 : 3), ptr, length);
+			sink = buf[0];
+		} else if (item == 0x4c || item == 0x70) {
+			GET_BUFFER (buf, 16, ptr, length);
+			sink = buf[0];
+		} else if (item == 0x87) {
+			GET_BUFFER (buf, 20, ptr, length);
+			sink = buf[0];
+		} else {		// everything else is two bytes
+			GET_BYTE (hi, ptr, length);
+			GET_BYTE (lo, ptr, length);
+			sink = (short)((hi << 8) | lo);
+		}
+	}
+	return (original_length - length);
+}
+
+static int
+legacy_sensor_id (uchar *ptr, int length)
+{
+	int	original_length = length;
+	int	type, battery, signal;
+	uchar	id[4];
+
+	while (length > 0) {
+		GET_BYTE (type, ptr, length);
+		GET_BUFFER (id, 4, ptr, length);
+		GET_BYTE (battery, ptr, length);
+		GET_BYTE (signal, ptr, length);
+		sink = type;
+		sink = ((long)id[0] << 24) | (id[1] << 16) | (id[2] << 8) | id[3];
+		sink = battery;
+		sink = signal;
+	}
+	return (original_length - length);
+}
+
+static int
+legacy_station_mac (uchar *ptr, int length)
+{
+	int	original_length = length;
+	uchar	macaddress[6];
+
+	GET_BUFFER (macaddress, 6, ptr, length);
+	sink = macaddress[5];
+	return (original_length - length);
+}
+
+static int
+legacy_firmware_version (uchar *ptr, int length)
+{
+	int	original_length = length;
+	int	version_length;
+	uchar	version_buffer[256];
+
+	GET_BYTE (version_length, ptr, length);
+	GET_BUFFER (version_buffer, version_length, ptr, length);
+	version_buffer[version_length] = '\0';
+	sink = version_buffer[0];
+	return (original_length - length);
+}
+
+static int
+legacy_interpret (uchar command, uchar *ptr, int length)
+{
+	nvalues = 0;
+	if (command == CMD_READ_SATION_MAC) {
+		return legacy_station_mac (ptr, length);
+	} else
+	if (command == CMD_READ_FIRMWARE_VERSION) {
+		return legacy_firmware_version (ptr, length);
+	} else
+	if (command == CMD_GW1000_LIVEDATA) {
+		return legacy_livedata (ptr, length);
+	} else
+	if (command == CMD_READ_SENSOR_ID_NEW) {
+		return legacy_sensor_id (ptr, length);
+	} else
+	if (command == CMD_WRITE_UPDATE) {
+		sink = *ptr;
+		return 1;
+	}
+	abort ();
+}
+
+
+/*
+ *	Synthetic reply data (just the part between the size and the
+ *	checksum) for each of the commands that we time.
+ */
+struct sample {
+	const char *name;
+	uchar	command;
+	int	length;
+	uchar	data[REPLY_MAXPACKET];
+};
+
+static void
+add_item (struct sample *sp, int item, int width)
+{
+	sp->data[sp->length++] = item;
+	while (width-- > 0)
+		sp->data[sp->length++] = (uchar)(item + width);
+}
+
+static void
+build_samples (struct sample *samples)
+{
+	struct sample *sp;
+	int	i;
+
+	// a busy live data reply - outdoor array, 8 temperature/humidity
+	// channels, 8 soil channels, and assorted extras:
+	sp = &samples[0];
+	sp->name = "livedata";
+	sp->command = CMD_GW1000_LIVEDATA;
+	for (i = 0x01; i <= 0x17; i++)
+		add_item (sp, i, (i == 0x06 || i == 0x07 || i == 0x17) ? 1 :
+				 (i >= 0x12 && i <= 0x15) ? 4 : 2);
+	for (i = 0x1a; i <= 0x21; i++)
+		add_item (sp, i, 2);
+	for (i = 0x22; i <= 0x29; i++)
+		add_item (sp, i, 1);
+	for (i = 0x2b; i <= 0x3a; i += 2) {
+		add_item (sp, i, 2);
+		add_item (sp, i + 1, 1);
+	}
+	add_item (sp, 0x4c, 16);
+	add_item (sp, 0x60, 1);
+	add_item (sp, 0x61, 4);
+	add_item (sp, 0x62, 4);
+	for (i = 0x63; i <= 0x66; i++)
+		add_item (sp, i, 3);
+	add_item (sp, 0x70, 16);
+
+	// sensor IDs for 40 sensors:
+	sp = &samples[1];
+	sp->name = "sensor_id";
+	sp->command = CMD_READ_SENSOR_ID_NEW;
+	for (i = 0; i < 40; i++) {
+		sp->data[sp->length++] = i;
+		sp->data[sp->length++] = 0xff;
+		sp->data[sp->length++] = 0xff;
+		sp->data[sp->length++] = 0xff;
+		sp->data[sp->length++] = 0xfe;
+		sp->data[sp->length++] = 0;
+		sp->data[sp->length++] = 4;
+	}
+
+	sp = &samples[2];
+	sp->name = "station_mac";
+	sp->command = CMD_READ_SATION_MAC;
+	memcpy (sp->data, "\x30\x83\x98\xa7\xe2\x9d", 6);
+	sp->length = 6;
+
+	sp = &samples[3];
+	sp->name = "firmware_version";
+	sp->command = CMD_READ_FIRMWARE_VERSION;
+	sp->data[0] = 14;
+	memcpy (sp->data + 1, "GW1100C_V2.1.8", 14);
+	sp->length = 15;
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char **argv)
+{
+	static struct sample samples[4];
+	static struct reply reply;
+	struct sample *sp;
+	long	iterations = 1000000;
+	long	n;
+	double	start, legacy, table;
+	int	i;
+
+	if (argc > 1)
+		iterations = atol (argv[1]);
+
+	build_samples (samples);
+
+	printf ("%-18s %6s %8s %14s %14s %8s\n",
+		"reply", "bytes", "fields", "legacy ns/op", "table ns/op", "speedup");
+
+	for (i = 0; i < 4; i++) {
+		sp = &samples[i];
+
+		// make sure that both decoders agree on the length:
+		if (legacy_interpret (sp->command, sp->data, sp->length) != sp->length ||
+		    decode_reply_data (sp->command, sp->data, sp->length, &reply) != sp->length) {
+			fprintf (stderr, "%s: %s: decoders disagree\n", progname, sp->name);
+			exit (1);
+		}
+
+		start = now ();
+		for (n = 0; n < iterations; n++)
+			legacy_interpret (sp->command, sp->data, sp->length);
+		legacy = (now () - start) * 1e9 / iterations;
+
+		start = now ();
+		for (n = 0; n < iterations; n++)
+			decode_reply_data (sp->command, sp->data, sp->length, &reply);
+		table = (now () - start) * 1e9 / iterations;
+
+		printf ("%-18s %6d %8d %14.1f %14.1f %7.2fx\n",
+			sp->name, sp->length, reply.nfields,
+			legacy, table, legacy / table);
+	}
+
+	return 0;
+}
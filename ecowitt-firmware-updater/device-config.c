@@ -0,0 +1,745 @@
+/*
+ *	Bulk configuration ("-C file"): bring the settings of every device
+ *	into line with a file of the settings that they should have.
+ *
+ *	The settings come in groups, each read with one command and written
+ *	with another - the whole group at once.  So each device is sent only
+ *	the groups that differ from the file, with whatever the file doesn't
+ *	mention left as the device had it, and each group is read back
+ *	afterwards to see that it took.  Without "-u", the differences are
+ *	only shown.
+ *
+ *	The file has a setting on each line, as "group key value", with
+ *	'#' comments.  Those after a "device MAC" line are for that device
+ *	only, until the next "device" line or "all":
+ *
+ *		customized server 192.168.1.10
+ *		customized port 8080
+ *		customized active 1
+ *		device 30:83:98:a7:e2:9d
+ *			customized id garage
+ *
+ *	A value is the rest of the line, which may be in quotes - "" for an
+ *	empty one.
+ *
+ *	Every device is talked to at once (up to CONFIG_MAXOPEN of them),
+ *	with poll(), each working through its own list of commands - its MAC
+ *	address, the groups that the file mentions, and then any writes and
+ *	their read-backs.  So a fleet takes about as long as its slowest
+ *	device, rather than the sum of them.  Each command gets
+ *	fw_deadline[DL_REPLY] seconds for its reply, and a reply whose
+ *	checksum is wrong is a failure, not just a complaint.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+#include "firmware-info.h"
+
+#define	CONFIG_MAXOPEN	256	// devices talked to at once
+#define	CONFIG_MAXDATA	250	// most data in a command, with its one-byte size
+#define	CONFIG_MAXKEYS	8	// settings in a group
+#define	CONFIG_MAXSTEPS	(1 + 3 * NGROUPS)	// MAC, then read, write, and read back
+
+/* a setting, in the order that the group's reply has them */
+struct setting {
+	const char *key;	// as it's given in the file, or NULL if it can't be
+	uchar	type;		// FT_U8, FT_U16 or FT_STRING
+};
+
+struct config_group {
+	const char *name;
+	uchar	read, write;	// the commands
+	int	nsettings;
+	struct setting settings[CONFIG_MAXKEYS];
+};
+
+static const struct config_group groups[] = {
+	{ "ecowitt", CMD_READ_ECOWITT, CMD_WRITE_ECOWITT, 1,
+		{ { "interval", FT_U8 } } },
+	{ "wunderground", CMD_READ_WUNDERGROUND, CMD_WRITE_WUNDERGROUND, 3,
+		{ { "id", FT_STRING }, { "password", FT_STRING }, { NULL, FT_U8 } } },
+	{ "customized", CMD_READ_CUSTOMIZED, CMD_WRITE_CUSTOMIZED, 7,
+		{ { "id", FT_STRING }, { "password", FT_STRING }, { "server", FT_STRING },
+		  { "port", FT_U16 }, { "interval", FT_U16 }, { "type", FT_U8 },
+		  { "active", FT_U8 } } },
+	{ "path", CMD_READ_USR_PATH, CMD_WRITE_USR_PATH, 2,
+		{ { "ecowitt", FT_STRING }, { "wunderground", FT_STRING } } }
+};
+
+#define	NGROUPS	((int) (sizeof groups / sizeof groups[0]))
+
+/* a line of the file */
+struct wanted {
+	struct wanted *next;
+	char	mac[32];	// normalized, or "" for every device
+	int	group, setting;
+	char	*value;
+	long	number;		// for the numeric settings
+};
+
+/* one device, while it's being done */
+struct config_device {
+	struct session *sp;
+	int	fd;
+	int	state;		// CS_...
+	int	step, nsteps;
+	uchar	command[CONFIG_MAXSTEPS];	// what to send at each step
+	signed char group[CONFIG_MAXSTEPS];	// ... for which group, or -1
+	uint64_t deadline;	// for the connection, or the reply
+	uchar	out[CONFIG_MAXDATA + 8];
+	int	outlen, outoff;
+	uchar	in[REPLY_MAXPACKET];
+	int	inlen;
+	uchar	*have[NGROUPS];	// each group's reply, as it was read
+	int	havelen[NGROUPS];
+	int	differ;		// groups that aren't as wanted, as bits
+	int	changes;	// settings that aren't
+	int	queued;		// the writes have been added to the steps
+	char	*diffs;		// ... shown one to a line
+	size_t	difflen;
+	char	error[160];	// why it failed, or ""
+};
+
+enum {
+	CS_WAITING,		// not started yet
+	CS_CONNECT,		// connecting
+	CS_SEND,		// sending the step's command
+	CS_REPLY,		// waiting for its reply
+	CS_DONE
+};
+
+static struct wanted *wants;
+static int	used;		// groups that the file mentions, as bits
+static struct reply reply;	// the reply being looked at - it's big
+static int	writing;	// change them, not just show them
+
+static int	config_read (char *configfile);
+static const struct wanted *config_wanted (const char *mac, int g, int s);
+static void	config_fail (struct config_device *dp, const char *fmt, ...);
+static void	config_diff (struct config_device *dp, const char *fmt, ...);
+static int	config_start (struct config_device *dp);
+static void	config_send (struct config_device *dp);
+static void	config_receive (struct config_device *dp);
+static int	config_verify (struct config_device *dp, int length);
+static int	config_compare (struct config_device *dp, int g, int show);
+static void	config_step (struct config_device *dp);
+static int	config_encode (struct config_device *dp, int g, uchar *data);
+static void	config_report (struct config_device *dp);
+
+
+/*
+ *	Read the file of settings.  Returns 0, or -1 (with a message).
+ */
+static int
+config_read (char *configfile)
+{
+	FILE	*fp;
+	char	line[1024];
+	char	mac[32] = "";
+	char	*cp, *group, *key, *value, *end;
+	struct wanted *wp, **wpp = &wants;
+	int	lineno = 0, g, s, n;
+
+	if ((fp = fopen (configfile, "r")) == NULL) {
+		fprintf (stderr, "%s: cannot open settings file \"%s\": %s\n",
+			progname, configfile, strerror (errno));
+		return -1;
+	}
+	while (fgets (line, sizeof line, fp) != NULL) {
+		lineno++;
+		if ((cp = strchr (line, '#')) != NULL)
+			*cp = '\0';
+		if ((group = strtok (line, " \t\r\n")) == NULL)
+			continue;
+		if (strcmp (group, "all") == 0) {
+			mac[0] = '\0';
+			continue;
+		}
+		key = strtok (NULL, " \t\r\n");
+		if (strcmp (group, "device") == 0 && key != NULL) {
+			fw_normalize_mac (key, mac, sizeof mac);
+			continue;
+		}
+		value = strtok (NULL, "\r\n");
+		for ( ; value != NULL && (*value == ' ' || *value == '\t'); value++)
+			;
+		if (key == NULL || value == NULL || *value == '\0')
+			goto bad;
+		for (n = strlen (value); n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t'); )
+			value[--n] = '\0';
+		if (n >= 2 && value[0] == '"' && value[n - 1] == '"') {
+			value[n - 1] = '\0';
+			value++;
+		}
+
+		for (g = 0; g < NGROUPS && strcmp (groups[g].name, group) != 0; g++)
+			;
+		if (g == NGROUPS)
+			goto bad;
+		for (s = 0; s < groups[g].nsettings; s++) {
+			if (groups[g].settings[s].key != NULL &&
+			    strcmp (groups[g].settings[s].key, key) == 0)
+				break;
+		}
+		if (s == groups[g].nsettings)
+			goto bad;
+
+		if ((wp = calloc (1, sizeof *wp)) == NULL || (wp->value = strdup (value)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		snprintf (wp->mac, sizeof wp->mac, "%s", mac);
+		wp->group = g;
+		wp->setting = s;
+		switch (groups[g].settings[s].type) {
+		case FT_STRING:
+			if (strlen (value) > 64)
+				goto bad;
+			break;
+		default:
+			wp->number = strtol (value, &end, 0);
+			if (*end != '\0' || wp->number < 0 ||
+			    wp->number > (groups[g].settings[s].type == FT_U8 ? 0xff : 0xffff))
+				goto bad;
+			break;
+		}
+		*wpp = wp;
+		wpp = &wp->next;
+		used |= 1 << g;
+	}
+	fclose (fp);
+	if (wants == NULL) {
+		fprintf (stderr, "%s: there are no settings in \"%s\"\n", progname, configfile);
+		return -1;
+	}
+	return 0;
+
+bad:
+	fprintf (stderr, "%s: %s, line %d: not a setting that we know, or a value that it can have\n",
+		progname, configfile, lineno);
+	fclose (fp);
+	return -1;
+}
+
+/* what the device with this (normalized) MAC should have for the setting, or NULL */
+static const struct wanted *
+config_wanted (const char *mac, int g, int s)
+{
+	const struct wanted *wp, *found = NULL;
+
+	for (wp = wants; wp != NULL; wp = wp->next) {
+		if (wp->group != g || wp->setting != s)
+			continue;
+		if (wp->mac[0] == '\0')
+			found = wp;
+		else if (strcmp (wp->mac, mac) == 0)
+			return wp;
+	}
+	return found;
+}
+
+static void
+config_fail (struct config_device *dp, const char *fmt, ...)
+{
+	va_list	ap;
+
+	va_start (ap, fmt);
+	vsnprintf (dp->error, sizeof dp->error, fmt, ap);
+	va_end (ap);
+	if (dp->fd >= 0) {
+		trace_close (dp->fd);
+		close (dp->fd);
+		dp->fd = -1;
+	}
+	dp->state = CS_DONE;
+}
+
+/* add a line to what's shown of the device's differences */
+static void
+config_diff (struct config_device *dp, const char *fmt, ...)
+{
+	va_list	ap;
+	char	line[512];
+	int	n;
+
+	va_start (ap, fmt);
+	n = vsnprintf (line, sizeof line, fmt, ap);
+	va_end (ap);
+	if (n >= (int) sizeof line)
+		n = sizeof line - 1;
+	if ((dp->diffs = realloc (dp->diffs, dp->difflen + n + 1)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	memcpy (dp->diffs + dp->difflen, line, n + 1);
+	dp->difflen += n;
+}
+
+/*
+ *	Start connecting to the device, without waiting.  Returns 0, or -1
+ *	if it failed already.
+ */
+static int
+config_start (struct config_device *dp)
+{
+	struct addrinfo hints = {0};
+	struct addrinfo *addresses;
+	char	peer[NI_MAXHOST + 16];
+	int	r, g;
+
+	hints.ai_family = AF_INET;		// the devices only do IPv4 and TCP
+	hints.ai_socktype = SOCK_STREAM;
+	if ((r = getaddrinfo (dp->sp->host, dp->sp->service, &hints, &addresses)) != 0) {
+		config_fail (dp, "could not resolve it: %s", gai_strerror (r));
+		return -1;
+	}
+	if ((dp->fd = socket (addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol)) < 0) {
+		freeaddrinfo (addresses);
+		config_fail (dp, "socket failed: %s", strerror (errno));
+		return -1;
+	}
+	fcntl (dp->fd, F_SETFL, fcntl (dp->fd, F_GETFL) | O_NONBLOCK);
+	r = connect (dp->fd, addresses->ai_addr, addresses->ai_addrlen);
+	getnameinfo (addresses->ai_addr, addresses->ai_addrlen, peer, NI_MAXHOST,
+		NULL, 0, NI_NUMERICHOST);
+	freeaddrinfo (addresses);
+	if (r < 0 && errno != EINPROGRESS) {
+		config_fail (dp, "cannot connect: %s", strerror (errno));
+		return -1;
+	}
+	snprintf (peer + strlen (peer), 16, " %s", dp->sp->service);
+	trace_open (dp->fd, TR_CONNECT, peer);
+
+	// its MAC address, then each group that the file mentions
+	dp->command[dp->nsteps] = CMD_READ_SATION_MAC;
+	dp->group[dp->nsteps++] = -1;
+	for (g = 0; g < NGROUPS; g++) {
+		if (used & (1 << g)) {
+			dp->command[dp->nsteps] = groups[g].read;
+			dp->group[dp->nsteps++] = g;
+		}
+	}
+	dp->state = CS_CONNECT;
+	dp->deadline = fw_clock () + fw_deadline[DL_REPLY] * 1000ULL;
+	return 0;
+}
+
+/* send (some more of) the step's command */
+static void
+config_send (struct config_device *dp)
+{
+	int	r;
+
+	if ((r = write (dp->fd, dp->out + dp->outoff, dp->outlen - dp->outoff)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			config_fail (dp, "cannot send to it: %s", strerror (errno));
+		return;
+	}
+	trace_data (dp->fd, TR_SEND, dp->out + dp->outoff, r);
+	if ((dp->outoff += r) < dp->outlen)
+		return;
+	dp->state = CS_REPLY;
+	dp->inlen = 0;
+	dp->deadline = fw_clock () + fw_deadline[DL_REPLY] * 1000ULL;
+}
+
+/*
+ *	The step's reply, checked strictly - its checksum, that it's the
+ *	reply to what we sent, that it fits its layout, and that the device
+ *	didn't say no - and decoded into "reply".  Returns 0, or -1.
+ */
+static int
+config_verify (struct config_device *dp, int length)
+{
+	uchar	command = dp->command[dp->step];
+	uchar	*packet = dp->in;
+	int	have = reply_layouts[packet[2]].sizebytes == 2 ? 5 : 4;
+	int	sum = 0, i;
+
+	for (i = 2; i < length - 1; i++)
+		sum += packet[i];
+	if ((sum & 0xff) != packet[length - 1]) {
+		config_fail (dp, "checksum error in the reply to %s", reply_layouts[command].name);
+		return -1;
+	}
+	if (packet[2] != command) {
+		config_fail (dp, "reply to command 0x%02x when we sent %s",
+			packet[2], reply_layouts[command].name);
+		return -1;
+	}
+	if (decode_reply_data (command, packet + have, length - have - 1, &reply) != length - have - 1) {
+		config_fail (dp, "the reply to %s doesn't match its layout", reply_layouts[command].name);
+		return -1;
+	}
+	if (reply.status != 0) {
+		config_fail (dp, "the device refused %s", reply_layouts[command].name);
+		return -1;
+	}
+	return 0;
+}
+
+/* read (some more of) the step's reply, and act on it once it's all here */
+static void
+config_receive (struct config_device *dp)
+{
+	int	r, size;
+
+	if ((r = read (dp->fd, dp->in + dp->inlen, sizeof dp->in - dp->inlen)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			config_fail (dp, "cannot read from it: %s", strerror (errno));
+		return;
+	}
+	trace_data (dp->fd, TR_RECV, dp->in + dp->inlen, r);
+	if (r == 0) {
+		config_fail (dp, "it closed the connection");
+		return;
+	}
+	dp->inlen += r;
+
+	// the size counts everything after the ff ff
+	if (dp->inlen >= 2 && (dp->in[0] != 0xff || dp->in[1] != 0xff)) {
+		config_fail (dp, "the reply doesn't start with ff ff");
+		return;
+	}
+	if (dp->inlen < 4)
+		return;
+	size = dp->in[3];
+	if (reply_layouts[dp->in[2]].sizebytes == 2) {
+		if (dp->inlen < 5)
+			return;
+		size = (size << 8) | dp->in[4];
+	}
+	if (2 + size > (int) sizeof dp->in || size < 3) {
+		config_fail (dp, "a reply of %d bytes", 2 + size);
+		return;
+	}
+	if (dp->inlen < 2 + size)
+		return;
+	if (dp->inlen > 2 + size) {
+		config_fail (dp, "more than the reply to %s", reply_layouts[dp->command[dp->step]].name);
+		return;
+	}
+	if (config_verify (dp, dp->inlen) == 0)
+		config_step (dp);
+}
+
+/*
+ *	Compare the group as it was read (in "reply") with what the file
+ *	wants, noting the differences if "show".  Returns how many settings
+ *	differ, or -1 if the reply isn't the group that we expected.
+ */
+static int
+config_compare (struct config_device *dp, int g, int show)
+{
+	const struct config_group *gp = &groups[g];
+	const struct wanted *wp;
+	struct reply_field *f;
+	char	mac[32];
+	int	s, n = 0;
+
+	if (reply.nfields != gp->nsettings)
+		return -1;
+	fw_normalize_mac (dp->sp->mac, mac, sizeof mac);
+	for (s = 0; s < gp->nsettings; s++) {
+		f = &reply.field[s];
+		if (f->desc->type != gp->settings[s].type)
+			return -1;
+		if (gp->settings[s].key == NULL || (wp = config_wanted (mac, g, s)) == NULL)
+			continue;
+		if (f->desc->type == FT_STRING) {
+			if (f->value == (long) strlen (wp->value) &&
+			    memcmp (f->data, wp->value, f->value) == 0)
+				continue;
+			if (show)
+				config_diff (dp, "\t%s %s: \"%.*s\" -> \"%s\"\n", gp->name,
+					gp->settings[s].key, (int) f->value, f->data, wp->value);
+		} else {
+			if (f->value == wp->number)
+				continue;
+			if (show)
+				config_diff (dp, "\t%s %s: %ld -> %ld\n", gp->name,
+					gp->settings[s].key, f->value, wp->number);
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ *	The data for writing the group: what it had, with what the file
+ *	wants in its place.  Returns its length, or -1 if it won't fit.
+ */
+static int
+config_encode (struct config_device *dp, int g, uchar *data)
+{
+	const struct config_group *gp = &groups[g];
+	const struct wanted *wp;
+	struct reply_field *f;
+	char	mac[32];
+	int	s, n = 0, len;
+	long	v;
+
+	fw_normalize_mac (dp->sp->mac, mac, sizeof mac);
+	decode_reply_data (gp->read, dp->have[g], dp->havelen[g], &reply);
+	for (s = 0; s < gp->nsettings; s++) {
+		f = &reply.field[s];
+		wp = gp->settings[s].key != NULL ? config_wanted (mac, g, s) : NULL;
+		switch (gp->settings[s].type) {
+		case FT_STRING:
+			len = wp != NULL ? (int) strlen (wp->value) : (int) f->value;
+			if (n + 1 + len > CONFIG_MAXDATA)
+				return -1;
+			data[n++] = len;
+			memcpy (data + n, wp != NULL ? (uchar *) wp->value : f->data, len);
+			n += len;
+			break;
+		case FT_U16:
+			v = wp != NULL ? wp->number : f->value;
+			data[n++] = v >> 8;
+			data[n++] = v;
+			break;
+		default:
+			v = wp != NULL ? wp->number : f->value;
+			data[n++] = v;
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ *	The step's reply is in: act on it, and send the next command - or
+ *	finish, when there's nothing more to do.
+ */
+static void
+config_step (struct config_device *dp)
+{
+	struct reply_field *f;
+	uchar	data[CONFIG_MAXDATA];
+	int	g = dp->group[dp->step];
+	int	step, n, len;
+
+	if (dp->command[dp->step] == CMD_READ_SATION_MAC) {
+		if ((f = find_field (&reply, FT_MAC)) != NULL)
+			snprintf (dp->sp->mac, sizeof dp->sp->mac, "%02x:%02x:%02x:%02x:%02x:%02x",
+				f->data[0], f->data[1], f->data[2],
+				f->data[3], f->data[4], f->data[5]);
+	} else if (dp->command[dp->step] == groups[g].read && dp->have[g] == NULL) {
+		// the first read of the group: keep it, and see what's different
+		if ((n = config_compare (dp, g, 1)) < 0) {
+			config_fail (dp, "the reply to %s isn't what we expected", reply_layouts[groups[g].read].name);
+			return;
+		}
+		len = dp->inlen - (reply_layouts[dp->in[2]].sizebytes == 2 ? 5 : 4) - 1;
+		if ((dp->have[g] = malloc (len)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		memcpy (dp->have[g], dp->in + dp->inlen - 1 - len, len);
+		dp->havelen[g] = len;
+		if (n > 0) {
+			dp->differ |= 1 << g;
+			dp->changes += n;
+		}
+	} else if (dp->command[dp->step] == groups[g].read) {
+		// read back, after writing it
+		if (config_compare (dp, g, 0) != 0) {
+			config_fail (dp, "the %s settings didn't take", groups[g].name);
+			return;
+		}
+	}
+
+	// once every group has been read, write those that need it
+	if (dp->step + 1 == dp->nsteps && writing && dp->differ != 0 && !dp->queued) {
+		dp->queued = 1;
+		for (n = 0; n < NGROUPS; n++) {
+			if (dp->differ & (1 << n)) {
+				dp->command[dp->nsteps] = groups[n].write;
+				dp->group[dp->nsteps++] = n;
+				dp->command[dp->nsteps] = groups[n].read;
+				dp->group[dp->nsteps++] = n;
+			}
+		}
+	}
+
+	if ((step = ++dp->step) == dp->nsteps) {
+		trace_close (dp->fd);
+		close (dp->fd);
+		dp->fd = -1;
+		dp->state = CS_DONE;
+		return;
+	}
+	len = 0;
+	if (dp->command[step] == groups[dp->group[step]].write &&
+	    (len = config_encode (dp, dp->group[step], data)) < 0) {
+		config_fail (dp, "the %s settings are too long to send", groups[dp->group[step]].name);
+		return;
+	}
+	dp->outlen = build_command_packet (dp->command[step], data, len, dp->out);
+	dp->outoff = 0;
+	dp->state = CS_SEND;
+	config_send (dp);
+}
+
+/* one line for the device, and its differences under it */
+static void
+config_report (struct config_device *dp)
+{
+	struct session *sp = dp->sp;
+
+	printf ("%-20s %-17s ", sp->host, sp->mac[0] ? sp->mac : "-");
+	if (dp->error[0] != '\0')
+		printf ("FAILED: %s\n", dp->error);
+	else if (dp->changes == 0)
+		printf ("as wanted\n");
+	else
+		printf ("%s %d setting%s\n", writing ? "changed" : "would change",
+			dp->changes, dp->changes == 1 ? "" : "s");
+	if (dp->diffs != NULL)
+		fputs (dp->diffs, stdout);
+}
+
+/*
+ *	Bring each of the devices into line with the settings in the file
+ *	- or, unless "change", show where they aren't.  Returns 0, or 1 if any
+ *	of them failed.
+ */
+int
+do_config (char *configfile, struct session *sessions, int n, int change)
+{
+	struct config_device *devices, *dp;
+	struct pollfd *pfds;
+	struct config_device **polled;
+	struct timeval start, now;
+	uint64_t clock;
+	int	next = 0, open = 0, left = n;
+	int	i, np, timeout, ok = 0, changed = 0, failed = 0;
+	int	err;
+	socklen_t errlen;
+
+	writing = change;
+	if (config_read (configfile) < 0)
+		return 1;
+	if ((devices = calloc (n, sizeof *devices)) == NULL ||
+	    (pfds = calloc (CONFIG_MAXOPEN, sizeof *pfds)) == NULL ||
+	    (polled = calloc (CONFIG_MAXOPEN, sizeof *polled)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	for (i = 0; i < n; i++) {
+		devices[i].sp = &sessions[i];
+		devices[i].fd = -1;
+	}
+	gettimeofday (&start, NULL);
+
+	while (left > 0) {
+		// start as many as we may
+		for ( ; next < n && open < CONFIG_MAXOPEN; next++) {
+			if (config_start (&devices[next]) == 0)
+				open++;
+			else
+				left--;
+		}
+
+		clock = fw_clock ();
+		timeout = -1;
+		for (i = np = 0; i < n && np < CONFIG_MAXOPEN; i++) {
+			dp = &devices[i];
+			if (dp->state == CS_WAITING || dp->state == CS_DONE)
+				continue;
+			if (clock >= dp->deadline) {
+				if (dp->state == CS_CONNECT)
+					config_fail (dp, "no answer within %d seconds", fw_deadline[DL_REPLY]);
+				else
+					config_fail (dp, "no reply to %s within %d seconds",
+						reply_layouts[dp->command[dp->step]].name, fw_deadline[DL_REPLY]);
+				open--;
+				left--;
+				continue;
+			}
+			if (timeout < 0 || (int) (dp->deadline - clock) < timeout)
+				timeout = dp->deadline - clock;
+			pfds[np].fd = dp->fd;
+			pfds[np].events = dp->state == CS_REPLY ? POLLIN : POLLOUT;
+			pfds[np].revents = 0;
+			polled[np++] = dp;
+		}
+		if (np == 0)
+			continue;
+		if (poll (pfds, np, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "%s: poll failed: %s\n", __FUNCTION__, strerror (errno));
+			exit (1);
+		}
+
+		for (i = 0; i < np; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+			dp = polled[i];
+			switch (dp->state) {
+			case CS_CONNECT:
+				errlen = sizeof err;
+				if (getsockopt (dp->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+					err = errno;
+				if (err != 0) {
+					config_fail (dp, "cannot connect: %s", strerror (err));
+					break;
+				}
+				dp->outlen = build_command_packet (dp->command[0], NULL, 0, dp->out);
+				dp->outoff = 0;
+				dp->state = CS_SEND;
+				// fall through
+			case CS_SEND:
+				config_send (dp);
+				break;
+			case CS_REPLY:
+				config_receive (dp);
+				break;
+			}
+			if (dp->state == CS_DONE) {
+				open--;
+				left--;
+			}
+		}
+	}
+
+	gettimeofday (&now, NULL);
+	printf ("\n");
+	for (i = 0; i < n; i++) {
+		dp = &devices[i];
+		config_report (dp);
+		if (dp->error[0] != '\0')
+			failed++;
+		else if (dp->changes > 0)
+			changed++;
+		else
+			ok++;
+	}
+	printf ("\n%d device%s: %d as wanted, %d %s, %d failed, in %.1f seconds\n",
+		n, n == 1 ? "" : "s", ok, changed, writing ? "changed" : "to change", failed,
+		(now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6);
+
+	for (i = 0; i < n; i++) {
+		for (np = 0; np < NGROUPS; np++)
+			free (devices[i].have[np]);
+		free (devices[i].diffs);
+	}
+	free (devices);
+	free (pfds);
+	free (polled);
+	return failed > 0 ? 1 : 0;
+}
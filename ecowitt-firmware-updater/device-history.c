@@ -0,0 +1,388 @@
+/*
+ *	The history of each device's firmware ("-H file"): a line for every
+ *	download, as it's done, with when it was, the device's MAC address
+ *	and model, the version that it went from and to, how it went, and
+ *	how long each part of it took:
+ *
+ *		2024-06-12T14:03:27 30:83:98:a7:e2:9d GW1100C V2.1.8 V2.3.3 updated
+ *		    connect=0.81 request=0.02 prep=4.13 chunks=9.62 close=0.00
+ *		    rtt50=5.2 rtt90=7.9 rtt99=31.0 reboot=11.0 retries=0
+ *
+ *	(all on one line) - the phases in seconds, and the chunks' round
+ *	trips in milliseconds.  So that a rollback ("-R") can send each
+ *	device back to the version that it ran before, which may not be
+ *	the one just below it in the catalog, if it skipped some; and so
+ *	that a device that's getting slower to update - its Wi-Fi failing,
+ *	say - can be seen before it fails.
+ *
+ *	The file is only ever added to.  Beside it, in "file.baseline", is
+ *	a line for each device: what its downloads usually take, as a
+ *	moving average of its median chunk round trip and the pause while
+ *	it prepares its flash, and what its last one took.  That is brought
+ *	up to date as each download is added, so that "-A" can compare
+ *	each device's last download with its own usual without reading the
+ *	whole history - which is only read for a rollback, or to make the
+ *	baseline again if it's lost.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+#include "firmware-info.h"
+
+#define	BASELINE_SUFFIX	".baseline"
+#define	BASELINE_WEIGHT	0.25	// of each download, in the moving average
+#define	BASELINE_MIN	2	// downloads in the usual, before it's compared
+#define	RTT_FLOOR	1.0	// milliseconds slower, at least, to count
+#define	PREP_FLOOR	0.5	// ... and seconds
+
+/* a change of version */
+struct history {
+	char	mac[32];	// normalized, as the catalog has them
+	char	from[64];
+	char	to[64];
+};
+
+/* what a device's downloads usually take */
+struct baseline {
+	char	mac[32];	// as the history has it
+	char	nmac[32];	// ... and normalized
+	char	model[64];
+	int	downloads;	// that worked, with their times
+	double	rtt, prep;	// the moving averages, before the last
+	double	last_rtt, last_prep;	// the last one
+	char	when[32];	// ... and when it was
+};
+
+static char	*history_file;		// -H, or NULL
+static struct history *history;		// the changes of version, oldest first
+static int	nhistory, maxhistory;
+static struct baseline *baselines;
+static int	nbaselines, maxbaselines;
+static int	baselines_changed;
+
+static void	add_history (const char *mac, const char *from, const char *to);
+static void	add_baseline (const char *mac, const char *model, const char *when,
+			double rtt, double prep);
+static int	read_baselines (const char *fname);
+static int	read_history (int rebuild);
+static double	field_value (char **fields, int n, const char *name);
+
+
+static void
+add_history (const char *mac, const char *from, const char *to)
+{
+	struct history *hp;
+
+	if (nhistory == maxhistory) {
+		maxhistory = maxhistory ? 2 * maxhistory : 64;
+		if ((hp = realloc (history, maxhistory * sizeof *hp)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		history = hp;
+	}
+	hp = &history[nhistory++];
+	fw_normalize_mac (mac, hp->mac, sizeof hp->mac);
+	snprintf (hp->from, sizeof hp->from, "%s", from);
+	snprintf (hp->to, sizeof hp->to, "%s", to);
+}
+
+/* another download that worked, for the device's baseline */
+static void
+add_baseline (const char *mac, const char *model, const char *when, double rtt, double prep)
+{
+	struct baseline *bp;
+	char	nmac[32];
+	int	i;
+
+	fw_normalize_mac (mac, nmac, sizeof nmac);
+	for (i = 0; i < nbaselines && strcmp (baselines[i].nmac, nmac) != 0; i++)
+		;
+	if (i == nbaselines) {
+		if (nbaselines == maxbaselines) {
+			maxbaselines = maxbaselines ? 2 * maxbaselines : 64;
+			if ((bp = realloc (baselines, maxbaselines * sizeof *bp)) == NULL) {
+				fprintf (stderr, "%s: out of memory\n", progname);
+				exit (1);
+			}
+			baselines = bp;
+		}
+		bp = &baselines[nbaselines++];
+		memset (bp, 0, sizeof *bp);
+		snprintf (bp->mac, sizeof bp->mac, "%s", mac);
+		snprintf (bp->nmac, sizeof bp->nmac, "%s", nmac);
+	}
+	bp = &baselines[i];
+
+	// the last one joins the usual, and this one is the last
+	if (bp->downloads == 1) {
+		bp->rtt = bp->last_rtt;
+		bp->prep = bp->last_prep;
+	} else if (bp->downloads > 1) {
+		bp->rtt += BASELINE_WEIGHT * (bp->last_rtt - bp->rtt);
+		bp->prep += BASELINE_WEIGHT * (bp->last_prep - bp->prep);
+	}
+	bp->last_rtt = rtt;
+	bp->last_prep = prep;
+	bp->downloads++;
+	snprintf (bp->model, sizeof bp->model, "%s", model);
+	snprintf (bp->when, sizeof bp->when, "%s", when);
+	baselines_changed = 1;
+}
+
+/* the baselines, as history_save() left them - 0, or -1 if there aren't any */
+static int
+read_baselines (const char *fname)
+{
+	struct baseline b;
+	char	line[512];
+	FILE	*fp;
+
+	if ((fp = fopen (fname, "r")) == NULL)
+		return -1;
+	while (fgets (line, sizeof line, fp) != NULL) {
+		memset (&b, 0, sizeof b);
+		if (line[0] == '#' || sscanf (line, "%31s %63s %d %lf %lf %lf %lf %31s", b.mac,
+		    b.model, &b.downloads, &b.rtt, &b.prep, &b.last_rtt, &b.last_prep, b.when) != 8)
+			continue;
+		add_baseline (b.mac, b.model, b.when, 0, 0);
+		baselines[nbaselines - 1] = b;
+		fw_normalize_mac (b.mac, baselines[nbaselines - 1].nmac, sizeof b.nmac);
+	}
+	fclose (fp);
+	baselines_changed = 0;
+	return 0;
+}
+
+/* the value of "name=..." among the fields, or -1 */
+static double
+field_value (char **fields, int n, const char *name)
+{
+	size_t	len = strlen (name);
+	int	i;
+
+	for (i = 6; i < n; i++) {
+		if (strncmp (fields[i], name, len) == 0 && fields[i][len] == '=')
+			return atof (fields[i] + len + 1);
+	}
+	return -1;
+}
+
+/*
+ *	Read the whole history: the changes of version, for a rollback, and
+ *	if "rebuild", the baselines too.  Returns 0, or -1 (with a message).
+ */
+static int
+read_history (int rebuild)
+{
+	FILE	*fp;
+	char	line[1024];
+	char	*fields[32];
+	double	rtt, prep;
+	int	n, ok;
+
+	if ((fp = fopen (history_file, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf (stderr, "%s: cannot open history file \"%s\": %s\n",
+			progname, history_file, strerror (errno));
+		return -1;
+	}
+	while (fgets (line, sizeof line, fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+		for (n = 0; n < 32 && (fields[n] = strtok (n == 0 ? line : NULL, " \t\r\n")) != NULL; n++)
+			;
+		if (n < 5)
+			continue;
+		// when mac model from to [outcome timings...]
+		ok = n == 5 || strcmp (fields[5], "updated") == 0 ||
+			strcmp (fields[5], "unverified") == 0;
+		if (ok && strcasecmp (fields[3], fields[4]) != 0 && strcmp (fields[4], "-") != 0)
+			add_history (fields[1], fields[3], fields[4]);
+		if (ok && rebuild && (rtt = field_value (fields, n, "rtt50")) >= 0 &&
+		    (prep = field_value (fields, n, "prep")) >= 0)
+			add_baseline (fields[1], fields[2], fields[0], rtt, prep);
+	}
+	fclose (fp);
+	if (verbose)
+		printf ("%d update%s in the history in \"%s\"\n", nhistory,
+			nhistory == 1 ? "" : "s", history_file);
+	return 0;
+}
+
+/*
+ *	Keep the history in this file, which needn't be there yet - with
+ *	the baselines beside it, which are made from the history if they're
+ *	not there.  With "full", the whole history is read, for a rollback.
+ *	Returns 0, or -1 (with a message).
+ */
+int
+history_open (char *fname, int full)
+{
+	char	bname[1024];
+	int	rebuild;
+
+	history_file = fname;
+	snprintf (bname, sizeof bname, "%s" BASELINE_SUFFIX, fname);
+	rebuild = read_baselines (bname) < 0;
+	if (!full && !rebuild)
+		return 0;
+	if (read_history (rebuild) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ *	The version that this device ran before "current" - from the last
+ *	update that brought it to "current" from an older version - or NULL
+ *	if the history doesn't say.  Going back and forth between versions
+ *	leaves the older one as the one to go back to.
+ */
+const char *
+history_previous (const char *mac, const char *current)
+{
+	char	nmac[32];
+	int	i;
+
+	fw_normalize_mac (mac, nmac, sizeof nmac);
+	for (i = nhistory - 1; i >= 0; i--) {
+		if (strcmp (history[i].mac, nmac) == 0 &&
+		    strcasecmp (history[i].to, current) == 0 &&
+		    fw_version_compare (history[i].from, current) < 0)
+			return history[i].from;
+	}
+	return NULL;
+}
+
+/* add the device's download to the history, if it had one */
+void
+history_record (struct session *sp)
+{
+	static const char *outcomes[DEV_NOUTCOMES] = {
+		"failed", "checked", "current", "updated", "unverified"
+	};
+	struct transfer *tp = &sp->timings;
+	const char *to = sp->newversion[0] ? sp->newversion : sp->target[0] ? sp->target : "-";
+	char	when[32], rtts[64], reboot[32];
+	int	ok = sp->outcome == DEV_UPDATED || sp->outcome == DEV_UNVERIFIED;
+	time_t	now;
+	FILE	*fp;
+
+	if (history_file == NULL || !sp->updated || sp->mac[0] == '\0')
+		return;
+
+	time (&now);
+	strftime (when, sizeof when, "%Y-%m-%dT%H:%M:%S", localtime (&now));
+	rtts[0] = reboot[0] = '\0';
+	if (tp->chunks > 0)
+		snprintf (rtts, sizeof rtts, " rtt50=%.1f rtt90=%.1f rtt99=%.1f",
+			transfer_rtt_percentile (tp, 0.5), transfer_rtt_percentile (tp, 0.9),
+			transfer_rtt_percentile (tp, 0.99));
+	if (sp->reboot >= 0)
+		snprintf (reboot, sizeof reboot, " reboot=%.1f", sp->reboot);
+
+	if ((fp = fopen (history_file, "a")) == NULL ||
+	    (fprintf (fp, "%s %s %s %s %s %s connect=%.2f request=%.2f prep=%.2f chunks=%.2f"
+		" close=%.2f%s%s retries=%d\n", when, sp->mac, sp->model[0] ? sp->model : "-",
+		sp->version[0] ? sp->version : "-", to, outcomes[sp->outcome],
+		tp->phase[DL_CONNECT] / 1e3, tp->phase[DL_REQUEST] / 1e3, tp->phase[DL_PREP] / 1e3,
+		tp->phase[DL_CHUNK] / 1e3, tp->phase[DL_CLOSE] / 1e3, rtts, reboot, sp->retries),
+	    fclose (fp)) != 0) {
+		fprintf (stderr, "%s: can't add %s's update to the history in \"%s\": %s\n",
+			progname, sp->host, history_file, strerror (errno));
+		return;
+	}
+	if (ok && strcasecmp (to, sp->version) != 0 && strcmp (to, "-") != 0)
+		add_history (sp->mac, sp->version, to);
+	if (ok && tp->chunks > 0)
+		add_baseline (sp->mac, sp->model, when, transfer_rtt_percentile (tp, 0.5),
+			tp->phase[DL_PREP] / 1e3);
+}
+
+/*
+ *	Write the baselines out again, if they've changed - to a new file,
+ *	which then takes the old one's place.  Returns 0, or -1 (with a
+ *	message).
+ */
+int
+history_save (void)
+{
+	char	bname[1024], tmpname[1100];
+	struct baseline *bp;
+	FILE	*fp;
+	int	i;
+
+	if (history_file == NULL || !baselines_changed)
+		return 0;
+	snprintf (bname, sizeof bname, "%s" BASELINE_SUFFIX, history_file);
+	snprintf (tmpname, sizeof tmpname, "%s.new", bname);
+	if ((fp = fopen (tmpname, "w")) == NULL)
+		goto fail;
+	fprintf (fp, "# mac model downloads rtt-ms prep-s last-rtt-ms last-prep-s last - from %s\n",
+		history_file);
+	for (i = 0, bp = baselines; i < nbaselines; i++, bp++)
+		fprintf (fp, "%s %s %d %.2f %.2f %.2f %.2f %s\n", bp->mac, bp->model, bp->downloads,
+			bp->rtt, bp->prep, bp->last_rtt, bp->last_prep, bp->when);
+	if (fclose (fp) != 0 || rename (tmpname, bname) < 0)
+		goto fail;
+	baselines_changed = 0;
+	return 0;
+
+fail:
+	fprintf (stderr, "%s: can't write \"%s\": %s\n", progname, tmpname, strerror (errno));
+	unlink (tmpname);
+	return -1;
+}
+
+/*
+ *	"-A percent": the devices whose last download was slower than usual
+ *	for them - its median chunk round trip, or the pause while the
+ *	device prepared its flash, more than "threshold" (a fraction) over
+ *	its baseline.  With "-v", every device is shown.  Returns how many
+ *	were slower, or -1 (with a message).
+ */
+int
+history_report (char *fname, double threshold)
+{
+	struct baseline *bp;
+	int	i, rttslow, prepslow, slow = 0, compared = 0;
+
+	if (history_open (fname, 0) < 0 || history_save () < 0)	// if it made them again
+		return -1;
+	if (nbaselines == 0) {
+		fprintf (stderr, "%s: there are no downloads in the history in \"%s\"\n",
+			progname, fname);
+		return -1;
+	}
+	for (i = 0, bp = baselines; i < nbaselines; i++, bp++) {
+		if (bp->downloads <= BASELINE_MIN) {
+			if (verbose)
+				printf ("%-17s %-8s %3d download%s - too few to compare\n", bp->mac,
+					bp->model, bp->downloads, bp->downloads == 1 ? "" : "s");
+			continue;
+		}
+		compared++;
+		rttslow = bp->last_rtt > bp->rtt * (1 + threshold) && bp->last_rtt - bp->rtt >= RTT_FLOOR;
+		prepslow = bp->last_prep > bp->prep * (1 + threshold) &&
+			bp->last_prep - bp->prep >= PREP_FLOOR;
+		slow += rttslow || prepslow;
+		if (!rttslow && !prepslow && !verbose)
+			continue;
+		printf ("%-17s %-8s %3d downloads, the last at %s: chunk RTT %6.1f ms (usually %6.1f)%s,"
+			" prep %5.1f s (usually %5.1f)%s\n", bp->mac, bp->model, bp->downloads, bp->when,
+			bp->last_rtt, bp->rtt, rttslow ? " SLOWER" : "",
+			bp->last_prep, bp->prep, prepslow ? " SLOWER" : "");
+	}
+	printf ("%d of %d device%s compared %s slower to update than usual (by more than %g%%)\n",
+		slow, compared, compared == 1 ? "" : "s", slow == 1 ? "is" : "are", threshold * 100);
+	return slow;
+}
@@ -35,6 +35,7 @@
 #include <poll.h>
 #include <netdb.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -46,16 +47,8 @@
 #include <sys/stat.h>
 #include <pthread.h>
 
-// Commands that we need to know - we only use a very few:
-typedef enum {
-	CMD_READ_SATION_MAC = 0x26,	// read MAC address (sic - missing the first 'T')
-	CMD_WRITE_UPDATE = 0x43,	// firmware upgrade
-	CMD_READ_FIRMWARE_VERSION = 0x50 // read current firmware version number
-} CMD_LT;
-
-typedef unsigned char	uchar;
-typedef unsigned short	ushort;
-typedef unsigned long	ulong;
+#include "ecowitt-firmware-updater.h"
+#include "firmware-info.h"
 
 
 /* global variables */
@@ -63,28 +56,62 @@ char	*progname;
 int	debug = 0;
 int	verbose = 0;
 int	update = 0;
+int	livedata = 0;
+int	sensorids = 0;
+char	*firmware1 = NULL,	// images given on the command line, or
+	*firmware2 = NULL;
+struct fw_catalog *catalog = NULL;	// ... chosen from this catalog (-c)
+char	*imagedir = NULL;	// ... in this directory (-D)
+int	verify_timeout = 180;	// seconds to wait for a device to come back (-w)
+int	maxfailures = 1;	// in a fleet, stop updating after this many (-g)
+int	jobs = 1;		// in a fleet, update this many at once (-j)
+int	engine = ENGINE_POLL;	// how to serve the downloads (-e)
+long	memlimit = POOL_DEFAULT;	// KiB for the downloads in progress (-m)
+int	retries = 1;		// times to start a download again if it stalls (-r)
+int	rollback = 0;		// send each device back to its previous version (-R)
+int	keephistory = 0;	// ... as the history kept with -H says
+int	force = 0;		// send an image even if it doesn't look right (-F)
+
+#define	VERIFY_MAXDELAY	16	// most seconds between attempts to reconnect
+#define	VERIFY_TIMEOUT	5	// seconds allowed to connect, or for a reply
+
+#define	CMD_MAXDATA	6	// most bytes of data in a command (CMD_WRITE_UPDATE's)
+#define	CMD_MAXPACKET	(CMD_MAXDATA + 5)	// ... and with the header, command,
+					// size, and checksum
 
 
 /* prototypes */
 int	build_command_packet (uchar command, uchar *data, int datalen, uchar *packet);
 int	receive_reply_packet (int fd, uchar *packet, int maxlen);
 
-int	interpret_read_station_mac (uchar command, uchar *ptr, int length);
-int	interpret_read_firmware_version (uchar command, uchar *ptr, int length);
-int	interpret_reply_packet (uchar expectedcommand, uchar *packet, int length);
+int	interpret_reply_packet (uchar expectedcommand, uchar *packet, int length, struct reply *rp);
 
-int	read_station_mac (int sock);
-int	read_firmware_version (int sock);
+int	read_simple_command (int sock, uchar command, struct reply *rp);
+int	read_station_mac (int sock, struct reply *rp);
+int	read_livedata (int sock, struct reply *rp);
+int	read_sensor_id (int sock, struct reply *rp);
+int	read_firmware_version (int sock, struct reply *rp);
 int	write_update (int sock, struct in_addr *addr, int port);
-int	do_firmware_service (int sock, int fd_user1, int fd_user2);
+int	start_update (int sock, char *fname_user1, char *fname_user2, struct fw_session *fsp,
+		const char *name, const char *model);
 
-int	open_socket (char *host, char *service);
+int	open_socket (char *host, char *service, int timeout);
 int	do_getsockname (int s, struct sockaddr_in *addrptr);
-void	hexdump (uchar *data, int length);
+
+void	verify_updates (struct session **sps, int n);
+int	begin_device (struct session *sp, struct fw_session *download);
+static void way_back (struct session *sp);
+static int close_device (struct session *sp, int r);
+static int retry_device (struct session *sp);
+int	finish_device (struct session *sp);
+int	do_devices (struct session *sessions, int n, int *status);
+int	do_device (struct session *sp);
+void	report_session (struct session *sp);
+int	read_hosts (char *hostfile, char *service, struct session **sessionsp);
+int	do_fleet (char *hostfile, char *service);
 
 int	safe_write (int fd, uchar *bufp, int len);
-int	timed_read (int fd, char *buf, int len, int timeout);
-int	read_until_null (int fd, char *buf, int bufsiz);
+int	timed_read (int fd, char *buf, int len, uint64_t deadline);
 
 void	usage (void);
 int	main (int argc, char **argv);
@@ -141,8 +168,11 @@ build_command_packet (uchar command, uchar *data, int datalen, uchar *packet)
 	return (int)(pptr - packet);		// total number of bytes in the packet
 }
 
-//XXX this function could use some reworking -- need to verify that
-//XXX the data received is what we expect, and timeouts are obeyed.
+/*
+ *	Read a reply from the device into packet.  The whole reply must
+ *	arrive within fw_deadline[DL_REPLY] seconds.
+ *	Returns its length, or -1.
+ */
 int
 receive_reply_packet (int fd, uchar *packet, int maxlen)
 {
@@ -151,18 +181,30 @@ receive_reply_packet (int fd, uchar *packet, int maxlen)
 	int	total_len = 0;
 	int	r;
 	int	size;
+	int	have;
 	int	remain;
+	uint64_t deadline = fw_clock () + fw_deadline[DL_REPLY] * 1000ULL;
 
 	/* first we expect to read the two header bytes - should be FF FF */
 
-	/* okay to block for the first header byte */
-	while ((r = read (fd, &c, 1)) >= 0 && maxlen > 0) {
+	/* the device may take a moment to start replying */
+	while ((r = timed_read (fd, (char *) &c, 1, deadline)) >= 0 && maxlen > 0) {
+		if (r == 0) {
+			fprintf (stderr, "%s: connection closed by remote.\n",
+				__FUNCTION__);
+			return -1;
+		}
 		*pptr++ = c;
 		maxlen--;
 		total_len++;
 		if (c == 0xff)	// this is what we want
 			break;
 	}
+	if (r == -2) {
+		fprintf (stderr, "%s: no reply within %d seconds.\n",
+			__FUNCTION__, fw_deadline[DL_REPLY]);
+		return -1;
+	}
 	if (r < 0) {		/* an error occurred */
 		fprintf (stderr, "%s: socket read error: %s\n",
 			__FUNCTION__, strerror (errno));
@@ -179,7 +221,7 @@ receive_reply_packet (int fd, uchar *packet, int maxlen)
 	 * should be the second FF, the command byte, and the size.
 	 */
 	while (total_len < 4) {
-		if ((r = timed_read (fd, (char *)pptr, (4 - total_len), 1)) < 0) {
+		if ((r = timed_read (fd, (char *)pptr, (4 - total_len), deadline)) <= 0) {
 			// the read timed out
 			fprintf (stderr, "%s: timeout reading header bytes (%d).\n",
 				__FUNCTION__, (4 - total_len));
@@ -189,27 +231,36 @@ receive_reply_packet (int fd, uchar *packet, int maxlen)
 		total_len += r;
 	}
 
-	//command = packet[2];		/* third byte is the command */
-
-	// NOTE that certain commands use two bytes for the size field, but
-	// we're not using those commands here.
-	/* the expected size is in packet[3] -- this size includes the
-	 * command byte, size byte, data byte(s), and checksum byte.
+	/* The third byte is the command, and the expected size is in
+	 * packet[3] -- this size includes the command byte, size byte(s),
+	 * data byte(s), and checksum byte.  Certain commands use two bytes
+	 * for the size field, so get the second one for those.
 	 */
 	size = packet[3];
 	size &= 0x00ff;
-	if (size > (maxlen-2)) {	// sanity check
+	have = 2;			// command and size bytes
+	if (reply_layouts[packet[2]].sizebytes == 2) {
+		if (timed_read (fd, (char *)pptr, 1, deadline) != 1) {
+			fprintf (stderr, "%s: timeout reading second size byte.\n",
+				__FUNCTION__);
+			return -1;
+		}
+		size = (size << 8) | *pptr++;
+		total_len++;
+		have++;
+	}
+	if (size < have || size > (maxlen-2)) {	// sanity check
 		fprintf (stderr, "%s: size in reply packet is too large for buffer (%d vs %d)\n",
 			__FUNCTION__, size, maxlen);
 		return -1;
 	}
 
-	/* we need to get size-2 bytes (we already have command and size) */
-	remain = size - 2;
+	/* we need to get the rest (we already have command and size) */
+	remain = size - have;
 
 	/* now read the remaining bytes, with a timeout */
 	while (remain > 0) {
-		r = timed_read (fd, (char *)pptr, maxlen, 1);
+		r = timed_read (fd, (char *)pptr, remain, deadline);
 		if (r < 0) {
 			fprintf (stderr, "%s: timeout reading the rest.\n",
 				__FUNCTION__);
@@ -227,92 +278,22 @@ receive_reply_packet (int fd, uchar *packet, int maxlen)
 }
 
 
-/*
- *	Macros for pulling various-sized entities from the data buffer.
- *
- *	These are simple and brute-force, but don't have any alignment
- *	or byte-order issues...
- */
-#define	GET_BYTE(VAR,PTR,LEN)		{	\
-				VAR = (*(PTR++));	\
-				(LEN) --;		\
-					}
-
-#define	GET_BUFFER(VAR,N,PTR,LEN)	{	\
-				uchar *_p = (uchar *)(VAR);	\
-				for (int _remain = (N); _remain > 0; _remain--) {	\
-					*_p++ = (*(PTR++));	\
-					(LEN) --;		\
-				}				\
-					}
-
-
-//------------------------------------------------------------------------------
-/* Interpret the reply to CMD_READ_SATION_MAC (sic)..
- *
- * We expect to see this field here:
- *	Sta_mac[6]		6	sta_mac[0];sta_mac[1];sta_mac[2]; sta_mac[3];sta_mac[4];sta_mac[5];
- *
- * Returns the number of bytes consumed, so the caller can be sure that
- * everything was handled.
- */
-int
-interpret_read_station_mac (uchar command, uchar *ptr, int length)
-{
-	int	original_length = length;
-	uchar	macaddress[6];
-
-	/* the MAC address is six bytes */
-	GET_BUFFER (macaddress, 6, ptr, length);
-
-	printf ("MAC Address [%02x:%02x:%02x:%02x:%02x:%02x]\n",
-			macaddress[0], macaddress[1], macaddress[2],
-			macaddress[3], macaddress[4], macaddress[5]);
-
-	return (original_length - length);
-}
-
-//------------------------------------------------------------------------------
-/* Interpret the reply to CMD_READ_FIRMWARE_VERSION.
- *
- * We expect to see these fields here:
- *	Version length			1	Max value 23Bytes
- *	Version buffer				For example: "EasyWeatherV1.2.0"
- *
- * Returns the number of bytes consumed, so the caller can be sure that
- * everything was handled.
- */
-int
-interpret_read_firmware_version (uchar command, uchar *ptr, int length)
-{
-	int	original_length = length;
-	int	version_length;
-	uchar	version_buffer[256];
-
-	/* get the length of the version string */
-	GET_BYTE (version_length, ptr, length);
-
-	/* now collect that many bytes into version_buffer[] */
-	GET_BUFFER (version_buffer, version_length, ptr, length);
-
-	version_buffer[version_length] = '\0';	// null-terminate
-
-	printf ("Firmware Version [%s]\n", version_buffer);
-
-	return (original_length - length);
-}
-
 /*------------------------------------------------------------------------------
  *	This is the first code to handle a reply packet.
  *	- It knows that byte 0 and 1 are both 0xff.
  *	- Byte 2 is the command that this is a reply to.
  *	- Byte 3 [and possibly byte 4] is/are the size, including the command
- *	  and size bytes.  (It knows which commands use two-byte sizes.)
- *	- bytes 4 or 5 to N-1 are the payload
+ *	  and size bytes.  (reply_layouts[] knows which commands use two-byte
+ *	  sizes.)
+ *	- bytes 4 or 5 to N-1 are the payload, which is decoded into *rp
+ *	  according to the command's entry in reply_layouts[]
  *	- Byte N is the checksum.
+ *
+ *	Returns 0 on success, or -1 if the reply can't be decoded or the
+ *	device reported a failure.
  */
 int
-interpret_reply_packet (uchar expectedcommand, uchar *packet, int length)
+interpret_reply_packet (uchar expectedcommand, uchar *packet, int length, struct reply *rp)
 {
 	int	orig_length = length;
 	int	r;
@@ -321,7 +302,7 @@ interpret_reply_packet (uchar expectedcommand, uchar *packet, int length)
 	uchar	command;
 	int	size;
 	uchar	cksum;
-	int	status;
+	const struct reply_layout *layout;
 
 	ptr = packet;
 
@@ -368,76 +349,78 @@ interpret_reply_packet (uchar expectedcommand, uchar *packet, int length)
 			command, length, expectedcommand);
 	}
 
-	// NOTE that several commands use two bytes to specify the "size" value
-	// in their replies.  We are not using any of those commands here.
 	/* fourth byte is size */
 	size = (unsigned int) (*ptr++);
 	length--;
 
-	// take off one from the length for the checksum byte at the end.
-	length--;
-
-	/* now handle the data bytes - which depends on the command */
-
-	// read the gateway's MAC address
-	if (command == CMD_READ_SATION_MAC) {
-		r = interpret_read_station_mac (command, ptr, length);
-		if (r > 0) {	// adjust length and data pointer
-			length -= r;
-			ptr += r;
-		}
-	} else
-
-	// read the gateway's firmware version
-	if (command == CMD_READ_FIRMWARE_VERSION) {
-		r = interpret_read_firmware_version (command, ptr, length);
-		if (r > 0) {	// adjust length and data pointer
-			length -= r;
-			ptr += r;
-		}
-	} else
-
-	// write (firmware) update
-	if (command == CMD_WRITE_UPDATE) {
-		/* get the status - first data byte */
-		GET_BYTE (status, ptr, length);
-		if (debug) {
-			printf ("command CMD_WRITE_UPDATE: status = 0x%x\n", status);
-		}
-		if (status == 0)	// 0 = success
-			return 0;
-		return -1;		// else return failure
-	} else
-
-	{
+	layout = &reply_layouts[command];
+	if (layout->decode == NULL) {
 		// unknown command - perhaps we sent something the firmware
 		// doesn't recognise, or at least we don't recognise it here.
-
-		/* assume it's okay to get the status - first data byte */
-		int status;
-		GET_BYTE (status, ptr, length);
-
 		printf ("%s: UNHANDLED CASE: command=0x%x - length is %d\n",
 			__FUNCTION__, command, orig_length);
-		printf ("status = 0x%x, size = %d\n", status, size);
+		printf ("size = %d\n", size);
 
 		// dump out the raw data
 		printf ("%s: Dump of raw data - length %d bytes:\n", __FUNCTION__, orig_length);
 		hexdump (packet, orig_length);
 		printf ("\n");
 
-		abort();
+		return -1;
+	}
+
+	/* ... and the fifth byte is also size, for some commands */
+	if (layout->sizebytes == 2) {
+		size = (size << 8) | *ptr++;
+		length--;
+	}
+
+	// take off one from the length for the checksum byte at the end.
+	length--;
+
+	/* now handle the data bytes, as the layout for the command says */
+	r = decode_reply_data (command, ptr, length, rp);
+	if (r < 0) {
+		printf ("%s: reply to command 0x%02x doesn't match its layout (data length=%d)\n",
+			__FUNCTION__, command, length);
+		hexdump (packet, orig_length);
+		return -1;
 	}
 
 	// Make sure we consumed all bytes of the response - if not, we parsed it wrong!
-	if (length != 0) {
-		printf ("\n*** LENGTH IS %d - should be 0 (command 0x%02x). ***\n", length, command);
-		abort();
+	if (r != length) {
+		printf ("\n*** LENGTH IS %d - should be 0 (command 0x%02x). ***\n", length - r, command);
+		return -1;
 	}
 
+	print_reply (rp);
+
+	if (rp->status != 0)	// the device says that the command failed
+		return -1;
+
 	return 0;
 }
 
+/*
+ *	Send a command that takes no data, and collect and interpret the
+ *	reply into *rp.
+ */
+int
+read_simple_command (int sock, uchar command, struct reply *rp)
+{
+	int	packetlen;
+	uchar	commandpacket[CMD_MAXPACKET];
+	int	r;
+
+	packetlen = build_command_packet (command, NULL, 0, commandpacket);
+	if ((r = safe_write (sock, commandpacket, packetlen)) != packetlen)
+		return r;
+	if ((r = receive_reply_packet (sock, rp->packet, sizeof rp->packet)) < 0)
+		return r;
+	r = interpret_reply_packet (command, rp->packet, r, rp);
+	return r;
+}
+
 //------------------------------------------------
 // CMD_READ_SATION_MAC(sic) takes no data:
 //		Read MAC
@@ -453,20 +436,50 @@ interpret_reply_packet (uchar expectedcommand, uchar *packet, int length)
 //	Sta_mac[6]		6	sta_mac[0];sta_mac[1];sta_mac[2];sta_mac[3];sta_mac[4];sta_mac[5];
 //	Checksum		1	checksum
 int
-read_station_mac (int sock)
+read_station_mac (int sock, struct reply *rp)
 {
-	int	packetlen;
-	uchar	commandpacket[1024];
-	int	r;
-	uchar	response[1024];
+	return read_simple_command (sock, CMD_READ_SATION_MAC, rp);
+}
 
-	packetlen = build_command_packet (CMD_READ_SATION_MAC, NULL, 0, commandpacket);
-	if ((r = safe_write (sock, commandpacket, packetlen)) != packetlen)
-		return r;
-	if ((r = receive_reply_packet (sock, response, sizeof response)) < 0)
-		return r;
-	r = interpret_reply_packet (CMD_READ_SATION_MAC, response, r);
-	return r;
+//------------------------------------------------
+// CMD_GW1000_LIVEDATA takes no data:
+//		Read current data
+// Send:
+//	Fixed header		2	0xffff
+//	CMD_GW1000_LIVEDATA	1	0x27
+//	Size			1
+//	Checksum		1	checksum
+// Receive:
+//	Fixed header		2	0xffff
+//	CMD_GW1000_LIVEDATA	1	0x27
+//	Size			2	Packet size (two bytes)
+//	Item, data		...	see the ITEM entries in reply-layouts.def
+//	Checksum		1	checksum
+int
+read_livedata (int sock, struct reply *rp)
+{
+	return read_simple_command (sock, CMD_GW1000_LIVEDATA, rp);
+}
+
+//------------------------------------------------
+// CMD_READ_SENSOR_ID_NEW takes no data:
+//		Read sensor IDs, battery, and signal
+// Send:
+//	Fixed header		2	0xffff
+//	CMD_READ_SENSOR_ID_NEW	1	0x3c
+//	Size			1
+//	Checksum		1	checksum
+// Receive:
+//	Fixed header		2	0xffff
+//	CMD_READ_SENSOR_ID_NEW	1	0x3c
+//	Size			2	Packet size (two bytes)
+//	Type, ID, battery,	7	repeated for each sensor
+//	  signal
+//	Checksum		1	checksum
+int
+read_sensor_id (int sock, struct reply *rp)
+{
+	return read_simple_command (sock, CMD_READ_SENSOR_ID_NEW, rp);
 }
 
 //------------------------------------------------
@@ -485,20 +498,9 @@ read_station_mac (int sock)
 //	Version buffer				For example: "EasyWeatherV1.2.0"
 //	Checksum			1	checksum
 int
-read_firmware_version (int sock)
+read_firmware_version (int sock, struct reply *rp)
 {
-	int	packetlen;
-	uchar	commandpacket[1024];
-	int	r;
-	uchar	response[1024];
-
-	packetlen = build_command_packet (CMD_READ_FIRMWARE_VERSION, NULL, 0, commandpacket);
-	if ((r = safe_write (sock, commandpacket, packetlen)) != packetlen)
-		return r;
-	if ((r = receive_reply_packet (sock, response, sizeof response)) < 0)
-		return r;
-	r = interpret_reply_packet (CMD_READ_FIRMWARE_VERSION, response, r);
-	return r;
+	return read_simple_command (sock, CMD_READ_FIRMWARE_VERSION, rp);
 }
 
 //------------------------------------------------
@@ -523,11 +525,11 @@ int
 write_update (int sock, struct in_addr *addr, int port)
 {
 	int	packetlen;
-	uchar	commandpacket[1024];
-	uchar	databuf[1024];
+	uchar	commandpacket[CMD_MAXPACKET];
+	uchar	databuf[CMD_MAXDATA];
 	uchar	*dataptr = databuf;
 	int	r;
-	uchar	response[1024];
+	struct reply reply;
 	ulong	haddr;		// address in host byteorder
 	ushort	hport;		// port in host byteorder
 
@@ -549,264 +551,12 @@ write_update (int sock, struct in_addr *addr, int port)
 	packetlen = build_command_packet (CMD_WRITE_UPDATE, databuf, (int)(dataptr - databuf), commandpacket);
 	if ((r = safe_write (sock, commandpacket, packetlen)) != packetlen)
 		return r;
-	if ((r = receive_reply_packet (sock, response, sizeof response)) < 0)
+	if ((r = receive_reply_packet (sock, reply.packet, sizeof reply.packet)) < 0)
 		return r;
-	r = interpret_reply_packet (CMD_WRITE_UPDATE, response, r);
+	r = interpret_reply_packet (CMD_WRITE_UPDATE, reply.packet, r, &reply);
 	return r;
 }
 
-//==============================================================================
-
-// various states during the firmware transfer process:
-#define	STATE_BASE	0	// waiting to get "user1.bin" or "user2.bin"
-#define	GOT_USER1	1	// we have gotten "user1.bin"
-#define	GOT_USER2	2	// we have gotten "user2.bin"
-#define	GOT_START	3	// we have gotten "start"
-#define	GOT_CONTINUE	4	// we have gotten "continue"
-#define	GOT_END		5	// we have gotten "end"
-
-// helper function to decode "state" to a string:
-char *
-decode_state (int state)
-{
-	char *s;
-
-	switch (state) {
-	case STATE_BASE:	s = "state_base"; break;
-	case GOT_USER1:		s = "got_user1"; break;
-	case GOT_USER2:		s = "got_user2"; break;
-	case GOT_START:		s = "got_start"; break;
-	case GOT_CONTINUE:	s = "got_continue"; break;
-	case GOT_END:		s = "got_end"; break;
-	default:		s = "unknown"; break;
-	}
-
-	return s;
-}
-
-/*
- *	Firmware update - this is the part that actually handles the inbound
- *	conversation with the client device.  The process has already been
- *	initiated by sending the CMD_WRITE_UPDATE (0x43) to the device,
- *	specifying the IP address and TCP port number that the device should
- *	connect to in order to receive the firmware here, and the device has
- *	connected to our service port.  So now we talk the talk.
- *
- *	The protocol is very simple - it is all done over TCP, and all
- *	messages from the client are null-terminated.
- *
- *  ->	The client starts by asking for the firmware image that it wants
- *	with a simple "user1.bin\0" or "user2.bin\0" request. (Note: Older
- *	devices such as the GW1000 have two firmware images, referred to as
- *	"user1" and "user2". Newer device have a single image, and those
- *	devices always request "user1.bin".)
- *  <-	The server locates the correct file in the filesystem and opens it.
- *	It determines the file size (in bytes), and responds to the client
- *	with the size as a four-byte binary value, in network byte order.
- *	(NOT a string, which could be a variable length.)
- *
- *  The client usually takes a few seconds here -- I'm guessing that it's
- *  preparing the flash to store the inbound image.
- *
- *  ->	The client asks for the first data chunk by sending "start\0"
- *  <-	The server sends a buffer of data (1024 bytes, per observation of
- *	the WS View app - though the GW1000 specification says 1460.)
- * /->	The client replies with "continue\0"
- * \<-	The server loops - reading and sending the next buffer then waiting
- *	for "continue" again, until the entire image has been transferred.
- *	(The final buffer will be shorter, unless the file size is an exact
- *	multiple of the buffer size.)
- *  ->	When the client receives the full count of firmware image data, it
- *	will send "end\0", then close the TCP connection.
- */
-int
-do_firmware_service (int sock, int fd_user1, int fd_user2)
-{
-	char	line[BUFSIZ];	// client request buffer
-	int	linelen;	// number of bytes read from client
-	int	what;		// decoded value of what client just sent
-	int	fwfd = -1;	// file descriptor for firmware file
-	uchar	fwbuf[1024];	// size determined by observation of WS View app.
-	int	fwlen;		// number of bytes read from firmware file
-	struct stat stb;
-	int	packets_sent = 0;
-	int	bytes_sent = 0;
-	int	currstate = STATE_BASE;
-	int	nextstate = STATE_BASE;
-
-	for ( ;; ) {
-		// read the input from the client, which should end in \0
-		linelen = read_until_null (sock, line, sizeof line);
-		if (linelen < 0) {
-			perror ("reading command from client failed");
-			exit (6);
-		} else if (linelen == 0) {
-			printf ("\007Client closed the connection%s.\n",
-				nextstate == GOT_END ? "" : " before END");
-			break;
-		}
-
-		nextstate = currstate;
-
-		/* show the input buffer to the user */
-		printf (">>> %s\n", line);
-
-		// figure out what the client said to us:
-		if (linelen == 10 && memcmp (line, "user1.bin\0", 10) == 0) {
-			what = GOT_USER1;
-		} else if (linelen == 10 && memcmp (line, "user2.bin\0", 10) == 0) {
-			what = GOT_USER2;
-		} else if (linelen == 6 && memcmp (line, "start\0", 6) == 0) {
-			what = GOT_START;
-		} else if (linelen == 9 && memcmp (line, "continue\0", 9) == 0) {
-			what = GOT_CONTINUE;
-		} else if (linelen == 4 && memcmp (line, "end\0", 4) == 0) {
-			what = GOT_END;
-		} else {
-			// we got something unexpected - say so, and bail
-			printf ("%s: received unexpected \"%s\" from the client - quitting.\n",
-					__FUNCTION__, line);
-			exit (7);
-		}
-
-		// If we are at the base state, we expect the client
-		// to specify which image they want - the request
-		// should be literally "user1.bin" or "user2.bin".
-		// We use this to select which open file descriptor to use.
-		if (currstate == STATE_BASE) {
-			// we are waiting for the client to specify which image
-			// it wants - it should say "user1.bin" or "user2.bin"
-			if (what == GOT_USER1) {
-				fwfd = fd_user1;		// file descriptor for image 1
-				nextstate = GOT_USER1;		// update the state
-			} else if (what == GOT_USER2) {
-				fwfd = fd_user2;		// file descriptor for image 2
-				if (fwfd < 0) {			// but we don't have an image2 ?
-					fprintf (stderr,
-		"\n*** %s: device requested user2, but second firmware image was not specified ***\n\n",
-						progname);
-					return -1;
-				}
-				nextstate = GOT_USER2;		// update the state
-			} else {
-				// we got something unexpected while in the base state
-				printf ("%s: received unexpected \"%s\" while in the base state - quitting.\n",
-					__FUNCTION__, line);
-				exit (7);
-			}
-
-			// use the open firmware file descriptor to determine
-			// the size, then it to the client as a four-byte
-			// binary value:
-			if (fstat (fwfd, &stb) < 0) {
-				fprintf (stderr, "%s: fstat failed: %s\n",
-					__FUNCTION__, strerror (errno));
-				exit (8);
-			}
-
-			// We need to send four bytes - the binary
-			// representation of the file size, in network
-			// byte order.  (NOTE: NOT a string.)
-			// Do this using the st_size field, then convert
-			// to network byte order.
-			unsigned long size = htonl (stb.st_size);
-
-			// send the 4-byte size value to the client:
-			safe_write (sock, (uchar *)&size, 4);
-
-			printf ("file size is %ld bytes.\n", stb.st_size);
-			// After this, we expect the client to send "start".
-		} else if (currstate == GOT_USER1 || currstate == GOT_USER2) {
-			// the client should ask for the first block of data
-			// ("start").  Then we will start sending data.
-			if (what == GOT_START) {
-				// got "start" - send the first data packet
-				nextstate = GOT_START;	// update the state
-				packets_sent = 0;
-				// After this, we expect the client to send
-				// a series of "continue"s until all data is sent.
-			} else {
-				// we got something unexpected while in the GOT_USER state
-				printf ("%s: received unexpected \"%s\" while in GOT_USER state - quitting.\n",
-					__FUNCTION__, line);
-				exit (9);
-			}
-		} else if (currstate == GOT_START || currstate == GOT_CONTINUE) {
-			// the client should ask for the the next block of data
-			// ("continue") or say it is done ("end").
-			if (what == GOT_CONTINUE) {
-				// got "continue" - send the next data packet
-				nextstate = GOT_CONTINUE; // update the state
-			} else if (what == GOT_END) {
-				// got "end" - we're all done now.
-				nextstate = GOT_END;	// update the state
-			} else {
-				// we got something unexpected while in GOT_START/GOT_CONTINUE state
-				printf ("%s: received unexpected \"%s\" while in GOT_START/GOT_CONTINUE state - quitting.\n",
-					__FUNCTION__, line);
-				exit (10);
-			}
-		} else if (currstate == GOT_END) {
-			// we shouldn't be here - we should have already hopped out of the loop.
-			printf ("%s: Not sure why we're here in GOT_END state!\n", __FUNCTION__);
-			exit (11);
-		} else {
-			// we're in a totally unexpected state!
-			printf ("%s: We are in unexpected state %d !!!\n", __FUNCTION__, currstate);
-			exit (12);
-		}
-
-		// if we have just received either "start" or "continue",
-		// read the next block from the file and send to the client:
-		if (what == GOT_START || what == GOT_CONTINUE) {
-			/* read data from the file */
-			if ((fwlen = read (fwfd, fwbuf, sizeof fwbuf)) < 0) {
-				perror ("error reading firmware data");
-				break;
-			}
-			// if we're at EOF, drop out:
-			if (fwlen == 0) {
-				printf ("At EOF on firmware file after %d packet%s, %d bytes.\n",
-					packets_sent, packets_sent == 1 ? "" : "s", bytes_sent);
-				// *** this case actually should never happen - the client
-				// *** knows that there are zero bytes remaining, so it
-				// *** should send "end" instead of "continue".
-			} else {
-				/* send the buffer of data to the client */
-				packets_sent++;
-				printf ("sending packet %4d - %4d byte%s  ",
-					packets_sent, fwlen, fwlen == 1 ? "" : "s");
-				fflush (stdout);
-				safe_write (sock, fwbuf, fwlen);
-				bytes_sent += fwlen;
-				printf (" - sent=%d\n", bytes_sent);
-			}
-			// NOTE that if fwlen shows a *partial* read, then this
-			// was the last piece of the file. We expect the client
-			// to send "end".
-			// Otherwise, the client should send "continue" to keep
-			// going.
-		}
-
-		if (nextstate != currstate) {	// time to change state:
-			currstate = nextstate;	// update the state
-			if (debug || verbose)
-				printf ("newstate=%d [%s]\n",
-					currstate, decode_state (currstate));
-		}
-	}
-
-	/*
-	 *	All done.
-	 */
-	printf ("%s: sent total of %d packet%s, %d bytes.\n",
-		__FUNCTION__,
-		packets_sent, packets_sent == 1 ? "" : "s", bytes_sent);
-
-	return 0;
-}
-
-
 /*
  *	JCB NOTES - 9/29/2021
  *	After we send the "write_update" command, the device connects to the specified address and port.
@@ -823,56 +573,45 @@ do_firmware_service (int sock, int fd_user1, int fd_user2)
  *	It sends "end\0" and closes the connection.
  */
 
-/*
- *	A simple wrapper to open a firmware file for reading - prints the
- *	errno string upon failure.
- */
-int
-open_firmware_file (char *fname)
-{
-	int	fd;
-
-	if ((fd = open (fname, O_RDONLY)) < 0) {
-		fprintf (stderr,
-			"%s: cannot open cannot open firmware file \"%s\": %s\n",
-				progname, fname, strerror (errno));
-		return -1;
-	}
-	return fd;
-}
-
 /*------------------------------------------------------------------------------
- *	Update the firmware on the device, using the specified binary image
- *	file(s).
+ *	Start updating the firmware on the device, using the specified binary
+ *	image file(s): set up the server socket for the download, and tell
+ *	the device to fetch the firmware from it.  The download itself is
+ *	done by serve_sessions(), with fsp - see firmware-service.c.
  *
- *	This is the wrapper that calls the various stages involved -
- *		setup
- *		socket creation
- *		send command to the device
- *		actual data download
+ *	Returns 0, or a negative number for the stage that failed.
  */
 int
-update_firmware (int sock, char *fname_user1, char *fname_user2)
+start_update (int sock, char *fname_user1, char *fname_user2, struct fw_session *fsp,
+	const char *name, const char *model)
 {
 	int	r = -1;
-	int	fd_user1 = -1,
-		fd_user2 = -1;
+	struct fw_image *image1,
+		*image2 = NULL,
+		*ip;
+	const char *why;
 	int	listen_sock;
-	int	clientfd;
-	struct	sockaddr_in addr, command_addr, listen_addr, claddr;
-	socklen_t claddrlen = sizeof claddr;
+	struct	sockaddr_in addr, command_addr, listen_addr;
 
-	// Open the correct firmware file(s) based on the request.
-	// Open user1 image:
-	if ((fd_user1 = open_firmware_file (fname_user1)) < 0)
+	// Read the firmware image(s), unless we already have them:
+	if ((image1 = fw_image_load (fname_user1)) == NULL)
 		return -1;
-
-	// Open user2 image, if specified:
 	if (fname_user2 != NULL &&
-	    (fd_user2 = open_firmware_file (fname_user2)) < 0) {
+	    (image2 = fw_image_load (fname_user2)) == NULL) {
 		return -2;
 	}
 
+	// ... and don't send the device an image that isn't for it
+	for (ip = image1; ip != NULL; ip = ip == image1 ? image2 : NULL) {
+		if ((why = fw_image_refuses (ip, model)) != NULL) {
+			fprintf (stderr, "%s: %s \"%s\" to %s (%s): %s\n", progname,
+				force ? "warning: sending" : "not sending",
+				ip->path, name, model[0] ? model : "model unknown", why);
+			if (!force)
+				return -1;
+		}
+	}
+
 	/* Figure out the "our end" IP address for the connected command socket.
 	 * We will specify this same address in the CMD_WRITE_UPDATE command,
 	 * as that is clearly the address that the client can use to initiate
@@ -907,6 +646,7 @@ update_firmware (int sock, char *fname_user1, char *fname_user2)
 		fprintf (stderr, "%s: cannot bind local address %s:%d to socket: %s\n",
 			__FUNCTION__, inet_ntoa (addr.sin_addr), ntohs (addr.sin_port),
 			strerror (errno));
+		close (listen_sock);
 		return -5;
 	}
 
@@ -914,6 +654,7 @@ update_firmware (int sock, char *fname_user1, char *fname_user2)
 	if (do_getsockname (listen_sock, &listen_addr) < 0) {
 		fprintf (stderr, "%s: cannot getsockname on socket: %s\n",
 			__FUNCTION__, strerror (errno));
+		close (listen_sock);
 		return -6;
 	}
 	printf ("firmware server socket is bound to host address %s, port %hu\n",
@@ -923,6 +664,7 @@ update_firmware (int sock, char *fname_user1, char *fname_user2)
 	if (listen (listen_sock, -1) < 0) {
 		fprintf (stderr, "%s: cannot listen() on socket: %s\n",
 			__FUNCTION__, strerror (errno));
+		close (listen_sock);
 		return -7;
 	}
 
@@ -932,46 +674,15 @@ update_firmware (int sock, char *fname_user1, char *fname_user2)
 	r = write_update (sock, &listen_addr.sin_addr, listen_addr.sin_port);
 	if (r < 0) {
 		printf ("%s: write_update failed.\n", __FUNCTION__);
+		close (listen_sock);
 		return r;
 	}
 
-	// Now wait for the device to connect to our listening socket to
-	// request and download the actual firmware data...
-	printf ("Waiting for inbound connection... ");
-	fflush (stdout);
-	for ( ;; ) {
-		/* Wait for and accept the inbound connection.
-		 * Note that "accept()" will block until a client arrives.
-		 */
-		claddrlen = sizeof claddr;
-		clientfd = accept (listen_sock, (struct sockaddr *)&claddr,
-					&claddrlen);
-		if (clientfd < 0) {
-			if (errno == EINTR)
-				continue;
-			fprintf (stderr, "%s: cannot accept incoming connection on socket: %s\n",
-				__FUNCTION__, strerror (errno));
-			break;
-		}
-
-		printf ("\n%s: received inbound connection from address %s, port %hu\n",
-			__FUNCTION__,
-			inet_ntoa (claddr.sin_addr), ntohs (claddr.sin_port));
-
-		// Talk the protocol with the client:
-		r = do_firmware_service (clientfd, fd_user1, fd_user2);
-
-		// close the connection to the client now that we're done.
-		close (clientfd);
-
-		// we only handle one client per invocation, so we're done now.
-		break;
-	}
-
-	// Clean up and close our listening socket now - we don't expect another client.
-	close (listen_sock);
-
-	return r;
+	// Now the device will connect to our listening socket to request
+	// and download the actual firmware data...
+	printf ("Waiting for inbound connection...\n");
+	fw_session_init (fsp, name, listen_sock, image1, image2);
+	return 0;
 }
 
 /*
@@ -989,7 +700,10 @@ safe_write (int fd, uchar *bufp, int len)
 
 	remain = len;
 	while (remain > 0) {
-		if ((r = write (fd, bufp, remain)) > 0) {
+		r = write (fd, bufp, remain);
+		PROFILE_IO (profile_current, writes, wbytes, r);
+		if (r > 0) {
+			trace_data (fd, TR_SEND, bufp, r);
 			bufp += r;
 			remain -= r;
 			written += r;
@@ -1013,16 +727,28 @@ safe_write (int fd, uchar *bufp, int len)
 /*
  *	Open a socket to the specified host and service/port.
  *	Returns the connected stream socket descriptor.
+ *
+ *	With a timeout (in seconds), give up on an address that doesn't
+ *	answer in that time, rather than waiting for TCP to give up - and
+ *	only complain in verbose mode, as the caller is expecting failures.
+ *	Replies are also given that long to arrive.
  */
 int
-open_socket (char *host, char *service)
+open_socket (char *host, char *service, int timeout)
 {
 	struct addrinfo hints = {0};
 	struct addrinfo *p, *addresses;
 	int	sock = -1;
 	int	r;
+	int	flags;
+	int	err;
+	socklen_t errlen;
+	struct pollfd pfd;
+	struct timeval tv;
 	char	hostbuf[NI_MAXHOST];
 	char	servbuf[16];
+	char	peer[NI_MAXHOST + 16];
+	double	since;
 
 	// give it some hints - the devices only support IPv4 and TCP
 	hints.ai_family = AF_INET;		/* IPv4 only */
@@ -1051,11 +777,40 @@ open_socket (char *host, char *service)
 		}
 
 		// try to connect to the address:
-		r = connect (sock, p->ai_addr, p->ai_addrlen);
+		since = profiling ? profile_clock () : 0;
+		if (timeout > 0) {
+			// without blocking, then wait for it for no more than "timeout"
+			flags = fcntl (sock, F_GETFL);
+			fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+			r = connect (sock, p->ai_addr, p->ai_addrlen);
+			if (r == -1 && errno == EINPROGRESS) {
+				pfd.fd = sock;
+				pfd.events = POLLOUT;
+				if ((r = poll (&pfd, 1, timeout * 1000)) == 0) {
+					errno = ETIMEDOUT;
+					r = -1;
+				} else if (r > 0) {
+					errlen = sizeof err;
+					if (getsockopt (sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+						err = errno;
+					errno = err;
+					r = err ? -1 : 0;
+				}
+			}
+			fcntl (sock, F_SETFL, flags);
+			if (r == 0) {
+				tv.tv_sec = timeout;
+				tv.tv_usec = 0;
+				setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+			}
+		} else {
+			r = connect (sock, p->ai_addr, p->ai_addrlen);
+		}
+		profile_waited (since, 0);
 		if (r == -1) {		// connection failed
-			//XXX should we display an error?
-			fprintf (stderr, "Cannot connect to host address %s, port %s: %s\n",
-				hostbuf, servbuf, strerror (errno));
+			if (timeout == 0 || debug || verbose)
+				fprintf (stderr, "Cannot connect to host address %s, port %s: %s\n",
+					hostbuf, servbuf, strerror (errno));
 
 			close (sock);
 			sock = -1;
@@ -1065,6 +820,8 @@ open_socket (char *host, char *service)
 		if (debug || verbose) {
 			printf ("connected to server, socket file descriptor is %d\n", sock);
 		}
+		snprintf (peer, sizeof peer, "%s %s", hostbuf, servbuf);
+		trace_open (sock, TR_CONNECT, peer);
 		break;
 	}
 
@@ -1123,27 +880,38 @@ hexdump (uchar *data, int length)
 }
 
 /*
- * Read() with a timeout.
+ * Read() with a deadline - a time from fw_clock().
  * Returns the number of bytes actually read, -2 on timeout, -1 on other errors.
  */
 int
-timed_read (int fd, char *buf, int len, int timeout)
+timed_read (int fd, char *buf, int len, uint64_t deadline)
 {
 	int	r;
 	struct pollfd pfds[1];
+	uint64_t now;
+	double	since = 0;
 
 	for ( ;; ) {
 		/* set up the pollfd structure */
 		pfds[0].fd = fd;	/* file descriptor to read */
 		pfds[0].events = POLLIN | POLLRDNORM;
-		/* timeout needs to be converted to milliseconds */
-		if (poll (pfds, 1, timeout * 1000) < 0) {
+		pfds[0].revents = 0;
+		now = fw_clock ();
+		if (profiling)
+			since = profile_clock ();
+		r = poll (pfds, 1, now < deadline ? (int) (deadline - now) : 0);
+		profile_waited (since, 1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
 			perror ("poll");
 			break;
 		}
 		if ((pfds[0].revents & (POLLIN | POLLRDNORM)) != 0) {
 			// input is available - read it and return
 			r = read (fd, buf, len);
+			PROFILE_IO (profile_current, reads, rbytes, r);
+			trace_data (fd, TR_RECV, buf, r);
 			return r;
 		}
 		/* if we got here, nothing was ready to read */
@@ -1154,44 +922,715 @@ timed_read (int fd, char *buf, int len, int timeout)
 }
 
 
+/* seconds since *then */
+static double
+elapsed (struct timeval *then)
+{
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+	return (now.tv_sec - then->tv_sec) + (now.tv_usec - then->tv_usec) / 1e6;
+}
+
+/* the MAC address and the model and version, from the device on sock */
+static void
+identify_device (int sock, struct session *sp, char *version, size_t versionlen)
+{
+	struct reply reply;
+	struct reply_field *f;
+
+	// Read the hardware MAC address:
+	if (read_station_mac (sock, &reply) == 0 && (f = find_field (&reply, FT_MAC)) != NULL)
+		snprintf (sp->mac, sizeof sp->mac, "%02x:%02x:%02x:%02x:%02x:%02x",
+			f->data[0], f->data[1], f->data[2],
+			f->data[3], f->data[4], f->data[5]);
+
+	// Read the firmware version, which also tells us the model:
+	if (read_firmware_version (sock, &reply) == 0 && (f = find_field (&reply, FT_STRING)) != NULL)
+		(void) parse_firmware_version ((const char *) f->data, (int) f->value,
+			sp->model, sizeof sp->model, version, versionlen);
+}
+
+/* a device that we're waiting for, after its update - see verify_updates() */
+struct waiting {
+	struct session *sp;
+	struct sockaddr_in addr;
+	double	due;		// when to try it next, in seconds after its download
+	int	delay;		// ... and the time after that
+	int	fd;		// the connection being tried, or -1
+	double	tried;		// ... and when, in seconds after its download
+	int	away;		// have we seen it gone?
+	int	done;
+};
+
+/* try the device again after the delay, unless that's past its time */
+static void
+try_later (struct waiting *wp, double t)
+{
+	if (wp->fd >= 0) {
+		close (wp->fd);
+		wp->fd = -1;
+	}
+	if (t + wp->delay > verify_timeout) {
+		wp->done = 1;		// it didn't come back
+		return;
+	}
+	wp->due = t + wp->delay;
+	if (wp->delay < VERIFY_MAXDELAY)
+		wp->delay *= 2;
+}
+
+/* the device has taken the connection - see what it's running */
+static void
+probe_device (struct waiting *wp)
+{
+	struct session *sp = wp->sp, probe;
+	struct profile_mark mark;
+	struct timeval tv;
+	char	version[64], peer[64];
+	int	sock = wp->fd;
+
+	wp->fd = -1;
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) & ~O_NONBLOCK);
+	tv.tv_sec = VERIFY_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	snprintf (peer, sizeof peer, "%s %d", inet_ntoa (wp->addr.sin_addr), ntohs (wp->addr.sin_port));
+	trace_open (sock, TR_CONNECT, peer);
+
+	memset (&probe, 0, sizeof probe);
+	version[0] = '\0';
+	printf ("\n");
+	profile_begin (&sp->profile, &mark);
+	identify_device (sock, &probe, version, sizeof version);
+	profile_end (&mark);
+	shutdown (sock, 2);
+	trace_close (sock);
+	close (sock);
+
+	if (version[0] == '\0') {	// up, but not answering properly yet
+		wp->away = 1;
+		try_later (wp, elapsed (&sp->ended));
+		return;
+	}
+	if (!wp->away && strcasecmp (version, sp->version) == 0) {
+		printf ("(%s still running %s)", sp->host, version);
+		fflush (stdout);
+		try_later (wp, elapsed (&sp->ended));
+		return;
+	}
+	sp->reboot = elapsed (&sp->ended);
+	snprintf (sp->newversion, sizeof sp->newversion, "%s", version);
+	printf ("%s answered again after %.1f seconds, running %s.\n",
+		sp->host, sp->reboot, sp->newversion);
+	wp->done = 1;
+}
+
+/*
+ *	After their updates, wait for the devices to restart and answer
+ *	again, trying to connect to each after 1, 2, 4, ... seconds (up to
+ *	VERIFY_MAXDELAY between tries), for as long as verify_timeout from
+ *	the end of its own download.  Then check that each is running the
+ *	version that we sent it.  The devices are all waited for at once,
+ *	from one poll(), so that one that doesn't come back doesn't use up
+ *	the others' time, or add to their reboot times.
+ *
+ *	A device may still answer with the old firmware for a moment after
+ *	"end", so an answer only counts once the device has been away, or if
+ *	it gives a different version.  The time from the end of the download
+ *	until that answer is kept in the session as the reboot time.
+ *
+ *	A device that doesn't come back with the new version (or, when we
+ *	don't know the version, at all) is left as DEV_UNVERIFIED.
+ */
+void
+verify_updates (struct session **sps, int n)
+{
+	struct waiting *waiting, *wp;
+	struct pollfd *pfds;
+	struct addrinfo hints, *ai;
+	struct session *sp;
+	double	t, timeout, since;
+	int	i, npfds, left, r, err;
+	socklen_t errlen;
+
+	if ((waiting = calloc (n, sizeof *waiting)) == NULL ||
+	    (pfds = calloc (n, sizeof *pfds)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	memset (&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;		// the devices only support IPv4
+	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < n; i++) {
+		wp = &waiting[i];
+		wp->sp = sp = sps[i];
+		wp->fd = -1;
+		wp->delay = 1;
+		sp->reboot = -1;
+		if ((r = getaddrinfo (sp->host, sp->service, &hints, &ai)) != 0) {
+			fprintf (stderr, "%s: could not resolve host \"%s\": %s\n",
+				__FUNCTION__, sp->host, gai_strerror (r));
+			wp->done = 1;
+			continue;
+		}
+		memcpy (&wp->addr, ai->ai_addr, sizeof wp->addr);
+		freeaddrinfo (ai);
+		try_later (wp, elapsed (&sp->ended));
+	}
+	if (n == 1)
+		printf ("Waiting for %s to restart", sps[0]->host);
+	else
+		printf ("Waiting for %d devices to restart", n);
+	fflush (stdout);
+
+	for ( ;; ) {
+		// Start the connections that are due, and see how long until the next.
+		timeout = VERIFY_MAXDELAY;
+		for (i = npfds = left = 0, wp = waiting; i < n; i++, wp++) {
+			if (wp->done)
+				continue;
+			left++;
+			t = elapsed (&wp->sp->ended);
+			if (wp->fd < 0 && t >= wp->due) {
+				wp->sp->polls++;
+				wp->tried = t;
+				if ((wp->fd = socket (AF_INET, SOCK_STREAM, 0)) < 0) {
+					try_later (wp, t);
+					continue;
+				}
+				fcntl (wp->fd, F_SETFL, fcntl (wp->fd, F_GETFL) | O_NONBLOCK);
+				if (connect (wp->fd, (struct sockaddr *) &wp->addr, sizeof wp->addr) < 0 &&
+				    errno != EINPROGRESS) {
+					wp->away = 1;
+					printf (".");
+					try_later (wp, t);
+					continue;
+				}
+			}
+			if (wp->fd >= 0) {
+				pfds[npfds].fd = wp->fd;
+				pfds[npfds++].events = POLLOUT;
+				if (wp->tried + VERIFY_TIMEOUT - t < timeout)
+					timeout = wp->tried + VERIFY_TIMEOUT - t;
+			} else if (wp->due - t < timeout) {
+				timeout = wp->due - t;
+			}
+		}
+		if (left == 0)
+			break;
+		fflush (stdout);
+
+		since = profiling ? profile_clock () : 0;
+		r = poll (pfds, npfds, timeout > 0 ? (int) (timeout * 1000) + 1 : 0);
+		if (r < 0 && errno != EINTR) {
+			perror ("poll");
+			break;
+		}
+		for (i = 0, wp = waiting; profiling && i < n; i++, wp++) {
+			if (!wp->done) {	// the wait is charged to each that we waited for
+				profile_current = &wp->sp->profile;
+				profile_waited (since, npfds > 0);
+			}
+		}
+		profile_current = NULL;
+
+		// Those that answered, or have taken too long.
+		for (i = 0, wp = waiting; i < n; i++, wp++) {
+			if (wp->done || wp->fd < 0)
+				continue;
+			err = 0;
+			for (r = 0; r < npfds && pfds[r].fd != wp->fd; r++)
+				;
+			if (r < npfds && pfds[r].revents != 0) {
+				errlen = sizeof err;
+				if (getsockopt (wp->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+					err = errno;
+				if (err == 0) {
+					probe_device (wp);
+					continue;
+				}
+			}
+			t = elapsed (&wp->sp->ended);
+			if (err != 0 || t >= wp->tried + VERIFY_TIMEOUT) {
+				wp->away = 1;
+				printf (".");
+				try_later (wp, t);
+			}
+		}
+	}
+
+	for (i = 0, wp = waiting; i < n; i++, wp++) {
+		sp = wp->sp;
+		if (wp->fd >= 0)
+			close (wp->fd);
+		if (sp->reboot < 0) {
+			printf ("\n%s didn't come back%s within %d seconds.\n", sp->host,
+				wp->away ? "" : " with a new version", verify_timeout);
+			sp->outcome = DEV_UNVERIFIED;
+		} else if (sp->target[0] != '\0' && strcasecmp (sp->newversion, sp->target) != 0) {
+			printf ("*** %s should be running %s! ***\n", sp->host, sp->target);
+			sp->outcome = DEV_UNVERIFIED;
+		}
+	}
+	free (waiting);
+	free (pfds);
+}
+
 /*
- *	Read input until a terminating null is seen.
- *	Returns the number of bytes read (including the null),
- *	or 0 if the connection is closed before receiving the null,
- *	or -1 if a read error has occurred.
+ *	The first part of everything that we do with one device: show its
+ *	MAC address and firmware version (and the live data or sensors, if
+ *	asked), and if it should be updated - with the image(s) given, or
+ *	with the version that the catalog says it should have - tell it to
+ *	download the image, with "download".  A device that already has that
+ *	version is left alone, without setting up the firmware server.
+ *
+ *	Returns the exit status for the device; what happened is kept in
+ *	the session.  If it's being updated, sp->download is set, and the
+ *	command connection is left open for finish_device().
  */
 int
-read_until_null (int fd, char *buf, int bufsiz)
+begin_device (struct session *sp, struct fw_session *download)
 {
-	int	remain = bufsiz;
-	char	*bufp = buf;
-	int	count = 0;
-	char	cbuf[1];
-	int	r;
+	int	r = 0;
+	struct reply reply;
+	char	*fname1 = firmware1,
+		*fname2 = firmware2;
+	struct image_selection sel;
 
-	while (remain > 0) {
-		// try to read one byte of input:
-		r = read (fd, cbuf, 1);
-		if (r < 0) {	// read error occurred
-			fprintf (stderr, "%s: error reading from socket: %s\n",
-				__FUNCTION__, strerror (errno));
-			*bufp = '\0';
-			return -1;
+	sp->outcome = DEV_FAILED;
+	sp->reboot = -1;
+	sp->download = NULL;
+
+	/* attempt to open a connection to the device */
+	if ((sp->sock = open_socket (sp->host, sp->service, 0)) < 0) {
+		fprintf (stderr, "%s: can't connect to %s/%s\n",
+			progname, sp->host, sp->service);
+		return 2;
+	}
+
+	identify_device (sp->sock, sp, sp->version, sizeof sp->version);
+
+	// Show the current sensor readings and sensors, if they asked:
+	if (livedata)
+		r = read_livedata (sp->sock, &reply);
+	if (sensorids)
+		r = read_sensor_id (sp->sock, &reply);
+
+	sp->outcome = DEV_CHECKED;
+
+	// With a catalog, find out what the device should be running:
+	if (catalog != NULL && firmware1 == NULL) {
+		if (sp->mac[0] == '\0' || sp->model[0] == '\0') {
+			fprintf (stderr, "%s: couldn't read the MAC address and firmware version from %s\n",
+				progname, sp->host);
+			sp->outcome = DEV_FAILED;
+			r = 3;
+			goto done;
+		}
+		if (rollback)
+			r = select_previous (catalog, imagedir, sp->model, sp->version,
+				history_previous (sp->mac, sp->version), &sel);
+		else
+			r = select_image (catalog, imagedir, sp->model, sp->mac, sp->version, &sel);
+		if (r < 0) {
+			sp->outcome = DEV_FAILED;
+			r = 3;
+			goto done;
+		}
+		snprintf (sp->target, sizeof sp->target, "%s", sel.version);
+		if (r == 1) {
+			printf ("%s is already at %s - nothing to do.\n", sp->model, sel.version);
+			sp->outcome = DEV_CURRENT;
+			r = 0;
+			goto done;
 		}
-		if (r == 0) {	// connection was closed
-			*bufp = '\0';
-			return 0;
+		printf ("%s should %s %s (now %s): %s%s%s\n", sp->model,
+			rollback ? "go back to" : "be at", sel.version,
+			sp->version, sel.file1, sel.file2[0] ? " " : "", sel.file2);
+		fname1 = sel.file1;
+		fname2 = sel.file2[0] != '\0' ? sel.file2 : NULL;
+		if (update && keephistory && !rollback)
+			way_back (sp);
+	}
+
+	// If we want to actually do the update, start that now:
+	if (update) {
+		printf ("Updating firmware (fname1=%s, fname2=%s):\n",
+			fname1, fname2 ? fname2 : "<null>");
+
+		sp->updated = 1;
+		gettimeofday (&sp->start, NULL);
+		if ((r = start_update (sp->sock, fname1, fname2, download, sp->host, sp->model)) != 0) {
+			printf ("Firmware update failed.\n");
+			sp->outcome = DEV_FAILED;
+			goto done;
+		}
+		sp->download = download;
+		return 0;
+	}
+
+done:
+	return close_device (sp, r);
+}
+
+/*
+ *	Before a device is updated from the catalog, with a history kept:
+ *	read in the image of the version that it's running now, which a
+ *	rollback would send it back to.  It's held in memory for the rest
+ *	of the run, like every image, and if it can't be had, that's said
+ *	now - not when the new version has gone wrong.
+ */
+static void
+way_back (struct session *sp)
+{
+	struct image_selection back;
+	const char *why = NULL;
+	struct fw_image *ip;
+	int	i;
+
+	if (select_version (catalog, imagedir, sp->model, sp->version, &back) < 0) {
+		why = "there's no image for it";
+		goto fail;
+	}
+	for (i = 0; i < 2 && why == NULL; i++) {
+		if (i == 1 && back.file2[0] == '\0')
+			break;
+		if ((ip = fw_image_load (i == 0 ? back.file1 : back.file2)) == NULL)
+			why = "its image can't be read";
+		else if (!force)
+			why = fw_image_refuses (ip, sp->model);
+	}
+	if (why == NULL)
+		return;
+fail:
+	printf ("*** %s can't be rolled back to %s: %s ***\n", sp->host, sp->version, why);
+}
+
+/* shut down the command connection - returns r, unless that fails */
+static int
+close_device (struct session *sp, int r)
+{
+	if (sp->sock >= 0) {
+		shutdown (sp->sock, 2);
+		trace_close (sp->sock);
+		if (close (sp->sock) < 0) {
+			perror ("socket close");
+			r = 8;
 		}
-		// add the character to the buffer:
-		*bufp++ = cbuf[0];
-		count++;
+		sp->sock = -1;
+	}
+	return r;
+}
+
+/*
+ *	The download stalled - the device didn't do its part in time.  Tell
+ *	it to start again, over the same command connection, with the same
+ *	images.  Returns 0, or the stage of start_update() that failed.
+ */
+static int
+retry_device (struct session *sp)
+{
+	struct fw_session *fsp = sp->download;
+	struct fw_image *image1 = fsp->image[0],
+		*image2 = fsp->image[1];
+	struct profile *pp = fsp->profile;
+	struct transfer *tp = fsp->transfer;
+	int	quiet = fsp->quiet;
+	int	r;
+
+	sp->retries++;
+	METRIC_ADD (metrics.retries, 1);
+	printf ("\n%s: the download stalled - starting it again (%d of %d).\n",
+		sp->host, sp->retries, retries);
+	if ((r = start_update (sp->sock, image1->path, image2 != NULL ? image2->path : NULL,
+			fsp, sp->host, sp->model)) != 0)
+		return r;
+	fsp->quiet = quiet;
+	fsp->profile = pp;
+	if (tp != NULL)
+		fw_session_timed (fsp, tp);
+	return 0;
+}
+
+/*
+ *	After the download: if it worked, the device restarts now, and is
+ *	left as DEV_UPDATED, to wait for it to come back with the others -
+ *	see verify_updates().  Returns the exit status for the device.
+ */
+int
+finish_device (struct session *sp)
+{
+	struct fw_session *fsp = sp->download;
+	int	r;
+
+	sp->download = NULL;
+	sp->ended = fsp->finished;
+	sp->transfer = (sp->ended.tv_sec - sp->start.tv_sec) +
+		(sp->ended.tv_usec - sp->start.tv_usec) / 1e6;
+
+	if (fsp->status != FS_OK) {
+		printf ("Firmware update of %s failed: %s.\n", sp->host, fw_status (fsp->status));
+		sp->outcome = DEV_FAILED;
+		return close_device (sp, fsp->status);
+	}
+
+	// The device restarts now, so this connection is finished.
+	if ((r = close_device (sp, 0)) != 0)
+		return r;
+
+	sp->outcome = DEV_UPDATED;
+	return 0;
+}
+
+/*
+ *	Do these devices together: set each one going, serve all of their
+ *	downloads at once, then see that each came back.  The exit status
+ *	of each is left in status[].
+ *
+ *	Each download takes a session from the pool.  Once the pool is at
+ *	its ceiling, the rest of the devices are left to wait for the next
+ *	batch, rather than using more memory.  Returns how many of them
+ *	were done - always at least the first.
+ *
+ *	The downloads that stall are started again, up to "retries" times,
+ *	and served together again.
+ */
+int
+do_devices (struct session *sessions, int n, int *status)
+{
+	struct fw_session **batch,
+		**serving,	// those being served this time
+		*fsp = NULL;	// the session for the next device
+	struct session **updating;
+	struct fw_stats stats;
+	struct profile_mark mark;
+	int	i, k, m, done, attempt;
+
+	if ((batch = calloc (n, sizeof *batch)) == NULL ||
+	    (serving = calloc (n, sizeof *serving)) == NULL ||
+	    (updating = calloc (n, sizeof *updating)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
 
-		// if the character was the trailing null, we're done
-		if (cbuf[0] == '\0')
+	for (i = k = 0; i < n; i++) {
+		if (fsp == NULL && (fsp = fw_session_get ()) == NULL)
+			break;
+		if (n > 1)
+			printf ("\n=== %s ===\n", sessions[i].host);
+		profile_begin (&sessions[i].profile, &mark);
+		status[i] = begin_device (&sessions[i], fsp);
+		profile_end (&mark);
+		if (sessions[i].download != NULL) {
+			fsp->quiet = n > 1 && !verbose;
+			if (profiling)
+				fsp->profile = &sessions[i].profile;
+			if (keephistory)
+				fw_session_timed (fsp, &sessions[i].timings);
+			batch[k] = fsp;
+			updating[k++] = &sessions[i];
+			fsp = NULL;
+		}
+	}
+	fw_session_put (fsp);
+	if ((done = i) < n)
+		printf ("\n*** no memory for more downloads at once (-m) - %d device%s must wait ***\n",
+			n - done, n - done == 1 ? "" : "s");
+
+	memcpy (serving, batch, k * sizeof *batch);
+	for (attempt = 0, m = k; m > 0; attempt++) {
+		serve_sessions (serving, m, engine, &stats);
+		if (debug || verbose)
+			printf ("%ld bytes sent to %d device%s with %ld system calls\n",
+				stats.bytes, m, m == 1 ? "" : "s", stats.syscalls);
+		if (attempt == retries)
 			break;
-		remain--;
+		for (i = m = 0; i < k; i++) {
+			if (!batch[i]->stalled)
+				continue;
+			profile_begin (&updating[i]->profile, &mark);
+			if (retry_device (updating[i]) == 0)
+				serving[m++] = batch[i];
+			profile_end (&mark);
+		}
+	}
+
+	for (i = m = 0; i < k; i++) {
+		if (k > 1)
+			printf ("\n=== %s ===\n", updating[i]->host);
+		profile_begin (&updating[i]->profile, &mark);
+		status[updating[i] - sessions] = finish_device (updating[i]);
+		profile_end (&mark);
+		fw_session_put (batch[i]);
+		if (updating[i]->outcome == DEV_UPDATED)
+			updating[m++] = updating[i];	// ... to see that it comes back
+	}
+	if (verify_timeout > 0 && m > 0) {
+		if (k > 1)
+			printf ("\n");
+		verify_updates (updating, m);
+		for (i = 0; i < m; i++) {
+			if (updating[i]->outcome == DEV_UNVERIFIED)
+				status[updating[i] - sessions] = 13;
+		}
+	}
+
+	for (i = 0; i < done; i++) {
+		METRIC_ADD (metrics.devices[sessions[i].outcome], 1);
+		history_record (&sessions[i]);
+	}
+
+	free (batch);
+	free (serving);
+	free (updating);
+	return done;
+}
+
+/* everything that we do with one device */
+int
+do_device (struct session *sp)
+{
+	int	r;
+
+	do_devices (sp, 1, &r);
+	return r;
+}
+
+/* one line about how a device's session went */
+void
+report_session (struct session *sp)
+{
+	static const char *outcomes[DEV_NOUTCOMES] = {
+		"FAILED", "checked", "current", "updated", "UNVERIFIED"
+	};
+
+	printf ("%-20s %-17s %-8s %-8s", sp->host, sp->mac[0] ? sp->mac : "-",
+		sp->model[0] ? sp->model : "-", sp->version[0] ? sp->version : "-");
+	if (sp->updated) {
+		printf (" -> %-8s %-10s transfer %5.1fs", sp->newversion[0] ? sp->newversion : "?",
+			outcomes[sp->outcome], sp->transfer);
+		if (sp->reboot >= 0)
+			printf (", back after %5.1fs (%d tries)", sp->reboot, sp->polls);
+		if (sp->retries > 0)
+			printf (", %d retr%s", sp->retries, sp->retries == 1 ? "y" : "ies");
+	} else {
+		printf ("    %-8s %s", "", outcomes[sp->outcome]);
+	}
+	printf ("\n");
+	if (profiling)
+		profile_report (&sp->profile);
+}
+
+/*
+ *	Read the devices listed in a file, one per line as "host" or "host
+ *	port", with '#' comments, into a session for each.  Returns how many
+ *	there are, or -1 (with a message).
+ */
+int
+read_hosts (char *hostfile, char *service, struct session **sessionsp)
+{
+	FILE	*fp;
+	char	line[1024];
+	char	*cp, *host, *port;
+	struct session *sessions = NULL, *sp;
+	int	nsessions = 0;
+
+	if ((fp = fopen (hostfile, "r")) == NULL) {
+		fprintf (stderr, "%s: cannot open host file \"%s\": %s\n",
+			progname, hostfile, strerror (errno));
+		return -1;
+	}
+	while (fgets (line, sizeof line, fp) != NULL) {
+		if ((cp = strchr (line, '#')) != NULL)
+			*cp = '\0';
+		if ((host = strtok (line, " \t\r\n")) == NULL)
+			continue;
+		port = strtok (NULL, " \t\r\n");
+
+		if ((sp = realloc (sessions, (nsessions + 1) * sizeof *sessions)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		sessions = sp;
+		sp = &sessions[nsessions++];
+		memset (sp, 0, sizeof *sp);
+		if ((sp->host = strdup (host)) == NULL ||
+		    (sp->service = strdup (port ? port : service)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+	}
+	fclose (fp);
+	*sessionsp = sessions;
+	return nsessions;
+}
+
+/*
+ *	Do each of the devices listed in a file (see read_hosts()) -
+ *	"jobs" of them at a time.  Once
+ *	"maxfailures" updates have failed (or not come back with the new
+ *	version), the rest are only checked, not updated - so that a bad
+ *	image stops a rollout early.
+ *
+ *	Returns the exit status of the first device that failed, or 0.
+ */
+int
+do_fleet (char *hostfile, char *service)
+{
+	int	status = 0;
+	struct session *sessions = NULL, *sp;
+	int	*statuses;
+	int	nsessions = 0;
+	int	failures = 0;
+	int	count[DEV_NOUTCOMES] = { 0 };
+	struct fw_pool_stats pool;
+	int	i, j, n;
+
+	if ((nsessions = read_hosts (hostfile, service, &sessions)) < 0)
+		return 1;
+
+	if ((statuses = calloc (nsessions + 1, sizeof *statuses)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+
+	for (i = 0; i < nsessions; i += n) {
+		n = nsessions - i < jobs ? nsessions - i : jobs;
+		if (n == 1)
+			printf ("\n=== %s ===\n", sessions[i].host);
+		n = do_devices (&sessions[i], n, &statuses[i]);
+
+		for (j = i; j < i + n; j++) {
+			sp = &sessions[j];
+			count[sp->outcome]++;
+			if (statuses[j] != 0 && status == 0)
+				status = statuses[j];
+			if (sp->updated && sp->outcome != DEV_UPDATED)
+				failures++;
+		}
+		if (update && failures >= maxfailures) {
+			printf ("\n*** %d update%s failed - the rest will only be checked ***\n",
+				failures, failures == 1 ? "" : "s");
+			update = 0;
+		}
+	}
+
+	printf ("\n");
+	for (i = 0; i < nsessions; i++)
+		report_session (&sessions[i]);
+	printf ("\n%d device%s: %d updated, %d already current, %d checked, %d failed, %d not verified\n",
+		nsessions, nsessions == 1 ? "" : "s", count[DEV_UPDATED],
+		count[DEV_CURRENT], count[DEV_CHECKED], count[DEV_FAILED],
+		count[DEV_UNVERIFIED]);
+	if (debug || verbose) {
+		fw_pool_stats (&pool);
+		printf ("%ld download%s at once at most, in %ld bytes; the pool was full %ld time%s\n",
+			pool.peak, pool.peak == 1 ? "" : "s", (long) pool.bytes,
+			pool.refused, pool.refused == 1 ? "" : "s");
 	}
-	return count;
+	free (statuses);
+	return status;
 }
 
 
@@ -1199,7 +1638,11 @@ void
 usage (void)
 {
 	fprintf (stderr,
-		"Usage: %s [-d][-v] [-h host] [-p port] [-u firmware_image [firmware_image2]]\n",
+		"Usage: %s [-d][-v][-l][-s][-P][-F] {-h host | -f hostfile} [-p port]\n"
+		"\t[-c firmware-info [-D imagedir] [-H history] [-R]] [-A percent] [-w seconds] [-g failures] [-j jobs]\n"
+		"\t[-e poll|uring] [-m KiB] [-T phase=seconds,...] [-r retries] [-t tracefile]\n"
+		"\t[-M [address:]port|socket] [-C settings]\n"
+		"\t[-u [firmware_image [firmware_image2]]]\n",
 		progname);
 	exit (1);
 	/*NOTREACHED*/
@@ -1211,12 +1654,20 @@ main (int argc, char **argv)
 {
 	int	c;
 	char	*cp;
-	int	sock = -1;
 	int	r;
+	struct session session;
 	char	*host = NULL,
 		*service = "45000";	// default port for Ecowitt API
-	char	*firmware1 = NULL,
-		*firmware2 = NULL;
+	char	*hostfile = NULL;
+	char	*catalogfile = NULL;
+	char	*configfile = NULL;
+	char	*tracefile = NULL;
+	char	*historyfile = NULL;
+	struct session *sessions;
+	int	nsessions;
+	char	*metricsaddr = NULL;
+	char	errbuf[512];
+	double	slower = -1;
 
 	/* Always ensure that stdout and stderr are line-buffered,
 	 * even if output is redirected to a file, so that tracing
@@ -1225,6 +1676,11 @@ main (int argc, char **argv)
 	setvbuf (stdout, NULL, _IOLBF, BUFSIZ);
 	setvbuf (stderr, NULL, _IOLBF, BUFSIZ);
 
+	/* A device (or a scraper) that drops its connection must only
+	 * fail that one transfer - as EPIPE - not the whole run.
+	 */
+	signal (SIGPIPE, SIG_IGN);
+
 	if ((cp = strrchr (argv[0], '/')) != NULL) {
 		*cp++ = '\0';	/* zap the slash */
 		progname = cp;		/* progname becomes basename */
@@ -1235,17 +1691,84 @@ main (int argc, char **argv)
 
 	// process command-line options right away, particularly
 	// so we can have "debug" and "verbose" set correctly!
-	while ((c = getopt (argc, argv, "h:p:udv")) != EOF) {
+	while ((c = getopt (argc, argv, "A:c:C:D:e:f:g:h:H:j:m:M:p:r:t:T:udFlPRsvw:")) != EOF) {
 		switch (c) {
+		case 'A':	// which devices are this much slower to update than usual?
+			if ((slower = atof (optarg)) <= 0)
+				usage ();
+			break;
+		case 'c':	// choose the images from this firmware-info catalog
+			catalogfile = optarg;
+			break;
+		case 'C':	// bring the devices' settings into line with this file
+			configfile = optarg;
+			break;
+		case 'D':	// directory holding the images named in the catalog
+			imagedir = optarg;
+			break;
+		case 'e':	// serve the downloads with poll() or io_uring
+			if ((engine = engine_named (optarg)) < 0)
+				usage ();
+			break;
+		case 'j':	// in a fleet, update this many devices at once
+			if ((jobs = atoi (optarg)) <= 0)
+				usage ();
+			break;
+		case 'm':	// the most memory for the downloads in progress (0 = no limit)
+			if ((memlimit = atol (optarg)) < 0)
+				usage ();
+			break;
+		case 'f':	// do each of the devices listed in this file
+			hostfile = optarg;
+			break;
+		case 'g':	// in a fleet, stop updating after this many failures
+			if ((maxfailures = atoi (optarg)) <= 0)
+				usage ();
+			break;
+		case 'w':	// how long to wait for a device to come back (0 = don't)
+			verify_timeout = atoi (optarg);
+			break;
 		case 'h':	// specify the host name or IP address
 			host = optarg;
 			break;
+		case 'H':	// keep the history of each device's firmware in this file
+			historyfile = optarg;
+			break;
 		case 'p':	// specify the port/service
 			service = optarg;
 			break;
+		case 'M':	// serve the metrics on this port or Unix socket
+			metricsaddr = optarg;
+			break;
+		case 'r':	// start a stalled download again this many times
+			if ((retries = atoi (optarg)) < 0)
+				usage ();
+			break;
+		case 'T':	// the deadlines for each part of the protocol
+			if (fw_set_deadlines (optarg) < 0)
+				usage ();
+			break;
+		case 't':	// record everything sent and received in this file
+			tracefile = optarg;
+			break;
 		case 'd':	// enable debugging
 			debug++;
 			break;
+		case 'F':	// send the images even if they don't look right
+			force = 1;
+			break;
+		case 'l':	// show the live data
+			livedata++;
+			break;
+		case 'P':	// count what each device costs us, for the report
+			profiling++;
+			break;
+		case 'R':	// send each device back to the version that it ran before
+			rollback++;
+			break;
+		case 's':	// show the sensor IDs
+			sensorids++;
+			break;
 		case 'u':	// actually do the update
 			update++;
 			break;
@@ -1258,24 +1781,47 @@ main (int argc, char **argv)
 		}
 	}
 
-	// Make sure the host was specified:
-	if (host == NULL) {
+	// "-A" only reads the history, and doesn't talk to the devices.
+	if (slower > 0) {
+		if (historyfile == NULL) {
+			fprintf (stderr, "%s: \"-A\" needs the history - use \"-H history\"\n",
+				progname);
+			exit (1);
+		}
+		if ((r = history_report (historyfile, slower / 100)) < 0)
+			exit (2);
+		exit (r > 0);
+	}
+
+	// Make sure the host (or hosts) was specified:
+	if (host == NULL && hostfile == NULL) {
 		fprintf (stderr,
-			"%s: missing host name or address - use \"-h host\".\n",
+			"%s: missing host name or address - use \"-h host\" or \"-f hostfile\".\n",
 				progname);
 		exit (1);
 	}
+	if (host != NULL && hostfile != NULL) {
+		fprintf (stderr, "%s: use either \"-h host\" or \"-f hostfile\", not both.\n",
+			progname);
+		exit (1);
+	}
 
 	// If they want to update, we need one or two arguments to specify
-	// the firmware file(s):
-	if (update) {
+	// the firmware file(s) - or a catalog to choose them from.  (With
+	// "-C", it's the settings that are updated, not the firmware.)
+	if (configfile != NULL && catalogfile != NULL) {
+		fprintf (stderr, "%s: use either \"-C settings\" or \"-c firmware-info\", not both.\n",
+			progname);
+		exit (1);
+	}
+	if (update && configfile == NULL) {
 		if (optind < argc) {	// additional arg(s) present
 			firmware1 = argv[optind++];
 			if (optind != argc) {	// at least one more arg
 				firmware2 = argv[optind++];
 			}
-		} else {
-			fprintf (stderr, "%s: missing firmware file(s)\n",
+		} else if (catalogfile == NULL) {
+			fprintf (stderr, "%s: missing firmware file(s) - or use \"-c firmware-info\"\n",
 				progname);
 			usage();
 		}
@@ -1286,40 +1832,66 @@ main (int argc, char **argv)
 			progname, argv[optind]);
 		usage ();
 	}
-
-	/* attempt to open a connection to the device */
-	if ((sock = open_socket (host, service)) < 0) {
-		fprintf (stderr, "%s: can't connect to %s/%s\n",
-			progname, host, service);
-		exit (2);
+	if (rollback && (catalogfile == NULL || firmware1 != NULL)) {
+		fprintf (stderr, "%s: \"-R\" chooses the images from the catalog - use \"-c firmware-info\",\n"
+			"\twithout naming them.\n", progname);
+		exit (1);
 	}
 
-	// Read the hardware MAC address:
-	r = read_station_mac (sock);
-
-	// Read the firmware version, which also tells us the model:
-	r = read_firmware_version (sock);
-
-	// If we want to actually do the update, do that now:
-	if (update) {
-		printf ("Updating firmware (fname1=%s, fname2=%s):\n",
-			firmware1, firmware2 ? firmware2 : "<null>");
-
-		r = update_firmware (sock, firmware1, firmware2);
-
-		if (r != 0)
-			printf ("Firmware update failed.\n");
+	// Read the catalog.  Unless told otherwise, the images are in the
+	// "firmware" directory of the same document root, as the web pages
+	// in ../ecowitt-web-pages are laid out.
+	if (catalogfile != NULL) {
+		if ((catalog = fw_catalog_read (catalogfile, errbuf, sizeof errbuf)) == NULL) {
+			fprintf (stderr, "%s: %s\n", progname, errbuf);
+			exit (1);
+		}
+		if (imagedir == NULL) {
+			if ((imagedir = malloc (strlen (catalogfile) + 32)) == NULL) {
+				fprintf (stderr, "%s: out of memory\n", progname);
+				exit (1);
+			}
+			strcpy (imagedir, catalogfile);
+			if ((cp = strrchr (imagedir, '/')) != NULL)
+				strcpy (cp, "/../../../../firmware");
+			else
+				strcpy (imagedir, "../../../../firmware");
+		}
 	}
 
-	/*
-	 *	All done, shut down the socket and quit.
-	 */
-	shutdown (sock, 2);
-	if (close (sock) < 0) {
-		perror ("socket close");
-		exit (8);
+	if (historyfile != NULL) {
+		if (history_open (historyfile, rollback) < 0)
+			exit (1);
+		keephistory = 1;
+	}
+	if (tracefile != NULL && trace_start (tracefile) < 0)
+		exit (1);
+	if (metricsaddr != NULL && metrics_start (metricsaddr) < 0)
+		exit (1);
+	fw_pool_init (memlimit * 1024, serve_session_bytes (engine));
+
+	if (configfile != NULL) {
+		if (hostfile == NULL) {
+			memset (&session, 0, sizeof session);
+			session.host = host;
+			session.service = service;
+			sessions = &session;
+			nsessions = 1;
+		} else if ((nsessions = read_hosts (hostfile, service, &sessions)) < 0)
+			exit (1);
+		r = do_config (configfile, sessions, nsessions, update);
+	} else if (hostfile != NULL)
+		r = do_fleet (hostfile, service);
+	else {
+		memset (&session, 0, sizeof session);
+		session.host = host;
+		session.service = service;
+		r = do_device (&session);
+		if (session.updated || profiling)
+			report_session (&session);
 	}
 
+	if (keephistory && history_save () < 0 && r == 0)
+		r = 1;
 	exit (r);
 }
-
@@ -0,0 +1,475 @@
+/*
+ *	Common definitions for the Ecowitt firmware updater and its
+ *	helper modules.
+ */
+
+#ifndef ECOWITT_FIRMWARE_UPDATER_H
+#define ECOWITT_FIRMWARE_UPDATER_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+// Commands that we need to know - we only use a very few:
+typedef enum {
+	CMD_READ_ECOWITT = 0x1e,	// read the ecowitt.net upload interval
+	CMD_WRITE_ECOWITT = 0x1f,	// ... and set it
+	CMD_READ_WUNDERGROUND = 0x20,	// read the Weather Underground station and key
+	CMD_WRITE_WUNDERGROUND = 0x21,	// ... and set them
+	CMD_READ_SATION_MAC = 0x26,	// read MAC address (sic - missing the first 'T')
+	CMD_GW1000_LIVEDATA = 0x27,	// read current live data (two-byte size)
+	CMD_READ_CUSTOMIZED = 0x2a,	// read the custom server settings
+	CMD_WRITE_CUSTOMIZED = 0x2b,	// ... and set them
+	CMD_READ_SENSOR_ID_NEW = 0x3c,	// read sensor IDs and signal (two-byte size)
+	CMD_WRITE_UPDATE = 0x43,	// firmware upgrade
+	CMD_READ_FIRMWARE_VERSION = 0x50, // read current firmware version number
+	CMD_READ_USR_PATH = 0x51,	// read the custom server's paths
+	CMD_WRITE_USR_PATH = 0x52	// ... and set them
+} CMD_LT;
+
+typedef unsigned char	uchar;
+typedef unsigned short	ushort;
+typedef unsigned long	ulong;
+
+
+/* global variables */
+extern char	*progname;
+extern int	debug;
+extern int	verbose;
+
+
+/*
+ *	Decoded replies - see reply-decode.c and reply-layouts.def.
+ *
+ *	Decoding never allocates: each field simply records its value, or
+ *	points back into the packet for the MAC, string, and raw byte
+ *	fields.  The packet is kept in the reply itself for that reason.
+ */
+typedef enum {
+	FT_U8,		// unsigned, one byte
+	FT_U16,		// unsigned, two bytes, high byte first
+	FT_S16,		// signed, two bytes, high byte first
+	FT_U32,		// unsigned, four bytes, high byte first
+	FT_X32,		// unsigned, four bytes, shown in hex
+	FT_MAC,		// six-byte MAC address
+	FT_STRING,	// one byte of length, then that many bytes of text
+	FT_STATUS,	// result byte - 0 is success
+	FT_BYTES	// opaque bytes, shown in hex
+} FIELD_TYPE;
+
+/* what we know about a field from its layout - shared by every reply */
+struct field_desc {
+	const char	*label;		// e.g. "Firmware Version"
+	uchar		type;		// FIELD_TYPE
+	uchar		width;		// bytes of value in the packet
+	ushort		scale;		// divide the value by this to show it
+};
+
+struct reply_field {
+	const struct field_desc *desc;
+	const uchar	*data;		// first byte of the field in the packet
+	long		value;		// numeric value, before scaling (for
+					// strings and BYTES of width 0, the
+					// length of the data)
+};
+
+#define	REPLY_MAXPACKET	1024	// largest reply packet that we accept
+#define	REPLY_MAXFIELDS	REPLY_MAXPACKET	// every field uses at least one byte,
+					// so this can never overflow
+
+struct reply {
+	uchar	command;	// command that this is a reply to
+	int	status;		// value of an FT_STATUS field, otherwise 0
+	int	nfields;	// number of entries used in field[]
+	struct reply_field field[REPLY_MAXFIELDS];
+	uchar	packet[REPLY_MAXPACKET];	// the raw reply, which field[] refers to
+};
+
+struct reply_layout {
+	const char *name;	// NULL for a command that we don't know
+	int	sizebytes;	// 1, or 2 for commands with a two-byte size
+	int	(*decode) (const uchar *ptr, int length, struct reply *rp);
+};
+
+// indexed directly by the command byte:
+extern const struct reply_layout reply_layouts[256];
+
+
+/* the firmware chosen for a device from the catalog - see image-select.c */
+struct image_selection {
+	char	version[64];	// e.g. "V2.3.3"
+	char	file1[1024];	// path of the (first) image
+	char	file2[1024];	// path of the user2 image, or ""
+};
+
+struct fw_catalog;		// see ../ecowitt-web-server/firmware-info.h
+
+
+/*
+ *	Serving the firmware to the devices - see firmware-service.c.
+ *	Each image is read once and kept in memory, however many devices
+ *	are sent it.
+ */
+#define	IMAGE_MAXMODELS	4	// models that we keep of those named in an image
+
+struct fw_image {
+	struct fw_image *next;
+	char	*path;
+	char	*source;	// the file it came from: path, or path.zst
+	uchar	*data;
+	size_t	size;		// uncompressed
+	int	index;		// 0, 1, ... in the order that they were loaded
+
+	// what the image says it is - see image-check.c:
+	const char *kind;	// "ESP8266", "ESP32", ... or NULL if it isn't firmware
+	char	model[IMAGE_MAXMODELS][16];	// the models that it names
+	int	nmodels;
+	char	version[32];	// ... and its version, if it says
+};
+
+#define	IMAGE_ZSTD	".zst"		// a compressed image's suffix
+#define	IMAGE_MAXSIZE	(64 << 20)	// bigger than any firmware - see image-read.c
+
+/* why a download failed - these were the updater's exit statuses */
+enum {
+	FS_OK = 0,
+	FS_READ = 6,		// couldn't read the device's request, or it went quiet
+	FS_UNKNOWN = 7,		// a request that we don't know, or can't serve
+	FS_SEND = 8,		// couldn't send the size or the data
+	FS_NOSTART = 9,		// not "start" after the size
+	FS_NOCONTINUE = 10,	// not "continue" or "end" during the download
+	FS_AFTEREND = 11,	// something after "end"
+	FS_STATE = 12		// in a state that we don't know
+};
+
+#define	FS_CHUNK	1024	// bytes sent for each "start" or "continue"
+#define	FS_MAXREQUEST	16	// longest request that the device sends ("user1.bin",
+				// with its null), and room to spare
+
+/*
+ *	How long the device may take over each part of the protocol, in
+ *	seconds - see fw_deadline[] in firmware-service.c, and "-T".
+ */
+enum {
+	DL_REPLY,		// a reply to a command, on the command connection
+	DL_CONNECT,		// connecting back to us, after CMD_WRITE_UPDATE
+	DL_REQUEST,		// asking for an image, once it's connected
+	DL_PREP,		// "start", after the size - it prepares its flash first
+	DL_CHUNK,		// "continue" or "end", after each chunk
+	DL_CLOSE,		// closing the connection, after "end"
+	DL_NPHASES
+};
+
+extern int	fw_deadline[DL_NPHASES];
+
+/*
+ *	The timer wheel that the deadlines of the downloads are kept in -
+ *	see timer-wheel.c.  Times are in milliseconds, from fw_clock().
+ */
+#define	TW_TICK		100	// milliseconds in each tick of the wheel
+#define	TW_BITS		6
+#define	TW_SLOTS	(1 << TW_BITS)	// slots in each level
+#define	TW_LEVELS	4	// ... which reaches 19 days ahead
+
+struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer **pprev;	// what points to it, or NULL if it isn't armed
+	uint64_t expires;	// the tick that it's due on
+};
+
+struct timer_wheel {
+	uint64_t now;		// the tick that we've reached
+	long	armed;
+	struct tw_timer *slot[TW_LEVELS][TW_SLOTS];
+};
+
+/*
+ *	How one device's download went, for its history (-H) - see
+ *	device-history.c.  The chunks' round trips are counted in buckets,
+ *	eight to each power of two microseconds (within 12%).
+ */
+#define	TRANSFER_SUB		8
+#define	TRANSFER_BUCKETS	(22 * TRANSFER_SUB)	// ... up to 8 seconds
+
+struct transfer {
+	uint64_t mark;		// when the phase that it's in began (fw_clock())
+	uint32_t phase[DL_NPHASES];	// milliseconds spent waiting in each
+	uint32_t chunks;	// round trips counted
+	uint32_t rtt[TRANSFER_BUCKETS];
+};
+
+/*
+ *	One device's download.  These come from the session pool (see
+ *	session-pool.c), so they're kept small and all the same size: the
+ *	only buffers are the ones that the protocol needs - the request
+ *	being received, and the size reply.  The chunks of the image are
+ *	sent straight from the image in memory.
+ */
+struct fw_session {
+	const char *name;	// the device, for messages
+	struct profile *profile;	// what it costs us, with -P, else NULL
+	struct transfer *transfer;	// how it went, with -H, else NULL
+	struct fw_image *image[2];	// user1 and user2 (or NULL)
+	struct fw_image *current;	// the one that it asked for
+	const uchar *out;	// the reply to send now, if any
+	struct tw_timer timer;	// the deadline for what we're waiting for
+	struct timeval finished;	// when it was over
+	int	listen_fd;	// where it will connect, until it does
+	int	fd;		// its connection, or -1
+	int	index;		// where it is in serve_sessions()'s list
+	uint32_t offset;	// how much of the image it has been sent
+	uint32_t bytes;		// bytes of image sent
+	uint32_t packets;	// chunks sent
+	uint32_t chunk_sent;	// when the last one was (microseconds), for its RTT
+	uint16_t outlen;
+	uint8_t	state;		// where we are in the protocol
+	uint8_t	status;		// FS_OK, or why it failed
+	uint8_t	done;		// finished, one way or the other
+	uint8_t	quiet;		// don't show each request and chunk
+	uint8_t	phase;		// DL_..., that the timer is for
+	uint8_t	stalled;	// the device didn't keep up - it could try again
+	uint8_t	reqlen;
+	uchar	size[4];	// the size of the image, to send it
+	char	request[FS_MAXREQUEST];	// what it has sent, to the null
+};
+
+#define	POOL_SLAB	4096	// bytes of sessions allocated at a time
+#define	POOL_DEFAULT	4096	// KiB for the downloads in progress, unless -m
+
+struct fw_pool_stats {
+	long	slabs;		// allocated, and never given back
+	long	inuse;		// sessions handed out now
+	long	peak;		// ... and the most at once
+	long	refused;	// times that there wasn't room for another
+	size_t	bytes;		// counted against the ceiling, at the peak
+};
+
+struct sockaddr_in;
+
+/* the I/O that serve_sessions() does it with */
+enum {
+	ENGINE_POLL,		// poll(), read() and write()
+	ENGINE_URING		// io_uring, on Linux
+};
+
+struct fw_stats {
+	long	syscalls;	// system calls for the network I/O
+	long	bytes;		// bytes of image sent
+};
+
+
+/*
+ *	What one device cost us, for "-P" - see profile.c.  With io_uring,
+ *	the reads and writes of a download are the receives and sends that
+ *	were submitted for it, and its polls are the io_uring_enter()s that
+ *	waited for it.
+ */
+struct profile {
+	long	reads, rbytes;	// read()s, and the bytes that they got
+	long	writes, wbytes;	// write()s, and the bytes that they sent
+	long	polls;		// waits for the device, in poll()
+	double	user, sys;	// CPU seconds
+	long	nvcsw, nivcsw;	// voluntary and involuntary context switches
+	double	wall;		// seconds that we spent on it
+	double	wait;		// ... of them, waiting for the device
+	long	mark;		// reads + writes, when its batch was started
+};
+
+/* where things stood, when we started on a device */
+struct profile_mark {
+	double	when;
+	double	user, sys;
+	long	nvcsw, nivcsw;
+};
+
+extern int	profiling;
+extern struct profile *profile_current;
+
+#define	PROFILE_IO(pp, calls, bytes, n)	do { if ((pp) != NULL) { \
+		(pp)->calls++; (pp)->bytes += (n) > 0 ? (n) : 0; } } while (0)
+
+
+/* what happened to each device */
+enum {
+	DEV_FAILED,		// couldn't talk to it, or the update failed
+	DEV_CHECKED,		// looked at it, but didn't update it
+	DEV_CURRENT,		// already has the version that it should
+	DEV_UPDATED,		// updated, and came back with the new version
+	DEV_UNVERIFIED,		// updated, but didn't come back as it should
+	DEV_NOUTCOMES
+};
+
+/* one device's session, for the report at the end */
+struct session {
+	char	*host;
+	char	mac[32];
+	char	model[64];
+	char	version[64];	// what it was running
+	char	target[64];	// what we sent it, if we know, else ""
+	char	newversion[64];	// what it came back with, else ""
+	int	updated;	// did we try to update it?
+	int	outcome;	// DEV_...
+	double	transfer;	// seconds for the update itself
+	double	reboot;		// seconds from "end" to its first answer, or -1
+	int	polls;		// connection attempts while waiting for that
+	int	retries;	// downloads started again, after stalling
+	struct profile profile;	// with -P
+	struct transfer timings;	// with -H
+
+	// while it's being updated:
+	char	*service;	// its port
+	int	sock;		// the command connection, or -1
+	struct fw_session *download;	// the download, if it's being updated
+	struct timeval start;	// when the update started
+	struct timeval ended;	// ... and when the download ended
+};
+
+
+/*
+ *	What the updater is doing, for "-M" - see metrics.c.  Only the main
+ *	thread changes these, and the metrics thread only reads them, so
+ *	METRIC_ADD() is just a load and a store, without a lock.
+ */
+#define	METRIC_RTT_BUCKETS	12	// chunk RTT histogram buckets, before +Inf
+
+struct metrics {
+	atomic_long active;		// downloads in progress
+	atomic_long phase[DL_NPHASES];	// ... by what we're waiting for
+	atomic_long downloads;		// downloads that worked
+	atomic_long failures[FS_STATE + 1];	// ... and that failed, by status
+	atomic_long stalls;		// deadlines that passed
+	atomic_long retries;		// downloads started again
+	atomic_long bytes;		// bytes of image sent
+	atomic_long chunks;		// ... in this many chunks
+	atomic_long rtt[METRIC_RTT_BUCKETS + 1];	// from each chunk to the next request
+	atomic_long rtt_sum;		// ... in microseconds
+	atomic_long image_hits;		// images found already in memory
+	atomic_long image_misses;	// ... and read in
+	atomic_long devices[DEV_NOUTCOMES];	// what happened to each device
+};
+
+extern struct metrics metrics;
+
+#define	METRIC_ADD(m, n)	atomic_store_explicit (&(m), \
+		atomic_load_explicit (&(m), memory_order_relaxed) + (n), memory_order_relaxed)
+
+
+/*
+ *	Wire traces - see trace.c (which writes them) and trace-replay.c.
+ *	A trace file is a struct trace_header, then one struct trace_record
+ *	for each event, each followed by its "length" bytes of data.  The
+ *	numbers are in the byte order of the machine that wrote it, which
+ *	the version field shows.
+ */
+#define	TRACE_MAGIC	"ECOTRACE"
+#define	TRACE_VERSION	1
+
+struct trace_header {
+	char	magic[8];	// TRACE_MAGIC, without a null
+	uint32_t version;	// TRACE_VERSION
+	uint32_t reserved;
+	int64_t	start;		// when the trace started (microseconds since 1970)
+};
+
+/* the events */
+enum {
+	TR_CONNECT = 1,		// we connected to the device ("host port" as data)
+	TR_ACCEPT,		// the device connected to us, for the download
+	TR_SEND,		// bytes that we sent
+	TR_RECV,		// bytes that the device sent (none - it closed)
+	TR_CLOSE		// we closed the connection
+};
+
+struct trace_record {
+	uint64_t time;		// microseconds since the start of the trace
+	uint32_t length;	// bytes of data that follow
+	uint16_t channel;	// which connection: 1, 2, ... in order of opening
+	uint8_t	event;		// TR_...
+	uint8_t	reserved;
+};
+
+
+/* prototypes */
+int	decode_reply_data (uchar command, const uchar *ptr, int length, struct reply *rp);
+void	print_reply (struct reply *rp);
+struct reply_field *find_field (struct reply *rp, int type);
+
+int	parse_firmware_version (const char *s, int len, char *model, size_t modellen,
+		char *version, size_t versionlen);
+int	select_image (struct fw_catalog *cp, const char *imagedir, const char *model,
+		const char *mac, const char *current, struct image_selection *sp);
+int	select_version (struct fw_catalog *cp, const char *imagedir, const char *model,
+		const char *version, struct image_selection *sp);
+int	select_previous (struct fw_catalog *cp, const char *imagedir, const char *model,
+		const char *current, const char *previous, struct image_selection *sp);
+
+int	history_open (char *fname, int full);
+const char *history_previous (const char *mac, const char *current);
+void	history_record (struct session *sp);
+int	history_save (void);
+int	history_report (char *fname, double threshold);
+
+int	build_command_packet (uchar command, uchar *data, int datalen, uchar *packet);
+int	do_config (char *configfile, struct session *sessions, int n, int change);
+
+struct fw_image *fw_image_load (const char *path);
+int	fw_image_read (struct fw_image *ip, const char *path);
+const char *fw_image_source (const char *path, char *buf, size_t buflen);
+struct fw_image *fw_image_list (void);
+void	fw_image_inspect (struct fw_image *ip);
+const char *fw_image_refuses (struct fw_image *ip, const char *model);
+void	fw_session_init (struct fw_session *fsp, const char *name, int listen_fd,
+		struct fw_image *image1, struct fw_image *image2);
+void	fw_session_accepted (struct fw_session *fsp, int fd, struct sockaddr_in *addr);
+int	fw_session_input (struct fw_session *fsp, const uchar *data, int length);
+int	fw_session_next (struct fw_session *fsp);
+void	fw_session_end (struct fw_session *fsp, int status);
+void	fw_session_disarm (struct fw_session *fsp);
+struct fw_session *fw_session_stalled (void);
+void	fw_session_timed (struct fw_session *fsp, struct transfer *tp);
+double	transfer_rtt_percentile (struct transfer *tp, double p);
+long	fw_session_timeout (void);
+uint64_t fw_clock (void);
+int	fw_set_deadlines (const char *spec);
+const char *fw_status (int status);
+int	engine_named (const char *name);
+int	serve_sessions (struct fw_session **sessions, int n, int engine, struct fw_stats *stats);
+size_t	serve_session_bytes (int engine);
+int	serve_uring (struct fw_session **sessions, int n, struct fw_stats *stats);
+size_t	uring_session_bytes (void);
+
+void	fw_pool_init (size_t ceiling, size_t extra);
+struct fw_session *fw_session_get (void);
+void	fw_session_put (struct fw_session *fsp);
+void	fw_pool_stats (struct fw_pool_stats *psp);
+
+void	tw_init (struct timer_wheel *w, uint64_t now);
+void	tw_arm (struct timer_wheel *w, struct tw_timer *t, uint64_t when);
+void	tw_cancel (struct timer_wheel *w, struct tw_timer *t);
+struct tw_timer *tw_advance (struct timer_wheel *w, uint64_t now);
+long	tw_timeout (struct timer_wheel *w, uint64_t now);
+
+int	metrics_start (const char *where);
+void	metrics_chunk_rtt (long usecs);
+
+double	profile_clock (void);
+void	profile_begin (struct profile *pp, struct profile_mark *mp);
+void	profile_end (struct profile_mark *mp);
+void	profile_waited (double since, int polled);
+void	profile_batch_begin (struct fw_session **sessions, int n, struct profile_mark *mp);
+void	profile_batch_polled (struct fw_session **sessions, int n, double since);
+void	profile_batch_end (struct fw_session **sessions, int n, struct profile_mark *mp);
+void	profile_report (struct profile *pp);
+
+int	trace_start (const char *fname);
+void	trace_open (int fd, int event, const char *peer);
+void	trace_data (int fd, int event, const void *data, int length);
+void	trace_close (int fd);
+void	trace_finish (void);
+
+void	hexdump (uchar *data, int length);
+
+#endif /* ECOWITT_FIRMWARE_UPDATER_H */
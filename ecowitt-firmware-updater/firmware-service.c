@@ -0,0 +1,806 @@
+/*
+ *	Serving the firmware images to the devices, once they have been
+ *	sent CMD_WRITE_UPDATE and connect back to us.
+ *
+ *	Each download is a session, and the protocol is a small state
+ *	machine - fw_session_input() takes whatever the device sends, and
+ *	fw_session_next() works through its requests, one at a time, leaving
+ *	the reply to be sent in fsp->out.  Nothing in here waits for the
+ *	network, so any number of sessions can be in progress at once.
+ *	serve_sessions() does the I/O for all of them, with poll() (below)
+ *	or with io_uring (see firmware-uring.c).
+ *
+ *	The images are read into memory once and served from there, however
+ *	many devices are being sent the same one - so a compressed image is
+ *	decompressed only once, too.
+ *
+ *	Each part of the protocol has its own deadline (fw_deadline[]), from
+ *	the device connecting back to us to it closing the connection after
+ *	"end".  The session's timer is re-armed for the next one as it gets
+ *	there, in a single timer wheel for all of the sessions, and the
+ *	engines reap the ones whose timers have gone off.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+/*
+ *	This is the part that actually handles the inbound conversation
+ *	with the client device.  The process has already been
+ *	initiated by sending the CMD_WRITE_UPDATE (0x43) to the device,
+ *	specifying the IP address and TCP port number that the device should
+ *	connect to in order to receive the firmware here, and the device has
+ *	connected to our service port.  So now we talk the talk.
+ *
+ *	The protocol is very simple - it is all done over TCP, and all
+ *	messages from the client are null-terminated.
+ *
+ *  ->	The client starts by asking for the firmware image that it wants
+ *	with a simple "user1.bin\0" or "user2.bin\0" request. (Note: Older
+ *	devices such as the GW1000 have two firmware images, referred to as
+ *	"user1" and "user2". Newer device have a single image, and those
+ *	devices always request "user1.bin".)
+ *  <-	The server locates the correct file in the filesystem and opens it.
+ *	It determines the file size (in bytes), and responds to the client
+ *	with the size as a four-byte binary value, in network byte order.
+ *	(NOT a string, which could be a variable length.)
+ *
+ *  The client usually takes a few seconds here -- I'm guessing that it's
+ *  preparing the flash to store the inbound image.
+ *
+ *  ->	The client asks for the first data chunk by sending "start\0"
+ *  <-	The server sends a buffer of data (1024 bytes, per observation of
+ *	the WS View app - though the GW1000 specification says 1460.)
+ * /->	The client replies with "continue\0"
+ * \<-	The server loops - reading and sending the next buffer then waiting
+ *	for "continue" again, until the entire image has been transferred.
+ *	(The final buffer will be shorter, unless the file size is an exact
+ *	multiple of the buffer size.)
+ *  ->	When the client receives the full count of firmware image data, it
+ *	will send "end\0", then close the TCP connection.
+ */
+
+// various states during the firmware transfer process:
+#define	STATE_BASE	0	// waiting to get "user1.bin" or "user2.bin"
+#define	GOT_USER1	1	// we have gotten "user1.bin"
+#define	GOT_USER2	2	// we have gotten "user2.bin"
+#define	GOT_START	3	// we have gotten "start"
+#define	GOT_CONTINUE	4	// we have gotten "continue"
+#define	GOT_END		5	// we have gotten "end"
+
+static struct fw_image *images;		// every image that we've read
+static int	nimages;
+
+/* seconds for each part of the protocol - DL_... */
+int	fw_deadline[DL_NPHASES] = {
+	10,		// DL_REPLY
+	30,		// DL_CONNECT
+	10,		// DL_REQUEST
+	60,		// DL_PREP
+	15,		// DL_CHUNK
+	10		// DL_CLOSE
+};
+
+static const char *deadline_names[DL_NPHASES] = {
+	"reply", "connect", "request", "prep", "chunk", "close"
+};
+
+// what we were waiting for, when it went off:
+static const char *deadline_waits[DL_NPHASES] = {
+	"a reply",
+	"the device to connect",
+	"the device to ask for an image",
+	"\"start\" (preparing its flash)",
+	"\"continue\"",
+	"the device to close the connection"
+};
+
+static struct timer_wheel wheel;
+static int	wheel_started;
+static struct tw_timer *expired;	// gone off, but not yet reaped
+
+
+// helper function to decode "state" to a string:
+static char *
+decode_state (int state)
+{
+	char *s;
+
+	switch (state) {
+	case STATE_BASE:	s = "state_base"; break;
+	case GOT_USER1:		s = "got_user1"; break;
+	case GOT_USER2:		s = "got_user2"; break;
+	case GOT_START:		s = "got_start"; break;
+	case GOT_CONTINUE:	s = "got_continue"; break;
+	case GOT_END:		s = "got_end"; break;
+	default:		s = "unknown"; break;
+	}
+
+	return s;
+}
+
+/* milliseconds, from some time in the past */
+uint64_t
+fw_clock (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/* microseconds, for the chunks' round trips - they only need to be 32 bits */
+static uint32_t
+usecs (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ *	Change some of the deadlines, from e.g. "prep=90,chunk=20".
+ *	Returns 0, or -1 (with a message) if it doesn't make sense.
+ */
+int
+fw_set_deadlines (const char *spec)
+{
+	const char *cp = spec;
+	char	*end;
+	size_t	len;
+	long	secs;
+	int	i;
+
+	while (*cp != '\0') {
+		len = strcspn (cp, "=");
+		for (i = 0; i < DL_NPHASES; i++) {
+			if (strlen (deadline_names[i]) == len &&
+			    strncmp (cp, deadline_names[i], len) == 0)
+				break;
+		}
+		if (i == DL_NPHASES || cp[len] != '=' ||
+		    (secs = strtol (cp + len + 1, &end, 10)) <= 0 ||
+		    (*end != ',' && *end != '\0')) {
+			fprintf (stderr, "%s: bad deadline \"%s\" - use e.g. \"prep=90,chunk=20\", for",
+				progname, spec);
+			for (i = 0; i < DL_NPHASES; i++)
+				fprintf (stderr, " %s", deadline_names[i]);
+			fprintf (stderr, "\n");
+			return -1;
+		}
+		fw_deadline[i] = secs;
+		cp = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* start waiting for the device to do its part of this phase */
+static void
+fw_session_arm (struct fw_session *fsp, int phase)
+{
+	uint64_t now = fw_clock ();
+
+	if (!wheel_started) {
+		tw_init (&wheel, now);
+		wheel_started = 1;
+	}
+	if (phase != fsp->phase) {
+		if (fsp->transfer != NULL) {
+			fsp->transfer->phase[fsp->phase] += now - fsp->transfer->mark;
+			fsp->transfer->mark = now;
+		}
+		METRIC_ADD (metrics.phase[fsp->phase], -1);
+		METRIC_ADD (metrics.phase[phase], 1);
+		fsp->phase = phase;
+	}
+	tw_arm (&wheel, &fsp->timer, now + fw_deadline[phase] * 1000ULL);
+}
+
+/*
+ *	Keep the times of this session's phases, and its chunks' round
+ *	trips, in *tp - from now, until it ends.  The times of a download
+ *	that's started again are added to those of the first.
+ */
+void
+fw_session_timed (struct fw_session *fsp, struct transfer *tp)
+{
+	fsp->transfer = tp;
+	tp->mark = fw_clock ();
+}
+
+static void
+transfer_rtt (struct transfer *tp, uint32_t usecs)
+{
+	int	msb, b;
+
+	if (usecs < TRANSFER_SUB)
+		b = usecs;
+	else {
+		for (msb = 3; usecs >> (msb + 1) != 0; msb++)
+			;
+		b = (msb - 2) * TRANSFER_SUB + ((usecs >> (msb - 3)) & (TRANSFER_SUB - 1));
+		if (b >= TRANSFER_BUCKETS)
+			b = TRANSFER_BUCKETS - 1;
+	}
+	tp->rtt[b]++;
+	tp->chunks++;
+}
+
+/* the round trip, in milliseconds, that this fraction of the chunks were within */
+double
+transfer_rtt_percentile (struct transfer *tp, double p)
+{
+	uint32_t want = tp->chunks * p, seen = 0;
+	int	b, msb;
+
+	for (b = 0; b < TRANSFER_BUCKETS; b++) {
+		if ((seen += tp->rtt[b]) > want)
+			break;
+	}
+	if (b < TRANSFER_SUB)
+		return b / 1e3;
+	msb = b / TRANSFER_SUB + 2;	// the middle of the bucket
+	return ((TRANSFER_SUB + b % TRANSFER_SUB + 0.5) * (1 << (msb - 3))) / 1e3;
+}
+
+/* we're not waiting for the device any more */
+void
+fw_session_disarm (struct fw_session *fsp)
+{
+	tw_cancel (&wheel, &fsp->timer);
+}
+
+/*
+ *	The next session whose device hasn't done its part in time, or NULL
+ *	- for the engine to end it.  It's marked as stalled, so that it can
+ *	be tried again.
+ */
+struct fw_session *
+fw_session_stalled (void)
+{
+	struct fw_session *fsp;
+	struct tw_timer *t;
+
+	if (expired == NULL && wheel_started)
+		expired = tw_advance (&wheel, fw_clock ());
+	if ((t = expired) == NULL)
+		return NULL;
+	expired = t->next;
+	t->next = NULL;
+
+	fsp = (struct fw_session *) ((char *) t - offsetof (struct fw_session, timer));
+	fsp->stalled = 1;
+	METRIC_ADD (metrics.stalls, 1);
+	printf ("%s: waited %d seconds for %s.\n",
+		fsp->name, fw_deadline[fsp->phase], deadline_waits[fsp->phase]);
+	return fsp;
+}
+
+/* milliseconds that the engine can wait before a deadline could pass, or -1 */
+long
+fw_session_timeout (void)
+{
+	return wheel_started ? tw_timeout (&wheel, fw_clock ()) : -1;
+}
+
+/* what a session's status means */
+const char *
+fw_status (int status)
+{
+	switch (status) {
+	case FS_OK:		return "ok";
+	case FS_READ:		return "couldn't read from the device";
+	case FS_UNKNOWN:	return "unexpected request";
+	case FS_SEND:		return "couldn't send to the device";
+	case FS_NOSTART:	return "no \"start\" after the size";
+	case FS_NOCONTINUE:	return "no \"continue\" or \"end\" during the download";
+	case FS_AFTEREND:	return "request after \"end\"";
+	case FS_STATE:		return "unknown state";
+	}
+	return "unknown status";
+}
+
+/*
+ *	The image in this file, read into memory the first time that it's
+ *	asked for - decompressed, if it's only there as "path.zst" (see
+ *	image-read.c).  Returns NULL (with a message) if it can't be read.
+ */
+struct fw_image *
+fw_image_load (const char *path)
+{
+	struct fw_image *ip, **ipp;
+
+	for (ipp = &images; (ip = *ipp) != NULL; ipp = &ip->next) {
+		if (strcmp (ip->path, path) == 0) {
+			METRIC_ADD (metrics.image_hits, 1);
+			return ip;
+		}
+	}
+	METRIC_ADD (metrics.image_misses, 1);
+
+	if ((ip = calloc (1, sizeof *ip)) == NULL ||
+	    (ip->path = strdup (path)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	if (fw_image_read (ip, path) < 0) {
+		free (ip->path);
+		free (ip);
+		return NULL;
+	}
+	fw_image_inspect (ip);
+	ip->index = nimages++;
+	*ipp = ip;
+	return ip;
+}
+
+/* all of the images, in the order that they were read */
+struct fw_image *
+fw_image_list (void)
+{
+	return images;
+}
+
+/* get ready for a device to connect to listen_fd for one of these images */
+void
+fw_session_init (struct fw_session *fsp, const char *name, int listen_fd,
+	struct fw_image *image1, struct fw_image *image2)
+{
+	memset (fsp, 0, sizeof *fsp);
+	fsp->name = name;
+	fsp->listen_fd = listen_fd;
+	fsp->fd = -1;
+	fsp->image[0] = image1;
+	fsp->image[1] = image2;
+	fsp->state = STATE_BASE;
+	fsp->phase = DL_CONNECT;
+	METRIC_ADD (metrics.active, 1);
+	METRIC_ADD (metrics.phase[DL_CONNECT], 1);
+	fw_session_arm (fsp, DL_CONNECT);
+}
+
+/* the device connected - fd is its connection */
+void
+fw_session_accepted (struct fw_session *fsp, int fd, struct sockaddr_in *addr)
+{
+	char	peer[64];
+
+	printf ("\n%s: received inbound connection from address %s, port %hu\n",
+		fsp->name, inet_ntoa (addr->sin_addr), ntohs (addr->sin_port));
+	snprintf (peer, sizeof peer, "%s %hu",
+		inet_ntoa (addr->sin_addr), ntohs (addr->sin_port));
+	trace_open (fd, TR_ACCEPT, peer);
+
+	fsp->fd = fd;
+	fw_session_arm (fsp, DL_REQUEST);
+}
+
+static int
+fw_session_fail (struct fw_session *fsp, int status)
+{
+	fsp->status = status;
+	return -1;
+}
+
+/*
+ *	Take what the device has sent.  A length of 0 means that it closed
+ *	the connection - which it should only do after "end".
+ *	Returns 0, or -1 if the session has failed (see fsp->status).
+ */
+int
+fw_session_input (struct fw_session *fsp, const uchar *data, int length)
+{
+	if (length == 0) {
+		printf ("\007Client closed the connection%s.\n",
+			fsp->state == GOT_END ? "" : " before END");
+		return fsp->state == GOT_END ? 0 : fw_session_fail (fsp, FS_READ);
+	}
+	if (length > FS_MAXREQUEST - fsp->reqlen) {
+		printf ("%s: received an over-long request from the client - quitting.\n",
+			__FUNCTION__);
+		return fw_session_fail (fsp, FS_UNKNOWN);
+	}
+	memcpy (fsp->request + fsp->reqlen, data, length);
+	fsp->reqlen += length;
+	return 0;
+}
+
+/*
+ *	Deal with the next complete request from the device, if there is
+ *	one, leaving the reply in fsp->out and fsp->outlen.
+ *	Returns 1 if there was a request, 0 if we need more input, or -1
+ *	if the session has failed (see fsp->status).
+ */
+int
+fw_session_next (struct fw_session *fsp)
+{
+	char	line[FS_MAXREQUEST];	// client request
+	int	linelen;	// number of bytes in it, with the null
+	int	what;		// decoded value of what client just sent
+	int	currstate = fsp->state;
+	int	nextstate = fsp->state;
+	int	fwlen;		// number of bytes of the image to send
+	uint32_t size;
+	char	*nul;
+
+	fsp->out = NULL;
+	fsp->outlen = 0;
+
+	if ((nul = memchr (fsp->request, '\0', fsp->reqlen)) == NULL)
+		return 0;
+	linelen = nul - fsp->request + 1;
+	memcpy (line, fsp->request, linelen);
+	fsp->reqlen -= linelen;
+	memmove (fsp->request, fsp->request + linelen, fsp->reqlen);
+
+	/* show the input buffer to the user */
+	if (!fsp->quiet)
+		printf (">>> %s\n", line);
+
+	// figure out what the client said to us:
+	if (linelen == 10 && memcmp (line, "user1.bin\0", 10) == 0) {
+		what = GOT_USER1;
+	} else if (linelen == 10 && memcmp (line, "user2.bin\0", 10) == 0) {
+		what = GOT_USER2;
+	} else if (linelen == 6 && memcmp (line, "start\0", 6) == 0) {
+		what = GOT_START;
+	} else if (linelen == 9 && memcmp (line, "continue\0", 9) == 0) {
+		what = GOT_CONTINUE;
+	} else if (linelen == 4 && memcmp (line, "end\0", 4) == 0) {
+		what = GOT_END;
+	} else {
+		// we got something unexpected - say so, and bail
+		printf ("%s: received unexpected \"%s\" from the client - quitting.\n",
+				__FUNCTION__, line);
+		return fw_session_fail (fsp, FS_UNKNOWN);
+	}
+
+	// If we are at the base state, we expect the client
+	// to specify which image they want - the request
+	// should be literally "user1.bin" or "user2.bin".
+	if (currstate == STATE_BASE) {
+		if (what == GOT_USER1) {
+			fsp->current = fsp->image[0];	// image 1
+			nextstate = GOT_USER1;		// update the state
+		} else if (what == GOT_USER2) {
+			fsp->current = fsp->image[1];	// image 2
+			if (fsp->current == NULL) {	// but we don't have an image2 ?
+				fprintf (stderr,
+		"\n*** %s: device requested user2, but second firmware image was not specified ***\n\n",
+					progname);
+				return fw_session_fail (fsp, FS_UNKNOWN);
+			}
+			nextstate = GOT_USER2;		// update the state
+		} else {
+			// we got something unexpected while in the base state
+			printf ("%s: received unexpected \"%s\" while in the base state - quitting.\n",
+				__FUNCTION__, line);
+			return fw_session_fail (fsp, FS_UNKNOWN);
+		}
+
+		// We need to send four bytes - the binary
+		// representation of the image size, in network
+		// byte order.  (NOTE: NOT a string.)
+		size = htonl (fsp->current->size);
+		memcpy (fsp->size, &size, 4);
+		fsp->out = fsp->size;
+		fsp->outlen = 4;
+		fsp->offset = 0;
+
+		if (!fsp->quiet)
+			printf ("file size is %ld bytes.\n", (long) fsp->current->size);
+		// After this, we expect the client to send "start".
+	} else if (currstate == GOT_USER1 || currstate == GOT_USER2) {
+		// the client should ask for the first block of data
+		// ("start").  Then we will start sending data.
+		if (what == GOT_START) {
+			nextstate = GOT_START;	// update the state
+			fsp->packets = 0;
+		} else {
+			printf ("%s: received unexpected \"%s\" while in GOT_USER state - quitting.\n",
+				__FUNCTION__, line);
+			return fw_session_fail (fsp, FS_NOSTART);
+		}
+	} else if (currstate == GOT_START || currstate == GOT_CONTINUE) {
+		// the client should ask for the the next block of data
+		// ("continue") or say it is done ("end").
+		if (what == GOT_CONTINUE) {
+			nextstate = GOT_CONTINUE; // update the state
+		} else if (what == GOT_END) {
+			nextstate = GOT_END;	// update the state
+		} else {
+			printf ("%s: received unexpected \"%s\" while in GOT_START/GOT_CONTINUE state - quitting.\n",
+				__FUNCTION__, line);
+			return fw_session_fail (fsp, FS_NOCONTINUE);
+		}
+	} else if (currstate == GOT_END) {
+		printf ("%s: received \"%s\" after END - quitting.\n", __FUNCTION__, line);
+		return fw_session_fail (fsp, FS_AFTEREND);
+	} else {
+		// we're in a totally unexpected state!
+		printf ("%s: We are in unexpected state %d !!!\n", __FUNCTION__, currstate);
+		return fw_session_fail (fsp, FS_STATE);
+	}
+
+	// the time since the last chunk was sent is its round trip
+	if ((what == GOT_CONTINUE || what == GOT_END) && fsp->packets > 0) {
+		metrics_chunk_rtt ((uint32_t) (usecs () - fsp->chunk_sent));
+		if (fsp->transfer != NULL)
+			transfer_rtt (fsp->transfer, usecs () - fsp->chunk_sent);
+	}
+
+	// if we have just received either "start" or "continue",
+	// the reply is the next block of the image:
+	if (what == GOT_START || what == GOT_CONTINUE) {
+		fwlen = fsp->current->size - fsp->offset;
+		if (fwlen > FS_CHUNK)
+			fwlen = FS_CHUNK;
+		if (fwlen == 0) {
+			printf ("At EOF on firmware file after %d packet%s, %ld bytes.\n",
+				(int) fsp->packets, fsp->packets == 1 ? "" : "s", (long) fsp->bytes);
+			// *** this case actually should never happen - the client
+			// *** knows that there are zero bytes remaining, so it
+			// *** should send "end" instead of "continue".
+		} else {
+			fsp->out = fsp->current->data + fsp->offset;
+			fsp->outlen = fwlen;
+			fsp->offset += fwlen;
+			fsp->packets++;
+			fsp->bytes += fwlen;
+			fsp->chunk_sent = usecs ();
+			METRIC_ADD (metrics.chunks, 1);
+			METRIC_ADD (metrics.bytes, fwlen);
+			if (!fsp->quiet)
+				printf ("sending packet %4d - %4d byte%s   - sent=%ld\n",
+					(int) fsp->packets, fwlen, fwlen == 1 ? "" : "s", (long) fsp->bytes);
+		}
+	}
+
+	if (nextstate != currstate) {	// time to change state:
+		fsp->state = nextstate;	// update the state
+		if (debug || verbose)
+			printf ("newstate=%d [%s]\n",
+				fsp->state, decode_state (fsp->state));
+	}
+
+	// and what the device should do next, by when:
+	if (nextstate == GOT_USER1 || nextstate == GOT_USER2)
+		fw_session_arm (fsp, DL_PREP);
+	else if (nextstate == GOT_END)
+		fw_session_arm (fsp, DL_CLOSE);
+	else
+		fw_session_arm (fsp, DL_CHUNK);
+	return 1;
+}
+
+/* the session is over - close everything, and say how it went */
+void
+fw_session_end (struct fw_session *fsp, int status)
+{
+	fw_session_disarm (fsp);
+	if (fsp->fd >= 0) {
+		trace_close (fsp->fd);
+		close (fsp->fd);
+		fsp->fd = -1;
+	}
+	if (fsp->listen_fd >= 0) {
+		close (fsp->listen_fd);
+		fsp->listen_fd = -1;
+	}
+	fsp->status = status;
+	fsp->done = 1;
+	gettimeofday (&fsp->finished, NULL);
+	if (fsp->transfer != NULL)
+		fsp->transfer->phase[fsp->phase] += fw_clock () - fsp->transfer->mark;
+
+	METRIC_ADD (metrics.active, -1);
+	METRIC_ADD (metrics.phase[fsp->phase], -1);
+	if (status == FS_OK)
+		METRIC_ADD (metrics.downloads, 1);
+	else if (status <= FS_STATE)
+		METRIC_ADD (metrics.failures[status], 1);
+
+	if (status != FS_OK)
+		printf ("%s: firmware download failed: %s.\n", fsp->name, fw_status (status));
+	printf ("%s: sent total of %d packet%s, %ld bytes.\n",
+		fsp->name, (int) fsp->packets, fsp->packets == 1 ? "" : "s", (long) fsp->bytes);
+}
+
+/* "poll" or "uring" */
+int
+engine_named (const char *name)
+{
+	if (strcmp (name, "poll") == 0)
+		return ENGINE_POLL;
+	if (strcmp (name, "uring") == 0 || strcmp (name, "io_uring") == 0)
+		return ENGINE_URING;
+	return -1;
+}
+
+/* send the reply that fw_session_next() left */
+static int
+send_reply (struct fw_session *fsp, struct fw_stats *stats)
+{
+	const uchar *p = fsp->out;
+	int	remain = fsp->outlen;
+	int	r;
+
+	while (remain > 0) {
+		r = write (fsp->fd, p, remain);
+		stats->syscalls++;
+		PROFILE_IO (fsp->profile, writes, wbytes, r);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			fprintf (stderr, "%s: error writing to %s: %s\n",
+				__FUNCTION__, fsp->name, strerror (errno));
+			return fw_session_fail (fsp, FS_SEND);
+		}
+		trace_data (fsp->fd, TR_SEND, p, r);
+		p += r;
+		remain -= r;
+	}
+	fsp->outlen = 0;
+	return 0;
+}
+
+/*
+ *	The poll() engine: wait for any session's device to connect or send
+ *	something, and deal with it.
+ */
+static int
+serve_poll (struct fw_session **sessions, int n, struct fw_stats *stats)
+{
+	struct pollfd *pfds;
+	int	*which;
+	struct fw_session *fsp;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	uchar	buf[FS_MAXREQUEST];
+	int	i, j, count, r, fd;
+	double	since = 0;
+
+	if ((pfds = malloc (n * sizeof *pfds)) == NULL ||
+	    (which = malloc (n * sizeof *which)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+
+	for ( ;; ) {
+		while ((fsp = fw_session_stalled ()) != NULL)
+			fw_session_end (fsp, FS_READ);
+		for (i = count = 0; i < n; i++) {
+			fsp = sessions[i];
+			if (fsp->done)
+				continue;
+			pfds[count].fd = fsp->fd >= 0 ? fsp->fd : fsp->listen_fd;
+			pfds[count].events = POLLIN;
+			pfds[count].revents = 0;
+			which[count++] = i;
+		}
+		if (count == 0)
+			break;
+
+		if (profiling)
+			since = profile_clock ();
+		r = poll (pfds, count, fw_session_timeout ());
+		stats->syscalls++;
+		profile_batch_polled (sessions, n, since);
+		if (r < 0 && errno != EINTR) {
+			perror ("poll");
+			break;
+		}
+
+		for (j = 0; j < count && r > 0; j++) {
+			if (pfds[j].revents == 0)
+				continue;
+			fsp = sessions[which[j]];
+
+			// the device is connecting back to us
+			if (fsp->fd < 0) {
+				addrlen = sizeof addr;
+				fd = accept (fsp->listen_fd, (struct sockaddr *) &addr, &addrlen);
+				stats->syscalls++;
+				if (fd < 0) {
+					if (errno == EINTR || errno == EAGAIN)
+						continue;
+					fprintf (stderr, "%s: cannot accept incoming connection on socket: %s\n",
+						__FUNCTION__, strerror (errno));
+					fw_session_end (fsp, FS_READ);
+					continue;
+				}
+				close (fsp->listen_fd);		// we only take one
+				stats->syscalls++;
+				fsp->listen_fd = -1;
+				fw_session_accepted (fsp, fd, &addr);
+				continue;
+			}
+
+			r = read (fsp->fd, buf, sizeof buf);
+			stats->syscalls++;
+			PROFILE_IO (fsp->profile, reads, rbytes, r);
+			if (r < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				fprintf (stderr, "%s: error reading from socket: %s\n",
+					__FUNCTION__, strerror (errno));
+				fw_session_end (fsp, FS_READ);
+				continue;
+			}
+			trace_data (fsp->fd, TR_RECV, buf, r);
+			if (fw_session_input (fsp, buf, r) < 0 || r == 0) {
+				fw_session_end (fsp, fsp->status);
+				continue;
+			}
+			while ((i = fw_session_next (fsp)) > 0) {
+				if (fsp->outlen > 0 && send_reply (fsp, stats) < 0) {
+					i = -1;
+					break;
+				}
+			}
+			if (i < 0)
+				fw_session_end (fsp, fsp->status);
+		}
+	}
+
+	free (pfds);
+	free (which);
+	return 0;
+}
+
+/*
+ *	Do the downloads for all of these sessions, until they have all
+ *	finished (or failed - see each one's status).  The stats, if given,
+ *	get the system calls made and the bytes sent.
+ */
+int
+serve_sessions (struct fw_session **sessions, int n, int engine, struct fw_stats *stats)
+{
+	struct fw_stats mine;
+	struct profile_mark mark;
+	int	i, r = -1;
+
+	if (stats == NULL)
+		stats = &mine;
+	memset (stats, 0, sizeof *stats);
+	for (i = 0; i < n; i++)
+		sessions[i]->index = i;
+	profile_batch_begin (sessions, n, &mark);
+
+	if (engine == ENGINE_URING &&
+	    (r = serve_uring (sessions, n, stats)) < 0)
+		printf ("%s: io_uring isn't available here - using poll() instead.\n", progname);
+	if (r < 0)
+		r = serve_poll (sessions, n, stats);
+	profile_batch_end (sessions, n, &mark);
+
+	for (i = 0; i < n; i++)
+		stats->bytes += sessions[i]->bytes;
+	return r;
+}
+
+/* the bytes that the engine keeps for each session, besides the session */
+size_t
+serve_session_bytes (int engine)
+{
+	size_t	n = sizeof (struct pollfd) + sizeof (int);	// serve_poll()'s
+
+	if (engine == ENGINE_URING && uring_session_bytes () > n)
+		n = uring_session_bytes ();
+	return n;
+}
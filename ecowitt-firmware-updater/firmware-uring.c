@@ -0,0 +1,538 @@
+/*
+ *	The io_uring engine for serve_sessions() - see firmware-service.c.
+ *
+ *	Every session's accept, receive and send goes into one submission
+ *	ring, and a single io_uring_enter() both hands the kernel all of the
+ *	replies that are ready and waits for the next requests, from every
+ *	device at once.  Each reply is linked to the receive of the request
+ *	after it, so a chunk of the image and the wait for "continue" cost
+ *	one submission between them.
+ *
+ *	The images (kept in memory by fw_image_load()) and the sessions'
+ *	request buffers are registered with the kernel once, and the
+ *	devices' connections are registered as fixed files as they arrive,
+ *	so the kernel doesn't have to look them up or map them each time.
+ *	If the kernel won't register them, the plain operations are used.
+ *
+ *	A timeout in the ring wakes us once a second to reap the sessions
+ *	whose deadlines have passed - see fw_session_stalled().
+ *
+ *	This talks to the kernel directly, rather than needing liburing.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// what each submission is, in the low bits of its user_data
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_TICK };
+#define	OP_BITS		3
+#define	OP_MASK		((1 << OP_BITS) - 1)
+
+struct uring {
+	int	fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned entries;
+	unsigned tail;		// our copy of *sq_tail, ahead by what's not yet submitted
+	unsigned unsubmitted;
+	void	*sq_ring, *cq_ring;
+	size_t	sq_len, cq_len, sqes_len;
+	struct fw_stats *stats;
+};
+
+/* what the engine keeps for each session - registered with the kernel */
+struct slot {
+	uchar	recv[FS_MAXREQUEST];	// where the requests are received
+	uchar	size[4];		// the size reply, from here
+	struct sockaddr_in addr;	// who connected
+	socklen_t addrlen;
+	const uchar *out;		// the rest of the reply being sent
+	int	outlen;
+	int	accepting, receiving, sending;	// operations in progress
+	int	closing;		// finished, once those are done
+};
+
+static struct slot *slots;
+static int	fixed_buffers;		// the images and slots are registered
+static int	slot_buffer;		// ... the slots as this buffer
+static int	fixed_files;		// the connections are registered
+
+
+static int
+uring_setup (struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset (u, 0, sizeof *u);
+	memset (&p, 0, sizeof p);
+	if ((u->fd = syscall (__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = 0;
+	}
+	u->sq_ring = mmap (NULL, u->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (u->cq_len == 0)
+		u->cq_ring = u->sq_ring;
+	else if ((u->cq_ring = mmap (NULL, u->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+	u->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap (NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned *) ((char *) u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *) ((char *) u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *) ((char *) u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned *) ((char *) u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *) ((char *) u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+	u->entries = p.sq_entries;
+	u->tail = *u->sq_tail;
+	return 0;
+
+fail:
+	close (u->fd);
+	return -1;
+}
+
+static void
+uring_close (struct uring *u)
+{
+	munmap (u->sqes, u->sqes_len);
+	if (u->cq_ring != u->sq_ring)
+		munmap (u->cq_ring, u->cq_len);
+	munmap (u->sq_ring, u->sq_len);
+	close (u->fd);
+}
+
+/* give the kernel what we've queued, and wait for "wait" completions */
+static int
+uring_enter (struct uring *u, unsigned wait)
+{
+	int	r;
+
+	__atomic_store_n (u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	for ( ;; ) {
+		r = syscall (__NR_io_uring_enter, u->fd, u->unsubmitted, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		u->stats->syscalls++;
+		if (r >= 0) {
+			u->unsubmitted -= r;
+			return r;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -1;
+		if (errno != EINTR && wait == 0)
+			return 0;
+	}
+}
+
+/* the next free submission entry, submitting the queue if it's full */
+static struct io_uring_sqe *
+uring_get (struct uring *u, int op, int index)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	while (u->tail - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) >= u->entries)
+		uring_enter (u, 0);
+
+	i = u->tail & *u->sq_mask;
+	sqe = &u->sqes[i];
+	memset (sqe, 0, sizeof *sqe);
+	sqe->user_data = ((uint64_t) index << OP_BITS) | op;
+	u->sq_array[i] = i;
+	u->tail++;
+	u->unsubmitted++;
+	return sqe;
+}
+
+/* the session's connection, as the kernel should know it */
+static void
+set_file (struct io_uring_sqe *sqe, struct fw_session *fsp, int index)
+{
+	if (fixed_files) {
+		sqe->fd = index;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd = fsp->fd;
+}
+
+static int
+register_file (struct uring *u, int index, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset (&up, 0, sizeof up);
+	up.offset = index;
+	up.fds = (uint64_t) (uintptr_t) &fd;
+	u->stats->syscalls++;
+	return syscall (__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+static void
+submit_accept (struct uring *u, struct fw_session *fsp, int index)
+{
+	struct io_uring_sqe *sqe = uring_get (u, OP_ACCEPT, index);
+	struct slot *sl = &slots[index];
+
+	sl->addrlen = sizeof sl->addr;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fsp->listen_fd;
+	sqe->addr = (uint64_t) (uintptr_t) &sl->addr;
+	sqe->addr2 = (uint64_t) (uintptr_t) &sl->addrlen;
+	sl->accepting = 1;
+}
+
+static void
+submit_recv (struct uring *u, struct fw_session *fsp, int index)
+{
+	struct io_uring_sqe *sqe = uring_get (u, OP_RECV, index);
+	struct slot *sl = &slots[index];
+
+	set_file (sqe, fsp, index);
+	sqe->addr = (uint64_t) (uintptr_t) sl->recv;
+	sqe->len = FS_MAXREQUEST - fsp->reqlen;
+	if (fixed_buffers) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = slot_buffer;
+	} else
+		sqe->opcode = IORING_OP_RECV;
+	sl->receiving = 1;
+}
+
+/* send sl->out, and then (if "link") receive the next request */
+static void
+submit_send (struct uring *u, struct fw_session *fsp, int index, int link)
+{
+	struct io_uring_sqe *sqe = uring_get (u, OP_SEND, index);
+	struct slot *sl = &slots[index];
+	struct fw_image *ip = fsp->current;
+
+	set_file (sqe, fsp, index);
+	sqe->addr = (uint64_t) (uintptr_t) sl->out;
+	sqe->len = sl->outlen;
+	if (fixed_buffers) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		if (ip != NULL && sl->out >= ip->data && sl->out < ip->data + ip->size)
+			sqe->buf_index = ip->index;
+		else
+			sqe->buf_index = slot_buffer;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+	sl->sending = 1;
+
+	if (link)
+		submit_recv (u, fsp, index);
+}
+
+/* end the session, once the kernel has finished with it */
+static void
+finish (struct uring *u, struct fw_session *fsp, int index, int status)
+{
+	struct slot *sl = &slots[index];
+
+	fsp->status = status;
+	if (!sl->closing) {
+		sl->closing = 1;
+		fw_session_disarm (fsp);
+		// wake up anything still waiting on it
+		if (fsp->fd >= 0)
+			shutdown (fsp->fd, SHUT_RDWR);
+		else if (fsp->listen_fd >= 0)
+			shutdown (fsp->listen_fd, SHUT_RDWR);
+	}
+	if (sl->accepting || sl->receiving || sl->sending)
+		return;
+
+	if (fixed_files && fsp->fd >= 0)
+		register_file (u, index, -1);
+	fw_session_end (fsp, fsp->status);
+}
+
+/* deal with the requests received so far, and send or receive what's next */
+static void
+advance (struct uring *u, struct fw_session *fsp, int index)
+{
+	struct slot *sl = &slots[index];
+	int	k;
+
+	while ((k = fw_session_next (fsp)) > 0 && fsp->outlen == 0)
+		;
+	if (k < 0) {
+		finish (u, fsp, index, fsp->status);
+		return;
+	}
+	if (k == 0) {
+		submit_recv (u, fsp, index);
+		return;
+	}
+	if (fsp->out == fsp->size) {
+		memcpy (sl->size, fsp->size, sizeof sl->size);
+		sl->out = sl->size;
+	} else
+		sl->out = fsp->out;
+	sl->outlen = fsp->outlen;
+	submit_send (u, fsp, index, fsp->reqlen == 0);
+}
+
+/* one completion */
+static void
+complete (struct uring *u, struct fw_session *fsp, int index, int op, int res)
+{
+	struct slot *sl = &slots[index];
+	struct sockaddr_in addr;
+
+	switch (op) {
+	case OP_ACCEPT:
+		sl->accepting = 0;
+		if (sl->closing) {
+			if (res >= 0)
+				close (res);
+			break;
+		}
+		if (res < 0) {
+			fprintf (stderr, "%s: cannot accept incoming connection on socket: %s\n",
+				__FUNCTION__, strerror (-res));
+			finish (u, fsp, index, FS_READ);
+			return;
+		}
+		close (fsp->listen_fd);		// we only take one
+		u->stats->syscalls++;
+		fsp->listen_fd = -1;
+		addr = sl->addr;
+		fw_session_accepted (fsp, res, &addr);
+		if (fixed_files && register_file (u, index, res) < 0) {
+			fprintf (stderr, "%s: cannot register the connection: %s\n",
+				__FUNCTION__, strerror (errno));
+			finish (u, fsp, index, FS_READ);
+			return;
+		}
+		submit_recv (u, fsp, index);
+		return;
+
+	case OP_RECV:
+		sl->receiving = 0;
+		if (sl->closing)
+			break;
+		if (res == -ECANCELED) {	// the send before it was short
+			if (!sl->sending)
+				advance (u, fsp, index);
+			return;
+		}
+		if (res < 0) {
+			fprintf (stderr, "%s: error reading from socket: %s\n",
+				__FUNCTION__, strerror (-res));
+			finish (u, fsp, index, FS_READ);
+			return;
+		}
+		trace_data (fsp->fd, TR_RECV, sl->recv, res);
+		PROFILE_IO (fsp->profile, reads, rbytes, res);
+		if (fw_session_input (fsp, sl->recv, res) < 0 || res == 0) {
+			finish (u, fsp, index, fsp->status);
+			return;
+		}
+		advance (u, fsp, index);
+		return;
+
+	case OP_SEND:
+		sl->sending = 0;
+		if (sl->closing)
+			break;
+		if (res <= 0) {
+			fprintf (stderr, "%s: error writing to %s: %s\n",
+				__FUNCTION__, fsp->name, strerror (res < 0 ? -res : EPIPE));
+			finish (u, fsp, index, FS_SEND);
+			return;
+		}
+		trace_data (fsp->fd, TR_SEND, sl->out, res);
+		PROFILE_IO (fsp->profile, writes, wbytes, res);
+		sl->out += res;
+		if ((sl->outlen -= res) > 0) {
+			submit_send (u, fsp, index, 0);
+			return;
+		}
+		if (!sl->receiving)
+			advance (u, fsp, index);
+		return;
+	}
+
+	// the session is closing - end it once nothing is left in progress
+	finish (u, fsp, index, fsp->status);
+}
+
+/*
+ *	Do the downloads with io_uring.  Returns 0 when they are all done,
+ *	or -1 without having done anything if io_uring can't be used.
+ */
+int
+serve_uring (struct fw_session **sessions, int n, struct fw_stats *stats)
+{
+	struct uring ring, *u = &ring;
+	struct fw_image *ip;
+	struct iovec *iov;
+	struct __kernel_timespec tick = { 1, 0 };
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned entries, head, tail;
+	int	*fds;
+	int	i, nbuf, remaining;
+	uint64_t data;
+	double	since = 0;
+	struct fw_session *fsp;
+
+	for (entries = 8; entries < 2 * (unsigned) n + 2; entries *= 2)
+		;
+	if (uring_setup (u, entries) < 0)
+		return -1;
+	u->stats = stats;
+	stats->syscalls++;
+
+	if ((slots = calloc (n, sizeof *slots)) == NULL ||
+	    (fds = malloc (n * sizeof *fds)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+
+	// register the images, and the slots after them
+	for (nbuf = 1, ip = fw_image_list (); ip != NULL; ip = ip->next)
+		nbuf++;
+	if ((iov = calloc (nbuf, sizeof *iov)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	for (ip = fw_image_list (); ip != NULL; ip = ip->next) {
+		iov[ip->index].iov_base = ip->data;
+		iov[ip->index].iov_len = ip->size > 0 ? ip->size : 1;
+	}
+	slot_buffer = nbuf - 1;
+	iov[slot_buffer].iov_base = slots;
+	iov[slot_buffer].iov_len = n * sizeof *slots;
+	fixed_buffers = syscall (__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, nbuf) == 0;
+	stats->syscalls++;
+	free (iov);
+
+	// and room for the connections, as they arrive
+	for (i = 0; i < n; i++)
+		fds[i] = -1;
+	fixed_files = syscall (__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds, n) == 0;
+	stats->syscalls++;
+	free (fds);
+
+	if (debug || verbose)
+		printf ("io_uring: %u entries, %s buffers, %s files\n", u->entries,
+			fixed_buffers ? "fixed" : "plain", fixed_files ? "fixed" : "plain");
+
+	for (i = remaining = 0; i < n; i++) {
+		if (sessions[i]->done)
+			continue;
+		submit_accept (u, sessions[i], i);
+		remaining++;
+	}
+	sqe = uring_get (u, OP_TICK, 0);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) (uintptr_t) &tick;
+	sqe->len = 1;
+
+	while (remaining > 0) {
+		if (profiling)
+			since = profile_clock ();
+		if (uring_enter (u, 1) < 0) {
+			perror ("io_uring_enter");
+			break;
+		}
+		profile_batch_polled (sessions, n, since);
+
+		head = *u->cq_head;
+		tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+		for ( ; head != tail; head++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			data = cqe->user_data;
+			i = data >> OP_BITS;
+
+			if ((data & OP_MASK) == OP_TICK) {
+				// see who has kept us waiting too long
+				while ((fsp = fw_session_stalled ()) != NULL)
+					finish (u, fsp, fsp->index, FS_READ);
+				sqe = uring_get (u, OP_TICK, 0);
+				sqe->opcode = IORING_OP_TIMEOUT;
+				sqe->addr = (uint64_t) (uintptr_t) &tick;
+				sqe->len = 1;
+				continue;
+			}
+
+			complete (u, sessions[i], i, data & OP_MASK, cqe->res);
+		}
+		__atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+
+		for (i = remaining = 0; i < n; i++)
+			remaining += !sessions[i]->done;
+	}
+
+	// anything left (if io_uring failed) is abandoned
+	for (i = 0; i < n; i++) {
+		if (!sessions[i]->done)
+			fw_session_end (sessions[i], FS_READ);
+	}
+	uring_close (u);
+	free (slots);
+	slots = NULL;
+	return 0;
+}
+
+/* what we keep for each session */
+size_t
+uring_session_bytes (void)
+{
+	return sizeof (struct slot);
+}
+
+#else /* __linux__ */
+
+int
+serve_uring (struct fw_session **sessions, int n, struct fw_stats *stats)
+{
+	return -1;
+}
+
+size_t
+uring_session_bytes (void)
+{
+	return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,168 @@
+/*
+ *	What's in a firmware image, from the image itself: that it's an
+ *	Espressif (ESP8266 or ESP32) image, as every Ecowitt gateway's
+ *	firmware is, and which models and version it names - so that the
+ *	wrong image is refused before the device has spent minutes
+ *	preparing its flash and receiving it, rather than afterwards.
+ *
+ *	This is done once for each image, as it's read (fw_image_load()).
+ *	Only a name that the image itself gives is believed; the name of the
+ *	file is never looked at.  An image that doesn't name any model can
+ *	only be checked for being firmware at all.
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	ESP_MAGIC	0xe9		// the image header of the ESP SDKs
+#define	ESP_OTA_MAGIC	0xea		// ESP8266 "user1.bin", "user2.bin" (boot v1.2+)
+#define	ESP_MAXSEGMENTS	16
+#define	ESP_APP_MAGIC	0xabcd5432	// ESP-IDF's esp_app_desc_t, at ESP_APP_DESC
+#define	ESP_APP_DESC	32		// after the 24-byte header and the first segment's 8
+
+static const char *esp_kind (const uchar *p, size_t size);
+static void	add_model (struct fw_image *ip, const char *model, int len);
+static int	base_length (const char *model);
+
+
+static uint32_t
+get32 (const uchar *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* what the header says that the image is for, or NULL if it isn't one */
+static const char *
+esp_kind (const uchar *p, size_t size)
+{
+	uint32_t entry;
+
+	if (size < ESP_APP_DESC)
+		return NULL;
+	if (p[0] == ESP_OTA_MAGIC)
+		return p[1] == 4 ? "ESP8266" : NULL;
+	if (p[0] != ESP_MAGIC || p[1] == 0 || p[1] > ESP_MAXSEGMENTS)
+		return NULL;
+
+	// the entry point is in the instruction RAM or flash
+	entry = get32 (p + 4);
+	if (entry >> 24 != 0x40 && entry >> 24 != 0x42)
+		return NULL;
+	if (entry >> 16 == 0x4010)
+		return "ESP8266";
+	switch (p[12] | p[13] << 8) {		// ESP32's chip ID
+	case 0:		return "ESP32";
+	case 2:		return "ESP32-S2";
+	case 5:		return "ESP32-C3";
+	case 9:		return "ESP32-S3";
+	}
+	return "ESP32 (another chip)";
+}
+
+/* another model that the image names, if we haven't seen it */
+static void
+add_model (struct fw_image *ip, const char *model, int len)
+{
+	int	i;
+
+	if (len >= (int) sizeof ip->model[0] || ip->nmodels == IMAGE_MAXMODELS)
+		return;
+	for (i = 0; i < ip->nmodels; i++) {
+		if (strncasecmp (ip->model[i], model, len) == 0 && ip->model[i][len] == '\0')
+			return;
+	}
+	snprintf (ip->model[ip->nmodels++], sizeof ip->model[0], "%.*s", len, model);
+}
+
+/*
+ *	Look at the image: its header, and the "MODEL_Vx.y.z" strings that
+ *	the firmware reports itself with (and ESP-IDF's description of the
+ *	application, if it has one).
+ */
+void
+fw_image_inspect (struct fw_image *ip)
+{
+	const uchar *data = ip->data, *end = ip->data + ip->size;
+	const uchar *v, *m, *e;
+	int	digits;
+
+	ip->kind = esp_kind (data, ip->size);
+	ip->nmodels = 0;
+	ip->version[0] = '\0';
+
+	if (ip->kind != NULL && data[0] == ESP_MAGIC && get32 (data + ESP_APP_DESC) == ESP_APP_MAGIC &&
+	    ip->size > ESP_APP_DESC + 80) {
+		snprintf (ip->version, sizeof ip->version, "%.31s", data + ESP_APP_DESC + 16);
+		for (e = m = data + ESP_APP_DESC + 48; e < m + 31 && isalnum (*e); e++)
+			;
+		if (e - m >= 4 && *e == '\0' && isupper (*m))
+			add_model (ip, (const char *) m, e - m);
+	}
+
+	// "GW1100A_V2.3.3", or "WS3900-V1.0.2": capitals and digits, then the version
+	for (v = data + 1; ip->size > 8 && v < end - 4 &&
+	    (v = memchr (v, 'V', end - 4 - v)) != NULL; v++) {
+		if ((v[-1] != '_' && v[-1] != '-') || !isdigit (v[1]))
+			continue;
+		for (e = v + 1; e < end && (isdigit (*e) || *e == '.'); e++)
+			;
+		while (e[-1] == '.')
+			e--;
+		if (memchr (v, '.', e - v) == NULL)
+			continue;
+		for (m = v - 1, digits = 0; m > data && (isupper (m[-1]) || isdigit (m[-1])) &&
+		    v - 1 - m < (int) sizeof ip->model[0] - 1; m--)
+			digits += isdigit (m[-1]) != 0;
+		if (v - 1 - m < 4 || !digits || !isupper (*m) || (m > data && isalnum (m[-1])))
+			continue;
+		add_model (ip, (const char *) m, v - 1 - m);
+		if (ip->version[0] == '\0')
+			snprintf (ip->version, sizeof ip->version, "%.*s", (int) (e - v), v);
+	}
+
+	if (verbose)
+		printf ("firmware file \"%s\": %s image%s%s%s%s%s\n", ip->source,
+			ip->kind != NULL ? ip->kind : "not an ESP",
+			ip->nmodels > 0 ? ", for " : "", ip->nmodels > 0 ? ip->model[0] : "",
+			ip->nmodels > 1 ? " (and others)" : "",
+			ip->version[0] ? " " : "", ip->version);
+}
+
+/* the model, less a trailing letter for the frequency band ("GW1100C") */
+static int
+base_length (const char *model)
+{
+	int	n = strlen (model);
+
+	if (n > 1 && isalpha ((unsigned char) model[n - 1]) && isdigit ((unsigned char) model[n - 2]))
+		n--;
+	return n;
+}
+
+/*
+ *	Why the image can't be sent to this model of device, or NULL if it
+ *	can (or we can't tell).  The model is the one from the device's
+ *	firmware version ("GW1100C" from "GW1100C_V2.1.8"), or "" if that
+ *	isn't known.
+ */
+const char *
+fw_image_refuses (struct fw_image *ip, const char *model)
+{
+	int	i, n;
+
+	if (ip->kind == NULL)
+		return "it isn't an ESP firmware image";
+	if (model[0] == '\0' || ip->nmodels == 0)
+		return NULL;
+	n = base_length (model);
+	for (i = 0; i < ip->nmodels; i++) {
+		if (base_length (ip->model[i]) == n && strncasecmp (ip->model[i], model, n) == 0)
+			return NULL;
+	}
+	return "it is firmware for another model";
+}
@@ -0,0 +1,272 @@
+/*
+ *	Reading a firmware image into memory - as it is, or compressed with
+ *	zstd - and checking it against its MD5 checksum on the way.
+ *
+ *	A compressed image is "name.bin.zst", next to or instead of
+ *	"name.bin", and is asked for by the name that it had before it was
+ *	compressed.  It's decompressed once, as it's read, by zstd(1) - so
+ *	the size that the devices are sent, and the checksum, are those of
+ *	the image itself.
+ *
+ *	The checksum is the one in the image's name, as Ecowitt name them
+ *	("GW1100-V2.3.3-818c81b00866afbaf227d21d1b44e4ae.bin"), or else the
+ *	one in the MANIFEST that download-firmware.sh leaves beside them.
+ *	If there's neither, the image is taken as it is.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	ZSTD_MAGIC	0xfd2fb528
+
+static size_t	zstd_content_size (int fd);
+static int	zstd_open (const char *source, pid_t *pidp);
+static int	expected_md5 (const char *path, char *hex);
+
+
+/*
+ *	The file that the image "path" is in: "path" itself if it's there,
+ *	or else "path.zst" (in buf).  NULL if neither is.
+ */
+const char *
+fw_image_source (const char *path, char *buf, size_t buflen)
+{
+	struct stat stb;
+
+	if (stat (path, &stb) == 0 && S_ISREG (stb.st_mode))
+		return path;
+	snprintf (buf, buflen, "%s" IMAGE_ZSTD, path);
+	if (stat (buf, &stb) == 0 && S_ISREG (stb.st_mode))
+		return buf;
+	return NULL;
+}
+
+/*
+ *	The uncompressed size, from the header of the first frame, if the
+ *	compressor put it there (zstd(1) does) - or 0 if we can't tell.
+ *	The file is left where it was.
+ */
+static size_t
+zstd_content_size (int fd)
+{
+	static const int didsize[4] = { 0, 1, 2, 4 };
+	uchar	h[18];
+	int	n, fhd, single, fcs, at, i;
+	uint64_t size = 0;
+
+	n = pread (fd, h, sizeof h, 0);
+	if (n < 6 || (h[0] | h[1] << 8 | h[2] << 16 | (uint32_t) h[3] << 24) != ZSTD_MAGIC)
+		return 0;
+	fhd = h[4];
+	single = (fhd >> 5) & 1;
+	fcs = fhd >> 6 == 0 ? single : 1 << (fhd >> 6);
+	at = 5 + !single + didsize[fhd & 3];
+	if (fcs == 0 || at + fcs > n)
+		return 0;
+	for (i = fcs - 1; i >= 0; i--)
+		size = size << 8 | h[at + i];
+	if (fcs == 2)
+		size += 256;
+	return size < IMAGE_MAXSIZE ? size : 0;
+}
+
+/* start zstd(1) decompressing the file - returns the pipe to read */
+static int
+zstd_open (const char *source, pid_t *pidp)
+{
+	int	p[2];
+
+	if (pipe (p) < 0) {
+		fprintf (stderr, "%s: pipe failed: %s\n", __FUNCTION__, strerror (errno));
+		return -1;
+	}
+	if ((*pidp = fork ()) < 0) {
+		fprintf (stderr, "%s: fork failed: %s\n", __FUNCTION__, strerror (errno));
+		close (p[0]);
+		close (p[1]);
+		return -1;
+	}
+	if (*pidp == 0) {
+		dup2 (p[1], 1);
+		close (p[0]);
+		close (p[1]);
+		execlp ("zstd", "zstd", "-d", "-c", "-q", "--", source, (char *) NULL);
+		fprintf (stderr, "%s: cannot run zstd to decompress \"%s\": %s\n",
+			progname, source, strerror (errno));
+		_exit (127);
+	}
+	close (p[1]);
+	return p[0];
+}
+
+/*
+ *	The MD5 that the image "path" should have - from its name, or its
+ *	directory's MANIFEST - in hex.  Returns 0, or -1 if it isn't known.
+ */
+static int
+expected_md5 (const char *path, char *hex)
+{
+	const char *base, *dot;
+	char	manifest[1024];
+	char	line[1024];
+	char	sum[64], name[1024];
+	FILE	*fp;
+	int	i;
+
+	base = (base = strrchr (path, '/')) != NULL ? base + 1 : path;
+
+	// "...-<32 hex digits>.bin" or "..._<32 hex digits>.bin"
+	if ((dot = strrchr (base, '.')) != NULL && dot - base > 33 &&
+	    (dot[-33] == '-' || dot[-33] == '_')) {
+		for (i = 0; i < 32 && isxdigit ((unsigned char) dot[i - 32]); i++)
+			hex[i] = tolower ((unsigned char) dot[i - 32]);
+		if (i == 32) {
+			hex[32] = '\0';
+			return 0;
+		}
+	}
+
+	// "<md5>  <name>", as "md5sum -c" reads it
+	snprintf (manifest, sizeof manifest, "%.*sMANIFEST", (int) (base - path), path);
+	if ((fp = fopen (manifest, "r")) == NULL)
+		return -1;
+	while (fgets (line, sizeof line, fp) != NULL) {
+		if (sscanf (line, "%63s%*[ *]%1023[^\n]", sum, name) == 2 &&
+		    strlen (sum) == 32 && strcmp (name, base) == 0) {
+			for (i = 0; i <= 32; i++)
+				hex[i] = tolower ((unsigned char) sum[i]);
+			fclose (fp);
+			return 0;
+		}
+	}
+	fclose (fp);
+	return -1;
+}
+
+/*
+ *	Read the image "path" (or "path.zst") into ip->data, and check it.
+ *	Returns 0, or -1 (with a message).
+ */
+int
+fw_image_read (struct fw_image *ip, const char *path)
+{
+	struct stat stb;
+	struct md5 md5;
+	char	zpath[1024], plain[1024];
+	char	want[33], got[33];
+	const char *source;
+	size_t	have, room, n;
+	ssize_t	r;
+	uchar	*data;
+	pid_t	pid = 0;
+	int	fd, zfd, status, compressed;
+
+	if ((source = fw_image_source (path, zpath, sizeof zpath)) == NULL) {
+		fprintf (stderr, "%s: cannot open firmware file \"%s\": %s\n",
+			progname, path, strerror (ENOENT));
+		return -1;
+	}
+	if ((fd = open (source, O_RDONLY)) < 0) {
+		fprintf (stderr, "%s: cannot open firmware file \"%s\": %s\n",
+			progname, source, strerror (errno));
+		return -1;
+	}
+	// it may have been asked for by its compressed name, too
+	snprintf (plain, sizeof plain, "%s", path);
+	n = strlen (plain);
+	if ((compressed = n > strlen (IMAGE_ZSTD) &&
+	    strcmp (plain + n - strlen (IMAGE_ZSTD), IMAGE_ZSTD) == 0))
+		plain[n - strlen (IMAGE_ZSTD)] = '\0';
+	compressed |= source != path;
+
+	if (fstat (fd, &stb) < 0) {
+		fprintf (stderr, "%s: fstat failed: %s\n",
+			__FUNCTION__, strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	// as it is, we know how big it is; compressed, we may do
+	room = stb.st_size;
+	if (compressed) {
+		if ((room = zstd_content_size (fd)) == 0)
+			room = stb.st_size * 4 + FS_CHUNK;
+		zfd = zstd_open (source, &pid);
+		close (fd);
+		if ((fd = zfd) < 0)
+			return -1;
+	}
+
+	if ((data = malloc (room + 1)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	md5_init (&md5);
+	for (have = 0; ; ) {
+		// one byte more than we expect, to see that it really ends there
+		if ((r = read (fd, data + have, room + 1 - have)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		md5_update (&md5, data + have, r);
+		if ((have += r) <= room)
+			continue;
+		if (!compressed || room >= IMAGE_MAXSIZE)
+			break;
+		room = room * 2 < IMAGE_MAXSIZE ? room * 2 : IMAGE_MAXSIZE;
+		if ((data = realloc (data, room + 1)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+	}
+	close (fd);
+	status = 0;
+	if (pid > 0 && waitpid (pid, &status, 0) < 0)
+		status = -1;
+
+	if (r < 0 || status != 0 || have > room || (!compressed && have < room)) {
+		if (have > room)
+			fprintf (stderr, "%s: firmware file \"%s\" is %s\n", progname, source,
+				!compressed ? "still being written" : "too big to be firmware");
+		else if (r < 0)
+			fprintf (stderr, "%s: error reading firmware file \"%s\": %s\n",
+				progname, source, strerror (errno));
+		else if (compressed)
+			fprintf (stderr, "%s: cannot decompress firmware file \"%s\"\n",
+				progname, source);
+		else
+			fprintf (stderr, "%s: error reading firmware file \"%s\": it got shorter\n",
+				progname, source);
+		free (data);
+		return -1;
+	}
+
+	md5_final (&md5, got);
+	if (expected_md5 (plain, want) == 0 && strcmp (want, got) != 0) {
+		fprintf (stderr, "%s: firmware file \"%s\" is damaged: its MD5 is %s, not %s\n",
+			progname, source, got, want);
+		free (data);
+		return -1;
+	}
+	if (verbose)
+		printf ("read firmware file \"%s\": %ld bytes, MD5 %s\n",
+			source, (long) have, got);
+
+	if ((ip->source = strdup (source)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (1);
+	}
+	ip->data = data;
+	ip->size = have;
+	return 0;
+}
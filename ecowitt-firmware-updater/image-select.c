@@ -0,0 +1,207 @@
+/*
+ *	Choosing the firmware image for a device from the "firmware-info"
+ *	catalog - the same catalog, and the same rules, that info.php uses
+ *	to tell the devices which version they should run.  The catalog is
+ *	read by ../ecowitt-web-server/firmware-info.c.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "ecowitt-firmware-updater.h"
+#include "firmware-info.h"
+
+
+/*
+ *	Split the reply to CMD_READ_FIRMWARE_VERSION - e.g. "GW1100C_V2.1.8",
+ *	or "EasyWeatherV1.2.0" - into the model and the version.  The version
+ *	is the last "V" (or "v") that is followed by a digit, onwards.
+ *
+ *	Returns 0, or -1 if there's no version in it.
+ */
+int
+parse_firmware_version (const char *s, int len, char *model, size_t modellen,
+	char *version, size_t versionlen)
+{
+	int	i, m;
+
+	for (i = len - 2; i >= 0; i--) {
+		if ((s[i] == 'V' || s[i] == 'v') && isdigit ((unsigned char) s[i + 1]))
+			break;
+	}
+	if (i < 0)
+		return -1;
+
+	// the model is everything before that, less any "_" separator
+	for (m = i; m > 0 && (s[m - 1] == '_' || s[m - 1] == ' '); )
+		m--;
+	snprintf (model, modellen, "%.*s", m, s);
+	snprintf (version, versionlen, "%.*s", len - i, s + i);
+	return 0;
+}
+
+/*
+ *	The full path of a file named in the catalog, and make sure it's
+ *	there - or compressed, as "file.zst".
+ */
+static int
+image_path (const char *imagedir, const char *file, char *path, size_t pathlen)
+{
+	char	zpath[1024];
+
+	if (file[0] == '/' || imagedir == NULL)
+		snprintf (path, pathlen, "%s", file);
+	else
+		snprintf (path, pathlen, "%s/%s", imagedir, file);
+
+	if (fw_image_source (path, zpath, sizeof zpath) == NULL) {
+		fprintf (stderr, "%s: firmware file \"%s\" is listed in the catalog, but isn't there\n",
+			progname, path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	The device's model in the catalog.  The device's model may have a
+ *	trailing letter for its frequency band ("GW1100C") that the catalog
+ *	leaves off ("GW1100"), so that's tried too.  NULL (with a message)
+ *	if it isn't there.
+ */
+static struct fw_model *
+catalog_model (struct fw_catalog *cp, const char *model)
+{
+	struct fw_model *mp;
+	char	base[64];
+	int	n;
+
+	if ((mp = fw_find_model (cp, model)) == NULL) {
+		n = strlen (model);
+		if (n > 1 && n < (int) sizeof base && isalpha ((unsigned char) model[n - 1]) &&
+		    isdigit ((unsigned char) model[n - 2])) {
+			snprintf (base, sizeof base, "%.*s", n - 1, model);
+			mp = fw_find_model (cp, base);
+		}
+	}
+	if (mp == NULL)
+		fprintf (stderr, "%s: model \"%s\" isn't in the firmware catalog\n",
+			progname, model);
+	return mp;
+}
+
+/* the file(s) for this version, in imagedir - 0, or -1 with a message */
+static int
+version_files (struct fw_model *mp, const char *imagedir, const char *version,
+	struct image_selection *sp)
+{
+	struct fw_version *vp;
+
+	snprintf (sp->version, sizeof sp->version, "%s", version);
+	if ((vp = fw_find_version (mp, version)) == NULL || vp->file1 == NULL) {
+		fprintf (stderr, "%s: no firmware file is listed for %s version %s\n",
+			progname, mp->name, version);
+		return -1;
+	}
+	if (image_path (imagedir, vp->file1, sp->file1, sizeof sp->file1) < 0)
+		return -1;
+	if (vp->file2 != NULL &&
+	    image_path (imagedir, vp->file2, sp->file2, sizeof sp->file2) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ *	Find what the device should be running: the version wanted for its
+ *	MAC address (or the default wanted version, or the newest listed),
+ *	and the file(s) for that version, in imagedir.
+ *
+ *	Returns 1 if the device already has that version, 0 with *sp filled
+ *	in if it should be updated, or -1 (with a message) if we can't tell.
+ */
+int
+select_image (struct fw_catalog *cp, const char *imagedir, const char *model,
+	const char *mac, const char *current, struct image_selection *sp)
+{
+	struct fw_model *mp;
+	const char *want;
+	char	nmac[32];
+
+	memset (sp, 0, sizeof *sp);
+
+	if ((mp = catalog_model (cp, model)) == NULL)
+		return -1;
+
+	fw_normalize_mac (mac, nmac, sizeof nmac);
+	want = fw_wanted_version (mp, nmac);
+	if (want == NULL || *want == '\0') {
+		fprintf (stderr, "%s: no firmware versions are listed for model \"%s\"\n",
+			progname, mp->name);
+		return -1;
+	}
+	snprintf (sp->version, sizeof sp->version, "%s", want);
+
+	// the same test as info.php uses
+	if (strcasecmp (current, want) == 0)
+		return 1;
+
+	return version_files (mp, imagedir, want, sp);
+}
+
+/* the file(s) of one version of this model - 0, or -1 with a message */
+int
+select_version (struct fw_catalog *cp, const char *imagedir, const char *model,
+	const char *version, struct image_selection *sp)
+{
+	struct fw_model *mp;
+
+	memset (sp, 0, sizeof *sp);
+	if ((mp = catalog_model (cp, model)) == NULL)
+		return -1;
+	return version_files (mp, imagedir, version, sp);
+}
+
+/*
+ *	Find what the device should go back to, for a rollback: "previous",
+ *	the version that it ran before this one (from its history - see
+ *	device-history.c), if the catalog still has the file(s) for it, or
+ *	else the newest version listed that is older than "current".
+ *
+ *	Returns 0 with *sp filled in, or -1 (with a message) if there's
+ *	nothing to go back to.
+ */
+int
+select_previous (struct fw_catalog *cp, const char *imagedir, const char *model,
+	const char *current, const char *previous, struct image_selection *sp)
+{
+	struct fw_model *mp;
+	struct fw_version *vp, *best = NULL;
+	int	i;
+
+	memset (sp, 0, sizeof *sp);
+	if ((mp = catalog_model (cp, model)) == NULL)
+		return -1;
+
+	if (previous != NULL) {
+		if ((vp = fw_find_version (mp, previous)) != NULL && vp->file1 != NULL)
+			return version_files (mp, imagedir, previous, sp);
+		fprintf (stderr, "%s: %s ran %s before %s, but the catalog has no file for it\n",
+			progname, model, previous, current);
+	}
+
+	for (i = 0; i < mp->nversions; i++) {
+		vp = &mp->versions[i];
+		if (vp->file1 != NULL && fw_version_compare (vp->version, current) < 0 &&
+		    (best == NULL || fw_version_compare (vp->version, best->version) > 0))
+			best = vp;
+	}
+	if (best == NULL) {
+		fprintf (stderr, "%s: no version of %s older than %s is listed in the catalog\n",
+			progname, mp->name, current);
+		return -1;
+	}
+	return version_files (mp, imagedir, best->version, sp);
+}
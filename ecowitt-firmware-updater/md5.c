@@ -0,0 +1,157 @@
+/*
+ *	MD5 (RFC 1321) - only to check the firmware images against the
+ *	checksums that Ecowitt publish for them, so it's the plain version,
+ *	fed a piece at a time as the image is read.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define	G(x, y, z)	((y) ^ ((z) & ((x) ^ (y))))
+#define	H(x, y, z)	((x) ^ (y) ^ (z))
+#define	I(x, y, z)	((y) ^ ((x) | ~(z)))
+
+#define	STEP(f, a, b, c, d, x, t, s) \
+	(a) += f ((b), (c), (d)) + (x) + (t); \
+	(a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+	(a) += (b)
+
+static void md5_block (struct md5 *mp, const uchar *p);
+
+
+/* one 64-byte block */
+static void
+md5_block (struct md5 *mp, const uchar *p)
+{
+	uint32_t a = mp->h[0], b = mp->h[1], c = mp->h[2], d = mp->h[3];
+	uint32_t x[16];
+	int	i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		x[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+
+	STEP (F, a, b, c, d, x[0], 0xd76aa478, 7);
+	STEP (F, d, a, b, c, x[1], 0xe8c7b756, 12);
+	STEP (F, c, d, a, b, x[2], 0x242070db, 17);
+	STEP (F, b, c, d, a, x[3], 0xc1bdceee, 22);
+	STEP (F, a, b, c, d, x[4], 0xf57c0faf, 7);
+	STEP (F, d, a, b, c, x[5], 0x4787c62a, 12);
+	STEP (F, c, d, a, b, x[6], 0xa8304613, 17);
+	STEP (F, b, c, d, a, x[7], 0xfd469501, 22);
+	STEP (F, a, b, c, d, x[8], 0x698098d8, 7);
+	STEP (F, d, a, b, c, x[9], 0x8b44f7af, 12);
+	STEP (F, c, d, a, b, x[10], 0xffff5bb1, 17);
+	STEP (F, b, c, d, a, x[11], 0x895cd7be, 22);
+	STEP (F, a, b, c, d, x[12], 0x6b901122, 7);
+	STEP (F, d, a, b, c, x[13], 0xfd987193, 12);
+	STEP (F, c, d, a, b, x[14], 0xa679438e, 17);
+	STEP (F, b, c, d, a, x[15], 0x49b40821, 22);
+
+	STEP (G, a, b, c, d, x[1], 0xf61e2562, 5);
+	STEP (G, d, a, b, c, x[6], 0xc040b340, 9);
+	STEP (G, c, d, a, b, x[11], 0x265e5a51, 14);
+	STEP (G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+	STEP (G, a, b, c, d, x[5], 0xd62f105d, 5);
+	STEP (G, d, a, b, c, x[10], 0x02441453, 9);
+	STEP (G, c, d, a, b, x[15], 0xd8a1e681, 14);
+	STEP (G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+	STEP (G, a, b, c, d, x[9], 0x21e1cde6, 5);
+	STEP (G, d, a, b, c, x[14], 0xc33707d6, 9);
+	STEP (G, c, d, a, b, x[3], 0xf4d50d87, 14);
+	STEP (G, b, c, d, a, x[8], 0x455a14ed, 20);
+	STEP (G, a, b, c, d, x[13], 0xa9e3e905, 5);
+	STEP (G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+	STEP (G, c, d, a, b, x[7], 0x676f02d9, 14);
+	STEP (G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+	STEP (H, a, b, c, d, x[5], 0xfffa3942, 4);
+	STEP (H, d, a, b, c, x[8], 0x8771f681, 11);
+	STEP (H, c, d, a, b, x[11], 0x6d9d6122, 16);
+	STEP (H, b, c, d, a, x[14], 0xfde5380c, 23);
+	STEP (H, a, b, c, d, x[1], 0xa4beea44, 4);
+	STEP (H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+	STEP (H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+	STEP (H, b, c, d, a, x[10], 0xbebfbc70, 23);
+	STEP (H, a, b, c, d, x[13], 0x289b7ec6, 4);
+	STEP (H, d, a, b, c, x[0], 0xeaa127fa, 11);
+	STEP (H, c, d, a, b, x[3], 0xd4ef3085, 16);
+	STEP (H, b, c, d, a, x[6], 0x04881d05, 23);
+	STEP (H, a, b, c, d, x[9], 0xd9d4d039, 4);
+	STEP (H, d, a, b, c, x[12], 0xe6db99e5, 11);
+	STEP (H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+	STEP (H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+	STEP (I, a, b, c, d, x[0], 0xf4292244, 6);
+	STEP (I, d, a, b, c, x[7], 0x432aff97, 10);
+	STEP (I, c, d, a, b, x[14], 0xab9423a7, 15);
+	STEP (I, b, c, d, a, x[5], 0xfc93a039, 21);
+	STEP (I, a, b, c, d, x[12], 0x655b59c3, 6);
+	STEP (I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+	STEP (I, c, d, a, b, x[10], 0xffeff47d, 15);
+	STEP (I, b, c, d, a, x[1], 0x85845dd1, 21);
+	STEP (I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+	STEP (I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+	STEP (I, c, d, a, b, x[6], 0xa3014314, 15);
+	STEP (I, b, c, d, a, x[13], 0x4e0811a1, 21);
+	STEP (I, a, b, c, d, x[4], 0xf7537e82, 6);
+	STEP (I, d, a, b, c, x[11], 0xbd3af235, 10);
+	STEP (I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+	STEP (I, b, c, d, a, x[9], 0xeb86d391, 21);
+
+	mp->h[0] += a;
+	mp->h[1] += b;
+	mp->h[2] += c;
+	mp->h[3] += d;
+}
+
+void
+md5_init (struct md5 *mp)
+{
+	mp->h[0] = 0x67452301;
+	mp->h[1] = 0xefcdab89;
+	mp->h[2] = 0x98badcfe;
+	mp->h[3] = 0x10325476;
+	mp->length = 0;
+}
+
+void
+md5_update (struct md5 *mp, const void *data, size_t length)
+{
+	const uchar *p = data;
+	size_t	have = mp->length % 64, n;
+
+	mp->length += length;
+	if (have > 0) {
+		n = 64 - have < length ? 64 - have : length;
+		memcpy (mp->buf + have, p, n);
+		p += n;
+		length -= n;
+		if (have + n < 64)
+			return;
+		md5_block (mp, mp->buf);
+	}
+	for ( ; length >= 64; p += 64, length -= 64)
+		md5_block (mp, p);
+	memcpy (mp->buf, p, length);
+}
+
+/* the checksum, as the 32 lower-case hex digits that md5sum prints */
+void
+md5_final (struct md5 *mp, char *hex)
+{
+	static const uchar pad[64] = { 0x80 };
+	uint64_t bits = mp->length * 8;
+	uchar	len[8];
+	int	i;
+
+	for (i = 0; i < 8; i++)
+		len[i] = bits >> (i * 8);
+	md5_update (mp, pad, 1 + (119 - mp->length % 64) % 64);
+	md5_update (mp, len, 8);
+	for (i = 0; i < 16; i++)
+		sprintf (hex + i * 2, "%02x", (mp->h[i / 4] >> (i % 4 * 8)) & 0xff);
+}
@@ -0,0 +1,22 @@
+/*
+ *	MD5 - see md5.c.  The web server checks the firmware images with it
+ *	too, so it has a header of its own.
+ */
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+struct md5 {
+	uint32_t h[4];
+	uint64_t length;
+	unsigned char buf[64];
+};
+
+void	md5_init (struct md5 *mp);
+void	md5_update (struct md5 *mp, const void *data, size_t length);
+void	md5_final (struct md5 *mp, char *hex);
+
+#endif /* MD5_H */
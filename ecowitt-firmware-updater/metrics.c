@@ -0,0 +1,278 @@
+/*
+ *	Metrics for a long rollout, in the Prometheus text format, from a
+ *	small HTTP server on a local port or a Unix socket ("-M").
+ *
+ *	The counters are in "struct metrics", which the rest of the updater
+ *	adds to as things happen - only ever from the main thread, so each
+ *	change is a plain load and store, with no lock and no system call.
+ *	The server has a thread of its own, which only reads them.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	METRICS_MAXPAGE	8192	// bytes of metrics that we can send
+
+struct metrics metrics;
+
+// the upper bounds of the chunk RTT buckets, in microseconds:
+static const long rtt_bounds[METRIC_RTT_BUCKETS] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000
+};
+
+static const char *phase_names[DL_NPHASES] = {
+	"reply", "connect", "request", "prep", "chunk", "close"
+};
+
+// why a download failed, FS_READ ... FS_STATE:
+static const char *failure_names[FS_STATE + 1] = {
+	[FS_READ] = "read", [FS_UNKNOWN] = "unknown", [FS_SEND] = "send",
+	[FS_NOSTART] = "nostart", [FS_NOCONTINUE] = "nocontinue",
+	[FS_AFTEREND] = "afterend", [FS_STATE] = "state"
+};
+
+static const char *outcome_names[DEV_NOUTCOMES] = {
+	"failed", "checked", "current", "updated", "unverified"
+};
+
+static int	listen_fd = -1;
+static pthread_t server;
+
+
+/* a chunk's round trip - on the per-chunk path, so it's kept cheap */
+void
+metrics_chunk_rtt (long usecs)
+{
+	int	i;
+
+	for (i = 0; i < METRIC_RTT_BUCKETS && usecs > rtt_bounds[i]; i++)
+		;
+	METRIC_ADD (metrics.rtt[i], 1);
+	METRIC_ADD (metrics.rtt_sum, usecs);
+}
+
+static long
+get (atomic_long *m)
+{
+	return atomic_load_explicit (m, memory_order_relaxed);
+}
+
+/* add to the page, if there's room */
+static void
+add (char *page, size_t *len, const char *fmt, ...)
+{
+	va_list	ap;
+	int	n;
+
+	va_start (ap, fmt);
+	n = vsnprintf (page + *len, METRICS_MAXPAGE - *len, fmt, ap);
+	va_end (ap);
+	if (n > 0)
+		*len += n < (int) (METRICS_MAXPAGE - *len) ? n : METRICS_MAXPAGE - *len - 1;
+}
+
+/* everything, in the text format - returns its length */
+static size_t
+render (char *page)
+{
+	static struct timespec last;	// when we were last asked,
+	static long lastbytes;		// ... and what had been sent then
+	struct timespec now;
+	double	secs, rate = 0;
+	long	bytes, count, hits, misses;
+	size_t	len = 0;
+	int	i;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	bytes = get (&metrics.bytes);
+	secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+	if (last.tv_sec != 0 && secs > 0)
+		rate = (bytes - lastbytes) / secs;
+	last = now;
+	lastbytes = bytes;
+
+	add (page, &len, "# HELP ecowitt_updater_sessions_active Firmware downloads in progress.\n"
+		"# TYPE ecowitt_updater_sessions_active gauge\n"
+		"ecowitt_updater_sessions_active %ld\n", get (&metrics.active));
+	add (page, &len, "# HELP ecowitt_updater_sessions Firmware downloads in progress, by what they're waiting for.\n"
+		"# TYPE ecowitt_updater_sessions gauge\n");
+	for (i = DL_CONNECT; i < DL_NPHASES; i++)
+		add (page, &len, "ecowitt_updater_sessions{phase=\"%s\"} %ld\n",
+			phase_names[i], get (&metrics.phase[i]));
+
+	add (page, &len, "# HELP ecowitt_updater_downloads_total Firmware downloads that finished, by status.\n"
+		"# TYPE ecowitt_updater_downloads_total counter\n"
+		"ecowitt_updater_downloads_total{status=\"0\",reason=\"ok\"} %ld\n",
+		get (&metrics.downloads));
+	for (i = FS_READ; i <= FS_STATE; i++)
+		add (page, &len, "ecowitt_updater_downloads_total{status=\"%d\",reason=\"%s\"} %ld\n",
+			i, failure_names[i], get (&metrics.failures[i]));
+	add (page, &len, "# HELP ecowitt_updater_stalls_total Deadlines that passed.\n"
+		"# TYPE ecowitt_updater_stalls_total counter\n"
+		"ecowitt_updater_stalls_total %ld\n"
+		"# HELP ecowitt_updater_retries_total Downloads started again after stalling.\n"
+		"# TYPE ecowitt_updater_retries_total counter\n"
+		"ecowitt_updater_retries_total %ld\n",
+		get (&metrics.stalls), get (&metrics.retries));
+
+	add (page, &len, "# HELP ecowitt_updater_sent_bytes_total Bytes of firmware sent.\n"
+		"# TYPE ecowitt_updater_sent_bytes_total counter\n"
+		"ecowitt_updater_sent_bytes_total %ld\n"
+		"# HELP ecowitt_updater_sent_bytes_per_second Bytes of firmware sent per second, since the last scrape.\n"
+		"# TYPE ecowitt_updater_sent_bytes_per_second gauge\n"
+		"ecowitt_updater_sent_bytes_per_second %.0f\n"
+		"# HELP ecowitt_updater_chunks_total Chunks of firmware sent.\n"
+		"# TYPE ecowitt_updater_chunks_total counter\n"
+		"ecowitt_updater_chunks_total %ld\n",
+		bytes, rate, get (&metrics.chunks));
+
+	add (page, &len, "# HELP ecowitt_updater_chunk_rtt_seconds From sending a chunk to the device asking for the next.\n"
+		"# TYPE ecowitt_updater_chunk_rtt_seconds histogram\n");
+	for (i = count = 0; i < METRIC_RTT_BUCKETS; i++) {
+		count += get (&metrics.rtt[i]);
+		add (page, &len, "ecowitt_updater_chunk_rtt_seconds_bucket{le=\"%g\"} %ld\n",
+			rtt_bounds[i] / 1e6, count);
+	}
+	count += get (&metrics.rtt[i]);
+	add (page, &len, "ecowitt_updater_chunk_rtt_seconds_bucket{le=\"+Inf\"} %ld\n"
+		"ecowitt_updater_chunk_rtt_seconds_sum %g\n"
+		"ecowitt_updater_chunk_rtt_seconds_count %ld\n",
+		count, get (&metrics.rtt_sum) / 1e6, count);
+
+	hits = get (&metrics.image_hits);
+	misses = get (&metrics.image_misses);
+	add (page, &len, "# HELP ecowitt_updater_image_cache_hits_total Images that were already in memory.\n"
+		"# TYPE ecowitt_updater_image_cache_hits_total counter\n"
+		"ecowitt_updater_image_cache_hits_total %ld\n"
+		"# HELP ecowitt_updater_image_cache_misses_total Images that had to be read.\n"
+		"# TYPE ecowitt_updater_image_cache_misses_total counter\n"
+		"ecowitt_updater_image_cache_misses_total %ld\n"
+		"# HELP ecowitt_updater_image_cache_hit_ratio Of the images wanted, those already in memory.\n"
+		"# TYPE ecowitt_updater_image_cache_hit_ratio gauge\n"
+		"ecowitt_updater_image_cache_hit_ratio %g\n",
+		hits, misses, hits + misses > 0 ? (double) hits / (hits + misses) : 0.0);
+
+	add (page, &len, "# HELP ecowitt_updater_devices_total Devices done, by what happened.\n"
+		"# TYPE ecowitt_updater_devices_total counter\n");
+	for (i = 0; i < DEV_NOUTCOMES; i++)
+		add (page, &len, "ecowitt_updater_devices_total{outcome=\"%s\"} %ld\n",
+			outcome_names[i], get (&metrics.devices[i]));
+	return len;
+}
+
+/* answer each request with the metrics - whatever it asked for */
+static void *
+serve_metrics (void *arg)
+{
+	char	request[1024];
+	char	head[256];
+	char	*page;
+	struct timeval tv = { 2, 0 };
+	size_t	len;
+	int	fd, n;
+
+	if ((page = malloc (METRICS_MAXPAGE)) == NULL)
+		return NULL;
+	for ( ;; ) {
+		if ((fd = accept (listen_fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf (stderr, "%s: metrics: accept failed: %s\n",
+				progname, strerror (errno));
+			break;
+		}
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		if (read (fd, request, sizeof request) > 0) {
+			len = render (page);
+			n = snprintf (head, sizeof head, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %ld\r\n"
+				"Connection: close\r\n\r\n", (long) len);
+			if (send (fd, head, n, MSG_NOSIGNAL) == n)	// a scraper that gave up mustn't stop the rollout
+				(void) send (fd, page, len, MSG_NOSIGNAL);
+		}
+		close (fd);
+	}
+	free (page);
+	return NULL;
+}
+
+/*
+ *	Serve the metrics on "where" - "port" or "address:port" (on the
+ *	loopback address unless one is given), or the path of a Unix socket.
+ *	Returns 0, or -1 (with a message).
+ */
+int
+metrics_start (const char *where)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	const char *colon;
+	char	host[64];
+	int	on = 1;
+
+	if (strchr (where, '/') != NULL) {
+		memset (&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		if (strlen (where) >= sizeof sun.sun_path) {
+			fprintf (stderr, "%s: metrics socket path \"%s\" is too long\n",
+				progname, where);
+			return -1;
+		}
+		strcpy (sun.sun_path, where);
+		unlink (where);
+		if ((listen_fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    bind (listen_fd, (struct sockaddr *) &sun, sizeof sun) < 0)
+			goto fail;
+	} else {
+		memset (&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		if ((colon = strrchr (where, ':')) != NULL) {
+			snprintf (host, sizeof host, "%.*s", (int) (colon - where), where);
+			if (inet_aton (host, &sin.sin_addr) == 0) {
+				fprintf (stderr, "%s: bad metrics address \"%s\"\n", progname, host);
+				return -1;
+			}
+			where = colon + 1;
+		}
+		if ((sin.sin_port = htons (atoi (where))) == 0) {
+			fprintf (stderr, "%s: bad metrics port \"%s\"\n", progname, where);
+			return -1;
+		}
+		if ((listen_fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+			goto fail;
+		setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (bind (listen_fd, (struct sockaddr *) &sin, sizeof sin) < 0)
+			goto fail;
+	}
+	if (listen (listen_fd, 8) < 0)
+		goto fail;
+
+	if ((errno = pthread_create (&server, NULL, serve_metrics, NULL)) != 0)
+		goto fail;
+	pthread_detach (server);
+	return 0;
+
+fail:
+	fprintf (stderr, "%s: cannot serve metrics on \"%s\": %s\n",
+		progname, where, strerror (errno));
+	if (listen_fd >= 0)
+		close (listen_fd);
+	listen_fd = -1;
+	return -1;
+}
@@ -0,0 +1,190 @@
+/*
+ *	What each device costs us, for "-P": the system calls made for it,
+ *	and the bytes that each moved, the CPU time and context switches,
+ *	and how much of the time that it took was spent waiting for it.
+ *
+ *	Most of what we do with a device is done with it alone - talking to
+ *	it over the command connection, and waiting for it to come back -
+ *	and that is charged to it whole, between profile_begin() and
+ *	profile_end().  The downloads are served together, so each is
+ *	charged its own reads and writes, and every wait that it was one of
+ *	those waited for; the CPU time and context switches of serving them
+ *	are shared out among them by the reads and writes that each did.
+ *
+ *	The usage is the main thread's, so the metrics server isn't counted -
+ *	except where there's no RUSAGE_THREAD (not Linux), when it's the
+ *	whole process's, and the report says so.
+ */
+
+#define	_GNU_SOURCE		// for RUSAGE_THREAD on Linux
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#if defined (RUSAGE_THREAD)
+# define USAGE_WHO	RUSAGE_THREAD
+# define USAGE_WHOSE	""
+#elif defined (__linux__)
+# error "no RUSAGE_THREAD - is _GNU_SOURCE defined before the #includes?"
+#else
+# define USAGE_WHO	RUSAGE_SELF	// near enough, with -M off
+# define USAGE_WHOSE	" (the whole process's)"
+#endif
+
+int	profiling = 0;			// -P
+struct profile *profile_current;	// the device that we're working for, if any
+
+static void	snapshot (struct profile_mark *mp);
+
+
+/* seconds, for timing the waits - on the same clock as fsp->finished */
+double
+profile_clock (void)
+{
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static void
+snapshot (struct profile_mark *mp)
+{
+	struct rusage ru;
+
+	memset (&ru, 0, sizeof ru);
+	getrusage (USAGE_WHO, &ru);
+	mp->when = profile_clock ();
+	mp->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	mp->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	mp->nvcsw = ru.ru_nvcsw;
+	mp->nivcsw = ru.ru_nivcsw;
+}
+
+/* what we do from now on is for this device alone */
+void
+profile_begin (struct profile *pp, struct profile_mark *mp)
+{
+	if (!profiling)
+		return;
+	snapshot (mp);
+	profile_current = pp;
+}
+
+/* ... until now */
+void
+profile_end (struct profile_mark *mp)
+{
+	struct profile *pp = profile_current;
+	struct profile_mark now;
+
+	if (pp == NULL)
+		return;
+	snapshot (&now);
+	pp->user += now.user - mp->user;
+	pp->sys += now.sys - mp->sys;
+	pp->nvcsw += now.nvcsw - mp->nvcsw;
+	pp->nivcsw += now.nivcsw - mp->nivcsw;
+	pp->wall += now.when - mp->when;
+	profile_current = NULL;
+}
+
+/*
+ *	The device kept us waiting since "since" (from profile_clock()) -
+ *	in poll(), if "polled", or else connecting or sleeping.
+ */
+void
+profile_waited (double since, int polled)
+{
+	if (profile_current == NULL)
+		return;
+	profile_current->polls += polled;
+	profile_current->wait += profile_clock () - since;
+}
+
+/* these downloads are being served together, from now on */
+void
+profile_batch_begin (struct fw_session **sessions, int n, struct profile_mark *mp)
+{
+	struct profile *pp;
+	int	i;
+
+	if (!profiling)
+		return;
+	snapshot (mp);
+	for (i = 0; i < n; i++) {
+		if ((pp = sessions[i]->profile) != NULL)
+			pp->mark = pp->reads + pp->writes;
+	}
+}
+
+/* we waited for all of those still going, since "since" */
+void
+profile_batch_polled (struct fw_session **sessions, int n, double since)
+{
+	struct profile *pp;
+	double	waited;
+	int	i;
+
+	if (!profiling)
+		return;
+	waited = profile_clock () - since;
+	for (i = 0; i < n; i++) {
+		if (!sessions[i]->done && (pp = sessions[i]->profile) != NULL) {
+			pp->polls++;
+			pp->wait += waited;
+		}
+	}
+}
+
+/* they're all done - share out what serving them cost */
+void
+profile_batch_end (struct fw_session **sessions, int n, struct profile_mark *mp)
+{
+	struct profile_mark now;
+	struct fw_session *fsp;
+	struct profile *pp;
+	long	calls = 0;
+	double	share;
+	int	i;
+
+	if (!profiling)
+		return;
+	snapshot (&now);
+	for (i = 0; i < n; i++) {
+		if ((pp = sessions[i]->profile) != NULL)
+			calls += pp->reads + pp->writes - pp->mark;
+	}
+	for (i = 0; i < n; i++) {
+		fsp = sessions[i];
+		if ((pp = fsp->profile) == NULL)
+			continue;
+		share = calls > 0 ? (double) (pp->reads + pp->writes - pp->mark) / calls : 1.0 / n;
+		pp->user += (now.user - mp->user) * share;
+		pp->sys += (now.sys - mp->sys) * share;
+		pp->nvcsw += (now.nvcsw - mp->nvcsw) * share + 0.5;
+		pp->nivcsw += (now.nivcsw - mp->nivcsw) * share + 0.5;
+		if (fsp->finished.tv_sec != 0)
+			pp->wall += fsp->finished.tv_sec + fsp->finished.tv_usec / 1e6 - mp->when;
+		else
+			pp->wall += now.when - mp->when;
+	}
+}
+
+/* the report's line about it */
+void
+profile_report (struct profile *pp)
+{
+	printf ("%20s reads %ld (%ld bytes each), writes %ld (%ld bytes each), polls %ld;"
+		" CPU%s %.3fs user, %.3fs sys; %ld voluntary, %ld involuntary context switches;"
+		" %.2fs waiting for the device, %.3fs our own\n", "",
+		pp->reads, pp->reads > 0 ? pp->rbytes / pp->reads : 0,
+		pp->writes, pp->writes > 0 ? pp->wbytes / pp->writes : 0,
+		pp->polls, USAGE_WHOSE, pp->user, pp->sys, pp->nvcsw, pp->nivcsw,
+		pp->wait, pp->wall > pp->wait ? pp->wall - pp->wait : 0.0);
+}
@@ -0,0 +1,294 @@
+/*
+ *	Table-driven decoding of the replies from an Ecowitt device.
+ *
+ *	The layout of each reply is described in reply-layouts.def.  That
+ *	file is included here more than once, with the macros defined
+ *	differently each time, so that the C preprocessor generates:
+ *
+ *	- a straight-line decoder function for each reply layout,
+ *	- reply_layouts[], indexed directly by the command byte, and
+ *	- live_items[], indexed directly by the live data item number.
+ *
+ *	Nothing here allocates memory - decoded fields are stored into the
+ *	caller's struct reply, pointing back into the packet where needed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ecowitt-firmware-updater.h"
+
+
+/*
+ *	Macros for pulling the various types of values from the packet.
+ *	These don't have any alignment or byte-order issues, as the
+ *	device always sends the high byte first.
+ */
+#define	GET_U8(P)	((long)(P)[0])
+#define	GET_U16(P)	((long)(((P)[0] << 8) | (P)[1]))
+#define	GET_S16(P)	((long)(short)(((P)[0] << 8) | (P)[1]))
+#define	GET_U32(P)	((long)(((ulong)(P)[0] << 24) | ((ulong)(P)[1] << 16) | \
+				((ulong)(P)[2] << 8) | (ulong)(P)[3]))
+#define	GET_X32(P)	GET_U32(P)
+#define	GET_MAC(P)	0L
+#define	GET_STRING(P)	GET_U8(P)	// the length of the string
+#define	GET_STATUS(P)	GET_U8(P)
+#define	GET_BYTES(P)	0L
+
+/*
+ *	Any extra work needed once a field has been picked up - the string
+ *	is the only field with a variable length, and the status byte is
+ *	also recorded in the reply itself.
+ */
+#define	FIXUP_U8
+#define	FIXUP_U16
+#define	FIXUP_S16
+#define	FIXUP_U32
+#define	FIXUP_X32
+#define	FIXUP_MAC
+#define	FIXUP_BYTES
+#define	FIXUP_STATUS	rp->status = (int) f->value;
+#define	FIXUP_STRING						\
+		if (p + f->value > end)				\
+			return -1;				\
+		f->data = p;					\
+		p += f->value;
+
+/*
+ *	The same extraction, chosen at run time, for the live data items.
+ */
+static inline long
+get_value (int type, const uchar *p)
+{
+	switch (type) {
+	case FT_U8:	return GET_U8 (p);
+	case FT_U16:	return GET_U16 (p);
+	case FT_S16:	return GET_S16 (p);
+	case FT_U32:	return GET_U32 (p);
+	default:	return 0;
+	}
+}
+
+/*
+ *	First pass over the table - build live_items[] from the ITEM lines.
+ *	An item number that we don't know has a NULL label.
+ */
+#define	ITEM(NUMBER, TYPE, WIDTH, SCALE, LABEL)	\
+	[NUMBER] = { LABEL, FT_##TYPE, WIDTH, SCALE },
+
+static const struct field_desc live_items[256] = {
+#include "reply-layouts.def"
+};
+
+
+/*
+ *	Decode a run of live data items, each of which is the item number
+ *	followed by its value.  Returns a pointer just past the last item,
+ *	or NULL if the items don't fit the data.
+ *
+ *	Newer firmware adds items that we may not know yet.  We can't tell
+ *	how long one of those is, so the items after it are dropped, but
+ *	those before it are kept.
+ */
+static const uchar *
+decode_items (const uchar *p, const uchar *end, struct reply *rp)
+{
+	const struct field_desc *dp;
+	struct reply_field *f = &rp->field[rp->nfields];
+
+	while (p < end) {
+		dp = &live_items[*p];
+
+		// If we don't know the item, we don't know its width either,
+		// so there's no way to find the next one.
+		if (dp->label == NULL) {
+			fprintf (stderr, "%s: unknown live data item 0x%02x - "
+				"not showing the %d bytes from there\n",
+				__FUNCTION__, *p, (int)(end - p));
+			p = end;
+			break;
+		}
+		if (p + 1 + dp->width > end)
+			return NULL;
+
+		f->desc = dp;
+		f->data = ++p;
+		switch (dp->type) {
+		case FT_U8:	f->value = GET_U8 (p);	p += 1; break;
+		case FT_U16:	f->value = GET_U16 (p);	p += 2; break;
+		case FT_U32:	f->value = GET_U32 (p);	p += 4; break;
+		case FT_S16:	f->value = GET_S16 (p);	p += dp->width; break;
+		default:	f->value = 0;		p += dp->width; break;
+		case FT_BYTES:
+			if (dp->width > 0) {
+				f->value = 0;
+				p += dp->width;
+			} else {	// a length byte, then that many
+				if (p >= end || p + 1 + *p > end)
+					return NULL;
+				f->value = *p;
+				f->data = ++p;
+				p += f->value;
+			}
+			break;
+		}
+		f++;
+	}
+	rp->nfields = (int)(f - rp->field);
+	return p;
+}
+
+
+/*
+ *	Second pass over the table - generate a decoder for each reply.
+ *	Each one returns the number of bytes consumed, or -1 if the data
+ *	is too short for the layout.
+ */
+#define	REPLY(COMMAND, NAME, SIZEBYTES)					\
+static int								\
+decode_##NAME (const uchar *ptr, int length, struct reply *rp)		\
+{									\
+	const uchar *p = ptr;						\
+	const uchar *end = ptr + length;				\
+	struct reply_field *f = NULL;					\
+									\
+	(void) f;
+
+#define	FIELD(TYPE, WIDTH, SCALE, LABEL)				\
+	{								\
+	static const struct field_desc desc =				\
+		{ LABEL, FT_##TYPE, WIDTH, SCALE };			\
+	if (p + (WIDTH) > end)						\
+		return -1;						\
+	f = &rp->field[rp->nfields++];					\
+	f->desc = &desc;						\
+	f->data = p;							\
+	f->value = GET_##TYPE (p);					\
+	p += (WIDTH);							\
+	FIXUP_##TYPE							\
+	}
+
+#define	RECORDS		while (p < end) {
+#define	END_RECORDS	}
+
+#define	ITEMS								\
+	if ((p = decode_items (p, end, rp)) == NULL)			\
+		return -1;
+
+#define	END_REPLY							\
+	return (int)(p - ptr);						\
+}
+
+#include "reply-layouts.def"
+
+
+/*
+ *	Third pass over the table - the dispatch table, indexed directly
+ *	by the command byte.
+ */
+#define	REPLY(COMMAND, NAME, SIZEBYTES)	\
+	[COMMAND] = { #NAME, SIZEBYTES, decode_##NAME },
+
+const struct reply_layout reply_layouts[256] = {
+#include "reply-layouts.def"
+};
+
+
+/*
+ *	Decode the data part of a reply - everything between the size and
+ *	the checksum - into *rp.
+ *
+ *	Returns the number of bytes consumed, or -1 if the command is not
+ *	one that we know, or the data doesn't fit its layout.
+ */
+int
+decode_reply_data (uchar command, const uchar *ptr, int length, struct reply *rp)
+{
+	const struct reply_layout *lp = &reply_layouts[command];
+
+	rp->command = command;
+	rp->status = 0;
+	rp->nfields = 0;
+
+	if (lp->decode == NULL)		// not a command that we know
+		return -1;
+
+	return (*lp->decode) (ptr, length, rp);
+}
+
+/*
+ *	Show each field of a decoded reply, one per line, in the form
+ *	"Label [value]".  The status field is only of interest when
+ *	debugging, as the caller acts on it.
+ */
+void
+print_reply (struct reply *rp)
+{
+	struct reply_field *f;
+	const struct field_desc *dp;
+	int	decimals;
+	int	scale;
+	int	i, j;
+
+	for (i = 0; i < rp->nfields; i++) {
+		f = &rp->field[i];
+		dp = f->desc;
+
+		switch (dp->type) {
+		case FT_MAC:
+			printf ("%s [%02x:%02x:%02x:%02x:%02x:%02x]\n", dp->label,
+				f->data[0], f->data[1], f->data[2],
+				f->data[3], f->data[4], f->data[5]);
+			break;
+
+		case FT_STRING:
+			printf ("%s [%.*s]\n", dp->label, (int) f->value, f->data);
+			break;
+
+		case FT_STATUS:
+			if (debug)
+				printf ("command %s: %s = 0x%lx\n",
+					reply_layouts[rp->command].name,
+					dp->label, f->value);
+			break;
+
+		case FT_X32:
+			printf ("%s [%08lx]\n", dp->label, f->value);
+			break;
+
+		case FT_BYTES:
+			printf ("%s [", dp->label);
+			for (j = 0; j < (dp->width > 0 ? dp->width : f->value); j++)
+				printf ("%02x", f->data[j]);
+			printf ("]\n");
+			break;
+
+		default:	// the numeric fields
+			if (dp->scale > 1) {
+				for (decimals = 0, scale = dp->scale; scale > 1; scale /= 10)
+					decimals++;
+				printf ("%s [%.*f]\n", dp->label, decimals,
+					(double) f->value / dp->scale);
+			} else {
+				printf ("%s [%ld]\n", dp->label, f->value);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ *	The first field of the given type in a decoded reply - e.g. the MAC
+ *	address, or the version string - or NULL if there isn't one.
+ */
+struct reply_field *
+find_field (struct reply *rp, int type)
+{
+	int	i;
+
+	for (i = 0; i < rp->nfields; i++) {
+		if (rp->field[i].desc->type == type)
+			return &rp->field[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,124 @@
+/*
+ *	The session pool - where the downloads in progress live.
+ *
+ *	The sessions are all the same size, so they're carved out of slabs
+ *	of POOL_SLAB bytes, and one that's finished goes on a free list for
+ *	the next device rather than back to malloc().  The slabs are never
+ *	given back, so the pool only grows as far as the most downloads that
+ *	were ever in progress at once.
+ *
+ *	The pool has a ceiling: its slabs, and what the I/O engine keeps for
+ *	each session ("extra"), may not add up to more than that.  When there
+ *	isn't room, fw_session_get() says so instead of growing, and the
+ *	device waits its turn - see do_devices().
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecowitt-firmware-updater.h"
+
+struct slab {
+	struct slab *next;
+	// then the sessions
+};
+
+/* a session on the free list */
+struct free_session {
+	struct free_session *next;
+};
+
+#define	PER_SLAB	((POOL_SLAB - sizeof (struct slab)) / sizeof (struct fw_session))
+
+static struct slab *slabs;
+static struct free_session *freelist;
+static size_t	ceiling;	// bytes, or 0 for no limit
+static size_t	extra;		// bytes that the engine keeps for each session
+static struct fw_pool_stats stats;
+
+
+/* bytes counted against the ceiling with this many slabs and sessions */
+static size_t
+pool_cost (long nslabs, long nsessions)
+{
+	return nslabs * POOL_SLAB + nsessions * extra;
+}
+
+/*
+ *	Set the ceiling, in bytes (0 for none), and how many bytes the
+ *	engine will need for each session as well.  There must be room for
+ *	at least one download, or we'd never get anywhere.
+ */
+void
+fw_pool_init (size_t limit, size_t engine_bytes)
+{
+	ceiling = limit;
+	extra = engine_bytes;
+	if (ceiling > 0 && ceiling < pool_cost (1, 1)) {
+		fprintf (stderr, "%s: %ld bytes of memory isn't enough for even one download (%ld bytes)\n",
+			progname, (long) ceiling, (long) pool_cost (1, 1));
+		exit (1);
+	}
+}
+
+/* a cleared session, or NULL if there's no room for another */
+struct fw_session *
+fw_session_get (void)
+{
+	struct slab *sp;
+	struct free_session *fp;
+	uchar	*p;
+	size_t	i;
+
+	if (ceiling > 0 &&
+	    pool_cost (stats.slabs + (freelist == NULL), stats.inuse + 1) > ceiling) {
+		stats.refused++;
+		return NULL;
+	}
+
+	if (freelist == NULL) {
+		if ((sp = malloc (POOL_SLAB)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		sp->next = slabs;
+		slabs = sp;
+		stats.slabs++;
+		p = (uchar *) (sp + 1);
+		for (i = 0; i < PER_SLAB; i++, p += sizeof (struct fw_session)) {
+			fp = (struct free_session *) p;
+			fp->next = freelist;
+			freelist = fp;
+		}
+	}
+
+	fp = freelist;
+	freelist = fp->next;
+	if (++stats.inuse > stats.peak) {
+		stats.peak = stats.inuse;
+		stats.bytes = pool_cost (stats.slabs, stats.inuse);
+	}
+	memset (fp, 0, sizeof (struct fw_session));
+	return (struct fw_session *) fp;
+}
+
+/* the session is finished with */
+void
+fw_session_put (struct fw_session *fsp)
+{
+	struct free_session *fp = (struct free_session *) fsp;
+
+	if (fsp == NULL)
+		return;
+	fp->next = freelist;
+	freelist = fp;
+	stats.inuse--;
+}
+
+void
+fw_pool_stats (struct fw_pool_stats *psp)
+{
+	*psp = stats;
+}
@@ -0,0 +1,155 @@
+/*
+ *	A hierarchical timer wheel, for the deadlines of the downloads in
+ *	progress - however many there are, arming and cancelling a timer
+ *	costs the same, and nothing has to look at every session to see
+ *	which ones have stalled.
+ *
+ *	Time goes in ticks of TW_TICK milliseconds.  The first level of the
+ *	wheel has a slot for each of the next TW_SLOTS ticks; each level
+ *	after that has slots TW_SLOTS times as wide.  A timer goes in the
+ *	lowest level that reaches as far as it's due, and each time a level
+ *	comes round to its first slot, the timers in the next level's
+ *	current slot are moved down to where they now belong.  So a timer
+ *	only expires from the first level, exactly on its tick.
+ *
+ *	Each timer is kept in its slot's list with a pointer back to
+ *	whatever points to it, so it can be taken out without searching.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	TW_MASK		(TW_SLOTS - 1)
+
+static void
+tw_link (struct timer_wheel *w, struct tw_timer *t)
+{
+	uint64_t delta = t->expires - w->now;
+	struct tw_timer **slot;
+	int	level;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (uint64_t) TW_SLOTS << (level * TW_BITS))
+			break;
+	}
+	if (level == TW_LEVELS - 1 && delta >= (uint64_t) TW_SLOTS << (level * TW_BITS))
+		t->expires = w->now + ((uint64_t) TW_SLOTS << (level * TW_BITS)) - 1;	// as far as we go
+	slot = &w->slot[level][(t->expires >> (level * TW_BITS)) & TW_MASK];
+
+	t->next = *slot;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+/* start with nothing armed, at "now" */
+void
+tw_init (struct timer_wheel *w, uint64_t now)
+{
+	memset (w, 0, sizeof *w);
+	w->now = now / TW_TICK;
+}
+
+/* arm (or re-arm) the timer, to go off at "when" (milliseconds) */
+void
+tw_arm (struct timer_wheel *w, struct tw_timer *t, uint64_t when)
+{
+	tw_cancel (w, t);
+	t->expires = (when + TW_TICK - 1) / TW_TICK;
+	if (t->expires <= w->now)
+		t->expires = w->now + 1;
+	tw_link (w, t);
+	w->armed++;
+}
+
+/* the timer isn't wanted - it's all right if it isn't armed */
+void
+tw_cancel (struct timer_wheel *w, struct tw_timer *t)
+{
+	if (t->pprev == NULL)
+		return;
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	w->armed--;
+}
+
+/* move the timers in this level's current slot down to where they belong */
+static void
+tw_cascade (struct timer_wheel *w, int level)
+{
+	struct tw_timer *t, *next;
+	struct tw_timer **slot = &w->slot[level][(w->now >> (level * TW_BITS)) & TW_MASK];
+
+	t = *slot;
+	*slot = NULL;
+	for ( ; t != NULL; t = next) {
+		next = t->next;
+		tw_link (w, t);
+	}
+}
+
+/*
+ *	Move the wheel on to "now" (milliseconds), and return the timers
+ *	that have gone off, in a list through their "next".  They're no
+ *	longer armed.
+ */
+struct tw_timer *
+tw_advance (struct timer_wheel *w, uint64_t now)
+{
+	struct tw_timer *expired = NULL, *t, *next;
+	struct tw_timer **slot;
+	uint64_t tick = now / TW_TICK;
+	int	level;
+
+	if (w->armed == 0 && tick > w->now)
+		w->now = tick;
+
+	while (w->now < tick) {
+		w->now++;
+		for (level = 1; level < TW_LEVELS; level++) {
+			if (((w->now >> ((level - 1) * TW_BITS)) & TW_MASK) != 0)
+				break;
+			tw_cascade (w, level);
+		}
+
+		slot = &w->slot[0][w->now & TW_MASK];
+		for (t = *slot; t != NULL; t = next) {
+			next = t->next;
+			t->pprev = NULL;
+			t->next = expired;
+			expired = t;
+			w->armed--;
+		}
+		*slot = NULL;
+	}
+	return expired;
+}
+
+/*
+ *	Milliseconds from "now" until tw_advance() could find something
+ *	- the next timer in the first level, or the next time that a level
+ *	above it is moved down - or -1 if nothing is armed.
+ */
+long
+tw_timeout (struct timer_wheel *w, uint64_t now)
+{
+	uint64_t tick;
+	long	ms;
+
+	if (w->armed == 0)
+		return -1;
+	for (tick = w->now + 1; tick <= w->now + TW_SLOTS; tick++) {
+		if (w->slot[0][tick & TW_MASK] != NULL ||
+		    (tick & TW_MASK) == 0)
+			break;
+	}
+	ms = (long) (tick * TW_TICK) - (long) now;
+	return ms > 0 ? ms : 0;
+}
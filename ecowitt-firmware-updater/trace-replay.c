@@ -0,0 +1,491 @@
+/*
+ *	Play back the device's side of a trace recorded by the updater's
+ *	"-t" option, so that the updater can be run against it again - to
+ *	reproduce what a device did in the field, or to time the updater.
+ *
+ *	We listen where the device did (on the port given with -p), send
+ *	what the device sent, when it sent it, and check that the updater
+ *	sends the same bytes that it did when the trace was recorded.  The
+ *	firmware download works as it does with a real device: when the
+ *	trace has the device connecting back to the updater, we connect to
+ *	the address that the updater has just given us in CMD_WRITE_UPDATE.
+ *	After the download, the device is away (restarting) until the time
+ *	that it answered again in the trace.
+ *
+ *	Usage: trace-replay [-v] [-s speed] [-b address] [-p port] tracefile
+ *	       trace-replay -l [-v] tracefile
+ *
+ *	"-s 10" plays it ten times as fast; "-s 0" doesn't wait at all.
+ *	"-l" lists the events instead, with their data if "-v" is given too.
+ *
+ *	Exits with 0 if the updater did just what it did before, 1 if not,
+ *	or 2 if the replay couldn't be done.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	ACCEPT_TIMEOUT	60	// seconds to wait for the updater to connect
+#define	READ_TIMEOUT	30	// seconds to wait for what the updater should send
+
+char	*progname;
+int	debug = 0;
+int	verbose = 0;
+
+static const char *event_names[] = {
+	"?", "CONNECT", "ACCEPT", "SEND", "RECV", "CLOSE"
+};
+
+/* the trace, read into memory */
+static uchar	*trace;
+static size_t	tracelen;
+static struct trace_header *header;
+
+/* one event, and its data */
+struct event {
+	struct trace_record rec;
+	const uchar *data;
+};
+
+static struct event *events;
+static int	nevents;
+static int	maxchannel;
+
+/* what's happening now */
+static int	*fds;			// live socket for each channel, or -1
+static int	*kinds;			// how each channel was opened: TR_CONNECT or TR_ACCEPT
+static int	*diverged;		// each channel already reported as different
+static int	listen_sock = -1;
+static struct sockaddr_in listen_addr;
+static struct sockaddr_in download_addr;	// from the last CMD_WRITE_UPDATE
+static int	have_download_addr = 0;
+static int	differences = 0;
+static long	bytes_in, bytes_out;
+
+int	main (int argc, char **argv);
+void	usage (void);
+
+
+void
+usage (void)
+{
+	fprintf (stderr,
+		"Usage: %s [-v] [-s speed] [-b address] [-p port] tracefile\n"
+		"       %s -l [-v] tracefile\n",
+		progname, progname);
+	exit (2);
+}
+
+/* seconds on the monotonic clock */
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_until (double when)
+{
+	struct timespec ts;
+	double	d;
+
+	if ((d = when - now ()) <= 0)
+		return;
+	ts.tv_sec = (time_t) d;
+	ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+	nanosleep (&ts, NULL);
+}
+
+/*
+ *	Read the whole trace and check it.  Returns 0, or -1 with a message.
+ */
+static int
+read_trace (const char *fname)
+{
+	FILE	*fp;
+	struct stat stb;
+	struct trace_record rec;
+	size_t	off;
+	void	*np;
+
+	if ((fp = fopen (fname, "r")) == NULL || fstat (fileno (fp), &stb) < 0) {
+		fprintf (stderr, "%s: cannot open trace \"%s\": %s\n",
+			progname, fname, strerror (errno));
+		return -1;
+	}
+	tracelen = stb.st_size;
+	if ((trace = malloc (tracelen + 1)) == NULL ||
+	    fread (trace, 1, tracelen, fp) != tracelen) {
+		fprintf (stderr, "%s: cannot read trace \"%s\"\n", progname, fname);
+		fclose (fp);
+		return -1;
+	}
+	fclose (fp);
+
+	header = (struct trace_header *) trace;
+	if (tracelen < sizeof *header || memcmp (header->magic, TRACE_MAGIC, sizeof header->magic) != 0) {
+		fprintf (stderr, "%s: \"%s\" isn't a trace\n", progname, fname);
+		return -1;
+	}
+	if (header->version != TRACE_VERSION) {
+		fprintf (stderr, "%s: \"%s\" is version %u, or from a machine of the other byte order\n",
+			progname, fname, (unsigned) header->version);
+		return -1;
+	}
+
+	for (off = sizeof *header; off < tracelen; off += sizeof rec + rec.length) {
+		if (tracelen - off < sizeof rec) {
+			fprintf (stderr, "%s: \"%s\" ends part of the way through an event - ignoring that\n",
+				progname, fname);
+			break;
+		}
+		memcpy (&rec, trace + off, sizeof rec);
+		if (rec.length > tracelen - off - sizeof rec ||
+		    rec.event < TR_CONNECT || rec.event > TR_CLOSE || rec.channel == 0) {
+			fprintf (stderr, "%s: \"%s\" is damaged at offset %lu - ignoring the rest\n",
+				progname, fname, (unsigned long) off);
+			break;
+		}
+		if ((nevents & (nevents - 1)) == 0) {
+			if ((np = realloc (events, (nevents ? 2 * nevents : 64) * sizeof *events)) == NULL) {
+				fprintf (stderr, "%s: out of memory\n", progname);
+				return -1;
+			}
+			events = np;
+		}
+		events[nevents].rec = rec;
+		events[nevents].data = trace + off + sizeof rec;
+		nevents++;
+		if (rec.channel > maxchannel)
+			maxchannel = rec.channel;
+	}
+	return 0;
+}
+
+static void
+dump (const uchar *data, int length)
+{
+	int	i;
+
+	for (i = 0; i < length; i++) {
+		printf ("%s%02x", i % 16 == 0 ? "\t" : " ", data[i]);
+		if (i % 16 == 15 || i == length - 1)
+			printf ("\n");
+	}
+}
+
+/* -l: show what's in the trace */
+static void
+list_trace (void)
+{
+	struct event *ep;
+	time_t	t;
+	int	i;
+
+	t = header->start / 1000000;
+	printf ("trace started %s", ctime (&t));
+	for (i = 0; i < nevents; i++) {
+		ep = &events[i];
+		printf ("%12.6f  #%-3d %-8s", ep->rec.time / 1e6, ep->rec.channel,
+			event_names[ep->rec.event]);
+		if (ep->rec.event == TR_CONNECT || ep->rec.event == TR_ACCEPT)
+			printf (" %.*s\n", (int) ep->rec.length, ep->data);
+		else if (ep->rec.event == TR_CLOSE)
+			printf ("\n");
+		else if (ep->rec.length == 0)
+			printf (" (closed)\n");
+		else {
+			printf (" %u byte%s\n", ep->rec.length, ep->rec.length == 1 ? "" : "s");
+			if (verbose)
+				dump (ep->data, ep->rec.length);
+		}
+	}
+}
+
+/* count a difference, and report the first one on each channel */
+static void
+differs (struct event *ep, const char *fmt, ...)
+{
+	va_list	ap;
+
+	differences++;
+	if (diverged[ep->rec.channel]++)
+		return;
+	printf ("#%d at %.6f: ", ep->rec.channel, ep->rec.time / 1e6);
+	va_start (ap, fmt);
+	vprintf (fmt, ap);
+	va_end (ap);
+	printf ("\n");
+}
+
+/* be the device listening for the updater, and take its next connection */
+static int
+accept_updater (struct event *ep)
+{
+	struct pollfd pfd;
+	int	fd, one = 1;
+
+	if (listen_sock < 0) {
+		if ((listen_sock = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    setsockopt (listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0 ||
+		    bind (listen_sock, (struct sockaddr *) &listen_addr, sizeof listen_addr) < 0 ||
+		    listen (listen_sock, 16) < 0) {
+			fprintf (stderr, "%s: cannot listen on %s port %hu: %s\n",
+				progname, inet_ntoa (listen_addr.sin_addr),
+				ntohs (listen_addr.sin_port), strerror (errno));
+			exit (2);
+		}
+	}
+	pfd.fd = listen_sock;
+	pfd.events = POLLIN;
+	if (poll (&pfd, 1, ACCEPT_TIMEOUT * 1000) <= 0 ||
+	    (fd = accept (listen_sock, NULL, NULL)) < 0) {
+		differs (ep, "the updater didn't connect");
+		return -1;
+	}
+	if (verbose)
+		printf ("#%d: the updater connected (was %.*s)\n", ep->rec.channel,
+			(int) ep->rec.length, ep->data);
+	return fd;
+}
+
+/* be the device connecting back to the updater for the download */
+static int
+connect_updater (struct event *ep)
+{
+	int	fd;
+
+	if (!have_download_addr) {
+		differs (ep, "the updater never said where to get the firmware");
+		return -1;
+	}
+	if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    connect (fd, (struct sockaddr *) &download_addr, sizeof download_addr) < 0) {
+		differs (ep, "cannot connect to the updater for the download: %s",
+			strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return -1;
+	}
+	have_download_addr = 0;
+	if (verbose)
+		printf ("#%d: connected to the updater at %s port %hu\n", ep->rec.channel,
+			inet_ntoa (download_addr.sin_addr), ntohs (download_addr.sin_port));
+	return fd;
+}
+
+/*
+ *	Read what the updater should be sending now, and compare it.
+ *	Returns -1 if it didn't send that much - after which we can't go
+ *	on with the connection as it went before.
+ */
+static int
+expect_send (struct event *ep, int fd)
+{
+	uchar	buf[4096];
+	const uchar *want = ep->data;
+	int	remain = ep->rec.length;
+	int	got = 0;
+	int	n, r;
+	struct pollfd pfd;
+
+	while (remain > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, READ_TIMEOUT * 1000) <= 0 ||
+		    (r = read (fd, buf, remain < (int) sizeof buf ? remain : (int) sizeof buf)) <= 0) {
+			differs (ep, "the updater sent %d bytes less than before", remain);
+			return -1;
+		}
+		bytes_in += r;
+
+		// CMD_WRITE_UPDATE carries the updater's address, which is ours to use
+		if (got == 0 && r >= 10 && buf[0] == 0xff && buf[1] == 0xff &&
+		    buf[2] == CMD_WRITE_UPDATE) {
+			memset (&download_addr, 0, sizeof download_addr);
+			download_addr.sin_family = AF_INET;
+			memcpy (&download_addr.sin_addr, buf + 4, 4);
+			memcpy (&download_addr.sin_port, buf + 8, 2);
+			have_download_addr = 1;
+			n = 4;		// and which will be different this time
+		} else
+			n = r;
+
+		if (memcmp (buf, want, n) != 0) {
+			for (n = 0; buf[n] == want[n]; n++)
+				;
+			differs (ep, "the updater sent something different, at byte %d",
+				got + n);
+		}
+		want += r;
+		got += r;
+		remain -= r;
+	}
+	return 0;
+}
+
+/* play the trace back; returns when it's done */
+static void
+replay (double speed)
+{
+	struct event *ep;
+	double	mark = now ();		// when we finished the last event
+	uint64_t marktime = 0;		// ... and its time in the trace
+	int	away = 0;		// the device is restarting
+	int	i, fd;
+
+	for (i = 0; i < nevents; i++) {
+		ep = &events[i];
+		fd = fds[ep->rec.channel];
+
+		// The device's own actions happen when they did before; the
+		// updater's happen when it does them.
+		if ((ep->rec.event == TR_RECV || ep->rec.event == TR_ACCEPT ||
+		    (ep->rec.event == TR_CONNECT && away)) && speed > 0)
+			sleep_until (mark + (ep->rec.time - marktime) / 1e6 / speed);
+
+		switch (ep->rec.event) {
+		case TR_CONNECT:
+			kinds[ep->rec.channel] = TR_CONNECT;
+			if (away) {		// back from the restart
+				away = 0;
+				if (verbose)
+					printf ("#%d: the device is back\n", ep->rec.channel);
+			}
+			fds[ep->rec.channel] = accept_updater (ep);
+			break;
+
+		case TR_ACCEPT:
+			kinds[ep->rec.channel] = TR_ACCEPT;
+			fds[ep->rec.channel] = connect_updater (ep);
+			break;
+
+		case TR_SEND:
+			if (fd >= 0 && expect_send (ep, fd) < 0) {
+				close (fd);
+				fds[ep->rec.channel] = -1;
+			}
+			break;
+
+		case TR_RECV:
+			if (fd < 0)
+				break;
+			if (ep->rec.length == 0) {
+				shutdown (fd, SHUT_WR);
+				break;
+			}
+			if (write (fd, ep->data, ep->rec.length) != (ssize_t) ep->rec.length)
+				differs (ep, "the updater went away: %s", strerror (errno));
+			bytes_out += ep->rec.length;
+			break;
+
+		case TR_CLOSE:
+			if (fd >= 0)
+				close (fd);
+			fds[ep->rec.channel] = -1;
+			break;
+		}
+
+		// once the download is over, the device goes away to restart
+		if (ep->rec.event == TR_RECV && ep->rec.length == 0 &&
+		    kinds[ep->rec.channel] == TR_ACCEPT && listen_sock >= 0) {
+			close (listen_sock);
+			listen_sock = -1;
+			away = 1;
+			if (verbose)
+				printf ("#%d: the device is restarting\n", ep->rec.channel);
+		}
+
+		mark = now ();
+		marktime = ep->rec.time;
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	int	c, i;
+	int	list = 0;
+	double	speed = 1.0;
+	double	started, took;
+	char	*cp;
+
+	if ((cp = strrchr (argv[0], '/')) != NULL)
+		progname = cp + 1;
+	else
+		progname = argv[0];
+
+	memset (&listen_addr, 0, sizeof listen_addr);
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	listen_addr.sin_port = htons (45000);
+
+	while ((c = getopt (argc, argv, "b:lp:s:v")) != EOF) {
+		switch (c) {
+		case 'b':	// listen on this address
+			if (inet_aton (optarg, &listen_addr.sin_addr) == 0)
+				usage ();
+			break;
+		case 'l':	// list the trace
+			list++;
+			break;
+		case 'p':	// listen on this port
+			listen_addr.sin_port = htons (atoi (optarg));
+			break;
+		case 's':	// how much faster to play it back
+			if ((speed = atof (optarg)) < 0)
+				usage ();
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage ();
+		}
+	}
+	if (optind != argc - 1)
+		usage ();
+
+	if (read_trace (argv[optind]) < 0)
+		exit (2);
+	if (list) {
+		list_trace ();
+		exit (0);
+	}
+
+	if ((fds = malloc ((maxchannel + 1) * sizeof *fds)) == NULL ||
+	    (kinds = calloc (maxchannel + 1, sizeof *kinds)) == NULL ||
+	    (diverged = calloc (maxchannel + 1, sizeof *diverged)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (2);
+	}
+	for (i = 0; i <= maxchannel; i++)
+		fds[i] = -1;
+
+	started = now ();
+	replay (speed);
+	took = now () - started;
+
+	printf ("%d events on %d connections in %.3f seconds (%.3f when recorded): "
+		"%ld bytes to the updater, %ld from it, %d difference%s\n",
+		nevents, maxchannel, took,
+		nevents > 0 ? events[nevents - 1].rec.time / 1e6 : 0.0,
+		bytes_out, bytes_in, differences, differences == 1 ? "" : "s");
+	exit (differences ? 1 : 0);
+}
@@ -0,0 +1,270 @@
+/*
+ *	Wire traces: every byte sent to and received from the devices, on
+ *	the command connections and the firmware download connections, with
+ *	when it happened - the format is in ecowitt-firmware-updater.h.
+ *	trace-replay plays the device's side of a trace back to the updater.
+ *
+ *	The updater only copies each event into a ring buffer in memory; a
+ *	separate thread writes the ring out to the file.  There's a single
+ *	writer and a single reader, so the two only share the ring's head
+ *	and tail, as atomics - no locks.  If the file can't keep up and the
+ *	ring fills, the updater waits for room rather than losing anything.
+ *
+ *	The bytes read one at a time (read_until_null() and the start of
+ *	receive_reply_packet()) are gathered into one event until something
+ *	else happens, so a reply costs one record rather than one per byte.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-firmware-updater.h"
+
+#define	TRACE_RINGSIZE	(1024 * 1024)	// bytes - must be a power of two
+#define	TRACE_MAXDATA	(TRACE_RINGSIZE / 4)	// longest event; longer ones are split
+#define	TRACE_MAXFD	1024		// highest file descriptor that we follow
+#define	TRACE_GATHER	1024		// bytes of a reply gathered into one event
+
+static uchar	*ring;
+static atomic_size_t head;		// next byte to be added - only we move it
+static atomic_size_t tail;		// next byte to be written - only the thread moves it
+static atomic_int done;
+static int	tracefd = -1;
+static char	*tracefile;
+static pthread_t writer;
+static struct timespec started;
+
+static int	channels[TRACE_MAXFD];	// the channel of each fd, or 0
+static int	nchannels;
+
+/* the received bytes being gathered into one event */
+static struct {
+	int	fd;
+	uint64_t time;
+	int	length;
+	uchar	data[TRACE_GATHER];
+} gather = { -1 };
+
+static long	stalls;			// times that the ring was full
+
+
+/* microseconds since the trace started */
+static uint64_t
+trace_clock (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - started.tv_sec) * 1000000LL +
+		(now.tv_nsec - started.tv_nsec) / 1000;
+}
+
+/* copy into the ring at "at", wrapping around the end */
+static void
+ring_copy (size_t at, const void *data, size_t length)
+{
+	size_t	offset = at & (TRACE_RINGSIZE - 1);
+	size_t	first = TRACE_RINGSIZE - offset;
+
+	if (first > length)
+		first = length;
+	memcpy (ring + offset, data, first);
+	memcpy (ring, (const uchar *) data + first, length - first);
+}
+
+/* add one record to the ring, waiting for room if need be */
+static void
+ring_add (uint64_t time, int channel, int event, const void *data, size_t length)
+{
+	struct trace_record rec;
+	size_t	h = atomic_load_explicit (&head, memory_order_relaxed);
+	size_t	need = sizeof rec + length;
+	struct timespec pause = { 0, 100000 };
+
+	while (need > TRACE_RINGSIZE - (h - atomic_load_explicit (&tail, memory_order_acquire))) {
+		stalls++;
+		nanosleep (&pause, NULL);
+	}
+
+	memset (&rec, 0, sizeof rec);
+	rec.time = time;
+	rec.length = length;
+	rec.channel = channel;
+	rec.event = event;
+	ring_copy (h, &rec, sizeof rec);
+	ring_copy (h + sizeof rec, data, length);
+	atomic_store_explicit (&head, h + need, memory_order_release);
+}
+
+/* put the gathered bytes into the ring */
+static void
+flush_gather (void)
+{
+	if (gather.fd >= 0 && gather.length > 0)
+		ring_add (gather.time, channels[gather.fd], TR_RECV, gather.data, gather.length);
+	gather.fd = -1;
+	gather.length = 0;
+}
+
+/* write whatever is in the ring to the file, until we're told to stop */
+static void *
+trace_writer (void *arg)
+{
+	size_t	h, t, offset, n;
+	ssize_t	r;
+	struct timespec pause = { 0, 2000000 };
+	int	stopping;
+
+	for ( ;; ) {
+		stopping = atomic_load_explicit (&done, memory_order_acquire);
+		h = atomic_load_explicit (&head, memory_order_acquire);
+		t = atomic_load_explicit (&tail, memory_order_relaxed);
+		if (h == t) {
+			if (stopping)
+				break;
+			nanosleep (&pause, NULL);
+			continue;
+		}
+		while (t != h) {
+			offset = t & (TRACE_RINGSIZE - 1);
+			n = h - t;
+			if (n > TRACE_RINGSIZE - offset)
+				n = TRACE_RINGSIZE - offset;
+			if ((r = write (tracefd, ring + offset, n)) < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf (stderr, "%s: error writing trace file \"%s\": %s\n",
+					progname, tracefile, strerror (errno));
+				r = n;		// keep the updater going, at least
+			}
+			t += r;
+			atomic_store_explicit (&tail, t, memory_order_release);
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Start tracing to the file.  The trace is finished when we exit.
+ *	Returns 0, or -1 (with a message) if we can't.
+ */
+int
+trace_start (const char *fname)
+{
+	struct trace_header th;
+	struct timeval now;
+
+	if ((tracefd = open (fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf (stderr, "%s: cannot create trace file \"%s\": %s\n",
+			progname, fname, strerror (errno));
+		return -1;
+	}
+	if ((ring = malloc (TRACE_RINGSIZE)) == NULL ||
+	    (tracefile = strdup (fname)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		return -1;
+	}
+
+	gettimeofday (&now, NULL);
+	clock_gettime (CLOCK_MONOTONIC, &started);
+	memset (&th, 0, sizeof th);
+	memcpy (th.magic, TRACE_MAGIC, sizeof th.magic);
+	th.version = TRACE_VERSION;
+	th.start = now.tv_sec * 1000000LL + now.tv_usec;
+	if (write (tracefd, &th, sizeof th) != sizeof th) {
+		fprintf (stderr, "%s: cannot write trace file \"%s\": %s\n",
+			progname, fname, strerror (errno));
+		return -1;
+	}
+
+	if ((errno = pthread_create (&writer, NULL, trace_writer, NULL)) != 0) {
+		fprintf (stderr, "%s: cannot start trace writer: %s\n",
+			progname, strerror (errno));
+		return -1;
+	}
+	atexit (trace_finish);
+	return 0;
+}
+
+/* a new connection, to the device (TR_CONNECT) or from it (TR_ACCEPT) */
+void
+trace_open (int fd, int event, const char *peer)
+{
+	if (tracefd < 0 || fd < 0 || fd >= TRACE_MAXFD)
+		return;
+	flush_gather ();
+	channels[fd] = ++nchannels;
+	ring_add (trace_clock (), channels[fd], event, peer, strlen (peer));
+}
+
+/* bytes sent (TR_SEND) or received (TR_RECV) - none received is EOF */
+void
+trace_data (int fd, int event, const void *data, int length)
+{
+	uint64_t now;
+	int	n;
+
+	if (tracefd < 0 || fd < 0 || fd >= TRACE_MAXFD || channels[fd] == 0 || length < 0)
+		return;
+	now = trace_clock ();
+
+	if (event == TR_RECV && length > 0 && length < TRACE_GATHER) {
+		if (gather.fd != fd || gather.length + length > TRACE_GATHER)
+			flush_gather ();
+		if (gather.length == 0) {
+			gather.fd = fd;
+			gather.time = now;
+		}
+		memcpy (gather.data + gather.length, data, length);
+		gather.length += length;
+		return;
+	}
+
+	flush_gather ();
+	if (length == 0)
+		ring_add (now, channels[fd], event, data, 0);
+	for ( ; length > 0; length -= n) {
+		n = length < TRACE_MAXDATA ? length : TRACE_MAXDATA;
+		ring_add (now, channels[fd], event, data, n);
+		data = (const uchar *) data + n;
+	}
+}
+
+/* we're closing this connection */
+void
+trace_close (int fd)
+{
+	if (tracefd < 0 || fd < 0 || fd >= TRACE_MAXFD || channels[fd] == 0)
+		return;
+	flush_gather ();
+	ring_add (trace_clock (), channels[fd], TR_CLOSE, "", 0);
+	channels[fd] = 0;
+}
+
+/* write out the rest, and close the file */
+void
+trace_finish (void)
+{
+	if (tracefd < 0)
+		return;
+	flush_gather ();
+	atomic_store_explicit (&done, 1, memory_order_release);
+	pthread_join (writer, NULL);
+	if (close (tracefd) < 0)
+		fprintf (stderr, "%s: error writing trace file \"%s\": %s\n",
+			progname, tracefile, strerror (errno));
+	tracefd = -1;
+	if (debug || verbose || stalls > 0)
+		printf ("trace: %d connection%s written to %s%s\n",
+			nchannels, nchannels == 1 ? "" : "s", tracefile,
+			stalls > 0 ? " (the updater had to wait for it)" : "");
+}
@@ -20,6 +20,8 @@
 // edited to set a preference for a particular device based on its MAC address.
 //
 
+require_once ($_SERVER["DOCUMENT_ROOT"] . "/include/common.php");	// normalizemac()
+
 
 // This function reads the firmware information file and builds up the data
 // structures that we need to perform our tasks below.  Note that this is
@@ -171,6 +173,93 @@ function readfirmwareinfo ($fname, &$modelinfo, &$urlbase)
 }
 
 
+// Read the firmware information through a compiled copy of it, which is
+// rebuilt only when "firmware-info" changes.  The compiled copy is plain
+// PHP (written with var_export), so once opcache has it, loading it costs
+// the same however many models and versions we list.  It holds:
+//	"models" - the models, keyed by name, as readfirmwareinfo() gives,
+//		   but with the "want" entries keyed by normalized MAC, and
+//		   with "latest" set to the highest version of each model.
+//	"urlbase", and the size and time of the file that it came from.
+// This fills in $modelinfo and $urlbase, and returns true, just like
+// readfirmwareinfo().
+function loadfirmwareinfo ($fname, &$modelinfo, &$urlbase)
+{
+	$st = @stat ($fname);
+	if ($st === false)	// let readfirmwareinfo() report it
+		return readfirmwareinfo ($fname, $modelinfo, $urlbase);
+
+	// Keep the compiled copy next to the file if we can write there,
+	// otherwise in the temporary directory.
+	$dir = dirname (realpath ($fname));
+	if (! is_writable ($dir))
+		$dir = sys_get_temp_dir ();
+	$cachefile = sprintf ("%s/.%s.%s.php", $dir, basename ($fname),
+		md5 (realpath ($fname)));
+
+	// Only trust a compiled copy that we wrote ourselves:
+	if (@fileowner ($cachefile) === getmyuid ()) {
+		$compiled = @include ($cachefile);
+		if (is_array ($compiled) && $compiled["mtime"] == $st["mtime"]
+		    && $compiled["size"] == $st["size"]) {
+			$modelinfo = $compiled["models"];
+			$urlbase = $compiled["urlbase"];
+			return true;
+		}
+	}
+
+	// Missing or out of date - parse the file and compile it again.
+	if (readfirmwareinfo ($fname, $models, $urlbase) != true)
+		return false;
+
+	foreach ($models as $name => $model) {
+		// the highest version listed, as version_compare() sees it
+		$highest = "";
+		if (isset ($model["firmware"])) {
+			foreach (array_keys ($model["firmware"]) as $v) {
+				if (version_compare ($v, $highest) > 0)
+					$highest = $v;
+			}
+		}
+		$models[$name]["latest"] = $highest;
+
+		if (isset ($model["want"])) {
+			$want = array ();
+			foreach ($model["want"] as $mac => $v) {
+				if ($mac != "default")
+					$mac = normalizemac ($mac);
+				$want[$mac] = $v;
+			}
+			$models[$name]["want"] = $want;
+		}
+	}
+
+	$compiled = array ("mtime" => $st["mtime"],
+			   "size" => $st["size"],
+			   "urlbase" => $urlbase,
+			   "models" => $models);
+
+	// Write a new copy and rename it into place, so that nobody ever
+	// includes half of one.  If we can't, we simply carry on without.
+	$tmpfile = @tempnam ($dir, ".fwinfo");
+	if ($tmpfile !== false) {
+		$php = "<?php\n// compiled from \"" . realpath ($fname) . "\" - do not edit\nreturn "
+			. var_export ($compiled, true) . ";\n";
+		if (@file_put_contents ($tmpfile, $php) === strlen ($php)
+		    && @rename ($tmpfile, $cachefile)) {
+			if (function_exists ("opcache_invalidate"))
+				opcache_invalidate ($cachefile, true);
+		} else {
+			@unlink ($tmpfile);
+			syslog (LOG_ERR, sprintf ("cannot write \"%s\"", $cachefile));
+		}
+	}
+
+	$modelinfo = $models;
+	return true;
+}
+
+
 /*
  * Various errors found when probing the real Ecowitt page:
 {"code":41000,"msg":"id require","time":"1707781625","data":[]}
@@ -250,7 +339,7 @@ if ($gotsome > 0)
 // The Ecowitt site responds to this with a standard 200 code:
 http_response_code(200);
 
-if (readfirmwareinfo ("firmware-info", $modelinfo, $urlbase) != true) {
+if (loadfirmwareinfo ("firmware-info", $modelinfo, $urlbase) != true) {
 	// we encountered problems with our firmware information file. Oops.
 	$code = -1;
 	$msg = "internal configuration error";
@@ -269,7 +358,7 @@ if (! array_key_exists ("id", $_REQUEST)) {
 	// {"code":41000,"msg":"id require","time":"1707781625","data":[]}
 	sendresponse ($code, $msg, null);
 }
-$id = strtolower ($_REQUEST["id"]);		// this is the MAC address
+$id = normalizemac ($_REQUEST["id"]);		// this is the MAC address
 
 // Get the model and version from the request:
 if (! array_key_exists ("model", $_REQUEST)) {
@@ -327,27 +416,11 @@ if (array_key_exists ("want", $modelinfo) && array_key_exists ($id, $modelinfo["
 	$desiredversion = $modelinfo["want"]["default"];
 	syslog (LOG_ERR, sprintf ("default version is [%s]", $desiredversion));
 } else {
-	// If the wanted version is not specified, find the highest version
-	// listed in $modelinfo[firmware]
-
-	$versions = array_keys ($modelinfo["firmware"]);
-	syslog (LOG_ERR, sprintf ("versions for model %s: { %s }",
-			$model, var_export($versions, true)));
-	$highest = "";
-	$lowest = "";
-	foreach ($versions as $k => $v) {
-		// use version_compare(string $version1, string $version2) -
-		// returns -1 if the first version is lower than the second,
-		// 0 if they are equal, and 1 if the second is lower.
-		$r = version_compare($v, $highest);
-		if ($r > 0)	// $v is higher than the highest so far
-			$highest = $v;
-		$r = version_compare($v, $lowest);
-		if ($r < 0 || $lowest == "")	// $v is lower than lowest
-			$lowest = $v;
-	}
-	syslog (LOG_ERR, sprintf ("version: highest[%s] lowest[%s]",
-			$highest, $lowest));
+	// If the wanted version is not specified, use the highest version
+	// listed in $modelinfo[firmware], which was found when the file
+	// was compiled.
+	$highest = $modelinfo["latest"];
+	syslog (LOG_ERR, sprintf ("version: highest[%s]", $highest));
 
 	// use the highest version that we found:
 	$desiredversion = $highest;
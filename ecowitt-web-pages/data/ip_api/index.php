@@ -22,7 +22,16 @@
 // status - for this, we use the system information. Determining sunrise and
 // sunset requires knowing the correct latitude and longitude - to keep this
 // simple, this information is hardwired into this script. Look for "EDIT THIS"
-// below, and edit the array to provide your local information.
+// below, and edit the array to provide your local information.  Until then,
+// or a "locations" file, every request is answered with an error.
+//
+// If your devices are in more than one place, list the places in a file named
+// "locations" in this directory instead - see "locations.sample".  Each site
+// may have its own timezone there.
+//
+// Every device at a site gets the same answer all day, so the answer is
+// worked out once per site and kept (in APCu if it's there, or else in a
+// small file) until local midnight, or until the clocks change.
 //
 
 $method = $_SERVER["REQUEST_METHOD"];
@@ -57,15 +66,157 @@ http_response_code(202);
 // EDIT THIS: you can get your latitude and longitude by looking up your
 // address on Google Maps. Right-click on the pin, then click the first line
 // in the pop-up, which should put your latitude and longitude into the paste
-// buffer.  Paste it into this array, then check your work - it should be two
-// decimal values with one comma between them.
+// buffer.  Paste it into an array in place of the null, then check your work -
+// it should be two decimal values with one comma between them.  (With a
+// "locations" file, this is only used if the file has no sites in it.)
 //------------------------------------------------------------------------------
 // For example:
 // $latlong = array ( 33.76266954460827, -118.12121280197603 );
-$latlong = array ( EDIT THIS );
+$latlong = null;
+
+
+$locationsfile = __DIR__ . "/locations";
+
+require_once ($_SERVER["DOCUMENT_ROOT"] . "/include/common.php");	// normalizemac()
+
+
+// A small cache shared by every request: APCu if it's available, else one
+// file per key in the temporary directory, written by PHP as PHP so that
+// the opcode cache keeps it in memory.  Each value carries its own expiry.
+function cachefilename ($key)
+{
+	return sys_get_temp_dir () . "/." . preg_replace ('/[^A-Za-z0-9_.-]/', '_', $key) . ".php";
+}
+
+function cachefetch ($key)
+{
+	if (function_exists ("apcu_fetch") && apcu_enabled ())
+		return apcu_fetch ($key);
+
+	// only trust a file that we wrote ourselves
+	$fname = cachefilename ($key);
+	if (@fileowner ($fname) !== getmyuid ())
+		return false;
+	$value = @include ($fname);
+	return is_array ($value) ? $value : false;
+}
+
+function cachestore ($key, $value, $ttl)
+{
+	if (function_exists ("apcu_store") && apcu_enabled ()) {
+		apcu_store ($key, $value, $ttl);
+		return;
+	}
+
+	$fname = cachefilename ($key);
+	$tmp = @tempnam (dirname ($fname), ".ecowitt");
+	if ($tmp === false)
+		return;
+	if (@file_put_contents ($tmp, "<?php\nreturn " . var_export ($value, true) . ";\n") !== false &&
+	    @rename ($tmp, $fname)) {
+		if (function_exists ("opcache_invalidate"))
+			opcache_invalidate ($fname, true);
+	} else {
+		@unlink ($tmp);
+	}
+}
+
 
-$latitude = $latlong[0];
-$longitude = $latlong[1];
+// Read the locations file, which looks like:
+//	site NAME LATITUDE,LONGITUDE [TIMEZONE]
+//	mac MACADDRESS SITE
+// Returns array ("sites" => array (name => array (lat, lon, zone)),
+// "macs" => array (mac => name), "first" => name), or false without a file.
+function readlocations ($fname)
+{
+	$lines = @file ($fname, FILE_IGNORE_NEW_LINES);
+	if ($lines === false)
+		return false;
+
+	$loc = array ("sites" => array (), "macs" => array (), "first" => "");
+	foreach ($lines as $n => $line) {
+		$line = preg_replace ('/#.*/', '', $line);
+		$words = preg_split ('/\s+/', trim ($line), -1, PREG_SPLIT_NO_EMPTY);
+		if (count ($words) == 0)
+			continue;
+
+		if ($words[0] == "site" && (count ($words) == 3 || count ($words) == 4) &&
+		    preg_match ('/^\s*([-+0-9.eE]+)\s*,\s*([-+0-9.eE]+)\s*$/', $words[2], $m)) {
+			if (array_key_exists ($words[1], $loc["sites"])) {
+				syslog (LOG_ERR, sprintf ("site \"%s\" listed again at line %d in \"%s\"",
+					$words[1], $n + 1, $fname));
+				continue;
+			}
+			$loc["sites"][$words[1]] = array (floatval ($m[1]), floatval ($m[2]),
+				count ($words) == 4 ? $words[3] : "");
+			if ($loc["first"] == "")
+				$loc["first"] = $words[1];
+		} else if ($words[0] == "mac" && count ($words) == 3 &&
+		    array_key_exists ($words[2], $loc["sites"])) {
+			$loc["macs"][normalizemac ($words[1])] = $words[2];
+		} else {
+			syslog (LOG_ERR, sprintf ("bad line %d in \"%s\"", $n + 1, $fname));
+		}
+	}
+	return $loc;
+}
+
+// The same, but parsed only when the file has changed.
+function loadlocations ($fname)
+{
+	clearstatcache (true, $fname);
+	$mtime = @filemtime ($fname);
+	if ($mtime === false)
+		return false;
+	$size = @filesize ($fname);
+
+	$key = "ecowitt-locations-" . md5 ($fname);
+	$cached = cachefetch ($key);
+	if (is_array ($cached) && $cached["mtime"] === $mtime && $cached["size"] === $size)
+		return $cached["locations"];
+
+	$loc = readlocations ($fname);
+	if ($loc !== false)
+		cachestore ($key, array ("mtime" => $mtime, "size" => $size, "locations" => $loc), 0);
+	return $loc;
+}
+
+
+// Find this device's site - its own, if it's listed, else the first one.
+$site = "default";
+$zone = "";
+$loc = loadlocations ($locationsfile);
+if ($loc !== false && count ($loc["sites"]) > 0) {
+	$mac = array_key_exists ("mac", $_REQUEST) ? normalizemac ($_REQUEST["mac"]) : "";
+	if (array_key_exists ($mac, $loc["macs"]))
+		$site = $loc["macs"][$mac];
+	else
+		$site = $loc["first"];
+	list ($latitude, $longitude, $zone) = $loc["sites"][$site];
+} else if (is_array ($latlong) && count ($latlong) == 2) {
+	$latitude = $latlong[0];
+	$longitude = $latlong[1];
+} else {
+	// Nothing to work out the sunrise and sunset from - say so, rather
+	// than send the device a wrong answer.
+	syslog (LOG_ERR, sprintf ("%s: no location - edit \$latlong (\"EDIT THIS\"), or list the sites in \"%s\"",
+		__FILE__, $locationsfile));
+	http_response_code (500);
+	exit;
+}
+
+if ($zone != "")
+	date_default_timezone_set ($zone);
+
+$cachekey = "ecowitt-ip_api-" . md5 ($locationsfile . "|" . $site . "|" . $latitude . "," . $longitude . "|" . $zone);
+$cached = cachefetch ($cachekey);
+if (is_array ($cached) && $cached["expires"] > time ()) {
+	if (1) {	// DEBUG logging
+		syslog (LOG_ERR, sprintf ("site[%s] cached answer[%s]", $site, $cached["json"]));
+	}
+	printf ("%s\n", $cached["json"]);
+	exit;
+}
 
 
 # Get the current DST flag this way:
@@ -87,8 +238,12 @@ $zonemins = intval( $zoneinfo % 100 );
 // now figure out what that is in seconds:
 $tzoffset = (($zonehour * 60) + $zonemins) * 60;
 
-// Now try to guess the timezone name, based on the offset and DST flag:
-$tzname = timezone_name_from_abbr ("", $tzoffset, $dst);
+// Now try to guess the timezone name, based on the offset and DST flag -
+// unless the site has its own:
+if ($zone != "")
+	$tzname = $zone;
+else
+	$tzname = timezone_name_from_abbr ("", $tzoffset, $dst);
 
 // figure out the sunrise and sunset information for the lat/lon:
 $suninfo = date_sun_info (time(), $latitude, $longitude);
@@ -99,8 +254,8 @@ $sunset  = strftime ("%H:%M", $suninfo["sunset"]);
 if (1) {	// DEBUG logging
 	// Show our work to the system log:
 	syslog (LOG_ERR,
-		sprintf ("zoneinfo[%s] hour=%d mins=%d tzoffset[%d] dst[%d] name[%s] sunrise[%s] sunset[%s]",
-			$zoneinfo, $zonehour, $zonemins, $tzoffset, $dst,
+		sprintf ("site[%s] zoneinfo[%s] hour=%d mins=%d tzoffset[%d] dst[%d] name[%s] sunrise[%s] sunset[%s]",
+			$site, $zoneinfo, $zonehour, $zonemins, $tzoffset, $dst,
 			$tzname, $sunrise, $sunset));
 }
 
@@ -111,6 +266,17 @@ $data = array ("timezone" => $tzname,
 		"date_sunrise" => $sunrise,
 		"date_sunset" => $sunset);
 
+// Keep it until local midnight, or until the clocks change if that's sooner:
+$now = time ();
+$tz = new DateTimeZone (date_default_timezone_get ());
+$midnight = new DateTime ("tomorrow", $tz);
+$expires = $midnight->getTimestamp ();
+$changes = $tz->getTransitions ($now, $expires);
+if (is_array ($changes) && count ($changes) > 1 && $changes[1]["ts"] < $expires)
+	$expires = $changes[1]["ts"];
+$json = json_encode ($data);
+cachestore ($cachekey, array ("json" => $json, "expires" => $expires), max (1, $expires - $now));
+
 // output it as JSON that the device expects:
-printf ("%s\n", json_encode ($data));
+printf ("%s\n", $json);
 ?>
@@ -76,13 +76,11 @@ else
 	$httphost = "<notset>";
 
 if (1) {	// DEBUG logging
-	syslog (LOG_ERR, sprintf ("running %s - method[%s], host[%s], http_host[%s]",
-		__FILE__, $method, $ipaddr, $httphost));
-
-	foreach ($_REQUEST as $k => $v) {
-		syslog (LOG_ERR, sprintf (" var[%s] = \"%s\"", $k, $v));
-	}
-	syslog (LOG_ERR, "###");
+	// One line for the whole report, rather than one per field - with a
+	// few devices posting every 16 seconds, that adds up quickly.  (For
+	// keeping the reports, see ecowitt-web-server's "-s" option.)
+	syslog (LOG_ERR, sprintf ("report from %s - method[%s], http_host[%s]: %s",
+		$ipaddr, $method, $httphost, http_build_query ($_REQUEST)));
 }
 
 // Apparently the Ecowitt device wants a 202 code, not just 200.
@@ -1,31 +1,224 @@
 #!/bin/sh
 
-# A simple shell script to download a few Ecowitt firmware images.
+# Download the Ecowitt firmware images that firmware-info lists, and any
+# others that "sources" has a URL for, into this directory (or the one given
+# with -d).  An image that firmware-info lists but that has no URL is skipped
+# (and said so), so put it here by hand, or add it to "sources".
+#
+# Usage: download-firmware.sh [-q] [-j jobs] [-b baseurl] [-f firmware-info]
+#		[-s sources] [-d directory]
+#
+#	-q		don't show curl's progress meter
+#	-j jobs		how many downloads to run at once (default 4)
+#	-b baseurl	fetch every image from baseurl/FILENAME - a mirror, or a
+#			local test server - instead of the URLs in "sources"
+#	-f file		the firmware-info file (default
+#			../api/ota/v1/version/firmware-info)
+#	-s file		where each image comes from (default "sources", here)
+#	-d directory	where the images go (default this directory)
+#
+# Most images have their MD5 checksum in their names (as Ecowitt names them),
+# so an image that is already here and has the right checksum is not fetched
+# again.  Otherwise the request is conditional (If-Modified-Since), so the
+# server only sends something that has changed.  Each image is downloaded into
+# "NAME.part", resumed from where it stopped if the last run was interrupted,
+# checked, and only then renamed into place - so info.php never hands out half
+# of an image.
+#
+# Afterwards, MANIFEST lists the checksum of every image here, in the format
+# that "md5sum -c MANIFEST" checks.
+
+here=`cd \`dirname "$0"\` && pwd`
+
+# This script runs itself once for each image - see the bottom.
+if [ "$1" = "-1" ]; then
+	mode=one
+	shift
+fi
 
-#silent="--silent"
 silent=
+jobs=4
+baseurl=
+fwinfo="$here/../api/ota/v1/version/firmware-info"
+sources="$here/sources"
+dir="$here"
+
+usage () {
+	echo "Usage: $0 [-q] [-j jobs] [-b baseurl] [-f firmware-info] [-s sources] [-d directory]" 1>&2
+	exit 1
+}
+
+
+# the MD5 checksum of a file, with md5sum or BSD's md5
+md5of () {
+	if command -v md5sum > /dev/null 2>&1; then
+		md5sum < "$1" | awk '{ print $1 }'
+	else
+		md5 -q < "$1"
+	fi
+}
+
+# the checksum in a file name like GW1100-V2.3.3-818c81b00866afbaf227d21d1b44e4ae.bin
+wantedmd5 () {
+	echo "$1" | sed -n 's/.*[-_]\([0-9a-fA-F]\{32\}\)\.[^.]*$/\1/p' | tr A-F a-f
+}
+
+# fetch_one FILE URL - download one image, if it needs it
+fetch_one () {
+	file="$1"
+	url="$2"
+	dst="$dir/$file"
+	part="$dst.part"
+	want=`wantedmd5 "$file"`
+	since=
+
+	if [ -f "$dst" ]; then
+		if [ -z "$want" ]; then
+			since=yes		# only if it has changed since
+		elif [ "`md5of "$dst"`" = "$want" ]; then
+			echo "$file: up to date"
+			return 0
+		else
+			echo "$file: wrong checksum - downloading it again"
+		fi
+	fi
+
+	# An earlier run may have finished the download without renaming it.
+	if [ -n "$want" -a -f "$part" ] && [ "`md5of "$part"`" = "$want" ]; then
+		mv -f "$part" "$dst"
+		echo "$file: done (already downloaded)"
+		return 0
+	fi
+
+	if [ "$url" = "-" ]; then
+		echo "$file: skipped - not here, and no URL for it in $sources" 1>&2
+		return 0
+	fi
+
+	for try in resume fresh; do
+		if [ $try = resume -a -s "$part" ]; then
+			echo "$file: resuming $url"
+		elif [ $try = resume ]; then
+			echo "$file: downloading $url"
+		fi
 
-while read dst src
+		code=`curl $silent --fail --location --remote-time -C - ${since:+-z "$dst"} \
+			-w '%{http_code}' -o "$part" "$url"`
+		status=$?
+
+		if [ "$code" = "304" ]; then
+			rm -f "$part"
+			echo "$file: not modified"
+			return 0
+		fi
+		if [ "$code" = "416" -a -s "$part" ]; then
+			status=0	# we already had all of it
+		fi
+		if [ $status -ne 0 ]; then
+			# Keep what we got, so the next run can pick up from there.
+			echo "$file: download failed (curl exit $status, HTTP $code)" 1>&2
+			return 1
+		fi
+		if [ -z "$want" ] || [ "`md5of "$part"`" = "$want" ]; then
+			mv -f "$part" "$dst"
+			echo "$file: done"
+			return 0
+		fi
+
+		# A bad resume (the file changed on the server?) - start over, once.
+		echo "$file: wrong checksum after download" 1>&2
+		rm -f "$part"
+		if [ $try = resume ]; then
+			echo "$file: downloading $url again from the start"
+		fi
+	done
+	return 1
+}
+
+
+if [ "$mode" = one ]; then
+	dir="$FW_DIR"
+	silent="$FW_SILENT"
+	sources="$FW_SOURCES"
+	fetch_one "$1" "$2"
+	exit $?
+fi
+
+while getopts qj:b:f:s:d: c
 do
-	echo "Downloading $src -> $dst"
-	curl $silent --remote-time -o "$dst" "$src"
-	echo ""
-done << \EOF
-GW1100-V2.0.6-63bf599c5070fdb1cc5daf0807c2c038.bin	https://osswww.ecowitt.net/ota/20211013/63bf599c5070fdb1cc5daf0807c2c038.bin
-GW1100-V2.1.8-db2869ec13962015c813128b74693d13.bin	https://osswww.ecowitt.net/ota/20220811/db2869ec13962015c813128b74693d13.bin
-GW1100-V2.3.1-68dfe9b8d7e459739e85f2ba44188cf2.bin	https://osswww.ecowitt.net/ota/20240126/68dfe9b8d7e459739e85f2ba44188cf2.bin
-GW1100-V2.3.2-568ad1f21d0fe5e612b0e1ae4b7adcdd.bin	https://osswww.ecowitt.net/ota/20240425/568ad1f21d0fe5e612b0e1ae4b7adcdd.bin
-GW1100-V2.3.3-818c81b00866afbaf227d21d1b44e4ae.bin	https://oss.ecowitt.net/ota/20240628/818c81b00866afbaf227d21d1b44e4ae.bin
-GW1200-V1.2.8-c63ef3ec41b6c8d9e7e8a40cdcde0658.bin	https://osswww.ecowitt.net/ota/20240219/c63ef3ec41b6c8d9e7e8a40cdcde0658.bin
-GW1200-V1.3.0-fa57569a964b6a851a4537bb50a2910a.bin	https://osswww.ecowitt.net/ota/20240427/fa57569a964b6a851a4537bb50a2910a.bin
-GW1200-V1.3.1-4f4535d9ee80468cb18415e088ffd3e7.bin	https://osswww.ecowitt.net/ota/20240429/4f4535d9ee80468cb18415e088ffd3e7.bin
-GW1200-V1.3.2-fd0b98b0f7e7f6b3598fd5aaa6a6c7cc.bin	https://oss.ecowitt.net/ota/20240704/fd0b98b0f7e7f6b3598fd5aaa6a6c7cc.bin
-GW2000-V3.1.2-d0230943cdf23c9469244c49e32bc0e1.bin	https://osswww.ecowitt.net/ota/20240312/d0230943cdf23c9469244c49e32bc0e1.bin
-GW2000-V3.1.3-fedec1810580d5bc0b8a0c26c057202c.bin	https://oss.ecowitt.net/ota/20240521/fedec1810580d5bc0b8a0c26c057202c.bin
-GW2000-V3.1.4-2c83b647854e9a1c0ba560ec96082776.bin	https://oss.ecowitt.net/ota/20240621/2c83b647854e9a1c0ba560ec96082776.bin
-HP2550-V1.9.6-0e1c35332fbe187dd569b91c28a2e395.bin	https://osswww.ecowitt.net/ota/20240502/0e1c35332fbe187dd569b91c28a2e395.bin
-WN1820-V1.2.8-0a4e883b2fed37bf2edbcc77c744c420.bin	https://osswww.ecowitt.net/ota/20240220/0a4e883b2fed37bf2edbcc77c744c420.bin
-WN1820-V1.3.0-35273a44565d572fb1b62716f21f306c.bin	https://osswww.ecowitt.net/ota/20240430/35273a44565d572fb1b62716f21f306c.bin
-WS3800-V1.2.8.1-43ebdcb4964e074d406bfa3a2bf76bb4.bin	https://osswww.ecowitt.net/ota/20240325/43ebdcb4964e074d406bfa3a2bf76bb4.bin
-EOF
+	case $c in
+	q)	silent="--silent --show-error";;
+	j)	jobs="$OPTARG";;
+	b)	baseurl=`echo "$OPTARG" | sed 's,/*$,,'`;;
+	f)	fwinfo="$OPTARG";;
+	s)	sources="$OPTARG";;
+	d)	dir="$OPTARG";;
+	*)	usage;;
+	esac
+done
+shift `expr $OPTIND - 1`
+[ $# -eq 0 ] || usage
+
+if [ ! -r "$fwinfo" ]; then
+	echo "$0: cannot read \"$fwinfo\"" 1>&2
+	exit 1
+fi
+if [ -z "$baseurl" -a ! -r "$sources" ]; then
+	echo "$0: cannot read \"$sources\" - use -b baseurl instead?" 1>&2
+	exit 1
+fi
+
+# Every image named in firmware-info (file, file1, file2), then the others in
+# sources, once each, with where to get it: baseurl/FILE, or the URL in
+# sources, or "-" for nowhere.
+list=`awk -v base="$baseurl" -v sources="$sources" '
+	BEGIN {
+		while ((getline line < sources) > 0) {
+			if (line ~ /^[ \t]*(#|$)/)
+				continue
+			split (line, f)
+			if (!(f[1] in url))
+				order[n++] = f[1]
+			url[f[1]] = f[2]
+		}
+	}
+	function where(file) {
+		if (base != "")
+			return base "/" file
+		return file in url ? url[file] : "-"
+	}
+	$1 ~ /^file[12]?$/ && NF >= 2 && !seen[$2]++ {
+		print $2, where($2)
+	}
+	END {
+		for (i = 0; i < n; i++)
+			if (!seen[order[i]]++)
+				print order[i], where(order[i])
+	}' "$fwinfo"`
+
+if [ -z "$list" ]; then
+	echo "$0: no firmware files listed in \"$fwinfo\"" 1>&2
+	exit 1
+fi
+
+FW_DIR="$dir" FW_SILENT="$silent" FW_SOURCES="$sources"
+export FW_DIR FW_SILENT FW_SOURCES
+echo "$list" | xargs -n 2 -P "$jobs" sh "$here/`basename "$0"`" -1
+failed=$?
+
+# Refresh MANIFEST with everything that's here now.
+(
+	cd "$dir" &&
+	for f in `echo "$list" | awk '{ print $1 }'`; do
+		if [ -f "$f" ]; then
+			echo "`md5of "$f"`  $f"
+		fi
+	done > .MANIFEST.$$ &&
+	mv -f .MANIFEST.$$ MANIFEST
+) || echo "$0: could not write $dir/MANIFEST" 1>&2
 
+if [ $failed -ne 0 ]; then
+	echo "$0: some downloads failed - run it again to pick up where they stopped" 1>&2
+	exit 2
+fi
+exit 0
@@ -0,0 +1,19 @@
+<?php
+
+// This is to be installed as /include/common.php, beside /api and /data.
+// It holds what more than one of the pages needs, and is only ever
+// included by them - requesting it sends nothing.
+
+
+// Put a MAC address into one standard form - lower case, with colons -
+// so that "30-83-98-7A-E2-9D", "308398 7ae29d", and "30:83:98:7a:e2:9d"
+// are all the same device.  Anything that isn't a MAC address is simply
+// lower-cased.
+function normalizemac ($mac)
+{
+	$hex = preg_replace ('/[^0-9a-f]/', '', strtolower ($mac));
+	if (strlen ($hex) != 12)
+		return strtolower (trim ($mac));
+	return implode (":", str_split ($hex, 2));
+}
+?>
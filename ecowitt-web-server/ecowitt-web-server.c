@@ -0,0 +1,1056 @@
+/*
+ *	A small web server to stand in for the Ecowitt web sites, giving
+ *	the same responses as the PHP pages in ../ecowitt-web-pages, and
+ *	serving the firmware images.
+ *
+ *	This is a single process with a single thread - one poll() loop
+ *	handles every connection.  All of the connection buffers are
+ *	allocated at startup, so the memory used doesn't grow with the
+ *	load; when every slot is busy, new connections simply wait in the
+ *	listen queue.  The firmware-info catalog is parsed once and kept
+ *	in memory until the file changes - which a thread of its own watches
+ *	for, so the loop never waits for it to be read (see firmware-watch.c).
+ */
+
+#define	_GNU_SOURCE		// for memmem() and strptime() on Linux
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#elif defined(__FreeBSD__)
+# include <sys/uio.h>
+#endif
+
+#include <poll.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-web-server.h"
+#include "firmware-info.h"
+
+
+/* global variables */
+char	*progname;
+int	debug = 0;
+int	verbose = 0;
+char	*docroot = "/www/ecowitt";
+char	*fwinfo_file = NULL;	// default is within docroot - see main()
+char	*zonename = NULL;	// reported by ip_api, if given
+double	latitude, longitude;
+int	have_location = 0;
+char	*locations_file = NULL;	// default is within docroot - see main()
+char	*spooldir = NULL;	// where to spool the reports, if anywhere
+int	merge_window = 0;	// seconds in which to merge the sites' sensors, or 0
+int	rollups = 0;		// keep rollups of the reports, too?
+int	fanout = 0;		// sinks to send the reports on to, too
+
+static struct conn *conns;	// the connection table
+static struct pollfd *pfds;	// [0] is the listener, [i+1] is conns[i]
+static int	maxconns = 256;
+static int	nconns = 0;
+static time_t	now;
+
+#define	SENDFILE_CHUNK	(64 * 1024)	// so that one download can't hog the loop
+
+/*
+ *	The pages that we provide, in place of the PHP scripts.  Apache
+ *	finds these with or without the ".php" - see ecowitt-vhost.conf.
+ */
+static const struct route {
+	const char *path;
+	int	(*handler) (struct conn *cp, struct request *rq);
+} routes[] = {
+	{ "/api/ota/v1/version/info",		info_endpoint },
+	{ "/api/ota/v1/version/info.php",	info_endpoint },
+	{ "/api/index/initialization",		initialization_endpoint },
+	{ "/api/index/initialization.php",	initialization_endpoint },
+	{ "/data/ip_api/",			ip_api_endpoint },
+	{ "/data/ip_api/index.php",		ip_api_endpoint },
+	{ "/data/report/",			report_endpoint },
+	{ "/data/report/index.php",		report_endpoint },
+	{ NULL,					NULL }
+};
+
+
+/* prototypes */
+int	open_listener (char *host, char *service);
+void	accept_connections (int listenfd);
+void	conn_close (struct conn *cp);
+void	conn_read (struct conn *cp);
+void	conn_write (struct conn *cp);
+void	handle_requests (struct conn *cp);
+int	parse_request (struct conn *cp);
+void	finish_response (struct conn *cp);
+int	dispatch (struct conn *cp, struct request *rq);
+int	static_file (struct conn *cp, struct request *rq);
+int	start_response (struct conn *cp, struct request *rq, int status,
+		const char *content_type, const char *extra, off_t length);
+int	error_response (struct conn *cp, struct request *rq, int status);
+ssize_t	send_file (struct conn *cp);
+
+int	url_decode (char *s, int plus);
+void	parse_params (struct request *rq, char *s);
+int	parse_range (const char *s, off_t size, off_t *start, off_t *end);
+const char *http_date (time_t t);
+const char *status_text (int status);
+
+void	usage (void);
+
+
+/*
+ *	Get a request parameter, as PHP's $_REQUEST[] would - the POST
+ *	parameters follow the GET parameters, and the last one wins.
+ */
+char *
+get_param (struct request *rq, const char *name)
+{
+	int	i;
+
+	for (i = rq->nparams - 1; i >= 0; i--) {
+		if (strcmp (rq->params[i].name, name) == 0)
+			return rq->params[i].value;
+	}
+	return NULL;
+}
+
+/*
+ *	Log the request the way that the PHP pages do, if they asked for it.
+ */
+void
+log_request (struct conn *cp, struct request *rq, const char *script)
+{
+	int	i;
+
+	if (verbose < 2)
+		return;
+
+	syslog (LOG_INFO, "running %s - method[%s], host[%s], http_host[%s]",
+		script, rq->method, cp->ipaddr, rq->host ? rq->host : "<notset>");
+	for (i = 0; i < rq->nparams; i++)
+		syslog (LOG_INFO, " var[%s] = \"%s\"",
+			rq->params[i].name, rq->params[i].value);
+	if (rq->nparams > 0)
+		syslog (LOG_INFO, "###");
+}
+
+
+/*
+ *	Open the listening socket.
+ */
+int
+open_listener (char *host, char *service)
+{
+	struct addrinfo hints, *res, *ai;
+	int	s = -1;
+	int	on = 1;
+	int	r;
+
+	memset (&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((r = getaddrinfo (host, service, &hints, &res)) != 0) {
+		fprintf (stderr, "%s: %s/%s: %s\n",
+			progname, host ? host : "*", service, gai_strerror (r));
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((s = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (bind (s, ai->ai_addr, ai->ai_addrlen) == 0 && listen (s, 128) == 0)
+			break;
+		close (s);
+		s = -1;
+	}
+	freeaddrinfo (res);
+
+	if (s < 0) {
+		fprintf (stderr, "%s: cannot listen on %s/%s: %s\n",
+			progname, host ? host : "*", service, strerror (errno));
+		return -1;
+	}
+	fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
+	return s;
+}
+
+/*
+ *	Accept as many new connections as we have room for.
+ */
+void
+accept_connections (int listenfd)
+{
+	static int next = 0;		// where to start looking for a free slot
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	struct conn *cp;
+	int	fd;
+
+	while (nconns < maxconns) {
+		salen = sizeof sa;
+		if ((fd = accept (listenfd, (struct sockaddr *) &sa, &salen)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+			    errno != ECONNABORTED)
+				syslog (LOG_ERR, "%s: accept: %m", __FUNCTION__);
+			return;
+		}
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+		while (conns[next].state != CONN_FREE)
+			next = (next + 1) % maxconns;
+		cp = &conns[next];
+
+		cp->fd = fd;
+		cp->state = CONN_READING;
+		cp->lastactive = now;
+		cp->reqlen = 0;
+		cp->hdrlen = 0;
+		cp->resplen = cp->respoff = 0;
+		cp->filefd = -1;
+		getnameinfo ((struct sockaddr *) &sa, salen, cp->ipaddr, sizeof cp->ipaddr,
+			NULL, 0, NI_NUMERICHOST);
+		nconns++;
+	}
+}
+
+void
+conn_close (struct conn *cp)
+{
+	if (cp->filefd >= 0) {
+		close (cp->filefd);
+		cp->filefd = -1;
+	}
+	close (cp->fd);
+	cp->fd = -1;
+	cp->state = CONN_FREE;
+	nconns--;
+}
+
+void
+conn_read (struct conn *cp)
+{
+	ssize_t	r;
+
+	if (cp->reqlen >= REQ_BUFSIZE) {	// parse_request() should prevent this
+		conn_close (cp);
+		return;
+	}
+	r = read (cp->fd, cp->req + cp->reqlen, REQ_BUFSIZE - cp->reqlen);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (r <= 0) {		// closed by the client, or an error
+		conn_close (cp);
+		return;
+	}
+	cp->reqlen += r;
+	cp->lastactive = now;
+
+	handle_requests (cp);
+}
+
+/*
+ *	Answer each complete request in the buffer, one at a time - another
+ *	may have been sent (pipelined) before we answered the first one.
+ */
+void
+handle_requests (struct conn *cp)
+{
+	struct request *rq = &cp->rq;
+	int	r;
+
+	while (cp->state == CONN_READING && cp->reqlen > 0) {
+		if ((r = parse_request (cp)) == 0)	// need more
+			return;
+
+		cp->state = CONN_WRITING;
+		if (r < 0) {		// can't go on with this connection
+			cp->keepalive = 0;
+			error_response (cp, rq, -r);
+		} else {
+			dispatch (cp, rq);
+			if (cp->hdrlen + rq->bodylen < cp->reqlen)
+				rq->body[rq->bodylen] = cp->saved;
+		}
+		conn_write (cp);
+	}
+}
+
+/*
+ *	Parse the request in the connection's buffer.
+ *
+ *	Returns 0 if the request isn't complete yet, 1 if it is, or the
+ *	negated HTTP status to send back if it's unacceptable.
+ */
+int
+parse_request (struct conn *cp)
+{
+	struct request *rq = &cp->rq;
+	char	*end, *line, *next, *name, *val, *s;
+	char	*target, *version;
+	char	*connection = NULL;
+	long	clen = 0;
+
+	if (cp->hdrlen == 0) {
+		memset (rq, 0, offsetof (struct request, params));
+		rq->nparams = 0;
+
+		if ((end = memmem (cp->req, cp->reqlen, "\r\n\r\n", 4)) == NULL) {
+			if (cp->reqlen >= REQ_MAXHEADER)
+				return -400;
+			return 0;
+		}
+		cp->hdrlen = end + 4 - cp->req;
+		if (cp->hdrlen > REQ_MAXHEADER)
+			return -400;
+		*end = '\0';
+
+		// the request line - "GET /path?query HTTP/1.1"
+		line = cp->req;
+		if ((next = strchr (line, '\n')) != NULL)
+			*next++ = '\0';
+		rq->method = line;
+		if ((target = strchr (line, ' ')) == NULL)
+			return -400;
+		*target++ = '\0';
+		if ((version = strchr (target, ' ')) == NULL)
+			return -400;
+		*version++ = '\0';
+		if ((s = strchr (version, '\r')) != NULL)
+			*s = '\0';
+		if (strncmp (version, "HTTP/1.", 7) != 0)
+			return -505;
+		rq->minor = atoi (version + 7);
+		rq->head = (strcmp (rq->method, "HEAD") == 0);
+
+		if ((s = strchr (target, '?')) != NULL) {
+			*s++ = '\0';
+			rq->query = s;
+		}
+		rq->path = target;
+		if (*target != '/' || url_decode (target, 0) < 0)
+			return -400;
+
+		// the headers that we care about
+		for (line = next; line != NULL && *line != '\0'; line = next) {
+			if ((next = strchr (line, '\n')) != NULL)
+				*next++ = '\0';
+			if ((val = strchr (line, ':')) == NULL)
+				continue;
+			name = line;
+			*val++ = '\0';
+			while (*val == ' ' || *val == '\t')
+				val++;
+			for (s = val + strlen (val); s > val && isspace ((unsigned char) s[-1]); )
+				*--s = '\0';
+
+			if (strcasecmp (name, "Host") == 0)
+				rq->host = val;
+			else if (strcasecmp (name, "Content-Length") == 0) {
+				clen = strtol (val, &s, 10);
+				if (s == val || *s != '\0' || clen < 0)
+					return -400;
+			} else if (strcasecmp (name, "Content-Type") == 0)
+				rq->content_type = val;
+			else if (strcasecmp (name, "Connection") == 0)
+				connection = val;
+			else if (strcasecmp (name, "Range") == 0)
+				rq->range = val;
+			else if (strcasecmp (name, "If-Modified-Since") == 0)
+				rq->if_modified_since = val;
+			else if (strcasecmp (name, "Transfer-Encoding") == 0)
+				return -501;	// the devices never send chunked data
+		}
+
+		if (rq->minor >= 1)
+			cp->keepalive = (connection == NULL || strcasecmp (connection, "close") != 0);
+		else
+			cp->keepalive = (connection != NULL && strcasecmp (connection, "keep-alive") == 0);
+
+		if (clen > REQ_MAXBODY)
+			return -413;
+		rq->body = cp->req + cp->hdrlen;
+		rq->bodylen = (int) clen;
+	}
+
+	if (cp->hdrlen + rq->bodylen > cp->reqlen)	// still waiting for the body
+		return 0;
+
+	// Terminate the body, saving the byte that we overwrite - it may be
+	// the start of the next request.
+	cp->saved = rq->body[rq->bodylen];
+	rq->body[rq->bodylen] = '\0';
+
+	// now the parameters, GET first, then POST, as in $_REQUEST
+	if (rq->query != NULL)
+		parse_params (rq, rq->query);
+	if (rq->bodylen > 0 && rq->content_type != NULL &&
+	    strncasecmp (rq->content_type, "application/x-www-form-urlencoded", 33) == 0)
+		parse_params (rq, rq->body);
+
+	return 1;
+}
+
+/*
+ *	Decode "%xx" escapes (and '+', for parameters) in place.  Returns
+ *	the new length, or -1 if the result would include a null.
+ */
+int
+url_decode (char *s, int plus)
+{
+	char	*d = s;
+	char	*start = s;
+	int	hi, lo;
+
+	for ( ; *s != '\0'; s++) {
+		if (*s == '%' && isxdigit ((unsigned char) s[1]) && isxdigit ((unsigned char) s[2])) {
+			hi = isdigit ((unsigned char) s[1]) ? s[1] - '0' : (tolower ((unsigned char) s[1]) - 'a' + 10);
+			lo = isdigit ((unsigned char) s[2]) ? s[2] - '0' : (tolower ((unsigned char) s[2]) - 'a' + 10);
+			if ((*d = (hi << 4) | lo) == '\0')
+				return -1;
+			d++;
+			s += 2;
+		} else if (*s == '+' && plus) {
+			*d++ = ' ';
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+	return (int)(d - start);
+}
+
+/*
+ *	Split "name=value&name=value" into the request parameters.  As PHP
+ *	does, spaces and dots in the names become underscores.
+ */
+void
+parse_params (struct request *rq, char *s)
+{
+	char	*next, *val, *p;
+
+	for ( ; s != NULL; s = next) {
+		if ((next = strchr (s, '&')) != NULL)
+			*next++ = '\0';
+		if ((val = strchr (s, '=')) != NULL)
+			*val++ = '\0';
+		else
+			val = s + strlen (s);
+		if (url_decode (s, 1) <= 0 || url_decode (val, 1) < 0)
+			continue;
+		if (rq->nparams >= REQ_MAXPARAMS) {
+			syslog (LOG_WARNING, "%s: too many parameters - ignoring \"%s\"",
+				__FUNCTION__, s);
+			continue;
+		}
+		for (p = s; *p != '\0'; p++) {
+			if (*p == ' ' || *p == '.')
+				*p = '_';
+		}
+		rq->params[rq->nparams].name = s;
+		rq->params[rq->nparams].value = val;
+		rq->nparams++;
+	}
+}
+
+/*
+ *	Hand the request to the right page.
+ */
+int
+dispatch (struct conn *cp, struct request *rq)
+{
+	const struct route *rp;
+	char	extra[1024];
+	size_t	len;
+
+	for (rp = routes; rp->path != NULL; rp++) {
+		if (strcmp (rq->path, rp->path) == 0)
+			return (*rp->handler) (cp, rq);
+	}
+
+	// A directory without the trailing slash - Apache redirects these,
+	// so we do, too.
+	len = strlen (rq->path);
+	for (rp = routes; rp->path != NULL; rp++) {
+		if (strncmp (rp->path, rq->path, len) == 0 &&
+		    rp->path[len] == '/' && rp->path[len + 1] == '\0') {
+			snprintf (extra, sizeof extra, "Location: http://%s%s/%s%s\r\n",
+				rq->host ? rq->host : "localhost", rq->path,
+				rq->query ? "?" : "", rq->query ? rq->query : "");
+			return start_response (cp, rq, 301, NULL, extra, 0);
+		}
+	}
+
+	if (strncmp (rq->path, "/firmware/", 10) == 0)
+		return static_file (cp, rq);
+
+	return error_response (cp, rq, 404);
+}
+
+/*
+ *	Send a file from the document root - only the firmware images.
+ *	This supports HEAD, If-Modified-Since, and a single Range, which
+ *	is all that the devices (or curl -C) will use.
+ */
+int
+static_file (struct conn *cp, struct request *rq)
+{
+	char	fname[1024];
+	char	extra[256];
+	struct stat stb;
+	const struct fw_indexed *ip;
+	struct tm tm;
+	off_t	start, end;
+	int	status = 200;
+	int	fd;
+	int	n, r;
+
+	if (strcmp (rq->method, "GET") != 0 && strcmp (rq->method, "HEAD") != 0)
+		return error_response (cp, rq, 405);
+
+	// nothing hidden, and no way out of the document root
+	if (strstr (rq->path, "/.") != NULL)
+		return error_response (cp, rq, 404);
+
+	if (snprintf (fname, sizeof fname, "%s%s", docroot, rq->path) >= (int) sizeof fname)
+		return error_response (cp, rq, 404);
+	if ((fd = open (fname, O_RDONLY)) < 0)
+		return error_response (cp, rq, errno == EACCES ? 403 : 404);
+	if (fstat (fd, &stb) < 0 || !S_ISREG (stb.st_mode)) {
+		close (fd);
+		return error_response (cp, rq, 404);
+	}
+
+	n = snprintf (extra, sizeof extra, "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+		http_date (stb.st_mtime));
+
+	// what the watcher made of it, if this is the version that it looked at
+	if ((ip = find_image (rq->path + 10)) != NULL && ip->ino == stb.st_ino &&
+	    ip->size == stb.st_size && ip->mtime == stb.st_mtime) {
+		if (ip->damaged) {
+			close (fd);
+			return error_response (cp, rq, 404);
+		}
+		n += snprintf (extra + n, sizeof extra - n, "ETag: \"%s\"\r\n", ip->md5);
+	}
+
+	if (rq->if_modified_since != NULL && rq->range == NULL) {
+		memset (&tm, 0, sizeof tm);
+		if (strptime (rq->if_modified_since, "%a, %d %b %Y %H:%M:%S", &tm) != NULL &&
+		    stb.st_mtime <= timegm (&tm)) {
+			close (fd);
+			return start_response (cp, rq, 304, NULL, extra, -1);
+		}
+	}
+
+	start = 0;
+	end = stb.st_size;
+	if (rq->range != NULL) {
+		if ((r = parse_range (rq->range, stb.st_size, &start, &end)) < 0) {
+			close (fd);
+			snprintf (extra + n, sizeof extra - n, "Content-Range: bytes */%lld\r\n",
+				(long long) stb.st_size);
+			return start_response (cp, rq, 416, NULL, extra, 0);
+		}
+		if (r > 0) {
+			status = 206;
+			snprintf (extra + n, sizeof extra - n, "Content-Range: bytes %lld-%lld/%lld\r\n",
+				(long long) start, (long long) end - 1, (long long) stb.st_size);
+		}
+	}
+
+	if (start_response (cp, rq, status, "application/octet-stream", extra, end - start) < 0 ||
+	    rq->head || start == end) {
+		close (fd);
+		return 0;
+	}
+	cp->filefd = fd;
+	cp->fileoff = start;
+	cp->fileend = end;
+	return 0;
+}
+
+/*
+ *	Parse a "Range: bytes=..." header.  Returns 1 with the range to send
+ *	in *start and *end, 0 to ignore it and send the whole file, or -1 if
+ *	it can't be satisfied.
+ */
+int
+parse_range (const char *s, off_t size, off_t *start, off_t *end)
+{
+	long long first, last;
+	char	*e;
+
+	if (strncasecmp (s, "bytes=", 6) != 0)
+		return 0;
+	s += 6;
+	if (strchr (s, ',') != NULL)	// more than one range - send it all
+		return 0;
+
+	if (*s == '-') {		// the last N bytes
+		last = strtoll (s + 1, &e, 10);
+		if (e == s + 1 || *e != '\0')
+			return 0;
+		if (last <= 0)
+			return -1;
+		*start = last > size ? 0 : size - last;
+		*end = size;
+		return 1;
+	}
+
+	first = strtoll (s, &e, 10);
+	if (e == s || *e != '-')
+		return 0;
+	s = e + 1;
+	if (*s == '\0') {		// from here to the end
+		last = size - 1;
+	} else {
+		last = strtoll (s, &e, 10);
+		if (e == s || *e != '\0' || last < first)
+			return 0;
+		if (last >= size)
+			last = size - 1;
+	}
+	if (first >= size)
+		return -1;
+	*start = first;
+	*end = last + 1;
+	return 1;
+}
+
+/*
+ *	Send a complete response, with the body.  The pages use this.
+ */
+int
+http_respond (struct conn *cp, struct request *rq, int status,
+	const char *content_type, const char *body, int bodylen)
+{
+	if (start_response (cp, rq, status, content_type, NULL, bodylen) < 0)
+		return -1;
+	if (rq->head || bodylen == 0)
+		return 0;
+	if (cp->resplen + bodylen > RESP_BUFSIZE) {
+		syslog (LOG_ERR, "%s: %d byte response for %s is too large",
+			__FUNCTION__, bodylen, rq->path);
+		cp->keepalive = 0;
+		return start_response (cp, rq, 500, NULL, NULL, 0);
+	}
+	memcpy (cp->resp + cp->resplen, body, bodylen);
+	cp->resplen += bodylen;
+	return 0;
+}
+
+/*
+ *	Put the status line and headers into the response buffer.  A length
+ *	of -1 leaves out the Content-Length, for a 304.
+ */
+int
+start_response (struct conn *cp, struct request *rq, int status,
+	const char *content_type, const char *extra, off_t length)
+{
+	char	clen[64] = "";
+	char	ctype[128] = "";
+	int	n;
+
+	cp->status = status;
+	if (length >= 0)
+		snprintf (clen, sizeof clen, "Content-Length: %lld\r\n", (long long) length);
+	if (content_type != NULL)
+		snprintf (ctype, sizeof ctype, "Content-Type: %s\r\n", content_type);
+
+	n = snprintf (cp->resp, RESP_BUFSIZE,
+		"HTTP/1.1 %d %s\r\n"
+		"Date: %s\r\n"
+		"Server: %s\r\n"
+		"X-Frame-Options: DENY\r\n"
+		"%s%s%s"
+		"Connection: %s\r\n"
+		"\r\n",
+		status, status_text (status), http_date (now), progname,
+		extra ? extra : "", clen, ctype,
+		cp->keepalive ? "keep-alive" : "close");
+	if (n >= RESP_BUFSIZE) {	// can't happen, but ...
+		cp->keepalive = 0;
+		cp->resplen = 0;
+		return -1;
+	}
+	cp->resplen = n;
+	cp->respoff = 0;
+	return 0;
+}
+
+int
+error_response (struct conn *cp, struct request *rq, int status)
+{
+	char	body[256];
+	int	len;
+
+	len = snprintf (body, sizeof body,
+		"<html><head><title>%d %s</title></head>\n"
+		"<body><h1>%s</h1></body></html>\n",
+		status, status_text (status), status_text (status));
+	return http_respond (cp, rq, status, "text/html; charset=iso-8859-1", body, len);
+}
+
+/*
+ *	Send as much of the response as the socket will take.
+ */
+void
+conn_write (struct conn *cp)
+{
+	ssize_t	r;
+
+	while (cp->respoff < cp->resplen) {
+		r = write (cp->fd, cp->resp + cp->respoff, cp->resplen - cp->respoff);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			conn_close (cp);
+			return;
+		}
+		cp->respoff += r;
+		cp->lastactive = now;
+	}
+
+	while (cp->filefd >= 0 && cp->fileoff < cp->fileend) {
+		if ((r = send_file (cp)) < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (r <= 0) {		// error, or the file got shorter
+			conn_close (cp);
+			return;
+		}
+		cp->lastactive = now;
+	}
+
+	finish_response (cp);
+}
+
+/*
+ *	Send the next piece of the file, with sendfile() where we have it.
+ */
+ssize_t
+send_file (struct conn *cp)
+{
+	size_t	count = cp->fileend - cp->fileoff;
+	ssize_t	r;
+
+	if (count > SENDFILE_CHUNK)
+		count = SENDFILE_CHUNK;
+
+#if defined(__linux__)
+	r = sendfile (cp->fd, cp->filefd, &cp->fileoff, count);
+#elif defined(__FreeBSD__)
+	off_t	sbytes = 0;
+
+	r = sendfile (cp->filefd, cp->fd, cp->fileoff, count, NULL, &sbytes, 0);
+	cp->fileoff += sbytes;
+	if (sbytes > 0)		// a partial send is still progress
+		r = sbytes;
+#else
+	// no sendfile() - copy through the response buffer, which is done with
+	if (count > RESP_BUFSIZE)
+		count = RESP_BUFSIZE;
+	if ((r = pread (cp->filefd, cp->resp, count, cp->fileoff)) > 0 &&
+	    (r = write (cp->fd, cp->resp, r)) > 0)
+		cp->fileoff += r;
+#endif
+	return r;
+}
+
+/*
+ *	The response has gone - get ready for the next request.
+ */
+void
+finish_response (struct conn *cp)
+{
+	struct request *rq = &cp->rq;
+	int	consumed;
+
+	if (verbose)
+		syslog (LOG_INFO, "%s \"%s %s\" %d",
+			cp->ipaddr, rq->method ? rq->method : "-",
+			rq->path ? rq->path : "-", cp->status);
+
+	if (cp->filefd >= 0) {
+		close (cp->filefd);
+		cp->filefd = -1;
+	}
+	if (!cp->keepalive) {
+		conn_close (cp);
+		return;
+	}
+
+	consumed = cp->hdrlen + rq->bodylen;
+	memmove (cp->req, cp->req + consumed, cp->reqlen - consumed);
+	cp->reqlen -= consumed;
+	cp->hdrlen = 0;
+	cp->resplen = cp->respoff = 0;
+	cp->state = CONN_READING;
+}
+
+
+/*
+ *	Format a time for the Date and Last-Modified headers.  The current
+ *	time is asked for over and over, so remember the last one.
+ */
+const char *
+http_date (time_t t)
+{
+	static char nowbuf[64], buf[64];
+	static time_t last = -1;
+	struct tm tm;
+
+	if (t == now) {
+		if (t != last) {
+			gmtime_r (&t, &tm);
+			strftime (nowbuf, sizeof nowbuf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+			last = t;
+		}
+		return nowbuf;
+	}
+	gmtime_r (&t, &tm);
+	strftime (buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return buf;
+}
+
+const char *
+status_text (int status)
+{
+	switch (status) {
+	case 200:	return "OK";
+	case 202:	return "Accepted";
+	case 206:	return "Partial Content";
+	case 301:	return "Moved Permanently";
+	case 304:	return "Not Modified";
+	case 400:	return "Bad Request";
+	case 403:	return "Forbidden";
+	case 404:	return "Not Found";
+	case 405:	return "Method Not Allowed";
+	case 413:	return "Request Entity Too Large";
+	case 416:	return "Requested Range Not Satisfiable";
+	case 500:	return "Internal Server Error";
+	case 501:	return "Not Implemented";
+	case 505:	return "HTTP Version Not Supported";
+	default:	return "Unknown";
+	}
+}
+
+
+void
+usage (void)
+{
+	fprintf (stderr,
+		"Usage: %s [-d][-v] [-a address] [-p port] [-r docroot] [-f firmware-info]\n"
+		"\t[-l latitude,longitude] [-L locations] [-z timezone] [-c maxconns]\n"
+		"\t[-s spooldir [-m seconds] [-R] [-F sink]...]\n",
+		progname);
+	exit (1);
+	/*NOTREACHED*/
+}
+
+
+int
+main (int argc, char **argv)
+{
+	int	c;
+	char	*cp;
+	char	*host = NULL,
+		*service = "80";
+	int	listenfd;
+	int	i, r;
+	time_t	lastsweep = 0;
+
+	setvbuf (stdout, NULL, _IOLBF, BUFSIZ);
+	setvbuf (stderr, NULL, _IOLBF, BUFSIZ);
+
+	if ((cp = strrchr (argv[0], '/')) != NULL) {
+		*cp++ = '\0';	/* zap the slash */
+		progname = cp;		/* progname becomes basename */
+		argv[0] = progname;	/* for the benefit of getopt() */
+	} else {
+		progname = argv[0];	/* progname is simply argv[0] */
+	}
+
+	while ((c = getopt (argc, argv, "a:c:dF:f:l:L:m:p:r:Rs:vz:")) != EOF) {
+		switch (c) {
+		case 'a':	// address to listen on
+			host = optarg;
+			break;
+		case 'c':	// maximum number of connections
+			if ((maxconns = atoi (optarg)) <= 0)
+				usage ();
+			break;
+		case 'd':	// enable debugging - log to stderr, too
+			debug++;
+			break;
+		case 'F':	// send the reports on to this, too
+			if (fanout_add (optarg) < 0)
+				exit (1);
+			fanout++;
+			break;
+		case 'f':	// firmware-info file
+			fwinfo_file = optarg;
+			break;
+		case 'l':	// latitude,longitude for ip_api
+			if (sscanf (optarg, "%lf,%lf", &latitude, &longitude) != 2) {
+				fprintf (stderr, "%s: bad latitude,longitude \"%s\"\n",
+					progname, optarg);
+				exit (1);
+			}
+			have_location = 1;
+			break;
+		case 'L':	// where each device is, for ip_api
+			locations_file = optarg;
+			break;
+		case 'm':	// merge the sensors that a site's gateways share, over this long
+			if ((merge_window = atoi (optarg)) <= 0)
+				usage ();
+			break;
+		case 'p':	// port/service
+			service = optarg;
+			break;
+		case 'r':	// document root
+			docroot = optarg;
+			break;
+		case 'R':	// keep rollups of the reports, by the minute, hour and day
+			rollups++;
+			break;
+		case 's':	// spool the reports into this directory
+			spooldir = optarg;
+			break;
+		case 'v':	// log each request (twice for the parameters, too)
+			verbose++;
+			break;
+		case 'z':	// time zone to use and report
+			zonename = optarg;
+			setenv ("TZ", zonename, 1);
+			break;
+		case '?':	/* bad option */
+			usage ();
+			break;
+		}
+	}
+	if (optind != argc) {
+		fprintf (stderr, "%s: too many arguments specified -- \"%s\" ...\n",
+			progname, argv[optind]);
+		usage ();
+	}
+	if ((merge_window > 0 || rollups || fanout) && spooldir == NULL) {
+		fprintf (stderr, "%s: \"-%c\" works from the spool - use \"-s spooldir\"\n",
+			progname, fanout ? 'F' : rollups ? 'R' : 'm');
+		exit (1);
+	}
+
+	if (fwinfo_file == NULL) {
+		if ((fwinfo_file = malloc (strlen (docroot) + 64)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		sprintf (fwinfo_file, "%s/api/ota/v1/version/firmware-info", docroot);
+	}
+	if (locations_file == NULL) {
+		if ((locations_file = malloc (strlen (docroot) + 64)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			exit (1);
+		}
+		sprintf (locations_file, "%s/data/ip_api/locations", docroot);
+	}
+
+	tzset ();
+	openlog (progname, LOG_PID | (debug ? LOG_PERROR : 0), LOG_DAEMON);
+	signal (SIGPIPE, SIG_IGN);
+
+	// Everything that we will need, all at once:
+	conns = calloc (maxconns, sizeof *conns);
+	pfds = calloc (maxconns + 1, sizeof *pfds);
+	if (conns == NULL || pfds == NULL) {
+		fprintf (stderr, "%s: not enough memory for %d connections\n",
+			progname, maxconns);
+		exit (1);
+	}
+	for (i = 0; i < maxconns; i++) {
+		conns[i].fd = -1;
+		conns[i].filefd = -1;
+	}
+
+	if ((listenfd = open_listener (host, service)) < 0)
+		exit (2);
+	if (spooldir != NULL && spool_start (spooldir) < 0)
+		exit (2);
+	if (rollups && rollup_start (spooldir) < 0)
+		exit (2);
+	if (fanout && fanout_start () < 0)
+		exit (2);
+
+	// Read the catalog and locations now, to report any problems right away:
+	now = time (NULL);
+	if (watch_start () < 0)
+		exit (2);
+	find_site (NULL, now);
+
+	syslog (LOG_INFO, "listening on %s/%s, document root %s",
+		host ? host : "*", service, docroot);
+
+	for (;;) {
+		pfds[0].fd = (nconns < maxconns) ? listenfd : -1;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < maxconns; i++) {
+			pfds[i + 1].fd = conns[i].fd;
+			pfds[i + 1].events = (conns[i].state == CONN_WRITING) ? POLLOUT : POLLIN;
+			pfds[i + 1].revents = 0;
+		}
+
+		if ((r = poll (pfds, maxconns + 1, 1000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog (LOG_ERR, "poll: %m");
+			exit (3);
+		}
+		now = time (NULL);
+
+		for (i = 0; r > 0 && i < maxconns; i++) {
+			if (pfds[i + 1].revents == 0 || conns[i].fd != pfds[i + 1].fd)
+				continue;
+			r--;
+			if (conns[i].state == CONN_READING) {
+				conn_read (&conns[i]);
+			} else {
+				conn_write (&conns[i]);
+				handle_requests (&conns[i]);
+			}
+		}
+		if (pfds[0].fd >= 0 && (pfds[0].revents & POLLIN))
+			accept_connections (listenfd);
+
+		// close the connections that have gone quiet
+		if (now != lastsweep) {
+			for (i = 0; i < maxconns; i++) {
+				if (conns[i].state != CONN_FREE &&
+				    now - conns[i].lastactive > IDLE_TIMEOUT)
+					conn_close (&conns[i]);
+			}
+			lastsweep = now;
+		}
+
+		// nothing from the firmware snapshots is kept from here on
+		watch_quiescent ();
+	}
+	/*NOTREACHED*/
+}
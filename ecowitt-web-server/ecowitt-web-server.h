@@ -0,0 +1,167 @@
+/*
+ *	Common definitions for the Ecowitt web server and its endpoints.
+ */
+
+#ifndef ECOWITT_WEB_SERVER_H
+#define ECOWITT_WEB_SERVER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define	REQ_MAXHEADER	8192	// request line plus headers
+#define	REQ_MAXBODY	32768	// same as LimitRequestBody in ecowitt-vhost.conf
+#define	REQ_BUFSIZE	(REQ_MAXHEADER + REQ_MAXBODY)
+#define	RESP_BUFSIZE	16384	// response headers plus any generated body
+#define	REQ_MAXPARAMS	256	// GET and POST parameters, combined
+
+#define	IDLE_TIMEOUT	30	// seconds before closing an idle connection
+
+#define	REPORT_MAXSENSORS 128	// sensors named in report-fields.def
+#define	MERGE_MAXGATEWAYS 32	// at one site, whose sensors are merged
+
+/* the files made from the reports, beside them in the spool */
+enum { SPOOL_MERGED, SPOOL_ROLLUPS, SPOOL_NDERIVED };
+
+/* one GET or POST parameter, decoded in place in the request buffer */
+struct param {
+	char	*name;
+	char	*value;
+};
+
+/* the parsed request - everything points into the connection's buffer */
+struct request {
+	char	*method;
+	char	*path;		// decoded, without the query string
+	char	*query;		// raw query string, or NULL
+	int	minor;		// HTTP/1.x
+	char	*host;		// Host: header, or NULL
+	char	*content_type;
+	char	*range;
+	char	*if_modified_since;
+	char	*body;
+	int	bodylen;
+	int	head;		// HEAD - send the headers only
+	struct param params[REQ_MAXPARAMS];	// $_REQUEST - GET, then POST
+	int	nparams;
+};
+
+/* connection states */
+enum {
+	CONN_FREE,		// slot not in use
+	CONN_READING,		// waiting for (the rest of) a request
+	CONN_WRITING		// sending a response
+};
+
+struct conn {
+	int	fd;
+	int	state;
+	time_t	lastactive;
+	char	ipaddr[64];	// peer address, for logging
+	int	keepalive;
+	int	status;		// status of the response being sent
+
+	char	req[REQ_BUFSIZE + 1];	// +1 for a terminating null
+	int	reqlen;		// bytes in req[]
+	int	hdrlen;		// length of the request headers, once parsed
+	char	saved;		// byte overwritten by the null after the body
+	struct request rq;	// the request being answered
+
+	char	resp[RESP_BUFSIZE];
+	int	resplen;	// bytes in resp[]
+	int	respoff;	// bytes of resp[] already sent
+
+	int	filefd;		// file being sent after resp[], or -1
+	off_t	fileoff;	// next byte of the file to send
+	off_t	fileend;	// one past the last byte to send
+};
+
+/* where a device is, for ip_api - see locations.c */
+struct site {
+	char	*name;
+	double	latitude, longitude;
+	char	*zone;		// the site's own time zone, or NULL for ours
+	char	answer[256];	// the ip_api response, once worked out
+	int	answerlen;
+	time_t	expires;	// when the answer has to be worked out again
+	int	ngateways;	// devices listed at the site
+	int	merge;		// its window in report-merge.c, plus 1, once it has one
+};
+
+
+/* an image in the firmware directory, as the watcher found it - see firmware-watch.c */
+struct fw_indexed {
+	char	*name;		// e.g. "GW1100-V2.3.3.bin"
+	off_t	size;
+	time_t	mtime;
+	ino_t	ino;
+	char	md5[33];	// in hex
+	int	damaged;	// not the MD5 in its name - it isn't served
+};
+
+
+/* global variables - see ecowitt-web-server.c */
+extern char	*progname;
+extern int	debug;
+extern int	verbose;
+extern char	*docroot;
+extern char	*fwinfo_file;
+extern char	*zonename;
+extern double	latitude, longitude;
+extern int	have_location;
+extern char	*locations_file;
+extern char	*spooldir;
+extern int	merge_window;
+extern int	rollups;
+extern int	fanout;
+
+
+/* prototypes */
+
+// ecowitt-web-server.c:
+char	*get_param (struct request *rq, const char *name);
+int	http_respond (struct conn *cp, struct request *rq, int status,
+		const char *content_type, const char *body, int bodylen);
+void	log_request (struct conn *cp, struct request *rq, const char *script);
+
+// endpoints.c:
+int	info_endpoint (struct conn *cp, struct request *rq);
+int	initialization_endpoint (struct conn *cp, struct request *rq);
+int	ip_api_endpoint (struct conn *cp, struct request *rq);
+int	report_endpoint (struct conn *cp, struct request *rq);
+
+// firmware-watch.c:
+int	watch_start (void);
+void	watch_quiescent (void);
+struct fw_catalog *current_catalog (void);
+const struct fw_indexed *find_image (const char *name);
+
+// locations.c:
+struct site *find_site (const char *mac, time_t now);
+struct site *find_gateway (const char *passkey, time_t now, int *gateway);
+
+// report-fanout.c:
+int	fanout_add (const char *spec);
+int	fanout_start (void);
+void	fanout_report (const char *line, size_t len);
+
+// report-merge.c:
+void	merge_report (struct request *rq, time_t now);
+void	merge_expire (time_t now);
+
+// report-rollup.c:
+int	rollup_start (const char *dir);
+void	rollup_report (struct request *rq);
+void	rollup_expire (time_t now);
+
+// report-spool.c:
+int	spool_start (const char *dir);
+int	spool_report (struct request *rq);
+int	spool_derived (int which, const char *line, size_t len);
+int	report_sensor (const char *name, const char *value);
+int	report_reading (const char *name, const char *value);
+const char *report_field_name (int i);
+
+// sunriset.c:
+int	sun_rise_set (time_t when, double lat, double lon, time_t *rise, time_t *set);
+
+#endif /* ECOWITT_WEB_SERVER_H */
@@ -0,0 +1,527 @@
+/*
+ *	The pages that the devices ask for - each one gives the same
+ *	response as its PHP page in ../ecowitt-web-pages.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-web-server.h"
+#include "firmware-info.h"
+
+#define	PHP_CONTENT_TYPE	"text/html; charset=UTF-8"
+
+
+/*
+ *	Building JSON the way that PHP's json_encode() does - in particular,
+ *	'/' is escaped, and anything that isn't ASCII becomes "\uXXXX".
+ */
+struct json {
+	char	*buf;
+	int	len;
+	int	size;
+	int	error;		// out of room, or not valid UTF-8
+};
+
+static void
+json_raw (struct json *jp, const char *s)
+{
+	int	n = strlen (s);
+
+	if (jp->len + n >= jp->size) {
+		jp->error = 1;
+		return;
+	}
+	memcpy (jp->buf + jp->len, s, n + 1);
+	jp->len += n;
+}
+
+/* decode one UTF-8 character, as PHP does - returns its length, or -1 */
+static int
+utf8_char (const unsigned char *s, unsigned *cp)
+{
+	int	n, i;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	} else if (s[0] < 0xc2) {	// continuation byte, or overlong
+		return -1;
+	} else if (s[0] < 0xe0) {
+		*cp = s[0] & 0x1f;
+		n = 2;
+	} else if (s[0] < 0xf0) {
+		*cp = s[0] & 0x0f;
+		n = 3;
+	} else if (s[0] < 0xf5) {
+		*cp = s[0] & 0x07;
+		n = 4;
+	} else {
+		return -1;
+	}
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return -1;
+		*cp = (*cp << 6) | (s[i] & 0x3f);
+	}
+	if ((n == 3 && (*cp < 0x800 || (*cp >= 0xd800 && *cp <= 0xdfff))) ||
+	    (n == 4 && (*cp < 0x10000 || *cp > 0x10ffff)))
+		return -1;
+	return n;
+}
+
+/* a string, quoted and escaped - NULL gives null */
+static void
+json_str (struct json *jp, const char *s)
+{
+	const unsigned char *p;
+	char	esc[16];
+	unsigned cp;
+	int	n;
+
+	if (s == NULL) {
+		json_raw (jp, "null");
+		return;
+	}
+	json_raw (jp, "\"");
+	for (p = (const unsigned char *) s; *p != '\0' && !jp->error; p += n) {
+		if ((n = utf8_char (p, &cp)) < 0) {
+			jp->error = 1;
+			return;
+		}
+		switch (cp) {
+		case '"':	json_raw (jp, "\\\"");	break;
+		case '\\':	json_raw (jp, "\\\\");	break;
+		case '/':	json_raw (jp, "\\/");	break;
+		case '\b':	json_raw (jp, "\\b");	break;
+		case '\f':	json_raw (jp, "\\f");	break;
+		case '\n':	json_raw (jp, "\\n");	break;
+		case '\r':	json_raw (jp, "\\r");	break;
+		case '\t':	json_raw (jp, "\\t");	break;
+		default:
+			if (cp < 0x20 || cp >= 0x80) {
+				if (cp >= 0x10000) {	// needs a surrogate pair
+					cp -= 0x10000;
+					snprintf (esc, sizeof esc, "\\u%04x\\u%04x",
+						0xd800 | (cp >> 10), 0xdc00 | (cp & 0x3ff));
+				} else {
+					snprintf (esc, sizeof esc, "\\u%04x", cp);
+				}
+				json_raw (jp, esc);
+			} else {
+				esc[0] = cp;
+				esc[1] = '\0';
+				json_raw (jp, esc);
+			}
+			break;
+		}
+	}
+	json_raw (jp, "\"");
+}
+
+static void
+json_long (struct json *jp, long value)
+{
+	char	buf[32];
+
+	snprintf (buf, sizeof buf, "%ld", value);
+	json_raw (jp, buf);
+}
+
+/* "name": - with the comma, if this isn't the first */
+static void
+json_key (struct json *jp, const char *name)
+{
+	char	c = jp->len > 0 ? jp->buf[jp->len - 1] : '\0';
+
+	if (c != '{' && c != '[' && c != '\0')
+		json_raw (jp, ",");
+	json_str (jp, name);
+	json_raw (jp, ":");
+}
+
+
+/*
+ *	Send the response from info.php - the device is only interested in
+ *	"code", but the rest is there for completeness.
+ */
+static int
+info_response (struct conn *cp, struct request *rq, int code, const char *msg,
+	const char *name, const char *content, const char *attach1, const char *attach2)
+{
+	char	buf[RESP_BUFSIZE];
+	struct json js = { buf, 0, sizeof buf - 1, 0 };
+	char	*s, *d;
+
+	json_raw (&js, "{");
+	json_key (&js, "code");		json_long (&js, code);
+	json_key (&js, "msg");		json_str (&js, msg);
+	json_key (&js, "time");		json_long (&js, (long) time (NULL));
+	json_key (&js, "data");
+	if (name == NULL) {		// failures always have an empty array
+		json_raw (&js, "[]");
+	} else {
+		json_raw (&js, "{");
+		json_key (&js, "id");		json_long (&js, (long) getpid ());
+		json_key (&js, "name");		json_str (&js, name);
+		json_key (&js, "content");	json_str (&js, content);
+		json_key (&js, "attach1file");	json_str (&js, attach1);
+		json_key (&js, "attach2file");	json_str (&js, attach2);
+		json_key (&js, "queryintval");	json_long (&js, 86400);	// 24 hours
+		json_raw (&js, "}");
+	}
+	json_raw (&js, "}");
+
+	// As info.php does, un-do the escaping of backslashes so that "\r"
+	// and "\n" in the changelog come through to the device.  If the
+	// encoding failed, PHP would send just the newline.
+	if (js.error) {
+		js.len = 0;
+	} else {
+		for (s = d = buf; *s != '\0'; ) {
+			if (s[0] == '\\' && s[1] == '\\')
+				s++;
+			*d++ = *s++;
+		}
+		js.len = d - buf;
+	}
+	buf[js.len++] = '\n';
+
+	if (verbose > 1)
+		syslog (LOG_INFO, "response is [%.*s]", js.len - 1, buf);
+
+	return http_respond (cp, rq, 200, PHP_CONTENT_TYPE, buf, js.len);
+}
+
+/*
+ *	/api/ota/v1/version/info - the periodic firmware version check, e.g.
+ *	GET /api/ota/v1/version/info?id=30%3A83%3A98%3AA7%3A2E%3AD9&model=GW1100C&time=1715698261&user=1&version=V2.3.2&sign=0004C297194E4ACD3E2D67469442BA5F
+ */
+int
+info_endpoint (struct conn *cp, struct request *rq)
+{
+	struct fw_catalog *fcp;
+	struct fw_model *mp;
+	struct fw_version *vp;
+	char	*id, *model, *version;
+	char	mac[256];
+	const char *desired;
+	const char *urlbase;
+	char	attach1[1024], attach2[1024];
+
+	log_request (cp, rq, "info.php");
+
+	if ((fcp = current_catalog ()) == NULL)
+		return info_response (cp, rq, -1, "internal configuration error",
+			NULL, NULL, NULL, NULL);
+
+	if ((id = get_param (rq, "id")) == NULL)	// the MAC address
+		return info_response (cp, rq, 41000, "id require", NULL, NULL, NULL, NULL);
+	fw_normalize_mac (id, mac, sizeof mac);
+
+	if ((model = get_param (rq, "model")) == NULL)
+		return info_response (cp, rq, 41000, "model require", NULL, NULL, NULL, NULL);
+
+	if ((version = get_param (rq, "version")) == NULL)
+		return info_response (cp, rq, 41000, "version require", NULL, NULL, NULL, NULL);
+
+	// strip the trailing letter from the model (A,B,C,D), so that
+	// "GW2000B" becomes "GW2000"
+	if (*model != '\0')
+		model[strlen (model) - 1] = '\0';
+
+	if ((mp = fw_find_model (fcp, model)) == NULL) {
+		if (verbose > 1)
+			syslog (LOG_INFO, "unsupported model \"%s\"", model);
+		return info_response (cp, rq, 40013, "invalid model", NULL, NULL, NULL, NULL);
+	}
+
+	desired = fw_wanted_version (mp, mac);
+	vp = fw_find_version (mp, desired);
+	if (verbose > 1)
+		syslog (LOG_INFO, "model[%s] - desired version[%s] current[%s]",
+			model, desired, version);
+
+	urlbase = fcp->urlbase ? fcp->urlbase : "";
+	snprintf (attach1, sizeof attach1, "%s/%s", urlbase,
+		(vp && vp->file1) ? vp->file1 : "");
+	if (vp && vp->file2)
+		snprintf (attach2, sizeof attach2, "%s/%s", urlbase, vp->file2);
+	else
+		attach2[0] = '\0';
+
+	// Is the version the same as what the device already has?
+	if (strcasecmp (version, desired) == 0)
+		return info_response (cp, rq, -1, "The firmware is up to date",
+			desired, vp ? vp->changelog : NULL, attach1, attach2);
+	else
+		return info_response (cp, rq, 0, "Success",
+			desired, vp ? vp->changelog : NULL, attach1, attach2);
+}
+
+/*
+ *	/api/index/initialization - sent when the device starts up.  The
+ *	PHP page sends nothing back, and the devices are happy with that.
+ */
+int
+initialization_endpoint (struct conn *cp, struct request *rq)
+{
+	log_request (cp, rq, "initialization.php");
+	return http_respond (cp, rq, 200, PHP_CONTENT_TYPE, NULL, 0);
+}
+
+/*
+ *	/data/report/ - the Ecowitt-format weather data.  The device wants
+ *	a 202, not just 200.  With a spool directory, the report is kept
+ *	there - see report-spool.c.
+ */
+int
+report_endpoint (struct conn *cp, struct request *rq)
+{
+	log_request (cp, rq, "report/index.php");
+	if (spooldir != NULL)
+		spool_report (rq);
+	if (merge_window > 0)
+		merge_report (rq, time (NULL));
+	if (rollups)
+		rollup_report (rq);
+	return http_respond (cp, rq, 202, PHP_CONTENT_TYPE, "ok\r\n", 4);
+}
+
+
+/*
+ *	The time zone name that PHP's timezone_name_from_abbr("", offset, dst)
+ *	picks - the first entry with the same offset and DST flag in its
+ *	fallback table.
+ */
+static const struct {
+	int	dst;
+	long	offset;		// minutes east of UTC
+	const char *name;
+} php_zones[] = {
+	{ 0, -660, "Pacific/Apia" },
+	{ 0, -600, "Pacific/Honolulu" },
+	{ 0, -540, "America/Anchorage" },
+	{ 1, -480, "America/Anchorage" },
+	{ 0, -480, "America/Los_Angeles" },
+	{ 1, -420, "America/Los_Angeles" },
+	{ 0, -420, "America/Denver" },
+	{ 1, -360, "America/Denver" },
+	{ 0, -360, "America/Chicago" },
+	{ 1, -300, "America/Chicago" },
+	{ 0, -300, "America/New_York" },
+	{ 0, -270, "America/Caracas" },
+	{ 1, -240, "America/New_York" },
+	{ 0, -240, "America/Halifax" },
+	{ 1, -180, "America/Halifax" },
+	{ 0, -180, "America/Sao_Paulo" },
+	{ 1, -120, "America/Sao_Paulo" },
+	{ 0, -60, "Atlantic/Azores" },
+	{ 1, 0, "Atlantic/Azores" },
+	{ 0, 0, "UTC" },
+	{ 1, 60, "Europe/London" },
+	{ 0, 60, "Europe/Paris" },
+	{ 1, 120, "Europe/Paris" },
+	{ 0, 120, "Europe/Helsinki" },
+	{ 1, 180, "Europe/Helsinki" },
+	{ 0, 180, "Europe/Moscow" },
+	{ 1, 240, "Europe/Moscow" },
+	{ 0, 240, "Asia/Dubai" },
+	{ 0, 300, "Asia/Karachi" },
+	{ 0, 330, "Asia/Kolkata" },
+	{ 0, 345, "Asia/Katmandu" },
+	{ 1, 360, "Asia/Yekaterinburg" },
+	{ 1, 420, "Asia/Novosibirsk" },
+	{ 0, 420, "Asia/Krasnoyarsk" },
+	{ 1, 480, "Asia/Krasnoyarsk" },
+	{ 0, 540, "Asia/Tokyo" },
+	{ 0, 600, "Australia/Melbourne" },
+	{ 1, 630, "Australia/Adelaide" },
+	{ 1, 660, "Australia/Melbourne" },
+	{ 0, 720, "Pacific/Auckland" },
+	{ 1, 780, "Pacific/Auckland" },
+	{ 0, 0, NULL }
+};
+
+static const char *
+php_zone_name (long offset, int dst)
+{
+	int	i;
+
+	for (i = 0; php_zones[i].name != NULL; i++) {
+		if (php_zones[i].offset * 60 == offset && php_zones[i].dst == dst)
+			return php_zones[i].name;
+	}
+	return NULL;
+}
+
+/* switch to a site's own time zone, or back to ours with NULL */
+static void
+use_zone (const char *zone)
+{
+	static int saved = 0;
+	static char *ours = NULL;	// TZ as we started, if it was set
+	char	*s;
+
+	if (!saved) {
+		if ((s = getenv ("TZ")) != NULL)
+			ours = strdup (s);
+		saved = 1;
+	}
+	if (zone != NULL)
+		setenv ("TZ", zone, 1);
+	else if (ours != NULL)
+		setenv ("TZ", ours, 1);
+	else
+		unsetenv ("TZ");
+	tzset ();
+}
+
+/* the UTC offset and DST flag at this time, as one number to compare */
+static long
+zone_state (time_t t)
+{
+	struct tm tm;
+
+	localtime_r (&t, &tm);
+	return (long) tm.tm_gmtoff * 2 + (tm.tm_isdst > 0);
+}
+
+/*
+ *	How long an ip_api answer stays good: until the next local
+ *	midnight, when the sunrise and sunset change, or until the clocks
+ *	change, if that happens first.
+ */
+static time_t
+answer_expires (time_t now)
+{
+	struct tm tm;
+	time_t	midnight, lo, hi, mid;
+	long	state = zone_state (now);
+
+	localtime_r (&now, &tm);
+	tm.tm_mday++;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	if ((midnight = mktime (&tm)) == (time_t) -1 || midnight <= now)
+		midnight = now + 3600;	// shouldn't happen, but don't spin
+
+	if (zone_state (midnight - 1) == state)
+		return midnight;
+
+	// The clocks change today - find the first second after that.
+	lo = now;
+	hi = midnight - 1;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (zone_state (mid) == state)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+/*
+ *	Work out the ip_api answer for a site, e.g.
+ *	{"timezone":"America\/Los_Angeles","utc_offset":"-25200","dst":"1","date_sunrise":"06:40","date_sunset":"18:50"}
+ */
+static void
+ip_api_answer (struct site *sp, time_t now)
+{
+	struct json js = { sp->answer, 0, sizeof sp->answer - 1, 0 };
+	char	offset[32], dst[8], sunrise[16], sunset[16];
+	const char *tzname;
+	struct tm tm;
+	time_t	rise, set;
+	long	tzoffset;
+
+	if (sp->zone != NULL)
+		use_zone (sp->zone);
+
+	localtime_r (&now, &tm);
+
+	// whole minutes, as PHP finds it from strftime("%z")
+	tzoffset = (long) tm.tm_gmtoff / 60 * 60;
+	snprintf (offset, sizeof offset, "%ld", tzoffset);
+	snprintf (dst, sizeof dst, "%d", tm.tm_isdst > 0);
+
+	if (sp->zone != NULL)
+		tzname = sp->zone;
+	else if (zonename != NULL)
+		tzname = zonename;
+	else
+		tzname = php_zone_name (tzoffset, tm.tm_isdst > 0);
+
+	sun_rise_set (now, sp->latitude, sp->longitude, &rise, &set);
+	localtime_r (&rise, &tm);
+	strftime (sunrise, sizeof sunrise, "%H:%M", &tm);
+	localtime_r (&set, &tm);
+	strftime (sunset, sizeof sunset, "%H:%M", &tm);
+
+	sp->expires = answer_expires (now);
+
+	if (sp->zone != NULL)
+		use_zone (NULL);
+
+	if (verbose > 1)
+		syslog (LOG_INFO, "site[%s] tzoffset[%ld] dst[%s] name[%s] sunrise[%s] sunset[%s] until[%ld]",
+			sp->name, tzoffset, dst, tzname ? tzname : "<none>",
+			sunrise, sunset, (long) sp->expires);
+
+	json_raw (&js, "{");
+	json_key (&js, "timezone");
+	if (tzname != NULL)
+		json_str (&js, tzname);
+	else
+		json_raw (&js, "false");	// what PHP gives for an unknown zone
+	json_key (&js, "utc_offset");	json_str (&js, offset);	// intentionally in quotes
+	json_key (&js, "dst");		json_str (&js, dst);	// intentionally in quotes
+	json_key (&js, "date_sunrise");	json_str (&js, sunrise);
+	json_key (&js, "date_sunset");	json_str (&js, sunset);
+	json_raw (&js, "}\n");
+
+	// As PHP would, send just the newline if that went wrong (a bad
+	// time zone name in the locations file, say).
+	if (js.error) {
+		sp->answer[0] = '\n';
+		js.len = 1;
+	}
+	sp->answerlen = js.len;
+}
+
+/*
+ *	/data/ip_api/ - the time zone, UTC offset, DST flag, and today's
+ *	sunrise and sunset for the device's site.  Every device at a site
+ *	gets the same answer all day, so it's worked out once and then
+ *	handed out from memory until it changes.
+ */
+int
+ip_api_endpoint (struct conn *cp, struct request *rq)
+{
+	static int warned = 0;
+	struct site *sp;
+	time_t	now;
+
+	log_request (cp, rq, "ip_api/index.php");
+
+	now = time (NULL);
+	if ((sp = find_site (get_param (rq, "mac"), now)) == NULL) {
+		if (!warned++)
+			syslog (LOG_ERR, "no latitude and longitude - use \"-l latitude,longitude\" or a locations file");
+		return http_respond (cp, rq, 500, PHP_CONTENT_TYPE, NULL, 0);
+	}
+
+	if (now >= sp->expires)
+		ip_api_answer (sp, now);
+	else if (verbose > 1)
+		syslog (LOG_INFO, "site[%s] answer[%.*s]", sp->name, sp->answerlen - 1, sp->answer);
+
+	return http_respond (cp, rq, 202, PHP_CONTENT_TYPE, sp->answer, sp->answerlen);
+}
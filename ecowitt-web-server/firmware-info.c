@@ -0,0 +1,518 @@
+/*
+ *	Read the "firmware-info" catalog, following the same rules as
+ *	readfirmwareinfo() in info.php, so that both give the same answers
+ *	for the same file.
+ *
+ *	The whole file is read into memory once, and every string in the
+ *	catalog points into that copy.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "firmware-info.h"
+
+
+/* strip leading and trailing white space, in place */
+static char *
+trim (char *s)
+{
+	char	*e;
+
+	while (isspace ((unsigned char) *s))
+		s++;
+	e = s + strlen (s);
+	while (e > s && isspace ((unsigned char) e[-1]))
+		*--e = '\0';
+	return s;
+}
+
+/* find the named model, or add a new one at the end */
+static struct fw_model *
+add_model (struct fw_catalog *cp, char *name)
+{
+	struct fw_model *mp;
+
+	// a repeated model starts over, as info.php does
+	if ((mp = fw_find_model (cp, name)) != NULL) {
+		mp->nversions = 0;
+		while (mp->nwants > 0)
+			free (mp->wants[--mp->nwants].mac);
+		return mp;
+	}
+	mp = realloc (cp->models, (cp->nmodels + 1) * sizeof *mp);
+	if (mp == NULL)
+		return NULL;
+	cp->models = mp;
+	mp = &cp->models[cp->nmodels++];
+	memset (mp, 0, sizeof *mp);
+	mp->name = name;
+	return mp;
+}
+
+/* find the version in the model, or add a new one at the end */
+static struct fw_version *
+add_version (struct fw_model *mp, char *version)
+{
+	struct fw_version *vp;
+
+	if ((vp = fw_find_version (mp, version)) != NULL)
+		return vp;
+	vp = realloc (mp->versions, (mp->nversions + 1) * sizeof *vp);
+	if (vp == NULL)
+		return NULL;
+	mp->versions = vp;
+	return &mp->versions[mp->nversions++];
+}
+
+/* set the wanted version for a (normalized) MAC address, or "default" */
+static int
+add_want (struct fw_model *mp, const char *mac, char *version)
+{
+	struct fw_want *wp;
+	int	i;
+
+	for (i = 0; i < mp->nwants; i++) {
+		if (strcmp (mp->wants[i].mac, mac) == 0) {
+			mp->wants[i].version = version;
+			return 0;
+		}
+	}
+	wp = realloc (mp->wants, (mp->nwants + 1) * sizeof *wp);
+	if (wp == NULL)
+		return -1;
+	mp->wants = wp;
+	wp = &mp->wants[mp->nwants];
+	if ((wp->mac = strdup (mac)) == NULL)
+		return -1;
+	wp->version = version;
+	mp->nwants++;
+	return 0;
+}
+
+/*
+ *	Read and parse the firmware information file.
+ *
+ *	Returns the new catalog, or NULL with a description of the problem
+ *	in errbuf.
+ */
+struct fw_catalog *
+fw_catalog_read (const char *fname, char *errbuf, size_t errlen)
+{
+	struct fw_catalog *cp;
+	struct fw_model *mp = NULL;	// current model
+	struct fw_version *vp = NULL;	// current version within the model
+	struct fw_version fwinfo;	// info.php's $fwinfo
+	struct stat stb;
+	const char *previouskw = "";
+	char	*line, *next, *kw, *val, *s;
+	char	*mac;
+	char	macbuf[256];
+	int	linenum = 0;
+	int	fd;
+	ssize_t	r;
+	int	i;
+
+	if ((cp = calloc (1, sizeof *cp)) == NULL) {
+		snprintf (errbuf, errlen, "out of memory");
+		return NULL;
+	}
+
+	if ((fd = open (fname, O_RDONLY)) < 0 || fstat (fd, &stb) < 0) {
+		snprintf (errbuf, errlen, "cannot open firmware description file \"%s\": %s",
+			fname, strerror (errno));
+		goto fail;
+	}
+	cp->mtime = stb.st_mtime;
+	if ((cp->text = malloc (stb.st_size + 1)) == NULL) {
+		snprintf (errbuf, errlen, "out of memory");
+		goto fail;
+	}
+	if ((r = read (fd, cp->text, stb.st_size)) < 0) {
+		snprintf (errbuf, errlen, "cannot read \"%s\": %s", fname, strerror (errno));
+		goto fail;
+	}
+	cp->text[r] = '\0';
+	close (fd);
+	fd = -1;
+
+	memset (&fwinfo, 0, sizeof fwinfo);
+
+	for (line = cp->text; *line != '\0'; line = next) {
+		// info.php stops at end of file before looking at a last line
+		// that doesn't end with a newline, so we do the same.
+		if ((next = strchr (line, '\n')) == NULL)
+			break;
+		*next++ = '\0';
+		linenum++;
+
+		// anything after '#' is a comment
+		if ((s = strchr (line, '#')) != NULL)
+			*s = '\0';
+		kw = trim (line);
+		if (*kw == '\0')		// (effectively) blank line
+			continue;
+
+		// split the line into two pieces - keyword, value
+		for (val = kw; *val != '\0' && !isspace ((unsigned char) *val); val++)
+			;
+		if (*val == '\0') {		// malformed line - no value
+			snprintf (errbuf, errlen, "Bad line \"%s\" at line %d in \"%s\"",
+				kw, linenum, fname);
+			goto fail;
+		}
+		*val++ = '\0';
+		val = trim (val);
+
+		if (strcasecmp (kw, "urlbase") == 0) {
+			cp->urlbase = val;
+
+		} else if (strcasecmp (kw, "model") == 0) {
+			if ((mp = add_model (cp, val)) == NULL)
+				goto nomem;
+			memset (&fwinfo, 0, sizeof fwinfo);
+			vp = NULL;
+
+		} else if (strcasecmp (kw, "firmware") == 0) {
+			if (mp == NULL) {
+				snprintf (errbuf, errlen, "keyword \"%s\" must follow a \"model\" entry - line %d in \"%s\"",
+					kw, linenum, fname);
+				goto fail;
+			}
+			// NOTE that, as in info.php, the other details carry
+			// over from the previous version until they are set.
+			fwinfo.version = val;
+			if ((vp = add_version (mp, val)) == NULL)
+				goto nomem;
+			*vp = fwinfo;
+
+		} else if (strcasecmp (kw, "file") == 0 || strcasecmp (kw, "file1") == 0) {
+			if (strcmp (previouskw, "firmware") != 0) {
+				snprintf (errbuf, errlen, "keyword \"%s\" must follow \"firmware\" entry - line %d in \"%s\"",
+					kw, linenum, fname);
+				goto fail;
+			}
+			fwinfo.file1 = val;
+			*vp = fwinfo;
+
+		} else if (strcasecmp (kw, "file2") == 0) {
+			if (strcmp (previouskw, "file1") != 0) {
+				snprintf (errbuf, errlen, "keyword \"%s\" must follow \"file1\" entry - line %d in \"%s\"",
+					kw, linenum, fname);
+				goto fail;
+			}
+			fwinfo.file2 = val;
+			*vp = fwinfo;
+
+		} else if (strcasecmp (kw, "log") == 0) {
+			if (strcmp (previouskw, "file") != 0 &&
+			    strcmp (previouskw, "file1") != 0 &&
+			    strcmp (previouskw, "file2") != 0) {
+				snprintf (errbuf, errlen, "keyword \"%s\" must follow \"file*\" entry - line %d in \"%s\"",
+					kw, linenum, fname);
+				goto fail;
+			}
+			fwinfo.changelog = val;
+			*vp = fwinfo;
+
+		} else if (strcasecmp (kw, "want") == 0) {
+			// RHS may be simply "V2.3.2", or it may specify the
+			// version and MAC, e.g. "V2.1.8 for dc:da:0c:fa:c5:e0"
+			if (mp == NULL) {
+				snprintf (errbuf, errlen, "keyword \"%s\" must be within a \"model\" entry - line %d in \"%s\"",
+					kw, linenum, fname);
+				goto fail;
+			}
+			mac = NULL;
+			for (s = val; (s = strstr (s, "for")) != NULL; s++) {
+				if (isspace ((unsigned char) s[3])) {
+					*s = '\0';
+					mac = trim (s + 3);
+					break;
+				}
+			}
+			val = trim (val);
+			if (mac != NULL && *mac != '\0' && *val == '\0') {
+				val = mac;	// "want for V2.1.8" - odd, but allowed
+				mac = NULL;
+			}
+			if (mac == NULL || *mac == '\0') {
+				mac = "default";
+			} else {
+				fw_normalize_mac (mac, macbuf, sizeof macbuf);
+				mac = macbuf;
+			}
+			if (add_want (mp, mac, val) < 0)
+				goto nomem;
+
+		} else {
+			snprintf (errbuf, errlen, "unknown keyword \"%s\" specified at line %d in \"%s\"",
+				kw, linenum, fname);
+			goto fail;
+		}
+
+		// remember this keyword for the next line
+		previouskw = kw;
+	}
+
+	// Find the highest version listed for each model, so that nobody
+	// needs to search for it later.
+	for (mp = cp->models; mp < cp->models + cp->nmodels; mp++) {
+		mp->latest = "";
+		for (i = 0; i < mp->nversions; i++) {
+			if (fw_version_compare (mp->versions[i].version, mp->latest) > 0)
+				mp->latest = mp->versions[i].version;
+		}
+	}
+
+	return cp;
+
+nomem:
+	snprintf (errbuf, errlen, "out of memory");
+fail:
+	if (fd >= 0)
+		close (fd);
+	fw_catalog_free (cp);
+	return NULL;
+}
+
+void
+fw_catalog_free (struct fw_catalog *cp)
+{
+	int	i;
+
+	if (cp == NULL)
+		return;
+	for (i = 0; i < cp->nmodels; i++) {
+		while (cp->models[i].nwants > 0)
+			free (cp->models[i].wants[--cp->models[i].nwants].mac);
+		free (cp->models[i].versions);
+		free (cp->models[i].wants);
+	}
+	free (cp->models);
+	free (cp->text);
+	free (cp);
+}
+
+struct fw_model *
+fw_find_model (struct fw_catalog *cp, const char *name)
+{
+	int	i;
+
+	for (i = 0; i < cp->nmodels; i++) {
+		if (strcmp (cp->models[i].name, name) == 0)
+			return &cp->models[i];
+	}
+	return NULL;
+}
+
+struct fw_version *
+fw_find_version (struct fw_model *mp, const char *version)
+{
+	int	i;
+
+	for (i = 0; i < mp->nversions; i++) {
+		if (strcmp (mp->versions[i].version, version) == 0)
+			return &mp->versions[i];
+	}
+	return NULL;
+}
+
+/*
+ *	Put a MAC address into one standard form - lower case, with colons -
+ *	as normalizemac() in info.php does, so that "30-83-98-7A-E2-9D" and
+ *	"30:83:98:7a:e2:9d" are the same device.  Anything that isn't a MAC
+ *	address is simply lower-cased.
+ */
+void
+fw_normalize_mac (const char *mac, char *out, size_t outlen)
+{
+	char	hex[12];
+	const char *s, *e;
+	int	n = 0;
+	size_t	i;
+
+	for (s = mac; *s != '\0'; s++) {
+		if (isxdigit ((unsigned char) *s)) {
+			if (n < 12)
+				hex[n] = tolower ((unsigned char) *s);
+			n++;
+		}
+	}
+	if (n == 12) {
+		snprintf (out, outlen, "%.2s:%.2s:%.2s:%.2s:%.2s:%.2s",
+			hex, hex + 2, hex + 4, hex + 6, hex + 8, hex + 10);
+		return;
+	}
+
+	while (isspace ((unsigned char) *mac))
+		mac++;
+	for (e = mac + strlen (mac); e > mac && isspace ((unsigned char) e[-1]); )
+		e--;
+	for (i = 0; mac < e && i + 1 < outlen; i++)
+		out[i] = tolower ((unsigned char) *mac++);
+	if (outlen > 0)
+		out[i] = '\0';
+}
+
+/*
+ *	The version that a device should be running - the version wanted
+ *	for its (normalized) MAC address, else the default wanted version,
+ *	else the highest version listed.
+ */
+const char *
+fw_wanted_version (struct fw_model *mp, const char *mac)
+{
+	const char *dflt = NULL;
+	int	i;
+
+	for (i = 0; i < mp->nwants; i++) {
+		if (strcmp (mp->wants[i].mac, mac) == 0)
+			return mp->wants[i].version;
+		if (strcmp (mp->wants[i].mac, "default") == 0)
+			dflt = mp->wants[i].version;
+	}
+	return dflt != NULL ? dflt : mp->latest;
+}
+
+
+/*
+ *	Compare two version strings the way that PHP's version_compare()
+ *	does, so that we pick the same "highest" version as info.php.
+ *	Returns -1, 0, or 1.
+ */
+static int
+special_form (const char *form)
+{
+	static const struct {
+		const char *name;
+		int	order;
+	} forms[] = {
+		{ "dev", 0 }, { "alpha", 1 }, { "a", 1 }, { "beta", 2 },
+		{ "b", 2 }, { "RC", 3 }, { "rc", 3 }, { "#", 4 },
+		{ "pl", 5 }, { "p", 5 }, { NULL, 0 }
+	};
+	int	i;
+
+	for (i = 0; forms[i].name != NULL; i++) {
+		if (strncmp (form, forms[i].name, strlen (forms[i].name)) == 0)
+			return forms[i].order;
+	}
+	return -1;
+}
+
+static int
+compare_special (const char *f1, const char *f2)
+{
+	int	r = special_form (f1) - special_form (f2);
+
+	return (r > 0) - (r < 0);
+}
+
+/* split the version into '.'-separated parts, as PHP does */
+static void
+canonicalize (const char *v, char *buf, size_t bufsiz)
+{
+	char	*q = buf;
+	char	*end = buf + bufsiz - 2;
+	int	lp;
+
+#define	isdig(x)	(isdigit ((unsigned char)(x)) && (x) != '.')
+#define	isndig(x)	(!isdigit ((unsigned char)(x)) && (x) != '.')
+
+	if (*v == '\0') {
+		*q = '\0';
+		return;
+	}
+	*q++ = lp = *v++;
+	while (*v != '\0' && q < end) {
+		if (*v == '-' || *v == '_' || *v == '+') {
+			if (q[-1] != '.')
+				*q++ = '.';
+		} else if ((isndig (lp) && isdig (*v)) || (isdig (lp) && isndig (*v))) {
+			if (q[-1] != '.')
+				*q++ = '.';
+			*q++ = *v;
+		} else if (!isalnum ((unsigned char) *v)) {
+			if (q[-1] != '.')
+				*q++ = '.';
+		} else {
+			*q++ = *v;
+		}
+		lp = *v++;
+	}
+	*q = '\0';
+}
+
+int
+fw_version_compare (const char *v1, const char *v2)
+{
+	char	buf1[128], buf2[128];
+	char	*p1, *p2, *n1, *n2;
+	long	l1, l2;
+	int	compare = 0;
+
+	if (*v1 == '\0' || *v2 == '\0') {
+		if (*v1 == '\0' && *v2 == '\0')
+			return 0;
+		return *v1 != '\0' ? 1 : -1;
+	}
+
+	if (*v1 == '#')
+		snprintf (buf1, sizeof buf1, "%s", v1);
+	else
+		canonicalize (v1, buf1, sizeof buf1);
+	if (*v2 == '#')
+		snprintf (buf2, sizeof buf2, "%s", v2);
+	else
+		canonicalize (v2, buf2, sizeof buf2);
+
+	p1 = buf1;
+	p2 = buf2;
+	n1 = n2 = "";		// anything non-NULL to get started
+	while (*p1 != '\0' && *p2 != '\0' && n1 != NULL && n2 != NULL) {
+		if ((n1 = strchr (p1, '.')) != NULL)
+			*n1 = '\0';
+		if ((n2 = strchr (p2, '.')) != NULL)
+			*n2 = '\0';
+		if (isdigit ((unsigned char) *p1) && isdigit ((unsigned char) *p2)) {
+			l1 = strtol (p1, NULL, 10);
+			l2 = strtol (p2, NULL, 10);
+			compare = (l1 > l2) - (l1 < l2);
+		} else if (!isdigit ((unsigned char) *p1) && !isdigit ((unsigned char) *p2)) {
+			compare = compare_special (p1, p2);
+		} else if (isdigit ((unsigned char) *p1)) {
+			compare = compare_special ("#N#", p2);
+		} else {
+			compare = compare_special (p1, "#N#");
+		}
+		if (compare != 0)
+			break;
+		if (n1 != NULL)
+			p1 = n1 + 1;
+		if (n2 != NULL)
+			p2 = n2 + 1;
+	}
+	if (compare == 0) {
+		if (n1 != NULL) {
+			if (isdigit ((unsigned char) *p1))
+				compare = 1;
+			else
+				compare = fw_version_compare (p1, "#N#");
+		} else if (n2 != NULL) {
+			if (isdigit ((unsigned char) *p2))
+				compare = -1;
+			else
+				compare = fw_version_compare ("#N#", p2);
+		}
+	}
+	return compare;
+}
@@ -0,0 +1,53 @@
+/*
+ *	The "firmware-info" catalog, as read by info.php - see
+ *	../ecowitt-web-pages/api/ota/v1/version/firmware-info for the format.
+ */
+
+#ifndef FIRMWARE_INFO_H
+#define FIRMWARE_INFO_H
+
+#include <sys/types.h>
+#include <time.h>
+
+struct fw_version {
+	char	*version;	// e.g. "V2.3.2"
+	char	*file1;		// "file" or "file1" name, or NULL
+	char	*file2;		// "file2" name for two-file models, or NULL
+	char	*changelog;	// "log" text, with literal "\r\n" sequences, or NULL
+};
+
+struct fw_want {
+	char	*mac;		// normalized MAC address, or "default"
+	char	*version;
+};
+
+struct fw_model {
+	char	*name;		// e.g. "GW1100"
+	struct fw_version *versions;
+	int	nversions;
+	struct fw_want *wants;
+	int	nwants;
+	char	*latest;	// highest version listed, or "" if none
+};
+
+struct fw_catalog {
+	char	*urlbase;	// base URL for the firmware files, or NULL
+	struct fw_model *models;
+	int	nmodels;
+	time_t	mtime;		// modification time of the file when read
+	char	*text;		// contents of the file - all strings point in here
+};
+
+
+/* prototypes */
+struct fw_catalog *fw_catalog_read (const char *fname, char *errbuf, size_t errlen);
+void	fw_catalog_free (struct fw_catalog *cp);
+
+struct fw_model *fw_find_model (struct fw_catalog *cp, const char *name);
+struct fw_version *fw_find_version (struct fw_model *mp, const char *version);
+const char *fw_wanted_version (struct fw_model *mp, const char *mac);
+void	fw_normalize_mac (const char *mac, char *out, size_t outlen);
+
+int	fw_version_compare (const char *v1, const char *v2);
+
+#endif /* FIRMWARE_INFO_H */
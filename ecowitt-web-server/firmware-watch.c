@@ -0,0 +1,417 @@
+/*
+ *	Keeping the firmware-info catalog, and an index of the images in the
+ *	firmware directory, up to date while the server runs - without the
+ *	event loop ever waiting for either of them to be read.
+ *
+ *	A watcher thread is told of changes to them by inotify (on Linux;
+ *	elsewhere it looks every WATCH_INTERVAL seconds).  It reads the
+ *	catalog again if that has changed, and hashes only the images that
+ *	are new or have changed, then publishes the lot as a new snapshot
+ *	with a single pointer store.  The event loop only ever loads that
+ *	pointer, so it never waits for the watcher, or takes a lock.
+ *
+ *	The old snapshot is freed once the event loop has been round again
+ *	(see watch_quiescent()): it never keeps anything from a snapshot
+ *	from one pass to the next, so by then nothing can be using it.  This
+ *	is RCU, with the passes of the event loop as the grace periods.
+ *
+ *	A download that's under way has the image open, so it goes on with
+ *	the version that it started with when another is put in its place -
+ *	as long as that's done by renaming the new one in, as "mv" does,
+ *	rather than by writing over the old one.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+#include "ecowitt-web-server.h"
+#include "firmware-info.h"
+#include "md5.h"
+
+#define	WATCH_INTERVAL	5	// seconds between looks, without inotify
+#define	WATCH_SETTLE	2	// seconds that an image must be left alone, to be indexed
+#define	WATCH_DEBOUNCE	100	// milliseconds to gather the events of one change
+
+/* everything that the event loop sees, at one moment */
+struct snapshot {
+	struct fw_catalog *catalog;	// NULL, if it couldn't be read
+	struct stat catalog_stb;	// the file, when it was read (st_ino 0: not there)
+	struct fw_indexed *images;	// sorted by name
+	int	nimages;
+};
+
+static _Atomic (struct snapshot *) current;
+static atomic_ulong passes;	// of the event loop, for the grace periods
+static char	*imagedir;	// docroot/firmware
+
+static struct snapshot *rebuild (struct snapshot *old, int *unsettled);
+static void	publish (struct snapshot *sp, int wait);
+static void	*watcher (void *arg);
+
+
+/* the catalog, as it is now - or NULL, if it couldn't be read */
+struct fw_catalog *
+current_catalog (void)
+{
+	return atomic_load_explicit (&current, memory_order_acquire)->catalog;
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+	return strcmp (((const struct fw_indexed *) a)->name,
+		((const struct fw_indexed *) b)->name);
+}
+
+static struct fw_indexed *
+lookup (struct snapshot *sp, const char *name)
+{
+	struct fw_indexed key;
+
+	if (sp == NULL || sp->nimages == 0)
+		return NULL;
+	key.name = (char *) name;
+	return bsearch (&key, sp->images, sp->nimages, sizeof key, compare_names);
+}
+
+/* what we know of the image "name" in the firmware directory, or NULL */
+const struct fw_indexed *
+find_image (const char *name)
+{
+	return lookup (atomic_load_explicit (&current, memory_order_acquire), name);
+}
+
+/* the event loop has finished with whatever it had of the snapshots */
+void
+watch_quiescent (void)
+{
+	atomic_fetch_add_explicit (&passes, 1, memory_order_release);
+}
+
+/* the MD5 in the image's name, as Ecowitt name them - or -1 if it has none */
+static int
+md5_in_name (const char *name, char *hex)
+{
+	const char *dot;
+	int	i;
+
+	if ((dot = strrchr (name, '.')) == NULL || dot - name <= 33 ||
+	    (dot[-33] != '-' && dot[-33] != '_'))
+		return -1;
+	for (i = 0; i < 32; i++) {
+		if (!isxdigit ((unsigned char) dot[i - 32]))
+			return -1;
+		hex[i] = tolower ((unsigned char) dot[i - 32]);
+	}
+	hex[32] = '\0';
+	return 0;
+}
+
+/* read the image, and check it against the MD5 in its name */
+static int
+hash_image (const char *path, struct fw_indexed *ip)
+{
+	char	buf[65536];
+	char	want[33];
+	struct md5 md5;
+	ssize_t	r;
+	int	fd;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return -1;
+	md5_init (&md5);
+	while ((r = read (fd, buf, sizeof buf)) > 0 || (r < 0 && errno == EINTR)) {
+		if (r > 0)
+			md5_update (&md5, buf, r);
+	}
+	close (fd);
+	if (r < 0)
+		return -1;
+	md5_final (&md5, ip->md5);
+
+	ip->damaged = md5_in_name (ip->name, want) == 0 && strcmp (want, ip->md5) != 0;
+	if (ip->damaged)
+		syslog (LOG_ERR, "firmware image \"%s\" is damaged: its MD5 is %s, not %s - it won't be served",
+			path, ip->md5, want);
+	else if (verbose)
+		syslog (LOG_INFO, "indexed firmware image \"%s\": %lld bytes, MD5 %s",
+			path, (long long) ip->size, ip->md5);
+	return 0;
+}
+
+static void
+free_snapshot (struct snapshot *sp, struct snapshot *next)
+{
+	int	i;
+
+	if (sp == NULL)
+		return;
+	if (next == NULL || next->catalog != sp->catalog)
+		fw_catalog_free (sp->catalog);
+	for (i = 0; i < sp->nimages; i++)
+		free (sp->images[i].name);
+	free (sp->images);
+	free (sp);
+}
+
+/* does every image in the catalog exist? - it's only said, not enforced */
+static void
+check_catalog (struct snapshot *sp)
+{
+	struct fw_model *mp;
+	struct fw_version *vp;
+	int	i, j;
+
+	for (i = 0; i < sp->catalog->nmodels; i++) {
+		mp = &sp->catalog->models[i];
+		for (j = 0; j < mp->nversions; j++) {
+			vp = &mp->versions[j];
+			if (vp->file1 != NULL && lookup (sp, vp->file1) == NULL)
+				syslog (LOG_WARNING, "firmware-info lists \"%s\" for %s %s, but it isn't in %s",
+					vp->file1, mp->name, vp->version, imagedir);
+			if (vp->file2 != NULL && lookup (sp, vp->file2) == NULL)
+				syslog (LOG_WARNING, "firmware-info lists \"%s\" for %s %s, but it isn't in %s",
+					vp->file2, mp->name, vp->version, imagedir);
+		}
+	}
+}
+
+/*
+ *	A new snapshot, if anything has changed since "old" - reading only
+ *	what has.  An image that's still being written (changed within the
+ *	last WATCH_SETTLE seconds) is left out for now, and *unsettled set
+ *	to look again.  Returns NULL if nothing has changed.
+ */
+static struct snapshot *
+rebuild (struct snapshot *old, int *unsettled)
+{
+	struct snapshot *sp;
+	struct fw_indexed *ip, *op, *more;
+	struct dirent *de;
+	struct stat stb;
+	char	path[1024];
+	char	errbuf[512];
+	int	room = 0, changed = 0, recheck = 0, dir_ok, i;
+	time_t	now = time (NULL);
+	DIR	*dp;
+
+	*unsettled = 0;
+	if ((sp = calloc (1, sizeof *sp)) == NULL) {
+		syslog (LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+
+	// the catalog - again only if the file has changed
+	if (stat (fwinfo_file, &sp->catalog_stb) < 0)
+		memset (&sp->catalog_stb, 0, sizeof sp->catalog_stb);
+	if (old != NULL && sp->catalog_stb.st_ino == old->catalog_stb.st_ino &&
+	    sp->catalog_stb.st_dev == old->catalog_stb.st_dev &&
+	    sp->catalog_stb.st_mtime == old->catalog_stb.st_mtime &&
+	    sp->catalog_stb.st_size == old->catalog_stb.st_size) {
+		sp->catalog = old->catalog;
+	} else if (sp->catalog_stb.st_ino == 0) {
+		syslog (LOG_ERR, "cannot open firmware description file \"%s\": %s",
+			fwinfo_file, strerror (errno));
+		changed = 1;
+	} else {
+		// Even if it fails, it isn't read again until the file changes.
+		if ((sp->catalog = fw_catalog_read (fwinfo_file, errbuf, sizeof errbuf)) == NULL)
+			syslog (LOG_ERR, "%s", errbuf);
+		else if (verbose)
+			syslog (LOG_INFO, "read %d models from \"%s\"", sp->catalog->nmodels, fwinfo_file);
+		changed = recheck = 1;
+	}
+
+	// the images - hashing only those that are new, or have changed
+	if ((dir_ok = (dp = opendir (imagedir)) != NULL)) {
+		while ((de = readdir (dp)) != NULL) {
+			if (de->d_name[0] == '.' ||
+			    snprintf (path, sizeof path, "%s/%s", imagedir, de->d_name) >= (int) sizeof path ||
+			    stat (path, &stb) < 0 || !S_ISREG (stb.st_mode))
+				continue;
+			if (stb.st_mtime > now - WATCH_SETTLE) {
+				*unsettled = 1;
+				continue;
+			}
+			if (sp->nimages == room) {
+				room = room ? room * 2 : 32;
+				if ((more = realloc (sp->images, room * sizeof *more)) == NULL) {
+					syslog (LOG_ERR, "%s: out of memory", __FUNCTION__);
+					break;
+				}
+				sp->images = more;
+			}
+			ip = &sp->images[sp->nimages];
+			memset (ip, 0, sizeof *ip);
+			ip->size = stb.st_size;
+			ip->mtime = stb.st_mtime;
+			ip->ino = stb.st_ino;
+			if ((ip->name = strdup (de->d_name)) == NULL)
+				break;
+
+			if ((op = lookup (old, ip->name)) != NULL && op->ino == ip->ino &&
+			    op->size == ip->size && op->mtime == ip->mtime) {
+				memcpy (ip->md5, op->md5, sizeof ip->md5);
+				ip->damaged = op->damaged;
+			} else {
+				if (op != NULL && op->ino == ip->ino)
+					syslog (LOG_WARNING, "firmware image \"%s\" was written over - any download of it "
+						"in progress may be damaged; put new images in place with mv", path);
+				if (hash_image (path, ip) < 0) {
+					free (ip->name);
+					continue;
+				}
+				changed = 1;
+			}
+			sp->nimages++;
+		}
+		closedir (dp);
+	}
+	if (old == NULL || sp->nimages != old->nimages)
+		changed = 1;
+	qsort (sp->images, sp->nimages, sizeof *sp->images, compare_names);
+
+	// the catalog is checked when it's read, and when an image goes away
+	for (i = 0; old != NULL && i < old->nimages && !recheck; i++)
+		recheck = lookup (sp, old->images[i].name) == NULL;
+
+	if (!changed) {
+		sp->catalog = NULL;		// it's still old's
+		free_snapshot (sp, NULL);
+		return NULL;
+	}
+	if (recheck && sp->catalog != NULL && dir_ok)
+		check_catalog (sp);
+	return sp;
+}
+
+/*
+ *	Make sp the current snapshot, and free the one before, once the
+ *	event loop can't be using it - if it's running ("wait").
+ */
+static void
+publish (struct snapshot *sp, int wait)
+{
+	struct snapshot *old;
+	unsigned long pass;
+
+	old = atomic_exchange_explicit (&current, sp, memory_order_acq_rel);
+	pass = atomic_load_explicit (&passes, memory_order_acquire);
+	while (wait && atomic_load_explicit (&passes, memory_order_acquire) == pass)
+		usleep (10000);
+	free_snapshot (old, sp);
+}
+
+/* wait for a change, and publish what it changed */
+static void *
+watcher (void *arg)
+{
+	struct snapshot *sp;
+	char	*catalogdir;
+	char	*slash;
+	int	unsettled = 1;		// (for all we know)
+	int	fd = -1;
+	int	timeout;
+	ssize_t	n;
+#ifdef __linux__
+	char	events[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE;
+	int	watching = 0;
+#endif
+
+	if ((catalogdir = strdup (fwinfo_file)) == NULL)
+		return NULL;
+	if ((slash = strrchr (catalogdir, '/')) != NULL)
+		*slash = '\0';
+	else
+		strcpy (catalogdir, ".");
+
+#ifdef __linux__
+	if ((fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		syslog (LOG_ERR, "inotify: %m - looking for changes every %d seconds instead",
+			WATCH_INTERVAL);
+#endif
+
+	for ( ;; ) {
+		timeout = unsettled ? WATCH_SETTLE : WATCH_INTERVAL;
+#ifdef __linux__
+		// (either directory may not be there yet)
+		if (fd >= 0 && watching < 2) {
+			watching = (inotify_add_watch (fd, catalogdir, mask) >= 0) +
+				(inotify_add_watch (fd, imagedir, mask) >= 0);
+		}
+		if (fd >= 0) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll (&pfd, 1, watching < 2 || unsettled ? timeout * 1000 : -1) > 0) {
+				// gather up the rest of the change, then look at it all at once
+				usleep (WATCH_DEBOUNCE * 1000);
+				while ((n = read (fd, events, sizeof events)) > 0) {
+					for (ev = (struct inotify_event *) events; (char *) ev < events + n;
+					    ev = (struct inotify_event *) ((char *) (ev + 1) + ev->len)) {
+						if (ev->mask & IN_IGNORED)	// the directory went away
+							watching = 0;
+					}
+				}
+			}
+		} else
+#endif
+			sleep (timeout);
+
+		if ((sp = rebuild (atomic_load_explicit (&current, memory_order_acquire), &unsettled)) != NULL)
+			publish (sp, 1);
+	}
+	/*NOTREACHED*/
+	return arg;
+}
+
+/*
+ *	Read the catalog and index the images now, so that any problems are
+ *	reported right away, then start watching for changes.
+ */
+int
+watch_start (void)
+{
+	struct snapshot *sp;
+	pthread_t tid;
+	int	unsettled;
+
+	if ((imagedir = malloc (strlen (docroot) + 16)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		return -1;
+	}
+	sprintf (imagedir, "%s/firmware", docroot);
+
+	if ((sp = rebuild (NULL, &unsettled)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		return -1;
+	}
+	publish (sp, 0);
+
+	if ((errno = pthread_create (&tid, NULL, watcher, NULL)) != 0) {
+		fprintf (stderr, "%s: cannot start watching the firmware: %s\n",
+			progname, strerror (errno));
+		return -1;
+	}
+	pthread_detach (tid);
+	return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ *	Where the devices are - the "locations" file that ip_api uses to
+ *	find each device's site, as data/ip_api/index.php does.  The format
+ *	is described in ../ecowitt-web-pages/data/ip_api/locations.sample.
+ *
+ *	Each site also carries its ip_api answer, which endpoints.c works
+ *	out once and keeps until it changes - see ip_api_endpoint().  The
+ *	gateways listed at a site are the ones whose sensors are merged -
+ *	found by the PASSKEY of their reports, see report-merge.c.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "ecowitt-web-server.h"
+#include "firmware-info.h"
+#include "md5.h"
+
+#define	WHITE	" \t\r\n"
+
+/* one "mac" line - the site is an index, since sites[] may move */
+struct site_mac {
+	char	mac[32];	// normalized
+	char	passkey[33];	// ... as the device's reports have it
+	int	site;
+	int	gateway;	// which of the site's devices it is, from 0
+};
+
+struct locations {
+	struct site *sites;
+	int	nsites;
+	struct site_mac *macs;	// by MAC address
+	struct site_mac *keys;	// ... and again, by PASSKEY
+	int	nmacs;
+};
+
+static void	free_locations (struct locations *lp);
+
+
+static int
+compare_macs (const void *a, const void *b)
+{
+	return strcmp (((const struct site_mac *) a)->mac,
+		((const struct site_mac *) b)->mac);
+}
+
+static int
+compare_keys (const void *a, const void *b)
+{
+	return strcasecmp (((const struct site_mac *) a)->passkey,
+		((const struct site_mac *) b)->passkey);
+}
+
+/* what a device puts in its reports for its MAC address: the MD5 of it, in capitals */
+static void
+make_passkey (const char *mac, char *passkey)
+{
+	struct md5 md5;
+	char	upper[32];
+	int	i;
+
+	for (i = 0; mac[i] != '\0' && i < (int) sizeof upper - 1; i++)
+		upper[i] = toupper ((unsigned char) mac[i]);
+	upper[i] = '\0';
+	md5_init (&md5);
+	md5_update (&md5, upper, strlen (upper));
+	md5_final (&md5, passkey);
+	for (i = 0; passkey[i] != '\0'; i++)
+		passkey[i] = toupper ((unsigned char) passkey[i]);
+}
+
+static int
+find_named (struct locations *lp, const char *name)
+{
+	int	i;
+
+	for (i = 0; i < lp->nsites; i++) {
+		if (strcmp (lp->sites[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ *	Read the file.  Bad lines are logged and skipped, so that one typo
+ *	doesn't move every device back to the first site.
+ */
+static struct locations *
+read_locations (const char *fname)
+{
+	FILE	*fp;
+	struct locations *lp;
+	char	line[1024];
+	char	*kw, *a, *b, *c, *extra, *p;
+	double	lat, lon;
+	char	junk;
+	int	linenum = 0;
+	int	i;
+	void	*np;
+
+	if ((fp = fopen (fname, "r")) == NULL) {
+		syslog (LOG_ERR, "cannot open locations file \"%s\": %m", fname);
+		return NULL;
+	}
+	if ((lp = calloc (1, sizeof *lp)) == NULL)
+		goto nomem;
+
+	while (fgets (line, sizeof line, fp) != NULL) {
+		linenum++;
+		if ((p = strchr (line, '#')) != NULL)
+			*p = '\0';
+		if ((kw = strtok (line, WHITE)) == NULL)
+			continue;
+		a = strtok (NULL, WHITE);
+		b = strtok (NULL, WHITE);
+		c = strtok (NULL, WHITE);
+		extra = strtok (NULL, WHITE);
+
+		if (strcmp (kw, "site") == 0) {
+			if (a == NULL || b == NULL || extra != NULL ||
+			    sscanf (b, "%lf,%lf%c", &lat, &lon, &junk) != 2) {
+				syslog (LOG_ERR, "bad site at line %d in \"%s\"", linenum, fname);
+				continue;
+			}
+			if (find_named (lp, a) >= 0) {
+				syslog (LOG_ERR, "site \"%s\" listed again at line %d in \"%s\"",
+					a, linenum, fname);
+				continue;
+			}
+			if ((np = realloc (lp->sites, (lp->nsites + 1) * sizeof *lp->sites)) == NULL)
+				goto nomem;
+			lp->sites = np;
+			memset (&lp->sites[lp->nsites], 0, sizeof *lp->sites);
+			lp->sites[lp->nsites].name = strdup (a);
+			lp->sites[lp->nsites].latitude = lat;
+			lp->sites[lp->nsites].longitude = lon;
+			if (c != NULL)
+				lp->sites[lp->nsites].zone = strdup (c);
+			lp->nsites++;
+			if (lp->sites[lp->nsites - 1].name == NULL ||
+			    (c != NULL && lp->sites[lp->nsites - 1].zone == NULL))
+				goto nomem;
+
+		} else if (strcmp (kw, "mac") == 0) {
+			if (a == NULL || b == NULL || c != NULL) {
+				syslog (LOG_ERR, "bad mac at line %d in \"%s\"", linenum, fname);
+				continue;
+			}
+			if ((i = find_named (lp, b)) < 0) {
+				syslog (LOG_ERR, "unknown site \"%s\" at line %d in \"%s\" - list the site first",
+					b, linenum, fname);
+				continue;
+			}
+			if ((np = realloc (lp->macs, (lp->nmacs + 1) * sizeof *lp->macs)) == NULL)
+				goto nomem;
+			lp->macs = np;
+			fw_normalize_mac (a, lp->macs[lp->nmacs].mac, sizeof lp->macs[lp->nmacs].mac);
+			make_passkey (lp->macs[lp->nmacs].mac, lp->macs[lp->nmacs].passkey);
+			lp->macs[lp->nmacs].site = i;
+			lp->macs[lp->nmacs].gateway = lp->sites[i].ngateways++;
+			lp->nmacs++;
+
+		} else {
+			syslog (LOG_ERR, "unknown keyword \"%s\" at line %d in \"%s\"",
+				kw, linenum, fname);
+		}
+	}
+	fclose (fp);
+
+	qsort (lp->macs, lp->nmacs, sizeof *lp->macs, compare_macs);
+	if (lp->nmacs > 0) {
+		if ((lp->keys = malloc (lp->nmacs * sizeof *lp->keys)) == NULL)
+			goto nomem2;
+		memcpy (lp->keys, lp->macs, lp->nmacs * sizeof *lp->keys);
+		qsort (lp->keys, lp->nmacs, sizeof *lp->keys, compare_keys);
+	}
+	return lp;
+
+nomem:
+	fclose (fp);
+nomem2:
+	syslog (LOG_ERR, "out of memory reading \"%s\"", fname);
+	free_locations (lp);
+	return NULL;
+}
+
+static void
+free_locations (struct locations *lp)
+{
+	int	i;
+
+	if (lp == NULL)
+		return;
+	for (i = 0; i < lp->nsites; i++) {
+		free (lp->sites[i].name);
+		free (lp->sites[i].zone);
+	}
+	free (lp->sites);
+	free (lp->macs);
+	free (lp->keys);
+	free (lp);
+}
+
+/*
+ *	The locations, read again only when the file has changed - and
+ *	looked at no more than once a second, since every ip_api request
+ *	comes through here.  NULL if there's no file.
+ */
+static struct locations *
+current_locations (time_t now)
+{
+	static struct locations *locations = NULL;
+	static struct stat last;
+	static int loaded = 0;
+	static time_t checked = 0;
+	struct stat stb;
+
+	if (loaded && now == checked)
+		return locations;
+	checked = now;
+
+	if (stat (locations_file, &stb) < 0) {
+		if (errno != ENOENT || locations != NULL)
+			syslog (LOG_ERR, "cannot open locations file \"%s\": %m",
+				locations_file);
+		free_locations (locations);
+		locations = NULL;
+		loaded = 1;
+		memset (&last, 0, sizeof last);
+		return NULL;
+	}
+	if (loaded && stb.st_mtime == last.st_mtime && stb.st_size == last.st_size &&
+	    stb.st_ino == last.st_ino && stb.st_dev == last.st_dev)
+		return locations;
+
+	// This throws away the answers for the old sites, too.
+	free_locations (locations);
+	if ((locations = read_locations (locations_file)) != NULL && verbose)
+		syslog (LOG_INFO, "read %d sites and %d devices from \"%s\"",
+			locations->nsites, locations->nmacs, locations_file);
+
+	last = stb;
+	loaded = 1;
+	return locations;
+}
+
+/*
+ *	The site for the device with this MAC address - its own, if it's
+ *	listed, else the first site in the file.  Without a file (or with
+ *	no sites in it), the one location given by "-l" is used for all.
+ *	NULL if we don't know where anything is.
+ */
+struct site *
+find_site (const char *mac, time_t now)
+{
+	static struct site here;	// from -l
+	struct locations *lp;
+	struct site_mac key, *mp;
+
+	if ((lp = current_locations (now)) != NULL && lp->nsites > 0) {
+		if (mac != NULL && lp->nmacs > 0) {
+			fw_normalize_mac (mac, key.mac, sizeof key.mac);
+			mp = bsearch (&key, lp->macs, lp->nmacs, sizeof *lp->macs, compare_macs);
+			if (mp != NULL)
+				return &lp->sites[mp->site];
+		}
+		return &lp->sites[0];
+	}
+
+	if (!have_location)
+		return NULL;
+	if (here.name == NULL) {
+		here.name = "default";
+		here.latitude = latitude;
+		here.longitude = longitude;
+		here.zone = NULL;	// ours - set by -z, if anything
+	}
+	return &here;
+}
+
+/*
+ *	The site of the gateway whose reports carry this PASSKEY, and which
+ *	of the site's gateways it is - or NULL if it isn't listed.  (Unlike
+ *	find_site(), a device that isn't listed isn't at the first site:
+ *	its sensors aren't merged with anyone's.)
+ */
+struct site *
+find_gateway (const char *passkey, time_t now, int *gateway)
+{
+	struct locations *lp;
+	struct site_mac key, *mp;
+
+	if (passkey == NULL || (lp = current_locations (now)) == NULL || lp->nmacs == 0)
+		return NULL;
+	snprintf (key.passkey, sizeof key.passkey, "%s", passkey);
+	if ((mp = bsearch (&key, lp->keys, lp->nmacs, sizeof *lp->keys, compare_keys)) == NULL)
+		return NULL;
+	*gateway = mp->gateway;
+	return &lp->sites[mp->site];
+}
@@ -0,0 +1,504 @@
+/*
+ *	Fan-out of the weather reports to other local services - an MQTT
+ *	broker, a time-series database, or a file that something else reads -
+ *	besides the spool.  Each "-F sink" is one of:
+ *
+ *	mqtt://host[:port][/topic]	each report published (QoS 0) to
+ *					topic/PASSKEY (default "ecowitt")
+ *	http://host[:port]/path		the reports POSTed in batches, e.g. to
+ *					InfluxDB's /write or Telegraf's
+ *					http_listener_v2
+ *	/path/to/file			the reports appended to the file (or
+ *					written to a FIFO)
+ *
+ *	What's sent is the report's line of line protocol, as it's spooled.
+ *
+ *	The event loop only copies the line into each sink's queue in memory;
+ *	every sink has a thread of its own, that takes the whole queue once
+ *	per FANOUT_INTERVAL (or sooner, when it's half full) and sends it as
+ *	one batch.  If that fails, the same batch is tried again, waiting
+ *	twice as long each time, up to FANOUT_MAXBACKOFF, while the queue
+ *	fills behind it - and once the queue is full, further reports are
+ *	counted and dropped for that sink.  So a sink that is slow or down
+ *	never holds up the event loop, or the other sinks: the spool is the
+ *	copy that is kept.
+ */
+
+#define	_GNU_SOURCE		// for memmem() on Linux
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-web-server.h"
+
+#define	FANOUT_MAXSINKS	8
+#define	FANOUT_BUFSIZE	(256 * 1024)	// each sink's queue, and the batch that it's sending
+#define	FANOUT_INTERVAL	1		// seconds between batches
+#define	FANOUT_TIMEOUT	10		// seconds to connect, send, or answer
+#define	FANOUT_MAXBACKOFF 15		// seconds between tries, at most - they're local
+
+enum { SINK_FILE, SINK_HTTP, SINK_MQTT };
+
+struct sink {
+	const char *spec;	// as given to "-F"
+	int	kind;
+	char	host[256];
+	char	port[16];
+	char	path[512];	// the HTTP path, MQTT topic, or file
+	int	fd;		// the MQTT connection, kept open, or -1
+
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	char	*queue;		// lines waiting - filled by the event loop
+	size_t	qlen;
+	int	nqueued;
+	int	dropped;	// reports that didn't fit
+	char	*batch;		// ... and those being sent
+	size_t	blen;
+	int	nbatch;
+};
+
+static struct sink sinks[FANOUT_MAXSINKS];
+static int	nsinks;
+
+
+/* prototypes */
+static void *fanout_sender (void *arg);
+static int	send_batch (struct sink *sp, char *why, size_t whysize);
+static int	send_file (struct sink *sp, char *why, size_t whysize);
+static int	send_http (struct sink *sp, char *why, size_t whysize);
+static int	send_mqtt (struct sink *sp, char *why, size_t whysize);
+static int	connect_sink (struct sink *sp, char *why, size_t whysize);
+
+
+/*
+ *	Add a sink, from the "-F" option.  Returns 0, or -1 (with a message)
+ *	if it isn't one that we know.
+ */
+int
+fanout_add (const char *spec)
+{
+	struct sink *sp;
+	const char *s, *cp;
+	size_t	n;
+
+	if (nsinks == FANOUT_MAXSINKS) {
+		fprintf (stderr, "%s: at most %d sinks\n", progname, FANOUT_MAXSINKS);
+		return -1;
+	}
+	sp = &sinks[nsinks];
+	sp->spec = spec;
+	sp->fd = -1;
+
+	if (spec[0] == '/') {
+		sp->kind = SINK_FILE;
+		snprintf (sp->path, sizeof sp->path, "%s", spec);
+		nsinks++;
+		return 0;
+	}
+	if (strncasecmp (spec, "http://", 7) == 0) {
+		sp->kind = SINK_HTTP;
+		s = spec + 7;
+		strcpy (sp->port, "80");
+	} else if (strncasecmp (spec, "mqtt://", 7) == 0) {
+		sp->kind = SINK_MQTT;
+		s = spec + 7;
+		strcpy (sp->port, "1883");
+	} else {
+		fprintf (stderr, "%s: \"%s\" isn't mqtt://, http:// or a /file\n", progname, spec);
+		return -1;
+	}
+
+	// host[:port][/path]
+	n = strcspn (s, "/");
+	if (s[0] == '[' && (cp = memchr (s, ']', n)) != NULL) {	// [IPv6]:port
+		snprintf (sp->host, sizeof sp->host, "%.*s", (int) (cp - s - 1), s + 1);
+		cp++;
+	} else {
+		if ((cp = memchr (s, ':', n)) == NULL)
+			cp = s + n;
+		snprintf (sp->host, sizeof sp->host, "%.*s", (int) (cp - s), s);
+	}
+	if (*cp == ':')
+		snprintf (sp->port, sizeof sp->port, "%.*s", (int) (s + n - cp - 1), cp + 1);
+	s += n;
+
+	if (sp->kind == SINK_HTTP)
+		snprintf (sp->path, sizeof sp->path, "%s", *s != '\0' ? s : "/");
+	else
+		snprintf (sp->path, sizeof sp->path, "%s", s[0] != '\0' && s[1] != '\0' ? s + 1 : "ecowitt");
+	if (sp->host[0] == '\0' || sp->port[0] == '\0') {
+		fprintf (stderr, "%s: no host in \"%s\"\n", progname, spec);
+		return -1;
+	}
+	nsinks++;
+	return 0;
+}
+
+/*
+ *	Set aside the sinks' queues, and start a thread for each.
+ */
+int
+fanout_start (void)
+{
+	struct sink *sp;
+	pthread_t tid;
+
+	for (sp = sinks; sp < sinks + nsinks; sp++) {
+		pthread_mutex_init (&sp->lock, NULL);
+		pthread_cond_init (&sp->wakeup, NULL);
+		if ((sp->queue = malloc (FANOUT_BUFSIZE)) == NULL ||
+		    (sp->batch = malloc (FANOUT_BUFSIZE)) == NULL) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			return -1;
+		}
+		if ((errno = pthread_create (&tid, NULL, fanout_sender, sp)) != 0) {
+			fprintf (stderr, "%s: cannot start the sender for \"%s\": %s\n",
+				progname, sp->spec, strerror (errno));
+			return -1;
+		}
+		pthread_detach (tid);
+	}
+	return 0;
+}
+
+/*
+ *	Queue a report's line (with its newline) for each sink - or count it
+ *	as dropped, for a sink that has fallen too far behind.
+ */
+void
+fanout_report (const char *line, size_t len)
+{
+	struct sink *sp;
+
+	for (sp = sinks; sp < sinks + nsinks; sp++) {
+		pthread_mutex_lock (&sp->lock);
+		if (sp->qlen + len > FANOUT_BUFSIZE)
+			sp->dropped++;
+		else {
+			memcpy (sp->queue + sp->qlen, line, len);
+			sp->qlen += len;
+			sp->nqueued++;
+		}
+		if (sp->qlen > FANOUT_BUFSIZE / 2)
+			pthread_cond_signal (&sp->wakeup);
+		pthread_mutex_unlock (&sp->lock);
+	}
+}
+
+
+/*
+ *	A sink's thread - take the queue as a batch once per interval, and
+ *	send it, until it goes.
+ */
+static void *
+fanout_sender (void *arg)
+{
+	struct sink *sp = arg;
+	struct timespec deadline, t0, t1;
+	char	why[256], *cp;
+	int	dropped = 0, tries = 0;
+	int	backoff, r;
+
+	for (;;) {
+		pthread_mutex_lock (&sp->lock);
+		if (sp->blen == 0) {
+			clock_gettime (CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += FANOUT_INTERVAL;
+			pthread_cond_timedwait (&sp->wakeup, &sp->lock, &deadline);
+			cp = sp->batch;
+			sp->batch = sp->queue;
+			sp->blen = sp->qlen;
+			sp->nbatch = sp->nqueued;
+			sp->queue = cp;
+			sp->qlen = sp->nqueued = 0;
+		}
+		dropped += sp->dropped;
+		sp->dropped = 0;
+		pthread_mutex_unlock (&sp->lock);
+
+		if (sp->blen == 0)
+			continue;
+
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+		why[0] = '\0';
+		r = send_batch (sp, why, sizeof why);
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+
+		if (r < 0) {		// try it again
+			if (tries++ == 0)
+				syslog (LOG_WARNING, "fan-out to %s: %s - trying again", sp->spec, why);
+			backoff = tries < 5 ? 1 << (tries - 1) : FANOUT_MAXBACKOFF;
+			sleep (backoff);
+			continue;
+		}
+		if (r > 0)		// it won't ever take them
+			syslog (LOG_ERR, "fan-out to %s: %s - %d reports lost", sp->spec, why, sp->nbatch);
+		else if (tries > 0)
+			syslog (LOG_WARNING, "fan-out to %s: sent %d reports after %d tries, %d dropped meanwhile",
+				sp->spec, sp->nbatch, tries + 1, dropped);
+		else if (dropped > 0)
+			syslog (LOG_WARNING, "fan-out to %s: sent %d reports, %d dropped - it's too slow",
+				sp->spec, sp->nbatch, dropped);
+		else if (verbose)
+			syslog (LOG_INFO, "fan-out to %s: sent %d reports - %zu bytes, %.1f ms",
+				sp->spec, sp->nbatch, sp->blen,
+				(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+		sp->blen = 0;
+		sp->nbatch = 0;
+		dropped = tries = 0;
+	}
+	/*NOTREACHED*/
+	return arg;
+}
+
+/*
+ *	Send the sink its batch.  Returns 0 once it has them, -1 (with why)
+ *	if it's worth trying again, or 1 if it turned them down.
+ */
+static int
+send_batch (struct sink *sp, char *why, size_t whysize)
+{
+	switch (sp->kind) {
+	case SINK_FILE:	return send_file (sp, why, whysize);
+	case SINK_HTTP:	return send_http (sp, why, whysize);
+	default:	return send_mqtt (sp, why, whysize);
+	}
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+	ssize_t	r;
+
+	while (len > 0) {
+		if ((r = write (fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ *	Append the batch to the file - opened each time, so that it can be
+ *	rotated.  A FIFO with nothing reading it yet isn't waited for.
+ */
+static int
+send_file (struct sink *sp, char *why, size_t whysize)
+{
+	int	fd;
+
+	if ((fd = open (sp->path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK, 0644)) < 0) {
+		snprintf (why, whysize, "cannot open: %s", strerror (errno));
+		return -1;
+	}
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+	if (write_all (fd, sp->batch, sp->blen) < 0) {
+		snprintf (why, whysize, "cannot write: %s", strerror (errno));
+		close (fd);
+		return -1;
+	}
+	close (fd);
+	return 0;
+}
+
+/*
+ *	POST the batch, on a connection of its own - one a second is nothing
+ *	to a local database, and there's no connection to go stale.
+ */
+static int
+send_http (struct sink *sp, char *why, size_t whysize)
+{
+	char	header[1024], answer[512];
+	int	fd, len, status, r;
+
+	if ((fd = connect_sink (sp, why, whysize)) < 0)
+		return -1;
+	len = snprintf (header, sizeof header,
+		"POST %s HTTP/1.1\r\n"
+		"Host: %s:%s\r\n"
+		"User-Agent: %s\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		sp->path, sp->host, sp->port, progname, sp->blen);
+	if (write_all (fd, header, len) < 0 || write_all (fd, sp->batch, sp->blen) < 0) {
+		snprintf (why, whysize, "cannot send: %s", strerror (errno));
+		close (fd);
+		return -1;
+	}
+	len = 0;
+	while (len < (int) sizeof answer - 1 && memchr (answer, '\n', len) == NULL) {
+		if ((r = read (fd, answer + len, sizeof answer - 1 - len)) <= 0)
+			break;
+		len += r;
+	}
+	close (fd);
+	answer[len] = '\0';
+
+	if (sscanf (answer, "HTTP/1.%*d %d", &status) != 1) {
+		snprintf (why, whysize, "no answer");
+		return -1;
+	}
+	if (status >= 200 && status < 300)
+		return 0;
+	answer[strcspn (answer, "\r\n")] = '\0';
+	snprintf (why, whysize, "\"%.200s\"", answer);
+	return status >= 400 && status < 500 && status != 408 && status != 429 ? 1 : -1;
+}
+
+/* an MQTT "remaining length" */
+static int
+put_length (unsigned char *p, size_t n)
+{
+	int	i = 0;
+
+	do {
+		p[i] = n % 128;
+		n /= 128;
+		if (n > 0)
+			p[i] |= 128;
+		i++;
+	} while (n > 0);
+	return i;
+}
+
+/*
+ *	Publish each report in the batch, at QoS 0, to topic/PASSKEY - on
+ *	the connection that's kept open, once it has been made.  There's
+ *	nothing to wait for from the broker: if the connection fails, the
+ *	whole batch is sent again on a new one, and any that went twice are
+ *	the same series at the same time.
+ */
+static int
+send_mqtt (struct sink *sp, char *why, size_t whysize)
+{
+	static const unsigned char connect_flags[] = {
+		0, 4, 'M', 'Q', 'T', 'T',	// protocol name
+		4,				// ... level (3.1.1)
+		0x02,				// clean session
+		0, 0,				// no keep-alive
+	};
+	unsigned char out[16384 + 1024], ack[4];
+	struct pollfd pfd;
+	char	topic[sizeof sp->path + 64], id[64], *line, *end, *p;
+	size_t	len, tlen, n;
+	int	fd;
+
+	// A broker that has closed the connection has nothing else to say.
+	if (sp->fd >= 0) {
+		pfd.fd = sp->fd;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, 0) != 0) {
+			close (sp->fd);
+			sp->fd = -1;
+		}
+	}
+	if (sp->fd < 0) {
+		if ((fd = connect_sink (sp, why, whysize)) < 0)
+			return -1;
+		n = snprintf (id, sizeof id, "%s-%d", progname, (int) getpid ());
+		out[0] = 0x10;		// CONNECT
+		len = 1 + put_length (out + 1, sizeof connect_flags + 2 + n);
+		memcpy (out + len, connect_flags, sizeof connect_flags);
+		len += sizeof connect_flags;
+		out[len++] = n >> 8;
+		out[len++] = n & 0xff;
+		memcpy (out + len, id, n);
+		len += n;
+		errno = 0;
+		if (write_all (fd, (char *) out, len) < 0 ||
+		    recv (fd, ack, sizeof ack, MSG_WAITALL) != sizeof ack) {
+			snprintf (why, whysize, "no CONNACK: %s", errno ? strerror (errno) : "closed");
+			close (fd);
+			return -1;
+		}
+		if (ack[0] != 0x20 || ack[3] != 0) {
+			snprintf (why, whysize, "connection refused (%d)", ack[3]);
+			close (fd);
+			return -1;
+		}
+		sp->fd = fd;
+	}
+
+	len = 0;
+	for (line = sp->batch; line < sp->batch + sp->blen; line = end + 1) {
+		end = memchr (line, '\n', sp->batch + sp->blen - line);
+		n = end - line;
+		if ((p = memmem (line, n, ",PASSKEY=", 9)) != NULL)
+			tlen = snprintf (topic, sizeof topic, "%s/%.*s", sp->path,
+				(int) strcspn (p + 9, ", "), p + 9);
+		else
+			tlen = snprintf (topic, sizeof topic, "%s", sp->path);
+		if (len + 8 + tlen + n > sizeof out) {
+			if (write_all (sp->fd, (char *) out, len) < 0)
+				goto failed;
+			len = 0;
+		}
+		out[len++] = 0x30;	// PUBLISH, QoS 0
+		len += put_length (out + len, 2 + tlen + n);
+		out[len++] = tlen >> 8;
+		out[len++] = tlen & 0xff;
+		memcpy (out + len, topic, tlen);
+		len += tlen;
+		memcpy (out + len, line, n);
+		len += n;
+	}
+	if (len > 0 && write_all (sp->fd, (char *) out, len) < 0)
+		goto failed;
+	return 0;
+
+failed:
+	snprintf (why, whysize, "cannot send: %s", strerror (errno));
+	close (sp->fd);
+	sp->fd = -1;
+	return -1;
+}
+
+/* a connection to the sink's host, that gives up after FANOUT_TIMEOUT */
+static int
+connect_sink (struct sink *sp, char *why, size_t whysize)
+{
+	struct addrinfo hints, *ai, *p;
+	struct timeval tv;
+	int	fd = -1, r;
+
+	memset (&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	if ((r = getaddrinfo (sp->host, sp->port, &hints, &ai)) != 0) {
+		snprintf (why, whysize, "%s", gai_strerror (r));
+		return -1;
+	}
+	tv.tv_sec = FANOUT_TIMEOUT;
+	tv.tv_usec = 0;
+	for (p = ai; p != NULL; p = p->ai_next) {
+		if ((fd = socket (p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);	// connect(), too
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		if (connect (fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		snprintf (why, whysize, "cannot connect: %s", strerror (errno));
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (ai);
+	return fd;
+}
@@ -0,0 +1,264 @@
+/*
+ *	Merging the readings of the sensors that more than one gateway hears.
+ *
+ *	Gateways at the same site often hear the same sensors - the outdoor
+ *	array, or a WN34 probe on channel 1 - so each of their reports has
+ *	the same readings, a few seconds apart.  With "-m seconds", the
+ *	reports of the gateways listed at each site in the locations file
+ *	are merged into one stream: in each window of that many seconds,
+ *	each sensor's readings are taken from one gateway's report, and the
+ *	window becomes one line in "merged-YYYY-MM-DD.lp":
+ *
+ *	ecowitt_merged,site=cabin tempf=71.2,humidity=40,...,tf_ch1=55.4,tf_batt1=1.48 1719566240000000000
+ *
+ *	A sensor is the one that report-fields.def gives for the field
+ *	("outdoor", "wn34_ch1"), at that site; the gateway's own readings -
+ *	indoors, its heap - aren't merged.  The reports don't say how well
+ *	a gateway hears a sensor, so that is judged by how many of its last
+ *	eight reports had the sensor's readings: they're taken from the
+ *	gateway that's been hearing it best, and between two as good, from
+ *	the one that they came from in the last window - so that a counter
+ *	such as dailyrainin, which each gateway keeps for itself, doesn't
+ *	jump between them - else from the fresher report.
+ *
+ *	A window ends as soon as every gateway at the site has reported in
+ *	it, or else when its time is up (as the spool writer finds, once a
+ *	second).  So with the window as long as the gateways' interval, no
+ *	reading is held for longer than that.  Each site keeps just the one
+ *	window, with one reading of each sensor, however many reports come.
+ */
+
+#define	_GNU_SOURCE		// for strptime() on Linux
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "ecowitt-web-server.h"
+
+#define	MERGE_MAXTEXT	512	// one sensor's readings, "tempf=71.2,humidity=40,..."
+
+/* a sensor's readings, in the window */
+struct reading {
+	char	*text;		// from the gateway's report, once there is one
+	size_t	len;
+	int	gateway;	// which gateway they're from, or -1 if none yet
+	int	heard;		// ... how well it's been hearing the sensor
+	time_t	when;		// ... and the time of its report
+	int	last;		// the gateway that they came from in the last window, or -1
+};
+
+/* a site, with its window */
+struct window {
+	char	*name;		// the site's
+	time_t	start;		// of the window
+	time_t	next;		// ... and the soonest that the next can start
+	uint32_t reported;	// the gateways that have reported in it
+	int	nreadings;	// sensors that have readings in it
+	struct reading readings[REPORT_MAXSENSORS];
+	uint8_t	heard[MERGE_MAXGATEWAYS][REPORT_MAXSENSORS];	// in each gateway's last eight reports
+};
+
+static struct window **windows;
+static int	nwindows, maxwindows;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	// the spool writer ends them, too
+
+
+/* prototypes */
+static struct window *find_window (struct site *sp);
+static int	better (struct reading *rp, int gateway, int heard, time_t when);
+static void	end_window (struct window *wp);
+
+
+/* the site's window - found by name, since the locations are read again as they change */
+static struct window *
+find_window (struct site *sp)
+{
+	struct window *wp, **np;
+	int	i;
+
+	if (sp->merge > 0 && strcmp (windows[sp->merge - 1]->name, sp->name) == 0)
+		return windows[sp->merge - 1];
+	for (i = 0; i < nwindows && strcmp (windows[i]->name, sp->name) != 0; i++)
+		;
+	if (i == nwindows) {
+		if (nwindows == maxwindows) {
+			maxwindows = maxwindows ? 2 * maxwindows : 16;
+			if ((np = realloc (windows, maxwindows * sizeof *np)) == NULL)
+				goto nomem;
+			windows = np;
+		}
+		if ((wp = calloc (1, sizeof *wp)) == NULL || (wp->name = strdup (sp->name)) == NULL) {
+			free (wp);
+			goto nomem;
+		}
+		for (i = 0; i < REPORT_MAXSENSORS; i++)
+			wp->readings[i].gateway = wp->readings[i].last = -1;
+		windows[i = nwindows++] = wp;
+	}
+	sp->merge = i + 1;
+	return windows[i];
+
+nomem:
+	syslog (LOG_ERR, "%s: out of memory for site \"%s\"", __FUNCTION__, sp->name);
+	return NULL;
+}
+
+/* should this gateway's readings of the sensor replace those that the window has? */
+static int
+better (struct reading *rp, int gateway, int heard, time_t when)
+{
+	if (rp->gateway < 0 || rp->gateway == gateway)	// none yet, or newer from the same
+		return 1;
+	if (heard != rp->heard)
+		return heard > rp->heard;
+	if (gateway == rp->last || rp->gateway == rp->last)
+		return gateway == rp->last;
+	return when > rp->when;
+}
+
+/* the window's line for the spool, if it has any readings - then start again */
+static void
+end_window (struct window *wp)
+{
+	static char line[REPORT_MAXSENSORS * MERGE_MAXTEXT + 1024];
+	struct reading *rp;
+	const char *s;
+	size_t	len;
+	int	i, n;
+
+	if (wp->nreadings > 0) {
+		len = snprintf (line, sizeof line, "ecowitt_merged,site=");
+		for (s = wp->name; *s != '\0' && len < 256; s++) {
+			if (strchr (", =", *s) != NULL)
+				line[len++] = '\\';
+			line[len++] = *s;
+		}
+		for (i = n = 0, rp = wp->readings; i < REPORT_MAXSENSORS; i++, rp++) {
+			if (rp->gateway < 0)
+				continue;
+			line[len++] = n++ > 0 ? ',' : ' ';
+			memcpy (line + len, rp->text, rp->len);
+			len += rp->len;
+		}
+		len += snprintf (line + len, sizeof line - len, " %lld000000000\n",
+			(long long) wp->start);
+		spool_derived (SPOOL_MERGED, line, len);
+	}
+
+	for (i = 0, rp = wp->readings; i < REPORT_MAXSENSORS; i++, rp++) {
+		if (rp->gateway >= 0)
+			rp->last = rp->gateway;
+		rp->gateway = -1;
+		rp->len = 0;
+	}
+	wp->nreadings = 0;
+	wp->reported = 0;
+	wp->next = wp->start + merge_window;
+}
+
+/*
+ *	Merge a report into its site's window, if it's from a gateway listed
+ *	at a site.
+ */
+void
+merge_report (struct request *rq, time_t now)
+{
+	int	sensor[REQ_MAXPARAMS];
+	char	take[REPORT_MAXSENSORS];
+	struct window *wp;
+	struct reading *rp;
+	struct param *pp;
+	struct site *sp;
+	struct tm tm;
+	const char *date;
+	time_t	when = 0;
+	uint32_t all;
+	int	g, i, n, heard;
+
+	if ((sp = find_gateway (get_param (rq, "PASSKEY"), now, &g)) == NULL ||
+	    g >= MERGE_MAXGATEWAYS)
+		return;
+	if ((date = get_param (rq, "dateutc")) != NULL) {
+		memset (&tm, 0, sizeof tm);
+		if (strptime (date, "%Y-%m-%d %H:%M:%S", &tm) != NULL)
+			when = timegm (&tm);
+	}
+	if (when <= 0)		// e.g. "dateutc=now"
+		when = now;
+	all = sp->ngateways >= MERGE_MAXGATEWAYS ? ~(uint32_t) 0 : ((uint32_t) 1 << sp->ngateways) - 1;
+
+	pthread_mutex_lock (&lock);
+	if ((wp = find_window (sp)) == NULL) {
+		pthread_mutex_unlock (&lock);
+		return;
+	}
+	if (wp->reported != 0 && now >= wp->start + merge_window)
+		end_window (wp);
+	if (wp->reported == 0) {	// on a multiple of the window, as at every other site
+		wp->start = now - now % merge_window;
+		if (wp->start < wp->next)
+			wp->start = wp->next;
+	}
+
+	// which sensors it has, and which of them to take
+	memset (take, 0, sizeof take);
+	for (i = 0; i < rq->nparams; i++) {
+		pp = &rq->params[i];
+		if ((sensor[i] = report_sensor (pp->name, pp->value)) >= 0)
+			take[sensor[i]] = 1;
+	}
+	for (i = 0; i < REPORT_MAXSENSORS; i++) {
+		wp->heard[g][i] = wp->heard[g][i] << 1 | take[i];
+		if (!take[i])
+			continue;
+		for (heard = 0, n = wp->heard[g][i]; n != 0; n &= n - 1)
+			heard++;
+		rp = &wp->readings[i];
+		if (!better (rp, g, heard, when) ||
+		    (rp->text == NULL && (rp->text = malloc (MERGE_MAXTEXT)) == NULL)) {
+			take[i] = 0;
+			continue;
+		}
+		if (rp->gateway < 0)
+			wp->nreadings++;
+		rp->gateway = g;
+		rp->heard = heard;
+		rp->when = when;
+		rp->len = 0;
+	}
+	for (i = 0; i < rq->nparams; i++) {
+		if (sensor[i] < 0 || !take[sensor[i]])
+			continue;
+		rp = &wp->readings[sensor[i]];
+		pp = &rq->params[i];
+		n = snprintf (rp->text + rp->len, MERGE_MAXTEXT - rp->len, "%s%s=%s",
+			rp->len > 0 ? "," : "", pp->name, pp->value);
+		if (n < (int) (MERGE_MAXTEXT - rp->len))	// else it's left out
+			rp->len += n;
+	}
+
+	wp->reported |= (uint32_t) 1 << g;
+	if ((wp->reported & all) == all)
+		end_window (wp);
+	pthread_mutex_unlock (&lock);
+}
+
+/* end the windows whose time is up - from the spool writer */
+void
+merge_expire (time_t now)
+{
+	int	i;
+
+	pthread_mutex_lock (&lock);
+	for (i = 0; i < nwindows; i++) {
+		if (windows[i]->reported != 0 && now >= windows[i]->start + merge_window)
+			end_window (windows[i]);
+	}
+	pthread_mutex_unlock (&lock);
+}
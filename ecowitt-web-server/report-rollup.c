@@ -0,0 +1,446 @@
+/*
+ *	Rollups of the reports ("-R"): for each station, the lowest, highest,
+ *	mean and last of each reading in every minute, hour and day (UTC),
+ *	brought up to date as each report comes in, so that a graph of a
+ *	month or a year needn't read every report.  They're spooled beside
+ *	the reports, in "rollups-YYYY-MM-DD.lp":
+ *
+ *	ecowitt_1h,PASSKEY=606...B888 samples=225,tempf_min=61.2,tempf_max=70.1,tempf_mean=65.53,tempf_last=62,...,dailyrainin_delta=0.12 1719565200000000000
+ *
+ *	The rain counters - the totals that the station keeps for the day
+ *	and the year - also have how much they went up, "_delta": the rain
+ *	that fell in that time.  A counter that goes down has been reset, and
+ *	counts up from nothing again.
+ *
+ *	A rollup is written once its time is up, by the spool writer.  Each
+ *	report counts in the rollups for its own time ("dateutc"), not when
+ *	it came, so one that comes late or out of order still counts where it
+ *	belongs: if that rollup was written already, it's written again, and
+ *	the later line takes the place of the earlier when they're loaded
+ *	(the same series and time).  The last few minutes, and the last two
+ *	hours and days, are kept for that; a report older than a rollup that
+ *	has gone only counts in those that are still kept.  A late report
+ *	doesn't change the counters' deltas, since the rain that it would add
+ *	was counted by the reports after it.
+ *
+ *	When the server starts, the rollups that were in progress are made
+ *	again from the day's reports file, so that they aren't written over
+ *	with only what comes after.  Those that had ended aren't touched.
+ */
+
+#define	_GNU_SOURCE		// for strptime() on Linux
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "ecowitt-web-server.h"
+
+#define	ROLLUP_MAXFIELDS 128	// readings of one station
+#define	ROLLUP_MAXLINE	32768
+#define	NSCALES		3
+#define	MAXKEEP		5
+#define	ROLLUP_AHEAD	300	// seconds that a station's clock may be fast
+
+static const struct scale {
+	const char *measurement;
+	int	seconds;
+	int	keep;		// rollups kept, for the reports that come late
+} scales[NSCALES] = {
+	{ "ecowitt_1m",	60,	MAXKEEP },
+	{ "ecowitt_1h",	3600,	2 },
+	{ "ecowitt_1d",	86400,	2 },
+};
+
+static const char *counters[] = {
+	"dailyrainin", "yearlyrainin", "drain_piezo", "yrain_piezo"
+};
+
+#define	NCOUNTERS	(int) (sizeof counters / sizeof counters[0])
+
+/* one reading, in one rollup */
+struct summary {
+	double	sum;
+	double	min, max, last;
+	uint32_t count;
+	time_t	when;		// of the last
+};
+
+struct rollup {
+	time_t	start;		// 0 if it isn't in use
+	int	dirty;		// changed since it was written
+	int	samples;	// reports in it
+	double	delta[NCOUNTERS];
+	struct summary *s;	// for each of the station's readings
+};
+
+struct station {
+	char	passkey[40];
+	short	field[ROLLUP_MAXFIELDS];	// which reading each summary is (report_reading())
+	int	nfields, maxfields;
+	double	counter[NCOUNTERS];	// the last value of each counter
+	time_t	counted[NCOUNTERS];	// ... and its time, or 0
+	struct rollup rollups[NSCALES][MAXKEEP];
+};
+
+static struct station **stations;	// by PASSKEY
+static int	nstations, maxstations;
+static int	counter_field[NCOUNTERS];	// as report_reading() gives them
+static time_t	started;		// rollups that ended before this were written already
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	// the spool writer writes them
+
+
+/* prototypes */
+static struct station *find_station (const char *passkey);
+static int	find_summary (struct station *stp, int field);
+static struct rollup *find_rollup (struct station *stp, int k, time_t when);
+static void	add_report (const char *passkey, time_t when, int n, char **names, char **values);
+static int	write_rollup (struct station *stp, int k, struct rollup *rp);
+static int	replay (const char *dir);
+
+
+/* the station, which is added if it's new - NULL if it can't be */
+static struct station *
+find_station (const char *passkey)
+{
+	struct station *stp, **np;
+	int	lo = 0, hi = nstations, mid, c, k, j;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((c = strcmp (passkey, stations[mid]->passkey)) == 0)
+			return stations[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (nstations == maxstations) {
+		maxstations = maxstations ? 2 * maxstations : 64;
+		if ((np = realloc (stations, maxstations * sizeof *np)) == NULL)
+			goto nomem;
+		stations = np;
+	}
+	if ((stp = calloc (1, sizeof *stp)) == NULL)
+		goto nomem;
+	stp->maxfields = 16;
+	for (k = 0; k < NSCALES; k++) {
+		for (j = 0; j < scales[k].keep; j++) {
+			if ((stp->rollups[k][j].s = calloc (stp->maxfields, sizeof (struct summary))) == NULL) {
+				for (k = 0; k < NSCALES; k++) {
+					for (j = 0; j < MAXKEEP; j++)
+						free (stp->rollups[k][j].s);
+				}
+				free (stp);
+				goto nomem;
+			}
+		}
+	}
+	snprintf (stp->passkey, sizeof stp->passkey, "%s", passkey);
+	memmove (stations + lo + 1, stations + lo, (nstations - lo) * sizeof *stations);
+	stations[lo] = stp;
+	nstations++;
+	return stp;
+
+nomem:
+	syslog (LOG_ERR, "%s: out of memory for station %s", __FUNCTION__, passkey);
+	return NULL;
+}
+
+/* where this reading's summaries are, in each of the station's rollups - or -1 */
+static int
+find_summary (struct station *stp, int field)
+{
+	struct summary *sp;
+	int	i, k, j, max;
+
+	for (i = 0; i < stp->nfields; i++) {
+		if (stp->field[i] == field)
+			return i;
+	}
+	if (stp->nfields == ROLLUP_MAXFIELDS)
+		return -1;
+	if (stp->nfields == stp->maxfields) {
+		max = 2 * stp->maxfields;
+		for (k = 0; k < NSCALES; k++) {
+			for (j = 0; j < scales[k].keep; j++) {
+				if ((sp = realloc (stp->rollups[k][j].s, max * sizeof *sp)) == NULL) {
+					syslog (LOG_ERR, "%s: out of memory for station %s",
+						__FUNCTION__, stp->passkey);
+					return -1;
+				}
+				memset (sp + stp->maxfields, 0, (max - stp->maxfields) * sizeof *sp);
+				stp->rollups[k][j].s = sp;
+			}
+		}
+		stp->maxfields = max;
+	}
+	stp->field[stp->nfields] = field;
+	return stp->nfields++;
+}
+
+/*
+ *	The station's rollup at this scale for a report at this time, started
+ *	now if it has to be - or NULL if it's too late for that.
+ */
+static struct rollup *
+find_rollup (struct station *stp, int k, time_t when)
+{
+	const struct scale *sc = &scales[k];
+	time_t	start = when - when % sc->seconds;
+	struct rollup *rp = &stp->rollups[k][(start / sc->seconds) % sc->keep];
+
+	if (rp->start == start)
+		return rp;
+	if (rp->start > start || start + sc->seconds <= started)
+		return NULL;
+	if (rp->start != 0 && rp->dirty && write_rollup (stp, k, rp) < 0)	// its time is up
+		syslog (LOG_WARNING, "%s: no room in the spool for the %s rollup of %s - lost",
+			__FUNCTION__, scales[k].measurement, stp->passkey);
+	rp->start = start;
+	rp->dirty = 0;
+	rp->samples = 0;
+	memset (rp->delta, 0, sizeof rp->delta);
+	memset (rp->s, 0, stp->maxfields * sizeof *rp->s);
+	return rp;
+}
+
+/* add a report - its readings, by name - to the station's rollups */
+static void
+add_report (const char *passkey, time_t when, int n, char **names, char **values)
+{
+	struct rollup *rp[NSCALES];
+	struct station *stp;
+	struct summary *sp;
+	double	v, d;
+	int	i, k, c, f, slot;
+
+	pthread_mutex_lock (&lock);
+	if ((stp = find_station (passkey)) == NULL) {
+		pthread_mutex_unlock (&lock);
+		return;
+	}
+	for (k = 0; k < NSCALES; k++) {
+		if ((rp[k] = find_rollup (stp, k, when)) != NULL) {
+			rp[k]->samples++;
+			rp[k]->dirty = 1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((f = report_reading (names[i], values[i])) < 0 || (slot = find_summary (stp, f)) < 0)
+			continue;
+		v = atof (values[i]);
+		for (k = 0; k < NSCALES; k++) {
+			if (rp[k] == NULL)
+				continue;
+			sp = &rp[k]->s[slot];
+			if (sp->count++ == 0)
+				sp->min = sp->max = v;
+			else if (v < sp->min)
+				sp->min = v;
+			else if (v > sp->max)
+				sp->max = v;
+			sp->sum += v;
+			if (when >= sp->when) {
+				sp->last = v;
+				sp->when = when;
+			}
+		}
+
+		// the rain since the last report, if this is the newest
+		for (c = 0; c < NCOUNTERS; c++) {
+			if (f != counter_field[c] || when <= stp->counted[c])
+				continue;
+			if (stp->counted[c] != 0) {
+				d = v >= stp->counter[c] ? v - stp->counter[c] : v;
+				for (k = 0; k < NSCALES; k++) {
+					if (rp[k] != NULL)
+						rp[k]->delta[c] += d;
+				}
+			}
+			stp->counter[c] = v;
+			stp->counted[c] = when;
+		}
+	}
+	pthread_mutex_unlock (&lock);
+}
+
+/*
+ *	The rollup's line, for the spool - 0, or -1 if there wasn't room.
+ *	Once the line is in the batch, the spool writer keeps it if the
+ *	batch can't be written, so the rollup counts as written.
+ */
+static int
+write_rollup (struct station *stp, int k, struct rollup *rp)
+{
+	static char line[ROLLUP_MAXLINE];
+	struct summary *sp;
+	const char *name;
+	size_t	len;
+	int	i, c;
+
+	len = snprintf (line, sizeof line, "%s,PASSKEY=%s samples=%d",
+		scales[k].measurement, stp->passkey, rp->samples);
+	for (i = 0; i < stp->nfields && len < sizeof line - 512; i++) {
+		if ((sp = &rp->s[i])->count == 0)
+			continue;
+		name = report_field_name (stp->field[i]);
+		len += snprintf (line + len, sizeof line - len,
+			",%s_min=%.10g,%s_max=%.10g,%s_mean=%.10g,%s_last=%.10g",
+			name, sp->min, name, sp->max, name, sp->sum / sp->count, name, sp->last);
+		for (c = 0; c < NCOUNTERS; c++) {
+			if (stp->field[i] == counter_field[c])
+				len += snprintf (line + len, sizeof line - len, ",%s_delta=%.10g",
+					name, rp->delta[c]);
+		}
+	}
+	len += snprintf (line + len, sizeof line - len, " %lld000000000\n", (long long) rp->start);
+	if (spool_derived (SPOOL_ROLLUPS, line, len) < 0)
+		return -1;
+	rp->dirty = 0;
+	return 0;
+}
+
+/* a PASSKEY that can go into a line as it is */
+static int
+good_passkey (const char *passkey)
+{
+	const char *p;
+
+	for (p = passkey; isalnum ((unsigned char) *p); p++)
+		;
+	return *p == '\0' && p > passkey && p - passkey < 40;
+}
+
+/*
+ *	Make the rollups that were in progress again, from the day's reports
+ *	file.  Returns how many reports were read, or -1.
+ */
+static int
+replay (const char *dir)
+{
+	static char line[ROLLUP_MAXLINE];
+	char	*names[REQ_MAXPARAMS], *values[REQ_MAXPARAMS];
+	char	fname[1024], day[16], *fields, *p, *e, *passkey;
+	struct tm tm;
+	long long ns;
+	FILE	*fp;
+	int	n, nreports = 0;
+
+	gmtime_r (&started, &tm);
+	strftime (day, sizeof day, "%Y-%m-%d", &tm);
+	snprintf (fname, sizeof fname, "%s/reports-%s.lp", dir, day);
+	if ((fp = fopen (fname, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		syslog (LOG_ERR, "%s: cannot open \"%s\": %m", __FUNCTION__, fname);
+		return -1;
+	}
+
+	// ecowitt,PASSKEY=606...B888,stationtype=... tempinf=78.08,humidityin=59,... 1719566240000000000
+	while (fgets (line, sizeof line, fp) != NULL) {
+		if (strncmp (line, "ecowitt,", 8) != 0 || (fields = strchr (line, ' ')) == NULL ||
+		    (e = strrchr (fields + 1, ' ')) == NULL || (p = strstr (line, ",PASSKEY=")) == NULL ||
+		    p > fields)
+			continue;
+		*fields++ = *e++ = '\0';
+		passkey = p + 9;
+		passkey[strcspn (passkey, ",")] = '\0';
+		ns = strtoll (e, NULL, 10);
+		for (n = 0, p = strtok (fields, ","); p != NULL && n < REQ_MAXPARAMS; p = strtok (NULL, ",")) {
+			if ((e = strchr (p, '=')) == NULL)
+				continue;
+			*e++ = '\0';
+			names[n] = p;
+			values[n++] = e;
+		}
+		if (good_passkey (passkey) && ns > 0) {
+			add_report (passkey, ns / 1000000000, n, names, values);
+			nreports++;
+		}
+	}
+	fclose (fp);
+	return nreports;
+}
+
+/*
+ *	Start keeping the rollups - after spool_start(), which knows the
+ *	fields.  Returns 0, or -1 if it can't.
+ */
+int
+rollup_start (const char *dir)
+{
+	int	c, n;
+
+	for (c = 0; c < NCOUNTERS; c++)
+		counter_field[c] = report_reading (counters[c], "0");
+	started = time (NULL);
+	if ((n = replay (dir)) < 0)
+		return -1;
+	if (n > 0)
+		syslog (LOG_INFO, "made the rollups in progress again from %d reports", n);
+	return 0;
+}
+
+/* add a report to its station's rollups */
+void
+rollup_report (struct request *rq)
+{
+	char	*names[REQ_MAXPARAMS], *values[REQ_MAXPARAMS];
+	const char *passkey, *date;
+	struct tm tm;
+	time_t	when = 0, now = time (NULL);
+	int	i;
+
+	if ((passkey = get_param (rq, "PASSKEY")) == NULL || !good_passkey (passkey))
+		return;
+	if ((date = get_param (rq, "dateutc")) != NULL) {
+		memset (&tm, 0, sizeof tm);
+		if (strptime (date, "%Y-%m-%d %H:%M:%S", &tm) != NULL)
+			when = timegm (&tm);
+	}
+	if (when <= 0)		// e.g. "dateutc=now"
+		when = now;
+	else if (when > now + ROLLUP_AHEAD)	// it would push out the rollups in progress
+		return;
+	for (i = 0; i < rq->nparams; i++) {
+		names[i] = rq->params[i].name;
+		values[i] = rq->params[i].value;
+	}
+	add_report (passkey, when, rq->nparams, names, values);
+}
+
+/*
+ *	Write the rollups whose time is up, that have changed - from the
+ *	spool writer.  When a minute ends, every station's rollup is written
+ *	at once, so those that don't fit in this batch wait for the next.
+ */
+void
+rollup_expire (time_t now)
+{
+	struct rollup *rp;
+	int	i, k, j;
+
+	pthread_mutex_lock (&lock);
+	for (i = 0; i < nstations; i++) {
+		for (k = 0; k < NSCALES; k++) {
+			for (j = 0; j < scales[k].keep; j++) {
+				rp = &stations[i]->rollups[k][j];
+				if (rp->dirty && rp->start + scales[k].seconds <= now &&
+				    write_rollup (stations[i], k, rp) < 0)
+					goto full;
+			}
+		}
+	}
+full:
+	pthread_mutex_unlock (&lock);
+}
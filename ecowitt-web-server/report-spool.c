@@ -0,0 +1,624 @@
+/*
+ *	Spooling of the weather reports posted to /data/report/, in place
+ *	of logging every field of every report.
+ *
+ *	Each report is checked against the fields listed in report-fields.def
+ *	and becomes one line of InfluxDB line protocol, e.g.
+ *
+ *	ecowitt,PASSKEY=606...B888,stationtype=GW1100B_V2.3.2 tempinf=78.08,humidityin=59,... 1719566240000000000
+ *
+ *	Any field that isn't listed (or whose value isn't a number) goes to
+ *	a side table instead, one line per field, so that nothing is lost:
+ *
+ *	ecowitt_unknown,PASSKEY=606...B888,stationtype=GW1100B_V2.3.2,field=newsensor value="12.3" 1719566240000000000
+ *
+ *	The two go to "reports-YYYY-MM-DD.lp" and "unknown-YYYY-MM-DD.lp" in
+ *	the spool directory (dated in UTC) - and with "-m", the readings of
+ *	the sensors that several gateways share, merged, go to
+ *	"merged-YYYY-MM-DD.lp" (see report-merge.c), and with "-R", the
+ *	rollups of each station's readings go to "rollups-YYYY-MM-DD.lp"
+ *	(see report-rollup.c).  With "-F", each report's line is sent on to
+ *	other services, too (see report-fanout.c).
+ *
+ *	The event loop only formats each report into the current batch in
+ *	memory.  A separate writer thread takes the whole batch once per
+ *	SPOOL_INTERVAL (or sooner, when it's half full), writes it, and
+ *	calls fsync() once for all of it - a group commit - then logs one
+ *	summary line for the batch.  If the writer falls so far behind that
+ *	the batch fills up, further reports are counted and dropped rather
+ *	than holding up the event loop.  A batch that can't be written goes
+ *	back in front of the next one, as far as there's room, to be tried
+ *	again.
+ */
+
+#define	_GNU_SOURCE		// for strptime() on Linux
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecowitt-web-server.h"
+
+#define	SPOOL_BUFSIZE	(256 * 1024)	// each of the two batches, for each file
+#define	SPOOL_INTERVAL	1		// seconds between commits
+#define	SPOOL_MAXLINE	16384		// longest report line that we'll write
+
+/* what we know about a report field */
+enum { RF_TAG, RF_TIME, RF_NUMBER };
+
+struct report_field {
+	const char *name;
+	int	kind;
+	const char *sensor;	// the one that it comes from, or "" (the gateway)
+	int	index;		// ... as an index into sensors[], or -1
+};
+
+#define	REPORT_FIELD(NAME, KIND, SENSOR)	{ NAME, RF_##KIND, SENSOR },
+
+static struct report_field report_fields[] = {
+#include "report-fields.def"
+};
+
+#define	NFIELDS	(sizeof report_fields / sizeof report_fields[0])
+
+static const char *sensors[REPORT_MAXSENSORS];	// the ones that other gateways might hear
+static int	nsensors;
+
+/* the reports waiting to be written */
+struct batch {
+	char	*reports;	// lines for the reports file
+	size_t	rlen;
+	char	*unknown;	// lines for the unknown fields file
+	size_t	ulen;
+	char	*derived[SPOOL_NDERIVED];	// lines for the merged and rollups files
+	size_t	dlen[SPOOL_NDERIVED];
+	int	nreports;	// lines in the reports file - not those with no readings
+	int	nunknown;
+	int	nderived[SPOOL_NDERIVED];
+	int	dropped;	// reports that didn't fit
+};
+
+static struct batch batches[2];
+static struct batch *active = &batches[0];	// the one being filled
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static const char *spool_dir;
+static const char *derived_names[SPOOL_NDERIVED] = { "merged", "rollups" };
+
+/* a line being built */
+struct line {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+	int	overflow;
+};
+
+
+/* prototypes */
+static void *spool_writer (void *arg);
+static int commit_batch (struct batch *bp);
+static void keep_batch (struct batch *bp, int err);
+
+
+static int
+compare_fields (const void *a, const void *b)
+{
+	return strcmp (((const struct report_field *) a)->name,
+		((const struct report_field *) b)->name);
+}
+
+static const struct report_field *
+find_field (const char *name)
+{
+	struct report_field key;
+
+	key.name = name;
+	return bsearch (&key, report_fields, NFIELDS, sizeof key, compare_fields);
+}
+
+static void
+put (struct line *lp, const char *s, size_t n)
+{
+	if (lp->len + n >= lp->size) {
+		lp->overflow = 1;
+		return;
+	}
+	memcpy (lp->buf + lp->len, s, n);
+	lp->len += n;
+}
+
+/*
+ *	Put a string, with a backslash before any of the special characters.
+ *	Line protocol has no way to escape a newline, so those become spaces.
+ */
+static void
+put_escaped (struct line *lp, const char *s, const char *special)
+{
+	for ( ; *s != '\0'; s++) {
+		if (*s == '\n' || *s == '\r')
+			put (lp, " ", 1);
+		else {
+			if (strchr (special, *s) != NULL)
+				put (lp, "\\", 1);
+			put (lp, s, 1);
+		}
+	}
+}
+
+#define	put_str(LP, S)	put ((LP), (S), strlen (S))
+#define	KEY_SPECIAL	", ="		// tag keys and values, and field keys
+#define	STRING_SPECIAL	"\"\\"		// field values within double quotes
+
+/* plain decimal numbers only - not "inf", "nan", or hex */
+static int
+is_number (const char *s)
+{
+	const char *p;
+	char	*end;
+
+	if (*s == '\0')
+		return 0;
+	for (p = s; *p != '\0'; p++) {
+		if (strchr ("0123456789+-.eE", *p) == NULL)
+			return 0;
+	}
+	strtod (s, &end);
+	return *end == '\0';
+}
+
+
+/*
+ *	Get ready to spool the reports into the directory, and start the
+ *	writer thread.
+ */
+int
+spool_start (const char *dir)
+{
+	pthread_t tid;
+	int	i, j;
+
+	if (access (dir, W_OK) < 0) {
+		fprintf (stderr, "%s: cannot write to spool directory \"%s\": %s\n",
+			progname, dir, strerror (errno));
+		return -1;
+	}
+	spool_dir = dir;
+
+	qsort (report_fields, NFIELDS, sizeof report_fields[0], compare_fields);
+	for (i = 0; i < (int) NFIELDS; i++) {
+		report_fields[i].index = -1;
+		if (report_fields[i].sensor[0] == '\0')
+			continue;
+		for (j = 0; j < nsensors && strcmp (sensors[j], report_fields[i].sensor) != 0; j++)
+			;
+		if (j == REPORT_MAXSENSORS) {
+			fprintf (stderr, "%s: too many sensors in report-fields.def\n", progname);
+			return -1;
+		}
+		if (j == nsensors)
+			sensors[nsensors++] = report_fields[i].sensor;
+		report_fields[i].index = j;
+	}
+
+	for (i = 0; i < 2; i++) {
+		batches[i].reports = malloc (SPOOL_BUFSIZE);
+		batches[i].unknown = malloc (SPOOL_BUFSIZE);
+		for (j = 0; j < SPOOL_NDERIVED; j++) {
+			if ((batches[i].derived[j] = malloc (SPOOL_BUFSIZE)) == NULL)
+				break;
+		}
+		if (batches[i].reports == NULL || batches[i].unknown == NULL ||
+		    j < SPOOL_NDERIVED) {
+			fprintf (stderr, "%s: out of memory\n", progname);
+			return -1;
+		}
+	}
+
+	if ((errno = pthread_create (&tid, NULL, spool_writer, NULL)) != 0) {
+		fprintf (stderr, "%s: cannot start spool writer: %s\n",
+			progname, strerror (errno));
+		return -1;
+	}
+	pthread_detach (tid);
+	return 0;
+}
+
+/*
+ *	Add one report to the current batch.  Returns 0, or -1 if it had to
+ *	be dropped.
+ */
+int
+spool_report (struct request *rq)
+{
+	char	tbuf[2048], rbuf[SPOOL_MAXLINE], ubuf[SPOOL_MAXLINE];
+	struct line tags = { tbuf, 0, sizeof tbuf, 0 };
+	struct line rl = { rbuf, 0, sizeof rbuf, 0 };
+	struct line ul = { ubuf, 0, sizeof ubuf, 0 };
+	const struct report_field *fp;
+	struct param *pp;
+	struct tm tm;
+	char	ts[32];
+	time_t	when = 0;
+	int	nfields = 0, nunknown = 0;
+	int	r = 0;
+	int	i;
+
+	// First, the tags and the time, which every line will need.
+	for (i = 0; i < rq->nparams; i++) {
+		pp = &rq->params[i];
+		if ((fp = find_field (pp->name)) == NULL || *pp->value == '\0')
+			continue;
+		if (fp->kind == RF_TAG) {
+			put_str (&tags, ",");
+			put_escaped (&tags, pp->name, KEY_SPECIAL);
+			put_str (&tags, "=");
+			put_escaped (&tags, pp->value, KEY_SPECIAL);
+		} else if (fp->kind == RF_TIME) {
+			memset (&tm, 0, sizeof tm);
+			if (strptime (pp->value, "%Y-%m-%d %H:%M:%S", &tm) != NULL)
+				when = timegm (&tm);
+		}
+	}
+	if (when <= 0)		// e.g. "dateutc=now"
+		when = time (NULL);
+	snprintf (ts, sizeof ts, " %lld000000000\n", (long long) when);
+
+	// Then the readings, and anything that we don't know.
+	put_str (&rl, "ecowitt");
+	put (&rl, tags.buf, tags.len);
+	for (i = 0; i < rq->nparams; i++) {
+		pp = &rq->params[i];
+		if (*pp->value == '\0')		// e.g. "lightning=" - no strikes yet
+			continue;
+		fp = find_field (pp->name);
+		if (fp != NULL && fp->kind != RF_NUMBER)
+			continue;
+		if (fp != NULL && is_number (pp->value)) {
+			put_str (&rl, nfields > 0 ? "," : " ");
+			nfields++;
+			put_str (&rl, pp->name);
+			put_str (&rl, "=");
+			put_str (&rl, pp->value);
+		} else {
+			put_str (&ul, "ecowitt_unknown");
+			put (&ul, tags.buf, tags.len);
+			put_str (&ul, ",field=");
+			put_escaped (&ul, pp->name, KEY_SPECIAL);
+			put_str (&ul, " value=\"");
+			put_escaped (&ul, pp->value, STRING_SPECIAL);
+			put_str (&ul, "\"");
+			put_str (&ul, ts);
+			nunknown++;
+		}
+	}
+	put_str (&rl, ts);
+
+	if (tags.overflow || rl.overflow || ul.overflow) {
+		syslog (LOG_WARNING, "%s: report too large - dropped", __FUNCTION__);
+		return -1;
+	}
+
+	pthread_mutex_lock (&lock);
+	if (active->rlen + rl.len > SPOOL_BUFSIZE || active->ulen + ul.len > SPOOL_BUFSIZE) {
+		active->dropped++;
+		r = -1;
+	} else {
+		if (nfields > 0) {	// line protocol needs at least one field
+			memcpy (active->reports + active->rlen, rl.buf, rl.len);
+			active->rlen += rl.len;
+			active->nreports++;
+		}
+		memcpy (active->unknown + active->ulen, ul.buf, ul.len);
+		active->ulen += ul.len;
+		active->nunknown += nunknown;
+	}
+	if (active->rlen > SPOOL_BUFSIZE / 2 || active->ulen > SPOOL_BUFSIZE / 2)
+		pthread_cond_signal (&wakeup);
+	pthread_mutex_unlock (&lock);
+
+	if (nfields > 0 && fanout)	// and to the other services, with "-F"
+		fanout_report (rl.buf, rl.len);
+	return r;
+}
+
+/*
+ *	The sensor that this field of a report comes from, if other gateways
+ *	might hear it too, and it's a reading - as an index, below
+ *	REPORT_MAXSENSORS - else -1.
+ */
+int
+report_sensor (const char *name, const char *value)
+{
+	const struct report_field *fp;
+
+	if ((fp = find_field (name)) == NULL || fp->kind != RF_NUMBER || !is_number (value))
+		return -1;
+	return fp->index;
+}
+
+/*
+ *	The field, if it's a reading, as an index into the fields that we
+ *	know - for report_field_name() - else -1.
+ */
+int
+report_reading (const char *name, const char *value)
+{
+	const struct report_field *fp;
+
+	if ((fp = find_field (name)) == NULL || fp->kind != RF_NUMBER || !is_number (value))
+		return -1;
+	return fp - report_fields;
+}
+
+const char *
+report_field_name (int i)
+{
+	return report_fields[i].name;
+}
+
+/*
+ *	Add a line made from the reports - merged readings (SPOOL_MERGED) or
+ *	rollups (SPOOL_ROLLUPS) - to the current batch.  Returns 0, or -1 if
+ *	there isn't room: merged readings are dropped, but a rollup is still
+ *	in memory, and can wait for the next batch.
+ */
+int
+spool_derived (int which, const char *line, size_t len)
+{
+	int	r = 0;
+
+	pthread_mutex_lock (&lock);
+	if (active->dlen[which] + len > SPOOL_BUFSIZE) {
+		if (which != SPOOL_ROLLUPS)
+			active->dropped++;
+		r = -1;
+	} else {
+		memcpy (active->derived[which] + active->dlen[which], line, len);
+		active->dlen[which] += len;
+		active->nderived[which]++;
+	}
+	if (active->dlen[which] > SPOOL_BUFSIZE / 2)
+		pthread_cond_signal (&wakeup);
+	pthread_mutex_unlock (&lock);
+	return r;
+}
+
+
+/*
+ *	The writer thread - swap the batches once per interval, and commit
+ *	the one that was being filled.  The merged readings of the windows
+ *	that have ended, and the rollups that have changed, are added to it
+ *	first.
+ */
+static void *
+spool_writer (void *arg)
+{
+	struct batch *bp;
+	struct timespec deadline;
+	int	i;
+
+	for (;;) {
+		pthread_mutex_lock (&lock);
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SPOOL_INTERVAL;
+		pthread_cond_timedwait (&wakeup, &lock, &deadline);
+		if (merge_window > 0 || rollups) {	// they take the lock to add them
+			pthread_mutex_unlock (&lock);
+			if (merge_window > 0)
+				merge_expire (time (NULL));
+			if (rollups)
+				rollup_expire (time (NULL));
+			pthread_mutex_lock (&lock);
+		}
+
+		bp = active;
+		active = (active == &batches[0]) ? &batches[1] : &batches[0];
+		pthread_mutex_unlock (&lock);
+
+		if (bp->nreports > 0 || bp->nunknown > 0 || bp->nderived[SPOOL_MERGED] > 0 ||
+		    bp->nderived[SPOOL_ROLLUPS] > 0 || bp->dropped > 0) {
+			if ((i = commit_batch (bp)) != 0)
+				keep_batch (bp, i);
+		}
+		bp->rlen = bp->ulen = 0;
+		bp->nreports = bp->nunknown = bp->dropped = 0;
+		for (i = 0; i < SPOOL_NDERIVED; i++)
+			bp->dlen[i] = bp->nderived[i] = 0;
+	}
+	/*NOTREACHED*/
+	return arg;
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+	ssize_t	r;
+
+	while (len > 0) {
+		if ((r = write (fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* (re)open one of the spool files for today */
+static int
+open_spool (int *fdp, const char *name, const char *day)
+{
+	char	fname[1024];
+
+	if (*fdp >= 0)
+		close (*fdp);
+	snprintf (fname, sizeof fname, "%s/%s-%s.lp", spool_dir, name, day);
+	if ((*fdp = open (fname, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+		syslog (LOG_ERR, "%s: cannot open \"%s\": %m", __FUNCTION__, fname);
+	return *fdp;
+}
+
+/* where the file ends, to cut it back to if the batch can't be written */
+static off_t
+spool_end (int fd)
+{
+	return fd >= 0 ? lseek (fd, 0, SEEK_END) : -1;
+}
+
+static void
+cut_back (int fd, off_t end)
+{
+	if (fd >= 0 && end >= 0 && ftruncate (fd, end) < 0)
+		syslog (LOG_ERR, "%s: cannot truncate a spool file: %m", __FUNCTION__);
+}
+
+/*
+ *	Write the batch to the spool files, then fsync() them once.  If any
+ *	of it can't be written, the files are cut back to where they ended,
+ *	so that no partial line is left for the next batch to run into.
+ *	Returns 0, or the error.
+ */
+static int
+commit_batch (struct batch *bp)
+{
+	static int rfd = -1, ufd = -1, dfd[SPOOL_NDERIVED] = { -1, -1 };
+	static char today[16];
+	struct timespec t0, t1;
+	struct tm tm;
+	char	day[16];
+	time_t	now;
+	off_t	rend, uend, dend[SPOOL_NDERIVED];
+	size_t	bytes;
+	int	failed = 0;
+	int	i;
+
+	now = time (NULL);
+	gmtime_r (&now, &tm);
+	strftime (day, sizeof day, "%Y-%m-%d", &tm);
+	if (strcmp (day, today) != 0 || rfd < 0 || ufd < 0) {
+		open_spool (&rfd, "reports", day);
+		open_spool (&ufd, "unknown", day);
+		for (i = 0; i < SPOOL_NDERIVED; i++) {
+			if (dfd[i] >= 0)
+				close (dfd[i]);
+			dfd[i] = -1;	// opened when there's something for it
+		}
+		strcpy (today, day);
+	}
+	for (i = 0; i < SPOOL_NDERIVED; i++) {
+		if (bp->dlen[i] > 0 && dfd[i] < 0)
+			open_spool (&dfd[i], derived_names[i], day);
+	}
+
+	rend = spool_end (rfd);
+	uend = spool_end (ufd);
+	for (i = 0; i < SPOOL_NDERIVED; i++)
+		dend[i] = spool_end (dfd[i]);
+
+	if (bp->rlen > 0 && (rfd < 0 || write_all (rfd, bp->reports, bp->rlen) < 0))
+		failed++;
+	if (bp->ulen > 0 && (ufd < 0 || write_all (ufd, bp->unknown, bp->ulen) < 0))
+		failed++;
+	for (i = 0; i < SPOOL_NDERIVED; i++) {
+		if (bp->dlen[i] > 0 && (dfd[i] < 0 || write_all (dfd[i], bp->derived[i], bp->dlen[i]) < 0))
+			failed++;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	if (bp->rlen > 0 && rfd >= 0 && fsync (rfd) < 0)
+		failed++;
+	if (bp->ulen > 0 && ufd >= 0 && fsync (ufd) < 0)
+		failed++;
+	for (i = 0; i < SPOOL_NDERIVED; i++) {
+		if (bp->dlen[i] > 0 && dfd[i] >= 0 && fsync (dfd[i]) < 0)
+			failed++;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	if (failed) {
+		failed = errno != 0 ? errno : EIO;
+		cut_back (rfd, rend);
+		cut_back (ufd, uend);
+		for (i = 0; i < SPOOL_NDERIVED; i++)
+			cut_back (dfd[i], dend[i]);
+		close (rfd);
+		close (ufd);
+		for (i = 0; i < SPOOL_NDERIVED; i++) {
+			if (dfd[i] >= 0)
+				close (dfd[i]);
+			dfd[i] = -1;
+		}
+		rfd = ufd = -1;		// try opening them again next time
+		return failed;
+	}
+
+	bytes = bp->rlen + bp->ulen;
+	for (i = 0; i < SPOOL_NDERIVED; i++)
+		bytes += bp->dlen[i];
+	syslog (LOG_INFO, "spooled %d reports, %d unknown fields, %d merged, %d rollups, %d dropped - %zu bytes, fsync %.1f ms",
+		bp->nreports, bp->nunknown, bp->nderived[SPOOL_MERGED], bp->nderived[SPOOL_ROLLUPS],
+		bp->dropped, bytes,
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	return 0;
+}
+
+/* put the lines back in front of those in the batch being filled, if they fit */
+static int
+put_back (char *buf, size_t *lenp, const char *old, size_t oldlen)
+{
+	if (*lenp + oldlen > SPOOL_BUFSIZE)
+		return -1;
+	memmove (buf + oldlen, buf, *lenp);
+	memcpy (buf, old, oldlen);
+	*lenp += oldlen;
+	return 0;
+}
+
+/*
+ *	The batch couldn't be written - keep what we can of it, to be tried
+ *	again with the next, and say what was lost.  The rollups in it have
+ *	been marked as written, so they'd be lost for good otherwise.
+ */
+static void
+keep_batch (struct batch *bp, int err)
+{
+	int	lost[SPOOL_NDERIVED];
+	int	lostreports = 0, lostunknown = 0;
+	int	i;
+
+	pthread_mutex_lock (&lock);
+	if (put_back (active->reports, &active->rlen, bp->reports, bp->rlen) == 0)
+		active->nreports += bp->nreports;
+	else
+		lostreports = bp->nreports;
+	if (put_back (active->unknown, &active->ulen, bp->unknown, bp->ulen) == 0)
+		active->nunknown += bp->nunknown;
+	else
+		lostunknown = bp->nunknown;
+	for (i = 0; i < SPOOL_NDERIVED; i++) {
+		lost[i] = 0;
+		if (put_back (active->derived[i], &active->dlen[i], bp->derived[i], bp->dlen[i]) == 0)
+			active->nderived[i] += bp->nderived[i];
+		else
+			lost[i] = bp->nderived[i];
+	}
+	active->dropped += bp->dropped;
+	pthread_mutex_unlock (&lock);
+
+	syslog (LOG_ERR, "%s: cannot write to \"%s\": %s - trying %d reports, %d unknown fields, %d merged, %d rollups again; "
+		"lost %d reports, %d unknown fields, %d merged, %d rollups",
+		__FUNCTION__, spool_dir, strerror (err),
+		bp->nreports - lostreports, bp->nunknown - lostunknown,
+		bp->nderived[SPOOL_MERGED] - lost[SPOOL_MERGED], bp->nderived[SPOOL_ROLLUPS] - lost[SPOOL_ROLLUPS],
+		lostreports, lostunknown, lost[SPOOL_MERGED], lost[SPOOL_ROLLUPS]);
+}
@@ -0,0 +1,133 @@
+/*
+ *	Sunrise and sunset times, calculated the same way as PHP's
+ *	date_sun_info() (which uses Paul Schlyter's public domain
+ *	"sunriset.c"), so that ip_api gives the same answers as before.
+ */
+
+#include <math.h>
+#include <time.h>
+
+#include "ecowitt-web-server.h"
+
+#define	PI		3.1415926535897932384
+#define	RADEG		(180.0 / PI)
+#define	DEGRAD		(PI / 180.0)
+
+#define	sind(x)		sin ((x) * DEGRAD)
+#define	cosd(x)		cos ((x) * DEGRAD)
+#define	acosd(x)	(RADEG * acos (x))
+#define	atan2d(y,x)	(RADEG * atan2 ((y), (x)))
+
+#define	INV360		(1.0 / 360.0)
+
+// Unix time of the J2000 epoch, 2000-01-01 12:00 UTC
+#define	J2000_EPOCH	946728000
+
+
+/* reduce an angle to between 0 and 360 degrees */
+static double
+revolution (double x)
+{
+	return x - 360.0 * floor (x * INV360);
+}
+
+/* reduce an angle to between -180 and +180 degrees */
+static double
+rev180 (double x)
+{
+	return x - 360.0 * floor (x * INV360 + 0.5);
+}
+
+/* Greenwich Mean Sidereal Time at 0h UT, in degrees */
+static double
+GMST0 (double d)
+{
+	return revolution ((180.0 + 356.0470 + 282.9404) +
+		(0.9856002585 + 4.70935E-5) * d);
+}
+
+/* the Sun's ecliptic longitude and distance, at d days since 2000 Jan 0.0 */
+static void
+sunpos (double d, double *lon, double *r)
+{
+	double	M, w, e, E, x, y, v;
+
+	M = revolution (356.0470 + 0.9856002585 * d);	// mean anomaly
+	w = 282.9404 + 4.70935E-5 * d;			// argument of perihelion
+	e = 0.016709 - 1.151E-9 * d;			// eccentricity
+
+	E = M + e * RADEG * sind (M) * (1.0 + e * cosd (M));
+	x = cosd (E) - e;
+	y = sqrt (1.0 - e * e) * sind (E);
+	*r = sqrt (x * x + y * y);
+	v = atan2d (y, x);
+	*lon = v + w;
+	if (*lon >= 360.0)
+		*lon -= 360.0;
+}
+
+/* the Sun's right ascension and declination */
+static void
+sun_RA_dec (double d, double *RA, double *dec, double *r)
+{
+	double	lon, obl_ecl, x, y, z;
+
+	sunpos (d, &lon, r);
+	x = *r * cosd (lon);
+	y = *r * sind (lon);
+	obl_ecl = 23.4393 - 3.563E-7 * d;
+	z = y * sind (obl_ecl);
+	y = y * cosd (obl_ecl);
+	*RA = atan2d (y, x);
+	*dec = atan2d (z, sqrt (x * x + y * y));
+}
+
+/*
+ *	Find the sunrise and sunset for the local date at "when".
+ *
+ *	Returns 0 with the times in *rise and *set, or -1 if the sun never
+ *	rises that day, or 1 if it never sets.  As PHP does, those two
+ *	cases give times of 0 and 1 respectively.
+ */
+int
+sun_rise_set (time_t when, double lat, double lon, time_t *rise, time_t *set)
+{
+	struct tm tm;
+	time_t	midnight;	// 00:00 UTC of the local date
+	double	d, sidtime, sRA, sdec, sr;
+	double	tsouth, sradius, altit, cost, t;
+
+	localtime_r (&when, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = 0;
+	midnight = timegm (&tm);
+
+	// days since 2000 Jan 0.0, at local noon
+	d = (double)(midnight - J2000_EPOCH) / 86400.0 + 2 - lon / 360.0;
+
+	sidtime = revolution (GMST0 (d) + 180.0 + lon);
+	sun_RA_dec (d, &sRA, &sdec, &sr);
+
+	// when the Sun is due south, in hours UT
+	tsouth = 12.0 - rev180 (sidtime - sRA) / 15.0;
+
+	// the upper limb of the Sun, allowing for refraction
+	sradius = 0.2666 / sr;
+	altit = -35.0 / 60.0 - sradius;
+
+	cost = (sind (altit) - sind (lat) * sind (sdec)) / (cosd (lat) * cosd (sdec));
+	if (cost >= 1.0) {
+		*rise = 0;
+		*set = 0;
+		return -1;
+	}
+	if (cost <= -1.0) {
+		*rise = 1;
+		*set = 1;
+		return 1;
+	}
+	t = acosd (cost) / 15.0;	// the diurnal arc, in hours
+	*rise = (time_t) ((tsouth - t) * 3600 + midnight);
+	*set = (time_t) ((tsouth + t) * 3600 + midnight);
+	return 0;
+}
@@ -0,0 +1,875 @@
+/*
+ *	Load a server - this one, or the PHP pages - the way a swarm of
+ *	gateways would, to see how many it can take, and to catch a change
+ *	that makes it slower.
+ *
+ *	Each simulated gateway has its own MAC address, model and version.
+ *	When it starts, it does what a real one does: GET
+ *	/api/index/initialization, then the firmware check (GET
+ *	/api/ota/v1/version/info, signed as the devices sign it), then POST
+ *	/data/ip_api/ for its time zone and sunrise.  From then on, it posts
+ *	a report to /data/report/ every 16 seconds or so, and checks its
+ *	firmware and asks ip_api again every day.  The gateways
+ *	start spread over one report interval, or all at once with "-R 0",
+ *	as after a power cut.
+ *
+ *	Every request is on a connection of its own, as the devices do it.
+ *	A request's latency is from when it was due to when its response
+ *	had all arrived - so when the server falls behind, the reports that
+ *	wait for it count against it, as they would on a real network.
+ *
+ *	Usage: swarm-load [-v] [-n gateways] [-i seconds] [-j percent] [-I seconds]
+ *		[-R seconds] [-t seconds] [-c maxconns] [-T timeout] [-r seconds]
+ *		[-f firmware-info] http://host[:port]
+ *
+ *	Exits with 0 if every request worked, 1 if any failed, or 2 if the
+ *	load couldn't be run.
+ */
+
+#define	_GNU_SOURCE		// for strcasestr() on Linux
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "md5.h"
+#include "firmware-info.h"
+
+#define	REPORT_INTERVAL	16	// seconds between reports (-i)
+#define	INFO_INTERVAL	86400	// ... firmware checks, as info tells them (-I)
+#define	IPAPI_INTERVAL	86400	// ... and ip_api requests
+#define	SIGN_SECRET	"@ecowittnet"	// added to the parameters, for the "sign"
+
+#define	REQ_MAXOUT	2048	// the most that a request can be
+#define	REQ_MAXIN	1024	// what we keep of the response
+
+/* the requests, in the order that a gateway makes them when it starts */
+enum {
+	EP_INIT,
+	EP_INFO,
+	EP_IPAPI,
+	EP_REPORT,
+	EP_N
+};
+
+static const struct {
+	const char *name;
+	int	status;		// what the devices get, when it works
+} endpoints[EP_N] = {
+	{ "initialization",	200 },
+	{ "info",		200 },
+	{ "ip_api",		202 },
+	{ "report",		202 },
+};
+
+/* why a request failed */
+enum {
+	ERR_CONNECT,		// couldn't connect, or send it
+	ERR_TIMEOUT,		// no complete response in time (-T)
+	ERR_CLOSED,		// the connection closed before the response did
+	ERR_STATUS,		// not the status that the devices get
+	ERR_BODY,		// an info response that isn't one
+	ERR_N
+};
+
+static const char *errnames[ERR_N] = {
+	"connect", "timeout", "closed", "status", "body"
+};
+
+/* the models and versions, unless they come from the catalog */
+static const struct {
+	const char *model;
+	const char *version;
+} default_models[] = {
+	{ "GW1100C",	"V2.3.3" },
+	{ "GW2000A",	"V3.1.4" },
+	{ "GW1200B",	"V1.3.1" },
+};
+
+/* one simulated gateway */
+struct gateway {
+	char	mac[18];	// "30:83:98:00:12:3A", as the gateway has it
+	char	passkey[33];	// the MD5 of the MAC address, as the reports have it
+	char	model[24];
+	char	version[24];
+	int	step;		// EP_... of its next request
+	double	due;		// ... when that's due
+	double	report_due, info_due, ipapi_due;
+	double	booted;
+	float	temp, humidity, pressure, wind;	// what it reports, wandering
+	float	rain;
+};
+
+/* a request in progress */
+struct conn {
+	int	fd;		// -1 if the slot is free
+	struct gateway *gp;
+	int	endpoint;
+	int	connected;
+	double	due;		// when it was due, for its latency
+	double	deadline;
+	int	outlen, sent;
+	int	inlen;
+	long	received;	// bytes of the response, in all
+	long	length;		// ... that it should be, once the header has said
+	char	in[REQ_MAXIN];	// the start of it
+	char	out[REQ_MAXOUT];
+};
+
+/*
+ *	Latencies are counted in buckets: to the microsecond below 16us,
+ *	and then sixteen to each power of two - within 6% of the truth.
+ */
+#define	HIST_SUB	16
+#define	HIST_BUCKETS	(40 * HIST_SUB)
+
+struct stats {
+	long	requests;	// finished, one way or the other
+	long	errors[ERR_N];
+	long	failed;
+	long	hist[HIST_BUCKETS];	// the latency of those that worked
+	long	ok;
+	double	max;
+};
+
+char	*progname;
+int	verbose = 0;
+
+static int	ngateways = 1000;
+static double	report_interval = REPORT_INTERVAL;
+static double	info_interval = INFO_INTERVAL;
+static double	jitter = 0.1;		// each interval is this much either way (-j)
+static double	ramp = -1;		// seconds to start the gateways over (-R)
+static double	duration = 60;		// -t
+static int	maxconns = 256;		// -c
+static double	timeout = 10;		// -T
+static double	every = 10;		// seconds between progress lines (-r)
+
+static struct sockaddr_storage server;
+static socklen_t serverlen;
+static char	hostheader[256];
+
+static struct gateway *gateways;
+static struct gateway **heap;		// the gateways by when they're next due
+static int	nheap;
+static struct conn *conns;
+static int	nbusy;
+
+static struct stats totals[EP_N], interval;
+static volatile sig_atomic_t stopping;
+
+void	usage (void);
+int	main (int argc, char **argv);
+
+static double	now (void);
+static double	jittered (double seconds);
+static void	heap_push (struct gateway *gp);
+static struct gateway *heap_pop (void);
+static void	schedule (struct gateway *gp, double t);
+static void	sign (char *query, size_t querylen, int at);
+static void	dateutc (char *buf, size_t buflen);
+static int	build_request (struct conn *cp, double t);
+static void	start_request (struct gateway *gp, double t);
+static void	finish (struct conn *cp, int err, double t);
+static void	progress (struct conn *cp, double t);
+static void	received (struct conn *cp, double t);
+static int	bucket (long usecs);
+static double	bucket_value (int b);
+static void	count (struct stats *sp, int err, double latency);
+static double	percentile (struct stats *sp, double p);
+static void	report (double elapsed);
+static void	init_gateways (struct fw_catalog *catalog);
+static void	stop (int sig);
+
+
+void
+usage (void)
+{
+	fprintf (stderr,
+		"Usage: %s [-v] [-n gateways] [-i seconds] [-j percent] [-I seconds]\n"
+		"\t[-R seconds] [-t seconds] [-c maxconns] [-T timeout] [-r seconds]\n"
+		"\t[-f firmware-info] http://host[:port]\n", progname);
+	exit (2);
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* seconds, give or take the jitter */
+static double
+jittered (double seconds)
+{
+	return seconds * (1 + jitter * (2.0 * random () / RAND_MAX - 1));
+}
+
+static void
+heap_push (struct gateway *gp)
+{
+	int	i = nheap++, parent;
+
+	while (i > 0 && heap[parent = (i - 1) / 2]->due > gp->due) {
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = gp;
+}
+
+static struct gateway *
+heap_pop (void)
+{
+	struct gateway *top = heap[0], *last = heap[--nheap];
+	int	i = 0, child;
+
+	while ((child = 2 * i + 1) < nheap) {
+		if (child + 1 < nheap && heap[child + 1]->due < heap[child]->due)
+			child++;
+		if (last->due <= heap[child]->due)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/*
+ *	The gateway's next request: whichever of its timers is first, the
+ *	firmware check first if they're together.  The reports keep to
+ *	their cadence, however late the last one was; the rest are made as
+ *	soon as they can be, once they're due.
+ */
+static void
+schedule (struct gateway *gp, double t)
+{
+	gp->step = EP_REPORT;
+	gp->due = gp->report_due;
+	if (gp->ipapi_due <= gp->due) {
+		gp->step = EP_IPAPI;
+		gp->due = gp->ipapi_due;
+	}
+	if (gp->info_due <= gp->due) {
+		gp->step = EP_INFO;
+		gp->due = gp->info_due;
+	}
+	if (gp->step != EP_REPORT && gp->due < t)
+		gp->due = t;
+	heap_push (gp);
+}
+
+/* add "&sign=" to the query, for the parameters up to "at" */
+static void
+sign (char *query, size_t querylen, int at)
+{
+	struct md5 md5;
+	char	hex[33];
+	int	i, n = strlen (query);
+
+	md5_init (&md5);
+	md5_update (&md5, query, at);
+	md5_update (&md5, SIGN_SECRET, strlen (SIGN_SECRET));
+	md5_final (&md5, hex);
+	for (i = 0; hex[i] != '\0'; i++)
+		hex[i] = toupper ((unsigned char) hex[i]);
+	snprintf (query + n, querylen - n, "&sign=%s", hex);
+}
+
+/* the time, as the reports have it: "2024-06-28+09%3A17%3A20" */
+static void
+dateutc (char *buf, size_t buflen)
+{
+	time_t	t = time (NULL);
+
+	strftime (buf, buflen, "%Y-%m-%d+%H%%3A%M%%3A%S", gmtime (&t));
+}
+
+/* what the gateway sends next - returns its length, or -1 */
+static int
+build_request (struct conn *cp, double t)
+{
+	struct gateway *gp = cp->gp;
+	char	query[512], body[1400], date[64];
+	const char *method = "GET", *path;
+	int	n, i;
+
+	body[0] = '\0';
+	switch (cp->endpoint) {
+	case EP_INIT:
+		n = snprintf (query, sizeof query, "mac=%s&model=%s&version=%s",
+			gp->mac, gp->model, gp->version);
+		for (i = 4; i < 4 + 17; i++)
+			query[i] = toupper ((unsigned char) query[i]);
+		sign (query, sizeof query, n);
+		strncat (query, "&last_ret=-1", sizeof query - strlen (query) - 1);
+		path = "/api/index/initialization?";
+		break;
+
+	case EP_INFO:
+		n = snprintf (query, sizeof query, "id=%.2s%%3A%.2s%%3A%.2s%%3A%.2s%%3A%.2s%%3A%.2s"
+			"&model=%s&time=%ld&user=1&version=%s",
+			gp->mac, gp->mac + 3, gp->mac + 6, gp->mac + 9, gp->mac + 12, gp->mac + 15,
+			gp->model, (long) time (NULL), gp->version);
+		sign (query, sizeof query, n);
+		path = "/api/ota/v1/version/info?";
+		break;
+
+	case EP_IPAPI:
+		snprintf (body, sizeof body, "mac=%s&stationtype=%s_%s"
+			"&fields=timezone,utc_offset,dst,date_sunrise,date_sunset",
+			gp->mac, gp->model, gp->version);
+		method = "POST";
+		path = "/data/ip_api/";
+		query[0] = '\0';
+		break;
+
+	default:	// EP_REPORT - a station with the usual outdoor array
+		gp->temp += (random () % 21 - 10) / 100.0;
+		gp->humidity += (random () % 3 - 1);
+		gp->humidity = gp->humidity < 5 ? 5 : gp->humidity > 99 ? 99 : gp->humidity;
+		gp->pressure += (random () % 5 - 2) / 1000.0;
+		gp->wind = (random () % 600) / 100.0;
+		if (random () % 50 == 0)
+			gp->rain += 0.01;
+		dateutc (date, sizeof date);
+		snprintf (body, sizeof body,
+			"PASSKEY=%s&stationtype=%s_%s&runtime=%ld&heap=%ld&dateutc=%s"
+			"&tempinf=%.2f&humidityin=%d&baromrelin=%.3f&baromabsin=%.3f"
+			"&tempf=%.2f&humidity=%d&winddir=%ld&windspeedmph=%.2f&windgustmph=%.2f"
+			"&maxdailygust=%.2f&solarradiation=%.2f&uv=%d"
+			"&rainratein=0.000&eventrainin=%.3f&hourlyrainin=0.000&dailyrainin=%.3f"
+			"&weeklyrainin=%.3f&monthlyrainin=%.3f&yearlyrainin=%.3f"
+			"&wh65batt=0&freq=915M&model=%s&interval=%d",
+			gp->passkey, gp->model, gp->version, (long) (t - gp->booted),
+			110000 + random () % 20000, date,
+			gp->temp + 8, (int) gp->humidity - 25, gp->pressure, gp->pressure - 0.4,
+			gp->temp, (int) gp->humidity, random () % 360, gp->wind, gp->wind * 1.6,
+			gp->wind * 2.2, (random () % 80000) / 100.0, (int) (random () % 8),
+			gp->rain, gp->rain, gp->rain, gp->rain, gp->rain,
+			gp->model, (int) report_interval);
+		method = "POST";
+		path = "/data/report/";
+		query[0] = '\0';
+		break;
+	}
+
+	if (body[0] == '\0')
+		n = snprintf (cp->out, sizeof cp->out, "%s %s%s HTTP/1.1\r\n"
+			"Host: %s\r\nConnection: close\r\n\r\n",
+			method, path, query, hostheader);
+	else
+		n = snprintf (cp->out, sizeof cp->out, "%s %s HTTP/1.1\r\n"
+			"Host: %s\r\nConnection: close\r\n"
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Content-Length: %d\r\n\r\n%s",
+			method, path, hostheader, (int) strlen (body), body);
+	if (n >= (int) sizeof cp->out)
+		return -1;
+	return n;
+}
+
+/* start the gateway's next request, on a free connection - there is one */
+static void
+start_request (struct gateway *gp, double t)
+{
+	struct conn *cp;
+	int	fd;
+
+	for (cp = conns; cp->fd >= 0; cp++)
+		;
+	memset (cp, 0, offsetof (struct conn, in) + 1);
+	cp->gp = gp;
+	cp->endpoint = gp->step;
+	cp->due = gp->due;
+	cp->deadline = t + timeout;
+	cp->length = -1;
+	cp->fd = -1;
+	nbusy++;
+
+	if ((cp->outlen = build_request (cp, t)) < 0) {
+		finish (cp, ERR_CONNECT, t);
+		return;
+	}
+	if ((fd = socket (server.ss_family, SOCK_STREAM, 0)) < 0 ||
+	    fcntl (fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    (connect (fd, (struct sockaddr *) &server, serverlen) < 0 && errno != EINPROGRESS)) {
+		if (verbose)
+			fprintf (stderr, "%s: %s: can't connect: %s\n", progname, gp->mac, strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		finish (cp, ERR_CONNECT, t);
+		return;
+	}
+	cp->fd = fd;
+}
+
+/* the request is over - count it, and schedule the gateway's next */
+static void
+finish (struct conn *cp, int err, double t)
+{
+	struct gateway *gp = cp->gp;
+	int	code = 0;
+
+	if (err < 0) {
+		if (sscanf (cp->in, "HTTP/%*d.%*d %d", &code) != 1)
+			err = ERR_CLOSED;
+		else if (code != endpoints[cp->endpoint].status)
+			err = ERR_STATUS;
+		else if (cp->endpoint == EP_INFO && strstr (cp->in, "\"code\":") == NULL)
+			err = ERR_BODY;
+		if (err >= 0 && verbose)
+			fprintf (stderr, "%s: %s: %s: %s - %.60s\n", progname, gp->mac,
+				endpoints[cp->endpoint].name, errnames[err], cp->in);
+	}
+	count (&totals[cp->endpoint], err, t - cp->due);
+	count (&interval, err, t - cp->due);
+
+	if (cp->fd >= 0)
+		close (cp->fd);
+	cp->fd = -1;
+	nbusy--;
+
+	switch (cp->endpoint) {
+	case EP_INIT:
+		gp->booted = t;
+		gp->info_due = gp->ipapi_due = t;
+		gp->report_due = t + report_interval * random () / RAND_MAX;
+		break;
+	case EP_INFO:
+		gp->info_due = t + jittered (info_interval);
+		break;
+	case EP_IPAPI:
+		gp->ipapi_due = t + IPAPI_INTERVAL;
+		break;
+	case EP_REPORT:
+		gp->report_due += jittered (report_interval);
+		break;
+	}
+	schedule (gp, t);
+}
+
+/* the connection is ready for writing */
+static void
+progress (struct conn *cp, double t)
+{
+	int	n, soerr;
+	socklen_t len = sizeof soerr;
+
+	if (!cp->connected) {
+		if (getsockopt (cp->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0 || soerr != 0) {
+			if (verbose)
+				fprintf (stderr, "%s: %s: can't connect: %s\n", progname, cp->gp->mac,
+					strerror (soerr));
+			finish (cp, ERR_CONNECT, t);
+			return;
+		}
+		cp->connected = 1;
+	}
+	if ((n = write (cp->fd, cp->out + cp->sent, cp->outlen - cp->sent)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			finish (cp, ERR_CONNECT, t);
+		return;
+	}
+	cp->sent += n;
+}
+
+/* some of the response has come */
+static void
+received (struct conn *cp, double t)
+{
+	char	buf[16384], *end, *cl;
+	int	n, keep;
+
+	if ((n = read (cp->fd, buf, sizeof buf)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			finish (cp, ERR_CLOSED, t);
+		return;
+	}
+	if (n == 0) {		// closed - it's all there, unless the header said otherwise
+		finish (cp, cp->length >= 0 && cp->received < cp->length ? ERR_CLOSED : -1, t);
+		return;
+	}
+	if ((keep = sizeof cp->in - 1 - cp->inlen) > n)
+		keep = n;
+	memcpy (cp->in + cp->inlen, buf, keep);
+	cp->inlen += keep;
+	cp->in[cp->inlen] = '\0';
+	cp->received += n;
+
+	// once the header is here, we know how much more is to come
+	if (cp->length < 0 && (end = strstr (cp->in, "\r\n\r\n")) != NULL) {
+		*end = '\0';
+		cl = strcasestr (cp->in, "\r\nContent-Length:");
+		*end = '\r';
+		cp->length = cl != NULL ? (end + 4 - cp->in) + atol (cl + 17) : 0x7fffffff;
+	}
+	if (cp->length >= 0 && cp->received >= cp->length)
+		finish (cp, -1, t);
+}
+
+static int
+bucket (long usecs)
+{
+	int	msb;
+
+	if (usecs < HIST_SUB)
+		return usecs < 0 ? 0 : usecs;
+	for (msb = 4; usecs >> (msb + 1) != 0; msb++)
+		;
+	if ((msb - 3) * HIST_SUB >= HIST_BUCKETS)
+		return HIST_BUCKETS - 1;
+	return (msb - 3) * HIST_SUB + ((usecs >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+/* the middle of the bucket, in seconds */
+static double
+bucket_value (int b)
+{
+	int	msb = b / HIST_SUB + 3;
+
+	if (b < HIST_SUB)
+		return b / 1e6;
+	return ((double) ((HIST_SUB + b % HIST_SUB) << (msb - 4)) + (1 << (msb - 4)) / 2.0) / 1e6;
+}
+
+/* a request finished - with err, or -1 if it worked */
+static void
+count (struct stats *sp, int err, double latency)
+{
+	sp->requests++;
+	if (err >= 0) {
+		sp->errors[err]++;
+		sp->failed++;
+		return;
+	}
+	sp->ok++;
+	sp->hist[bucket (latency * 1e6)]++;
+	if (latency > sp->max)
+		sp->max = latency;
+}
+
+/* the latency that this fraction of those that worked were within */
+static double
+percentile (struct stats *sp, double p)
+{
+	long	want = sp->ok * p, seen = 0;
+	int	b;
+
+	if (sp->ok == 0)
+		return 0;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if ((seen += sp->hist[b]) > want)
+			return bucket_value (b) < sp->max ? bucket_value (b) : sp->max;
+	}
+	return sp->max;
+}
+
+/* the table at the end */
+static void
+report (double elapsed)
+{
+	struct stats all;
+	int	i, e, b;
+
+	memset (&all, 0, sizeof all);
+	printf ("\n%-16s %9s %8s %8s %8s %8s %8s %8s %8s\n", "request", "count", "per sec",
+		"failed", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (i = 0; i <= EP_N; i++) {
+		struct stats *sp = i < EP_N ? &totals[i] : &all;
+
+		if (i < EP_N) {
+			all.requests += sp->requests;
+			all.failed += sp->failed;
+			all.ok += sp->ok;
+			for (e = 0; e < ERR_N; e++)
+				all.errors[e] += sp->errors[e];
+			for (b = 0; b < HIST_BUCKETS; b++)
+				all.hist[b] += sp->hist[b];
+			if (sp->max > all.max)
+				all.max = sp->max;
+		}
+		printf ("%-16s %9ld %8.1f %7.2f%% %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+			i < EP_N ? endpoints[i].name : "all", sp->requests, sp->requests / elapsed,
+			sp->requests ? 100.0 * sp->failed / sp->requests : 0.0,
+			percentile (sp, 0.5) * 1e3, percentile (sp, 0.9) * 1e3,
+			percentile (sp, 0.99) * 1e3, percentile (sp, 0.999) * 1e3, sp->max * 1e3);
+	}
+	if (all.failed > 0) {
+		printf ("failures:");
+		for (e = 0; e < ERR_N; e++) {
+			if (all.errors[e] > 0)
+				printf (" %ld %s", all.errors[e], errnames[e]);
+		}
+		printf ("\n");
+	}
+}
+
+/*
+ *	Give each gateway a MAC address (in Ecowitt's 30:83:98 block), and a
+ *	model and version - from the catalog, if there is one, so that the
+ *	firmware checks ask about models that it has, and get both answers.
+ */
+static void
+init_gateways (struct fw_catalog *catalog)
+{
+	struct gateway *gp;
+	struct fw_model *mp;
+	struct md5 md5;
+	int	i, k, n;
+
+	for (i = 0; i < ngateways; i++) {
+		gp = &gateways[i];
+		memset (gp, 0, sizeof *gp);
+		snprintf (gp->mac, sizeof gp->mac, "30:83:98:%02X:%02X:%02X",
+			(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		md5_init (&md5);
+		md5_update (&md5, gp->mac, strlen (gp->mac));
+		md5_final (&md5, gp->passkey);
+		for (k = 0; gp->passkey[k] != '\0'; k++)
+			gp->passkey[k] = toupper ((unsigned char) gp->passkey[k]);
+
+		n = 0;
+		if (catalog != NULL) {
+			for (k = 0; k < catalog->nmodels; k++)
+				n += catalog->models[k].nversions > 0;
+		}
+		if (n > 0) {
+			for (k = i % n, mp = catalog->models; ; mp++) {
+				if (mp->nversions > 0 && k-- == 0)
+					break;
+			}
+			snprintf (gp->model, sizeof gp->model, "%s%c", mp->name, "ABC"[i / n % 3]);
+			snprintf (gp->version, sizeof gp->version, "%s",
+				mp->versions[random () % mp->nversions].version);
+		} else {
+			k = i % (sizeof default_models / sizeof default_models[0]);
+			snprintf (gp->model, sizeof gp->model, "%s", default_models[k].model);
+			snprintf (gp->version, sizeof gp->version, "%s", default_models[k].version);
+		}
+
+		gp->temp = 50 + random () % 300 / 10.0;
+		gp->humidity = 40 + random () % 50;
+		gp->pressure = 29.5 + random () % 100 / 100.0;
+	}
+}
+
+static void
+stop (int sig)
+{
+	stopping = 1;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct fw_catalog *catalog = NULL;
+	struct addrinfo hints, *ai;
+	struct pollfd *pfds;
+	struct conn **polled;
+	struct rlimit rl;
+	char	*cp, *url, *port, host[256], errbuf[512];
+	double	start, t, wait, last, next;
+	int	c, i, n, r, status;
+
+	if ((cp = strrchr (argv[0], '/')) != NULL)
+		progname = cp + 1;
+	else
+		progname = argv[0];
+
+	while ((c = getopt (argc, argv, "c:f:i:I:j:n:r:R:t:T:v")) != EOF) {
+		switch (c) {
+		case 'c':	// the most requests in progress at once
+			if ((maxconns = atoi (optarg)) <= 0)
+				usage ();
+			break;
+		case 'f':	// take the models and versions from this catalog
+			if ((catalog = fw_catalog_read (optarg, errbuf, sizeof errbuf)) == NULL) {
+				fprintf (stderr, "%s: %s\n", progname, errbuf);
+				exit (2);
+			}
+			break;
+		case 'i':	// seconds between each gateway's reports
+			if ((report_interval = atof (optarg)) <= 0)
+				usage ();
+			break;
+		case 'I':	// ... and its firmware checks
+			if ((info_interval = atof (optarg)) <= 0)
+				usage ();
+			break;
+		case 'j':	// percent that each interval varies, either way
+			if ((jitter = atof (optarg) / 100) < 0 || jitter >= 1)
+				usage ();
+			break;
+		case 'n':	// how many gateways
+			if ((ngateways = atoi (optarg)) <= 0 || ngateways > 1 << 24)
+				usage ();
+			break;
+		case 'r':	// seconds between the progress lines (0 for none)
+			every = atof (optarg);
+			break;
+		case 'R':	// seconds to start them all over (0 = at once)
+			if ((ramp = atof (optarg)) < 0)
+				usage ();
+			break;
+		case 't':	// seconds to run for
+			if ((duration = atof (optarg)) <= 0)
+				usage ();
+			break;
+		case 'T':	// seconds that a request may take
+			if ((timeout = atof (optarg)) <= 0)
+				usage ();
+			break;
+		case 'v':	// show each failure
+			verbose++;
+			break;
+		default:
+			usage ();
+		}
+	}
+	if (optind != argc - 1)
+		usage ();
+	if (ramp < 0)
+		ramp = report_interval;
+
+	// http://host[:port][/...]
+	url = argv[optind];
+	if (strncasecmp (url, "http://", 7) == 0)
+		url += 7;
+	snprintf (host, sizeof host, "%.*s", (int) strcspn (url, "/"), url);
+	snprintf (hostheader, sizeof hostheader, "%s", host);
+	port = "80";
+	if (host[0] == '[' && (cp = strchr (host, ']')) != NULL) {	// [IPv6]:port
+		*cp++ = '\0';
+		memmove (host, host + 1, strlen (host));
+		if (*cp == ':')
+			port = cp + 1;
+	} else if ((cp = strrchr (host, ':')) != NULL) {
+		*cp = '\0';
+		port = cp + 1;
+	}
+	memset (&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	if ((r = getaddrinfo (host, port, &hints, &ai)) != 0) {
+		fprintf (stderr, "%s: %s: %s\n", progname, argv[optind], gai_strerror (r));
+		exit (2);
+	}
+	memcpy (&server, ai->ai_addr, ai->ai_addrlen);
+	serverlen = ai->ai_addrlen;
+	freeaddrinfo (ai);
+
+	// every connection is a descriptor
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) maxconns + 16) {
+		rl.rlim_cur = rl.rlim_max < (rlim_t) maxconns + 16 ? rl.rlim_max : (rlim_t) maxconns + 16;
+		setrlimit (RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < (rlim_t) maxconns + 16) {
+			maxconns = rl.rlim_cur - 16;
+			fprintf (stderr, "%s: only %d connections at once are allowed\n", progname, maxconns);
+		}
+	}
+
+	if ((gateways = calloc (ngateways, sizeof *gateways)) == NULL ||
+	    (heap = calloc (ngateways, sizeof *heap)) == NULL ||
+	    (conns = calloc (maxconns, sizeof *conns)) == NULL ||
+	    (pfds = calloc (maxconns, sizeof *pfds)) == NULL ||
+	    (polled = calloc (maxconns, sizeof *polled)) == NULL) {
+		fprintf (stderr, "%s: out of memory\n", progname);
+		exit (2);
+	}
+	for (i = 0; i < maxconns; i++)
+		conns[i].fd = -1;
+
+	srandom (getpid () ^ time (NULL));
+	init_gateways (catalog);
+
+	signal (SIGPIPE, SIG_IGN);
+	signal (SIGINT, stop);
+	signal (SIGTERM, stop);
+
+	start = last = now ();
+	for (i = 0; i < ngateways; i++) {
+		gateways[i].step = EP_INIT;
+		gateways[i].due = start + ramp * i / ngateways;
+		heap_push (&gateways[i]);
+	}
+	printf ("%d gateways, reporting every %g seconds, for %g seconds, against %s\n",
+		ngateways, report_interval, duration, argv[optind]);
+
+	while (nbusy > 0 || !stopping) {
+		t = now ();
+		if (t - start >= duration)
+			stopping = 1;
+
+		// start what's due, while there's room
+		while (!stopping && nheap > 0 && heap[0]->due <= t && nbusy < maxconns)
+			start_request (heap_pop (), t);
+
+		// wait for the first of: a connection, a deadline, or the next due
+		next = stopping ? t + timeout : start + duration;
+		if (!stopping && nheap > 0 && nbusy < maxconns && heap[0]->due < next)
+			next = heap[0]->due;
+		if (every > 0 && last + every < next)
+			next = last + every;
+		for (i = n = 0; i < maxconns; i++) {
+			if (conns[i].fd < 0)
+				continue;
+			pfds[n].fd = conns[i].fd;
+			pfds[n].events = conns[i].sent < conns[i].outlen ? POLLOUT : POLLIN;
+			polled[n++] = &conns[i];
+			if (conns[i].deadline < next)
+				next = conns[i].deadline;
+		}
+		wait = next - t;
+		if (poll (pfds, n, wait > 0 ? (int) (wait * 1000) + 1 : 0) < 0 && errno != EINTR) {
+			perror ("poll");
+			exit (2);
+		}
+
+		t = now ();
+		for (i = 0; i < n; i++) {
+			if (polled[i]->fd != pfds[i].fd)
+				continue;
+			if (pfds[i].revents & POLLOUT || (pfds[i].revents && !polled[i]->connected))
+				progress (polled[i], t);
+			else if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				received (polled[i], t);
+			if (polled[i]->fd >= 0 && polled[i]->deadline <= t)
+				finish (polled[i], ERR_TIMEOUT, t);
+		}
+
+		if (every > 0 && t - last >= every) {
+			printf ("%6.0fs %8ld requests %8.1f/s %6ld failed   p50 %7.2f ms  p99 %7.2f ms"
+				"  max %7.2f ms  %5d open\n", t - start, interval.requests,
+				interval.requests / (t - last), interval.failed,
+				percentile (&interval, 0.5) * 1e3, percentile (&interval, 0.99) * 1e3,
+				interval.max * 1e3, nbusy);
+			memset (&interval, 0, sizeof interval);
+			last = t;
+		}
+	}
+
+	t = now ();
+	report (t - start);
+	for (i = status = 0; i < EP_N; i++) {
+		if (totals[i].failed > 0)
+			status = 1;
+	}
+	exit (status);
+}